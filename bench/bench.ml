@@ -0,0 +1,259 @@
+(*
+ * bench.ml
+ * --------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ *)
+
+(* Benchmarks of the hot paths of the bindings. They are meant to be
+   run against the mock libspotify (see mock/), and print one JSON
+   object per line on stdout. *)
+
+open Spotify
+
+(* +-----------------------------------------------------------------+
+   | Output                                                          |
+   +-----------------------------------------------------------------+ *)
+
+let json_string str =
+  let buf = Buffer.create (String.length str + 2) in
+  Buffer.add_char buf '"';
+  String.iter
+    (function
+       | '"' -> Buffer.add_string buf "\\\""
+       | '\\' -> Buffer.add_string buf "\\\\"
+       | ch when Char.code ch < 32 -> Printf.bprintf buf "\\u%04x" (Char.code ch)
+       | ch -> Buffer.add_char buf ch)
+    str;
+  Buffer.add_char buf '"';
+  Buffer.contents buf
+
+(* [report name unit value fields] prints a result. [fields] are
+   additional numeric fields. *)
+let report name unit value fields =
+  Printf.printf "{\"benchmark\":%s,\"unit\":%s,\"value\":%.3f" (json_string name) (json_string unit) value;
+  List.iter (fun (key, value) -> Printf.printf ",%s:%.3f" (json_string key) value) fields;
+  print_string "}\n";
+  flush stdout
+
+let now = Unix.gettimeofday
+
+(* Run [f] [iterations] times and report the time and minor words
+   per call. *)
+let per_call name iterations f =
+  for i = 1 to iterations / 10 do
+    ignore (f i)
+  done;
+  let words = Gc.minor_words () in
+  let start = now () in
+  for i = 1 to iterations do
+    ignore (f i)
+  done;
+  let elapsed = now () -. start in
+  let words = Gc.minor_words () -. words in
+  report name "ns/call" (elapsed *. 1e9 /. float iterations)
+    ["iterations", float iterations; "minor_words_per_call", words /. float iterations]
+
+let percentile samples p =
+  let n = Array.length samples in
+  if n = 0 then
+    0.
+  else
+    samples.(min (n - 1) (int_of_float (p *. float n)))
+
+(* +-----------------------------------------------------------------+
+   | Session                                                         |
+   +-----------------------------------------------------------------+ *)
+
+let mutex = Mutex.create ()
+let cond = Condition.create ()
+
+(* Time of the last call to [notify_main_thread], if not yet
+   consumed. *)
+let notified = ref None
+
+let end_of_track = ref false
+let frames_delivered = ref 0
+
+class callbacks = object
+  inherit session_callbacks
+
+  method notify_main_thread session =
+    let time = now () in
+    Mutex.lock mutex;
+    if !notified = None then notified := Some time;
+    Condition.broadcast cond;
+    Mutex.unlock mutex
+
+  method music_delivery session format frames count =
+    frames_delivered := !frames_delivered + count;
+    count
+
+  method end_of_track session =
+    Mutex.lock mutex;
+    end_of_track := true;
+    Condition.broadcast cond;
+    Mutex.unlock mutex
+end
+
+(* Wait for a notification and return its time. *)
+let wait_notification () =
+  Mutex.lock mutex;
+  while !notified = None do
+    Condition.wait cond mutex
+  done;
+  let time = match !notified with Some time -> time | None -> assert false in
+  notified := None;
+  Mutex.unlock mutex;
+  time
+
+(* Process events until [f ()] holds. *)
+let rec process_until session f =
+  if not (f ()) then begin
+    ignore (wait_notification ());
+    ignore (session_process_events session);
+    process_until session f
+  end
+
+let config = {
+  api_version = api_version;
+  cache_location = "";
+  settings_location = "";
+  application_key = "ocaml-spotify benchmarks";
+  user_agent = "ocaml-spotify benchmarks";
+  callbacks = new callbacks;
+  compress_playlists = false;
+  dont_save_metadata_for_playlists = true;
+  initially_unload_playlists = true;
+}
+
+let search session query count =
+  let search =
+    search_create session
+      ~query
+      ~track_offset:0
+      ~track_count:count
+      ~album_offset:0
+      ~album_count:count
+      ~artist_offset:0
+      ~artist_count:count
+      ~callback:ignore
+  in
+  process_until session (fun () -> search_is_loaded search);
+  search
+
+(* +-----------------------------------------------------------------+
+   | Benchmarks                                                      |
+   +-----------------------------------------------------------------+ *)
+
+let bench_accessors session =
+  let search = search session "e" 100 in
+  let count = search_num_tracks search in
+  if count = 0 then failwith "the search returned no track";
+  let tracks = Array.init count (search_track search) in
+  let track i = tracks.(i mod count) in
+  per_call "track_name" 1_000_000 (fun i -> track_name (track i));
+  per_call "track_duration" 1_000_000 (fun i -> track_duration (track i));
+  per_call "track_popularity" 1_000_000 (fun i -> track_popularity (track i));
+  per_call "track_is_available" 1_000_000 (fun i -> track_is_available session (track i));
+  per_call "track_album" 1_000_000 (fun i -> track_album (track i));
+  per_call "track_artist" 1_000_000 (fun i -> track_artist (track i) 0);
+  let albums = Array.map track_album tracks in
+  per_call "album_name" 1_000_000 (fun i -> album_name albums.(i mod count));
+  per_call "album_year" 1_000_000 (fun i -> album_year albums.(i mod count));
+  per_call "album_cover" 1_000_000 (fun i -> album_cover albums.(i mod count));
+  let artists = Array.map (fun track -> track_artist track 0) tracks in
+  per_call "artist_name" 1_000_000 (fun i -> artist_name artists.(i mod count));
+  per_call "search_num_tracks" 1_000_000 (fun i -> search_num_tracks search);
+  per_call "search_track" 1_000_000 (fun i -> search_track search (i mod count));
+  per_call "link_as_string" 100_000
+    (fun i ->
+       let link = link_create_from_track (track i) 0. in
+       let str = link_as_string link in
+       link_release link;
+       str);
+  search_release search;
+  tracks
+
+let bench_callbacks session =
+  let iterations = 1000 in
+  let foreign = Array.make iterations 0. and dispatch = Array.make iterations 0. in
+  for i = 0 to iterations - 1 do
+    let completed = ref 0. in
+    let start = now () in
+    let search =
+      search_create session
+        ~query:"" ~track_offset:0 ~track_count:0 ~album_offset:0 ~album_count:0 ~artist_offset:0 ~artist_count:0
+        ~callback:(fun _ -> completed := now ())
+    in
+    let notified = wait_notification () in
+    ignore (session_process_events session);
+    process_until session (fun () -> !completed > 0.);
+    foreign.(i) <- (notified -. start) *. 1e6;
+    dispatch.(i) <- (!completed -. notified) *. 1e6;
+    search_release search
+  done;
+  Array.sort compare foreign;
+  Array.sort compare dispatch;
+  let mean samples = Array.fold_left (+.) 0. samples /. float (Array.length samples) in
+  report "notify_main_thread_latency" "us" (mean foreign)
+    ["p50", percentile foreign 0.5; "p99", percentile foreign 0.99; "iterations", float iterations];
+  report "search_complete_dispatch" "us" (mean dispatch)
+    ["p50", percentile dispatch 0.5; "p99", percentile dispatch 0.99; "iterations", float iterations]
+
+let bench_music_delivery session track =
+  session_player_load session track;
+  end_of_track := false;
+  frames_delivered := 0;
+  let words = Gc.minor_words () in
+  let start = now () in
+  session_player_play session true;
+  Mutex.lock mutex;
+  while not !end_of_track do
+    Condition.wait cond mutex
+  done;
+  Mutex.unlock mutex;
+  let elapsed = now () -. start in
+  let words = Gc.minor_words () -. words in
+  session_player_unload session;
+  let frames = float !frames_delivered in
+  report "music_delivery" "frames/s" (frames /. elapsed)
+    ["frames", frames; "minor_words_per_frame", words /. frames]
+
+let bench_handles tracks =
+  let iterations = 1_000_000 and count = Array.length tracks in
+  Gc.full_major ();
+  let start = now () in
+  for i = 1 to iterations do
+    ignore (track_album tracks.(i mod count))
+  done;
+  let allocated = now () in
+  Gc.full_major ();
+  let finalized = now () in
+  report "handle_allocation" "ns/handle" ((allocated -. start) *. 1e9 /. float iterations)
+    ["iterations", float iterations];
+  report "handle_finalization" "ns/handle" ((finalized -. allocated) *. 1e9 /. float iterations)
+    ["iterations", float iterations]
+
+(* +-----------------------------------------------------------------+
+   | Entry point                                                     |
+   +-----------------------------------------------------------------+ *)
+
+let () =
+  (* Do not pace audio delivery on the mock. *)
+  (try ignore (Sys.getenv "MOCK_SPOTIFY_DELIVERY_RATE") with Not_found -> Unix.putenv "MOCK_SPOTIFY_DELIVERY_RATE" "0");
+  try
+    let session = session_create config in
+    session_login session ~username:"bench" ~password:"bench" ~remember_me:false;
+    process_until session (fun () -> session_connection_state session = CONNECTION_STATE_LOGGED_IN);
+    let tracks = bench_accessors session in
+    bench_callbacks session;
+    bench_music_delivery session tracks.(0);
+    bench_handles tracks;
+    session_logout session;
+    session_release session
+  with Error (func, err) ->
+    Printf.eprintf "%s: %s\n" func (error_message err);
+    exit 1
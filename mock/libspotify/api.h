@@ -0,0 +1,479 @@
+/*
+ * api.h
+ * -----
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ */
+
+/* Subset of the libspotify 9 API implemented by the mock library. It
+   only declares what the bindings use, with the same names and
+   signatures as the real header. */
+
+#ifndef MOCK_LIBSPOTIFY_API_H
+#define MOCK_LIBSPOTIFY_API_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SPOTIFY_API_VERSION 9
+
+typedef unsigned char byte;
+
+/* +-----------------------------------------------------------------+
+   | Types                                                           |
+   +-----------------------------------------------------------------+ */
+
+typedef struct sp_session sp_session;
+typedef struct sp_track sp_track;
+typedef struct sp_album sp_album;
+typedef struct sp_artist sp_artist;
+typedef struct sp_artistbrowse sp_artistbrowse;
+typedef struct sp_albumbrowse sp_albumbrowse;
+typedef struct sp_toplistbrowse sp_toplistbrowse;
+typedef struct sp_search sp_search;
+typedef struct sp_link sp_link;
+typedef struct sp_image sp_image;
+typedef struct sp_user sp_user;
+typedef struct sp_playlist sp_playlist;
+typedef struct sp_playlistcontainer sp_playlistcontainer;
+typedef struct sp_inbox sp_inbox;
+
+/* +-----------------------------------------------------------------+
+   | Error handling                                                  |
+   +-----------------------------------------------------------------+ */
+
+/* The bindings convert errors with [Val_int], so the values follow
+   the order of the [error] type of the OCaml library. */
+typedef enum sp_error {
+  SP_ERROR_OK,
+  SP_ERROR_BAD_API_VERSION,
+  SP_ERROR_API_INITIALIZATION_FAILED,
+  SP_ERROR_TRACK_NOT_PLAYABLE,
+  SP_ERROR_BAD_APPLICATION_KEY,
+  SP_ERROR_BAD_USERNAME_OR_PASSWORD,
+  SP_ERROR_USER_BANNED,
+  SP_ERROR_UNABLE_TO_CONTACT_SERVER,
+  SP_ERROR_CLIENT_TOO_OLD,
+  SP_ERROR_OTHER_PERMANENT,
+  SP_ERROR_BAD_USER_AGENT,
+  SP_ERROR_MISSING_CALLBACK,
+  SP_ERROR_INVALID_INDATA,
+  SP_ERROR_INDEX_OUT_OF_RANGE,
+  SP_ERROR_USER_NEEDS_PREMIUM,
+  SP_ERROR_OTHER_TRANSIENT,
+  SP_ERROR_IS_LOADING,
+  SP_ERROR_NO_STREAM_AVAILABLE,
+  SP_ERROR_PERMISSION_DENIED,
+  SP_ERROR_INBOX_IS_FULL,
+  SP_ERROR_NO_CACHE,
+  SP_ERROR_NO_SUCH_USER,
+  SP_ERROR_NO_CREDENTIALS,
+} sp_error;
+
+const char *sp_error_message(sp_error error);
+
+/* +-----------------------------------------------------------------+
+   | Session handling                                                |
+   +-----------------------------------------------------------------+ */
+
+typedef enum sp_connectionstate {
+  SP_CONNECTION_STATE_LOGGED_OUT = 0,
+  SP_CONNECTION_STATE_LOGGED_IN = 1,
+  SP_CONNECTION_STATE_DISCONNECTED = 2,
+  SP_CONNECTION_STATE_UNDEFINED = 3,
+  SP_CONNECTION_STATE_OFFLINE = 4,
+} sp_connectionstate;
+
+typedef enum sp_sampletype {
+  SP_SAMPLETYPE_INT16_NATIVE_ENDIAN = 0,
+} sp_sampletype;
+
+typedef struct sp_audioformat {
+  sp_sampletype sample_type;
+  int sample_rate;
+  int channels;
+} sp_audioformat;
+
+typedef enum sp_bitrate {
+  SP_BITRATE_160k = 0,
+  SP_BITRATE_320k = 1,
+  SP_BITRATE_96k = 2,
+} sp_bitrate;
+
+typedef enum sp_playlist_type {
+  SP_PLAYLIST_TYPE_PLAYLIST = 0,
+  SP_PLAYLIST_TYPE_START_FOLDER = 1,
+  SP_PLAYLIST_TYPE_END_FOLDER = 2,
+  SP_PLAYLIST_TYPE_PLACEHOLDER = 3,
+} sp_playlist_type;
+
+typedef enum sp_playlist_offline_status {
+  SP_PLAYLIST_OFFLINE_STATUS_NO = 0,
+  SP_PLAYLIST_OFFLINE_STATUS_YES = 1,
+  SP_PLAYLIST_OFFLINE_STATUS_DOWNLOADING = 2,
+  SP_PLAYLIST_OFFLINE_STATUS_WAITING = 3,
+} sp_playlist_offline_status;
+
+typedef struct sp_audio_buffer_stats {
+  int samples;
+  int stutter;
+} sp_audio_buffer_stats;
+
+typedef enum sp_connection_type {
+  SP_CONNECTION_TYPE_UNKNOWN = 0,
+  SP_CONNECTION_TYPE_NONE = 1,
+  SP_CONNECTION_TYPE_MOBILE = 2,
+  SP_CONNECTION_TYPE_MOBILE_ROAMING = 3,
+  SP_CONNECTION_TYPE_WIFI = 4,
+  SP_CONNECTION_TYPE_WIRED = 5,
+} sp_connection_type;
+
+typedef enum sp_connection_rules {
+  SP_CONNECTION_RULE_NETWORK = 0x1,
+  SP_CONNECTION_RULE_NETWORK_IF_ROAMING = 0x2,
+  SP_CONNECTION_RULE_ALLOW_SYNC_OVER_MOBILE = 0x4,
+  SP_CONNECTION_RULE_ALLOW_SYNC_OVER_WIFI = 0x8,
+} sp_connection_rules;
+
+typedef struct sp_offline_sync_status {
+  int queued_tracks;
+  unsigned long long queued_bytes;
+  int done_tracks;
+  unsigned long long done_bytes;
+  int copied_tracks;
+  unsigned long long copied_bytes;
+  int willnotcopy_tracks;
+  int error_tracks;
+  bool syncing;
+} sp_offline_sync_status;
+
+typedef struct sp_session_callbacks {
+  void (*logged_in)(sp_session *session, sp_error error);
+  void (*logged_out)(sp_session *session);
+  void (*metadata_updated)(sp_session *session);
+  void (*connection_error)(sp_session *session, sp_error error);
+  void (*message_to_user)(sp_session *session, const char *message);
+  void (*notify_main_thread)(sp_session *session);
+  int (*music_delivery)(sp_session *session, const sp_audioformat *format, const void *frames, int num_frames);
+  void (*play_token_lost)(sp_session *session);
+  void (*log_message)(sp_session *session, const char *data);
+  void (*end_of_track)(sp_session *session);
+  void (*streaming_error)(sp_session *session, sp_error error);
+  void (*userinfo_updated)(sp_session *session);
+  void (*start_playback)(sp_session *session);
+  void (*stop_playback)(sp_session *session);
+  void (*get_audio_buffer_stats)(sp_session *session, sp_audio_buffer_stats *stats);
+  void (*offline_status_updated)(sp_session *session);
+} sp_session_callbacks;
+
+typedef struct sp_session_config {
+  int api_version;
+  const char *cache_location;
+  const char *settings_location;
+  const void *application_key;
+  size_t application_key_size;
+  const char *user_agent;
+  const sp_session_callbacks *callbacks;
+  void *userdata;
+  bool compress_playlists;
+  bool dont_save_metadata_for_playlists;
+  bool initially_unload_playlists;
+} sp_session_config;
+
+sp_error sp_session_create(const sp_session_config *config, sp_session **sess);
+void sp_session_release(sp_session *sess);
+void sp_session_login(sp_session *session, const char *username, const char *password, bool remember_me);
+sp_error sp_session_relogin(sp_session *session);
+size_t sp_session_remembered_user(sp_session *session, char *buffer, size_t buffer_size);
+void sp_session_forget_me(sp_session *session);
+sp_user *sp_session_user(sp_session *session);
+void sp_session_logout(sp_session *session);
+sp_connectionstate sp_session_connectionstate(sp_session *session);
+void *sp_session_userdata(sp_session *session);
+void sp_session_set_cache_size(sp_session *session, size_t size);
+void sp_session_process_events(sp_session *session, int *next_timeout);
+sp_error sp_session_player_load(sp_session *session, sp_track *track);
+void sp_session_player_seek(sp_session *session, int offset);
+void sp_session_player_play(sp_session *session, bool play);
+void sp_session_player_unload(sp_session *session);
+sp_error sp_session_player_prefetch(sp_session *session, sp_track *track);
+sp_playlistcontainer *sp_session_playlistcontainer(sp_session *session);
+sp_playlist *sp_session_inbox_create(sp_session *session);
+sp_playlist *sp_session_starred_create(sp_session *session);
+sp_playlist *sp_session_starred_for_user_create(sp_session *session, const char *canonical_username);
+sp_playlistcontainer *sp_session_publishedcontainer_for_user_create(sp_session *session, const char *canonical_username);
+void sp_session_preferred_bitrate(sp_session *session, sp_bitrate bitrate);
+void sp_session_preferred_offline_bitrate(sp_session *session, sp_bitrate bitrate, bool allow_resync);
+int sp_session_num_friends(sp_session *session);
+sp_user *sp_session_friend(sp_session *session, int index);
+void sp_session_set_connection_type(sp_session *session, sp_connection_type type);
+void sp_session_set_connection_rules(sp_session *session, sp_connection_rules rules);
+int sp_offline_tracks_to_sync(sp_session *session);
+int sp_offline_num_playlists(sp_session *session);
+bool sp_offline_sync_get_status(sp_session *session, sp_offline_sync_status *status);
+int sp_offline_time_left(sp_session *session);
+int sp_session_user_country(sp_session *session);
+
+/* +-----------------------------------------------------------------+
+   | Links                                                           |
+   +-----------------------------------------------------------------+ */
+
+typedef enum {
+  SP_LINKTYPE_INVALID = 0,
+  SP_LINKTYPE_TRACK = 1,
+  SP_LINKTYPE_ALBUM = 2,
+  SP_LINKTYPE_ARTIST = 3,
+  SP_LINKTYPE_SEARCH = 4,
+  SP_LINKTYPE_PLAYLIST = 5,
+  SP_LINKTYPE_PROFILE = 6,
+  SP_LINKTYPE_STARRED = 7,
+  SP_LINKTYPE_LOCALTRACK = 8,
+  SP_LINKTYPE_IMAGE = 9,
+} sp_linktype;
+
+sp_link *sp_link_create_from_string(const char *link);
+sp_link *sp_link_create_from_track(sp_track *track, int offset);
+sp_link *sp_link_create_from_album(sp_album *album);
+sp_link *sp_link_create_from_album_cover(sp_album *album);
+sp_link *sp_link_create_from_artist(sp_artist *artist);
+sp_link *sp_link_create_from_artist_portrait(sp_artist *artist);
+sp_link *sp_link_create_from_artistbrowse_portrait(sp_artistbrowse *arb, int index);
+sp_link *sp_link_create_from_search(sp_search *search);
+sp_link *sp_link_create_from_playlist(sp_playlist *playlist);
+sp_link *sp_link_create_from_user(sp_user *user);
+sp_link *sp_link_create_from_image(sp_image *image);
+int sp_link_as_string(sp_link *link, char *buffer, int buffer_size);
+sp_linktype sp_link_type(sp_link *link);
+sp_track *sp_link_as_track(sp_link *link);
+sp_track *sp_link_as_track_and_offset(sp_link *link, int *offset);
+sp_album *sp_link_as_album(sp_link *link);
+sp_artist *sp_link_as_artist(sp_link *link);
+sp_user *sp_link_as_user(sp_link *link);
+void sp_link_add_ref(sp_link *link);
+void sp_link_release(sp_link *link);
+
+/* +-----------------------------------------------------------------+
+   | Tracks                                                          |
+   +-----------------------------------------------------------------+ */
+
+bool sp_track_is_loaded(sp_track *track);
+sp_error sp_track_error(sp_track *track);
+bool sp_track_is_available(sp_session *session, sp_track *track);
+bool sp_track_is_local(sp_session *session, sp_track *track);
+bool sp_track_is_autolinked(sp_session *session, sp_track *track);
+sp_track *sp_track_get_playable(sp_session *session, sp_track *track);
+bool sp_track_is_starred(sp_session *session, sp_track *track);
+void sp_track_set_starred(sp_session *session, sp_track *const *tracks, int num_tracks, bool star);
+int sp_track_num_artists(sp_track *track);
+sp_artist *sp_track_artist(sp_track *track, int index);
+sp_album *sp_track_album(sp_track *track);
+const char *sp_track_name(sp_track *track);
+int sp_track_duration(sp_track *track);
+int sp_track_popularity(sp_track *track);
+int sp_track_disc(sp_track *track);
+int sp_track_index(sp_track *track);
+sp_track *sp_localtrack_create(const char *artist, const char *title, const char *album, int length);
+void sp_track_add_ref(sp_track *track);
+void sp_track_release(sp_track *track);
+
+/* +-----------------------------------------------------------------+
+   | Albums                                                          |
+   +-----------------------------------------------------------------+ */
+
+typedef enum {
+  SP_ALBUMTYPE_ALBUM = 0,
+  SP_ALBUMTYPE_SINGLE = 1,
+  SP_ALBUMTYPE_COMPILATION = 2,
+  SP_ALBUMTYPE_UNKNOWN = 3,
+} sp_albumtype;
+
+bool sp_album_is_loaded(sp_album *album);
+bool sp_album_is_available(sp_album *album);
+sp_artist *sp_album_artist(sp_album *album);
+const byte *sp_album_cover(sp_album *album);
+const char *sp_album_name(sp_album *album);
+int sp_album_year(sp_album *album);
+sp_albumtype sp_album_type(sp_album *album);
+void sp_album_add_ref(sp_album *album);
+void sp_album_release(sp_album *album);
+
+/* +-----------------------------------------------------------------+
+   | Artists                                                         |
+   +-----------------------------------------------------------------+ */
+
+const char *sp_artist_name(sp_artist *artist);
+bool sp_artist_is_loaded(sp_artist *artist);
+void sp_artist_add_ref(sp_artist *artist);
+void sp_artist_release(sp_artist *artist);
+
+/* +-----------------------------------------------------------------+
+   | Album browsing                                                  |
+   +-----------------------------------------------------------------+ */
+
+typedef void albumbrowse_complete_cb(sp_albumbrowse *result, void *userdata);
+
+sp_albumbrowse *sp_albumbrowse_create(sp_session *session, sp_album *album, albumbrowse_complete_cb *callback, void *userdata);
+bool sp_albumbrowse_is_loaded(sp_albumbrowse *alb);
+sp_error sp_albumbrowse_error(sp_albumbrowse *alb);
+sp_album *sp_albumbrowse_album(sp_albumbrowse *alb);
+sp_artist *sp_albumbrowse_artist(sp_albumbrowse *alb);
+int sp_albumbrowse_num_copyrights(sp_albumbrowse *alb);
+const char *sp_albumbrowse_copyright(sp_albumbrowse *alb, int index);
+int sp_albumbrowse_num_tracks(sp_albumbrowse *alb);
+sp_track *sp_albumbrowse_track(sp_albumbrowse *alb, int index);
+const char *sp_albumbrowse_review(sp_albumbrowse *alb);
+void sp_albumbrowse_add_ref(sp_albumbrowse *alb);
+void sp_albumbrowse_release(sp_albumbrowse *alb);
+
+/* +-----------------------------------------------------------------+
+   | Artist browsing                                                 |
+   +-----------------------------------------------------------------+ */
+
+typedef void artistbrowse_complete_cb(sp_artistbrowse *result, void *userdata);
+
+sp_artistbrowse *sp_artistbrowse_create(sp_session *session, sp_artist *artist, artistbrowse_complete_cb *callback, void *userdata);
+bool sp_artistbrowse_is_loaded(sp_artistbrowse *arb);
+sp_error sp_artistbrowse_error(sp_artistbrowse *arb);
+sp_artist *sp_artistbrowse_artist(sp_artistbrowse *arb);
+int sp_artistbrowse_num_portraits(sp_artistbrowse *arb);
+const byte *sp_artistbrowse_portrait(sp_artistbrowse *arb, int index);
+int sp_artistbrowse_num_tracks(sp_artistbrowse *arb);
+sp_track *sp_artistbrowse_track(sp_artistbrowse *arb, int index);
+int sp_artistbrowse_num_albums(sp_artistbrowse *arb);
+sp_album *sp_artistbrowse_album(sp_artistbrowse *arb, int index);
+int sp_artistbrowse_num_similar_artists(sp_artistbrowse *arb);
+sp_artist *sp_artistbrowse_similar_artist(sp_artistbrowse *arb, int index);
+const char *sp_artistbrowse_biography(sp_artistbrowse *arb);
+void sp_artistbrowse_add_ref(sp_artistbrowse *arb);
+void sp_artistbrowse_release(sp_artistbrowse *arb);
+
+/* +-----------------------------------------------------------------+
+   | Images                                                          |
+   +-----------------------------------------------------------------+ */
+
+typedef enum {
+  SP_IMAGE_FORMAT_UNKNOWN = -1,
+  SP_IMAGE_FORMAT_JPEG = 0,
+} sp_imageformat;
+
+typedef void image_loaded_cb(sp_image *image, void *userdata);
+
+sp_image *sp_image_create(sp_session *session, const byte image_id[20]);
+sp_image *sp_image_create_from_link(sp_session *session, sp_link *l);
+void sp_image_add_load_callback(sp_image *image, image_loaded_cb *callback, void *userdata);
+void sp_image_remove_load_callback(sp_image *image, image_loaded_cb *callback, void *userdata);
+bool sp_image_is_loaded(sp_image *image);
+sp_error sp_image_error(sp_image *image);
+sp_imageformat sp_image_format(sp_image *image);
+const void *sp_image_data(sp_image *image, size_t *data_size);
+const byte *sp_image_image_id(sp_image *image);
+void sp_image_add_ref(sp_image *image);
+void sp_image_release(sp_image *image);
+
+/* +-----------------------------------------------------------------+
+   | Searching                                                       |
+   +-----------------------------------------------------------------+ */
+
+typedef enum {
+  SP_RADIO_GENRE_ALT_POP_ROCK = 0x1,
+  SP_RADIO_GENRE_BLUES = 0x2,
+  SP_RADIO_GENRE_COUNTRY = 0x4,
+  SP_RADIO_GENRE_DISCO = 0x8,
+  SP_RADIO_GENRE_FUNK = 0x10,
+  SP_RADIO_GENRE_HARD_ROCK = 0x20,
+  SP_RADIO_GENRE_HEAVY_METAL = 0x40,
+  SP_RADIO_GENRE_RAP = 0x80,
+  SP_RADIO_GENRE_HOUSE = 0x100,
+  SP_RADIO_GENRE_JAZZ = 0x200,
+  SP_RADIO_GENRE_NEW_WAVE = 0x400,
+  SP_RADIO_GENRE_RNB = 0x800,
+  SP_RADIO_GENRE_POP = 0x1000,
+  SP_RADIO_GENRE_PUNK = 0x2000,
+  SP_RADIO_GENRE_REGGAE = 0x4000,
+  SP_RADIO_GENRE_POP_ROCK = 0x8000,
+  SP_RADIO_GENRE_SOUL = 0x10000,
+  SP_RADIO_GENRE_TECHNO = 0x20000,
+} sp_radio_genre;
+
+typedef void search_complete_cb(sp_search *result, void *userdata);
+
+sp_search *sp_search_create(sp_session *session, const char *query, int track_offset, int track_count, int album_offset, int album_count, int artist_offset, int artist_count, search_complete_cb *callback, void *userdata);
+sp_search *sp_radio_search_create(sp_session *session, unsigned int from_year, unsigned int to_year, sp_radio_genre genres, search_complete_cb *callback, void *userdata);
+bool sp_search_is_loaded(sp_search *search);
+sp_error sp_search_error(sp_search *search);
+int sp_search_num_tracks(sp_search *search);
+sp_track *sp_search_track(sp_search *search, int index);
+int sp_search_num_albums(sp_search *search);
+sp_album *sp_search_album(sp_search *search, int index);
+int sp_search_num_artists(sp_search *search);
+sp_artist *sp_search_artist(sp_search *search, int index);
+const char *sp_search_query(sp_search *search);
+const char *sp_search_did_you_mean(sp_search *search);
+int sp_search_total_tracks(sp_search *search);
+int sp_search_total_albums(sp_search *search);
+int sp_search_total_artists(sp_search *search);
+void sp_search_add_ref(sp_search *search);
+void sp_search_release(sp_search *search);
+
+/* +-----------------------------------------------------------------+
+   | Users, playlists and toplists                                   |
+   +-----------------------------------------------------------------+ */
+
+typedef struct sp_playlist_callbacks {
+  void (*tracks_added)(sp_playlist *pl, sp_track *const *tracks, int num_tracks, int position, void *userdata);
+  void (*tracks_removed)(sp_playlist *pl, const int *tracks, int num_tracks, void *userdata);
+  void (*tracks_moved)(sp_playlist *pl, const int *tracks, int num_tracks, int new_position, void *userdata);
+  void (*playlist_renamed)(sp_playlist *pl, void *userdata);
+  void (*playlist_state_changed)(sp_playlist *pl, void *userdata);
+  void (*playlist_update_in_progress)(sp_playlist *pl, bool done, void *userdata);
+  void (*playlist_metadata_updated)(sp_playlist *pl, void *userdata);
+} sp_playlist_callbacks;
+
+typedef struct sp_playlistcontainer_callbacks {
+  void (*playlist_added)(sp_playlistcontainer *pc, sp_playlist *playlist, int position, void *userdata);
+  void (*playlist_removed)(sp_playlistcontainer *pc, sp_playlist *playlist, int position, void *userdata);
+  void (*playlist_moved)(sp_playlistcontainer *pc, sp_playlist *playlist, int position, int new_position, void *userdata);
+  void (*container_loaded)(sp_playlistcontainer *pc, void *userdata);
+} sp_playlistcontainer_callbacks;
+
+bool sp_user_is_loaded(sp_user *user);
+const char *sp_user_canonical_name(sp_user *user);
+void sp_user_add_ref(sp_user *user);
+void sp_user_release(sp_user *user);
+
+bool sp_playlist_is_loaded(sp_playlist *playlist);
+void sp_playlist_add_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata);
+void sp_playlist_remove_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata);
+int sp_playlist_num_tracks(sp_playlist *playlist);
+sp_track *sp_playlist_track(sp_playlist *playlist, int index);
+const char *sp_playlist_name(sp_playlist *playlist);
+void sp_playlist_set_offline_mode(sp_session *session, sp_playlist *playlist, bool offline);
+sp_playlist_offline_status sp_playlist_get_offline_status(sp_session *session, sp_playlist *playlist);
+int sp_playlist_get_offline_download_completed(sp_session *session, sp_playlist *playlist);
+void sp_playlist_add_ref(sp_playlist *playlist);
+void sp_playlist_release(sp_playlist *playlist);
+
+bool sp_playlistcontainer_is_loaded(sp_playlistcontainer *pc);
+void sp_playlistcontainer_add_callbacks(sp_playlistcontainer *pc, sp_playlistcontainer_callbacks *callbacks, void *userdata);
+void sp_playlistcontainer_remove_callbacks(sp_playlistcontainer *pc, sp_playlistcontainer_callbacks *callbacks, void *userdata);
+int sp_playlistcontainer_num_playlists(sp_playlistcontainer *pc);
+sp_playlist *sp_playlistcontainer_playlist(sp_playlistcontainer *pc, int index);
+void sp_playlistcontainer_add_ref(sp_playlistcontainer *pc);
+void sp_playlistcontainer_release(sp_playlistcontainer *pc);
+
+void sp_toplistbrowse_add_ref(sp_toplistbrowse *tlb);
+void sp_toplistbrowse_release(sp_toplistbrowse *tlb);
+void sp_inbox_add_ref(sp_inbox *inbox);
+void sp_inbox_release(sp_inbox *inbox);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MOCK_LIBSPOTIFY_API_H */
@@ -0,0 +1,2813 @@
+/*
+ * mock_spotify.c
+ * --------------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ */
+
+/* Mock implementation of libspotify, serving a deterministic
+   synthetic catalog without any network access.
+
+   Like the real library it calls [notify_main_thread] from an
+   internal thread, dispatches results from
+   [sp_session_process_events] and calls [music_delivery] from an
+   audio thread. Its behaviour is configured with the following
+   environment variables, read when the first session is created:
+
+   - MOCK_SPOTIFY_TRACKS: number of tracks in the catalog (100000)
+   - MOCK_SPOTIFY_CATALOG_SEED: seed of the catalog (0)
+   - MOCK_SPOTIFY_UNAVAILABLE: ratio of unplayable tracks (0)
+   - MOCK_SPOTIFY_LATENCY_MS: delay of logins, searches, browses and
+     image loads (0)
+   - MOCK_SPOTIFY_JITTER_MS: maximum random delay added to it (0)
+   - MOCK_SPOTIFY_SEED: seed of jitter and fault injection (1)
+   - MOCK_SPOTIFY_FAULT_RATE: probability for an operation to fail (0)
+   - MOCK_SPOTIFY_FAULTS: comma separated operations which may fail,
+     among login, search, browse, image and stream (all of them)
+   - MOCK_SPOTIFY_SAMPLE_RATE, MOCK_SPOTIFY_CHANNELS: audio format
+     (44100, 2)
+   - MOCK_SPOTIFY_DELIVERY_FRAMES: frames per delivery (2048)
+   - MOCK_SPOTIFY_DELIVERY_RATE: delivery speed relative to real time,
+     0 for as fast as the application consumes (1)
+   - MOCK_SPOTIFY_RETRY_MS: delay before delivering again frames the
+     application did not accept (100)
+   - MOCK_SPOTIFY_STALL_EVERY, MOCK_SPOTIFY_STALL_MS: stop delivering
+     for the given time every given number of deliveries (0, 0)
+   - MOCK_SPOTIFY_LEAK_REPORT: report leaked objects at exit
+
+   Any username is accepted, with any non-empty password. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "mock_spotify.h"
+
+static void* xmalloc(size_t size)
+{
+  void *ptr = malloc(size);
+  if (ptr == NULL) {
+    perror("cannot allocate memory");
+    abort();
+  }
+  return ptr;
+}
+
+static char *xstrdup(const char *str)
+{
+  size_t len = strlen(str);
+  char *res = xmalloc(len + 1);
+  memcpy(res, str, len + 1);
+  return res;
+}
+
+#define new(type) (type*)xmalloc(sizeof(type))
+
+/* +-----------------------------------------------------------------+
+   | Configuration                                                   |
+   +-----------------------------------------------------------------+ */
+
+enum fault {
+  FAULT_LOGIN = 1,
+  FAULT_SEARCH = 2,
+  FAULT_BROWSE = 4,
+  FAULT_IMAGE = 8,
+  FAULT_STREAM = 16,
+};
+
+static struct config {
+  int num_tracks;
+  uint64_t catalog_seed;
+  double unavailable;
+  int latency;
+  int jitter;
+  uint64_t seed;
+  double fault_rate;
+  int faults;
+  int sample_rate;
+  int channels;
+  int delivery_frames;
+  double delivery_rate;
+  int retry;
+  int stall_every;
+  int stall;
+  int leak_report;
+} config;
+
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+static double env_double(const char *name, double def)
+{
+  const char *str = getenv(name);
+  char *end;
+  if (str == NULL || *str == 0) return def;
+  double x = strtod(str, &end);
+  if (*end) {
+    fprintf(stderr, "mock-spotify: invalid value for %s: %s\n", name, str);
+    return def;
+  }
+  return x;
+}
+
+static int env_int(const char *name, int def)
+{
+  return (int)env_double(name, def);
+}
+
+static int env_faults(const char *name)
+{
+  static const struct { const char *name; int fault; } names[] = {
+    { "login", FAULT_LOGIN },
+    { "search", FAULT_SEARCH },
+    { "browse", FAULT_BROWSE },
+    { "image", FAULT_IMAGE },
+    { "stream", FAULT_STREAM },
+  };
+  const char *str = getenv(name);
+  if (str == NULL) return FAULT_LOGIN | FAULT_SEARCH | FAULT_BROWSE | FAULT_IMAGE | FAULT_STREAM;
+  int faults = 0;
+  while (*str) {
+    size_t len = strcspn(str, ",");
+    size_t i;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+      if (strlen(names[i].name) == len && strncmp(names[i].name, str, len) == 0) break;
+    if (i < sizeof(names) / sizeof(names[0]))
+      faults |= names[i].fault;
+    else if (len > 0)
+      fprintf(stderr, "mock-spotify: unknown fault in %s: %.*s\n", name, (int)len, str);
+    str += len;
+    if (*str) str++;
+  }
+  return faults;
+}
+
+static void leak_report_at_exit()
+{
+  mock_spotify_leak_report(stderr);
+}
+
+static void load_config()
+{
+  config.num_tracks = env_int("MOCK_SPOTIFY_TRACKS", 100000);
+  if (config.num_tracks < 1) config.num_tracks = 1;
+  config.catalog_seed = env_int("MOCK_SPOTIFY_CATALOG_SEED", 0);
+  config.unavailable = env_double("MOCK_SPOTIFY_UNAVAILABLE", 0);
+  config.latency = env_int("MOCK_SPOTIFY_LATENCY_MS", 0);
+  config.jitter = env_int("MOCK_SPOTIFY_JITTER_MS", 0);
+  config.seed = env_int("MOCK_SPOTIFY_SEED", 1);
+  config.fault_rate = env_double("MOCK_SPOTIFY_FAULT_RATE", 0);
+  config.faults = env_faults("MOCK_SPOTIFY_FAULTS");
+  config.sample_rate = env_int("MOCK_SPOTIFY_SAMPLE_RATE", 44100);
+  config.channels = env_int("MOCK_SPOTIFY_CHANNELS", 2);
+  config.delivery_frames = env_int("MOCK_SPOTIFY_DELIVERY_FRAMES", 2048);
+  if (config.delivery_frames < 1) config.delivery_frames = 1;
+  config.delivery_rate = env_double("MOCK_SPOTIFY_DELIVERY_RATE", 1);
+  config.retry = env_int("MOCK_SPOTIFY_RETRY_MS", 100);
+  config.stall_every = env_int("MOCK_SPOTIFY_STALL_EVERY", 0);
+  config.stall = env_int("MOCK_SPOTIFY_STALL_MS", 0);
+  config.leak_report = getenv("MOCK_SPOTIFY_LEAK_REPORT") != NULL;
+  if (config.leak_report) atexit(leak_report_at_exit);
+}
+
+static void init()
+{
+  pthread_once(&config_once, load_config);
+}
+
+/* +-----------------------------------------------------------------+
+   | Utils                                                           |
+   +-----------------------------------------------------------------+ */
+
+static int64_t now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void deadline_to_timespec(int64_t deadline, struct timespec *ts)
+{
+  ts->tv_sec = deadline / 1000000000;
+  ts->tv_nsec = deadline % 1000000000;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/* Invertible permutation of 64-bit integers, used to make
+   identifiers look random. */
+
+#define PERMUTE_KEY 0x5bd1e9955bd1e995ULL
+#define PERMUTE_C1 0xff51afd7ed558ccdULL
+#define PERMUTE_C2 0xc4ceb9fe1a85ec53ULL
+
+static uint64_t inverse64(uint64_t a)
+{
+  uint64_t x = a;
+  int i;
+  for (i = 0; i < 5; i++) x *= 2 - a * x;
+  return x;
+}
+
+static uint64_t permute(uint64_t x)
+{
+  x ^= PERMUTE_KEY;
+  x *= PERMUTE_C1;
+  x ^= x >> 32;
+  x *= PERMUTE_C2;
+  return x ^ (x >> 32);
+}
+
+static uint64_t unpermute(uint64_t x)
+{
+  x ^= x >> 32;
+  x *= inverse64(PERMUTE_C2);
+  x ^= x >> 32;
+  x *= inverse64(PERMUTE_C1);
+  return x ^ PERMUTE_KEY;
+}
+
+/* +-----------------------------------------------------------------+
+   | Objects                                                         |
+   +-----------------------------------------------------------------+ */
+
+enum kind {
+  KIND_TRACK,
+  KIND_ALBUM,
+  KIND_ARTIST,
+  KIND_ARTISTBROWSE,
+  KIND_ALBUMBROWSE,
+  KIND_TOPLISTBROWSE,
+  KIND_SEARCH,
+  KIND_LINK,
+  KIND_IMAGE,
+  KIND_USER,
+  KIND_PLAYLIST,
+  KIND_PLAYLISTCONTAINER,
+  KIND_INBOX,
+};
+
+static const char *kind_names[] = {
+  "track",
+  "album",
+  "artist",
+  "artistbrowse",
+  "albumbrowse",
+  "toplistbrowse",
+  "search",
+  "link",
+  "image",
+  "user",
+  "playlist",
+  "playlistcontainer",
+  "inbox",
+};
+
+/* Header of all objects. */
+struct object {
+  enum kind kind;
+  int refcount;
+  /* References held by the application. */
+  int internal;
+  /* References held by the mock itself. */
+  int pinned;
+  /* Pinned objects belong to the catalog or to another object and
+     are never freed when their reference count drops to 0. */
+  void (*free)(struct object *object);
+  struct object *prev, *next;
+  /* Doubly linked list of all objects. */
+};
+
+static pthread_mutex_t objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct object *objects = NULL;
+
+static void object_init(struct object *object, enum kind kind, int refcount, int pinned, void (*free)(struct object *object))
+{
+  object->kind = kind;
+  object->refcount = refcount;
+  object->internal = 0;
+  object->pinned = pinned;
+  object->free = free;
+  object->prev = NULL;
+  pthread_mutex_lock(&objects_mutex);
+  object->next = objects;
+  if (objects) objects->prev = object;
+  objects = object;
+  pthread_mutex_unlock(&objects_mutex);
+}
+
+/* Unlink an object. Called with [objects_mutex] held. */
+static void object_unlink(struct object *object)
+{
+  if (object->prev)
+    object->prev->next = object->next;
+  else
+    objects = object->next;
+  if (object->next) object->next->prev = object->prev;
+}
+
+static void object_add_ref(struct object *object, int internal)
+{
+  pthread_mutex_lock(&objects_mutex);
+  if (internal)
+    object->internal++;
+  else
+    object->refcount++;
+  pthread_mutex_unlock(&objects_mutex);
+}
+
+static void object_release(struct object *object, int internal)
+{
+  int dead;
+  pthread_mutex_lock(&objects_mutex);
+  if (internal)
+    object->internal--;
+  else if (object->refcount == 0)
+    fprintf(stderr, "mock-spotify: %s %p released too many times\n", kind_names[object->kind], (void*)object);
+  else
+    object->refcount--;
+  dead = !object->pinned && object->refcount == 0 && object->internal == 0;
+  if (dead) object_unlink(object);
+  pthread_mutex_unlock(&objects_mutex);
+  if (dead) object->free(object);
+}
+
+int mock_spotify_refcount(const void *object)
+{
+  int refcount;
+  pthread_mutex_lock(&objects_mutex);
+  refcount = ((const struct object*)object)->refcount;
+  pthread_mutex_unlock(&objects_mutex);
+  return refcount;
+}
+
+int mock_spotify_live_objects(void)
+{
+  int count = 0;
+  struct object *object;
+  pthread_mutex_lock(&objects_mutex);
+  for (object = objects; object; object = object->next)
+    if (object->refcount > 0) count++;
+  pthread_mutex_unlock(&objects_mutex);
+  return count;
+}
+
+int64_t mock_spotify_references(void)
+{
+  int64_t count = 0;
+  struct object *object;
+  pthread_mutex_lock(&objects_mutex);
+  for (object = objects; object; object = object->next) count += object->refcount;
+  pthread_mutex_unlock(&objects_mutex);
+  return count;
+}
+
+int mock_spotify_leak_report(FILE *out)
+{
+  int counts[sizeof(kind_names) / sizeof(kind_names[0])];
+  int count = 0;
+  size_t i;
+  struct object *object;
+  memset(counts, 0, sizeof(counts));
+  pthread_mutex_lock(&objects_mutex);
+  for (object = objects; object; object = object->next)
+    if (object->refcount > 0) {
+      counts[object->kind]++;
+      count++;
+    }
+  pthread_mutex_unlock(&objects_mutex);
+  if (count > 0) {
+    fprintf(out, "mock-spotify: %d leaked object(s):\n", count);
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+      if (counts[i]) fprintf(out, "mock-spotify:   %s: %d\n", kind_names[i], counts[i]);
+  }
+  return count;
+}
+
+static void free_object(struct object *object)
+{
+  free(object);
+}
+
+#define DEFINE_REFCOUNT(name)                                           \
+  void sp_##name##_add_ref(sp_##name *name)                             \
+  {                                                                     \
+    object_add_ref((struct object*)name, 0);                            \
+  }                                                                     \
+                                                                        \
+  void sp_##name##_release(sp_##name *name)                             \
+  {                                                                     \
+    object_release((struct object*)name, 0);                            \
+  }
+
+/* +-----------------------------------------------------------------+
+   | Catalog                                                         |
+   +-----------------------------------------------------------------+ */
+
+#define TRACKS_PER_ALBUM 10
+#define ALBUMS_PER_ARTIST 5
+#define MAX_PORTRAITS 3
+
+static const char *words[] = {
+  "midnight", "river", "electric", "golden", "silent", "broken", "summer", "winter",
+  "ocean", "fire", "paper", "glass", "velvet", "neon", "desert", "thunder",
+  "shadow", "crystal", "wild", "lonely", "city", "heart", "dream", "stone",
+  "silver", "echo", "northern", "light", "rain", "highway", "garden", "mirror",
+  "blue", "red", "falling", "rising", "empty", "secret", "young", "ancient",
+  "machine", "ghost", "sugar", "storm", "morning", "island", "forest", "signal",
+  "copper", "lunar", "static", "hollow", "tiger", "harbor", "feather", "wire",
+  "cinnamon", "orbit", "lantern", "canyon", "smoke", "valley", "radio", "cherry",
+};
+
+#define NUM_WORDS (int)(sizeof(words) / sizeof(words[0]))
+
+struct sp_artist {
+  struct object object;
+  int index;
+  char *name;
+};
+
+struct sp_album {
+  struct object object;
+  int index;
+  char *name;
+  sp_artist *artist;
+  byte cover[20];
+  int year;
+  sp_albumtype type;
+};
+
+struct sp_track {
+  struct object object;
+  int index;
+  /* Index in the catalog, -1 for local tracks. */
+  char *name;
+  int duration;
+  int popularity;
+  int disc;
+  int track_index;
+  int available;
+  int starred;
+  sp_album *album;
+  int num_artists;
+  sp_artist *artists[2];
+};
+
+static pthread_mutex_t catalog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sp_track **catalog_tracks = NULL;
+static sp_album **catalog_albums = NULL;
+static sp_artist **catalog_artists = NULL;
+
+static int num_albums()
+{
+  return (config.num_tracks + TRACKS_PER_ALBUM - 1) / TRACKS_PER_ALBUM;
+}
+
+static int num_artists()
+{
+  return (num_albums() + ALBUMS_PER_ARTIST - 1) / ALBUMS_PER_ARTIST;
+}
+
+static uint64_t catalog_hash(enum kind kind, int index, int salt)
+{
+  return mix64(((uint64_t)kind << 56) ^ ((uint64_t)salt << 40) ^ (uint64_t)index ^ config.catalog_seed);
+}
+
+static void artist_name(int index, char *buffer, size_t size)
+{
+  uint64_t h = catalog_hash(KIND_ARTIST, index, 0);
+  snprintf(buffer, size, "The %s %s %d", words[h % NUM_WORDS], words[(h >> 8) % NUM_WORDS], index);
+}
+
+static void album_name(int index, char *buffer, size_t size)
+{
+  uint64_t h = catalog_hash(KIND_ALBUM, index, 0);
+  snprintf(buffer, size, "%s %s", words[h % NUM_WORDS], words[(h >> 8) % NUM_WORDS]);
+  buffer[0] = toupper(buffer[0]);
+}
+
+static void track_name(int index, char *buffer, size_t size)
+{
+  uint64_t h = catalog_hash(KIND_TRACK, index, 0);
+  snprintf(buffer, size, "%s %s %s", words[h % NUM_WORDS], words[(h >> 8) % NUM_WORDS], words[(h >> 16) % NUM_WORDS]);
+  buffer[0] = toupper(buffer[0]);
+}
+
+static int album_artist_index(int album)
+{
+  return album / ALBUMS_PER_ARTIST;
+}
+
+static int album_year(int album)
+{
+  return 1950 + (int)(catalog_hash(KIND_ALBUM, album, 1) % 62);
+}
+
+/* Genres of an album, as a mask of [sp_radio_genre]. */
+static unsigned album_genres(int album)
+{
+  uint64_t h = catalog_hash(KIND_ALBUM, album, 2);
+  return (1u << (h % 18)) | (1u << ((h >> 8) % 18));
+}
+
+/* Return the featured artist of a track, or -1 if it has only one. */
+static int track_featured_artist(int index)
+{
+  uint64_t h = catalog_hash(KIND_TRACK, index, 1);
+  if (h % 8 != 0 || num_artists() < 2) return -1;
+  return (album_artist_index(index / TRACKS_PER_ALBUM) + 1 + (int)((h >> 8) % (num_artists() - 1))) % num_artists();
+}
+
+static sp_artist *catalog_artist(int index)
+{
+  sp_artist *artist;
+  char name[128];
+  pthread_mutex_lock(&catalog_mutex);
+  artist = catalog_artists[index];
+  if (artist == NULL) {
+    artist = new(sp_artist);
+    object_init(&(artist->object), KIND_ARTIST, 0, 1, free_object);
+    artist->index = index;
+    artist_name(index, name, sizeof(name));
+    artist->name = xstrdup(name);
+    catalog_artists[index] = artist;
+  }
+  pthread_mutex_unlock(&catalog_mutex);
+  return artist;
+}
+
+static void image_id(byte id[20], enum kind kind, int sub, int index)
+{
+  uint64_t a = permute(((uint64_t)kind << 56) | ((uint64_t)sub << 48) | (uint32_t)index);
+  uint64_t b = mix64(a);
+  int i;
+  for (i = 0; i < 8; i++) {
+    id[i] = a >> (56 - 8 * i);
+    id[8 + i] = b >> (56 - 8 * i);
+  }
+  for (i = 0; i < 4; i++) id[16 + i] = b >> (8 * i);
+}
+
+static sp_album *catalog_album(int index)
+{
+  sp_album *album;
+  char name[128];
+  sp_artist *artist = catalog_artist(album_artist_index(index));
+  pthread_mutex_lock(&catalog_mutex);
+  album = catalog_albums[index];
+  if (album == NULL) {
+    album = new(sp_album);
+    object_init(&(album->object), KIND_ALBUM, 0, 1, free_object);
+    album->index = index;
+    album_name(index, name, sizeof(name));
+    album->name = xstrdup(name);
+    album->artist = artist;
+    image_id(album->cover, KIND_ALBUM, 0, index);
+    album->year = album_year(index);
+    album->type = catalog_hash(KIND_ALBUM, index, 3) % 10 == 0 ? SP_ALBUMTYPE_SINGLE : SP_ALBUMTYPE_ALBUM;
+    catalog_albums[index] = album;
+  }
+  pthread_mutex_unlock(&catalog_mutex);
+  return album;
+}
+
+static sp_track *catalog_track(int index)
+{
+  sp_track *track;
+  char name[128];
+  int featured = track_featured_artist(index);
+  sp_album *album = catalog_album(index / TRACKS_PER_ALBUM);
+  sp_artist *artist = featured >= 0 ? catalog_artist(featured) : NULL;
+  pthread_mutex_lock(&catalog_mutex);
+  track = catalog_tracks[index];
+  if (track == NULL) {
+    uint64_t h = catalog_hash(KIND_TRACK, index, 2);
+    track = new(sp_track);
+    object_init(&(track->object), KIND_TRACK, 0, 1, free_object);
+    track->index = index;
+    track_name(index, name, sizeof(name));
+    track->name = xstrdup(name);
+    track->duration = 90000 + (int)(h % 300000);
+    track->popularity = (int)((h >> 20) % 101);
+    track->disc = 1;
+    track->track_index = index % TRACKS_PER_ALBUM + 1;
+    track->available = (double)((h >> 32) & 0xffff) / 65536.0 >= config.unavailable;
+    track->starred = 0;
+    track->album = album;
+    track->artists[0] = album->artist;
+    track->artists[1] = artist;
+    track->num_artists = artist ? 2 : 1;
+    catalog_tracks[index] = track;
+  }
+  pthread_mutex_unlock(&catalog_mutex);
+  return track;
+}
+
+static void load_catalog()
+{
+  catalog_tracks = calloc(config.num_tracks, sizeof(sp_track*));
+  catalog_albums = calloc(num_albums(), sizeof(sp_album*));
+  catalog_artists = calloc(num_artists(), sizeof(sp_artist*));
+  if (catalog_tracks == NULL || catalog_albums == NULL || catalog_artists == NULL) {
+    perror("cannot allocate memory");
+    abort();
+  }
+}
+
+static pthread_once_t catalog_once = PTHREAD_ONCE_INIT;
+
+static void init_catalog()
+{
+  init();
+  pthread_once(&catalog_once, load_catalog);
+}
+
+int mock_spotify_num_tracks(void)
+{
+  init_catalog();
+  return config.num_tracks;
+}
+
+sp_track *mock_spotify_track(int index)
+{
+  init_catalog();
+  if (index < 0 || index >= config.num_tracks) return NULL;
+  return catalog_track(index);
+}
+
+/* +-----------------------------------------------------------------+
+   | Users                                                           |
+   +-----------------------------------------------------------------+ */
+
+struct sp_user {
+  struct object object;
+  char *name;
+  struct sp_user *next_user;
+};
+
+/* Users are interned by name. */
+static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sp_user *users = NULL;
+
+static sp_user *user_of_name(const char *name)
+{
+  sp_user *user;
+  pthread_mutex_lock(&users_mutex);
+  for (user = users; user; user = user->next_user)
+    if (strcmp(user->name, name) == 0) break;
+  if (user == NULL) {
+    user = new(sp_user);
+    object_init(&(user->object), KIND_USER, 0, 1, free_object);
+    user->name = xstrdup(name);
+    user->next_user = users;
+    users = user;
+  }
+  pthread_mutex_unlock(&users_mutex);
+  return user;
+}
+
+bool sp_user_is_loaded(sp_user *user)
+{
+  return true;
+}
+
+const char *sp_user_canonical_name(sp_user *user)
+{
+  return user->name;
+}
+
+DEFINE_REFCOUNT(user)
+
+/* +-----------------------------------------------------------------+
+   | Error handling                                                  |
+   +-----------------------------------------------------------------+ */
+
+const char *sp_error_message(sp_error error)
+{
+  switch (error) {
+  case SP_ERROR_OK: return "No error";
+  case SP_ERROR_BAD_API_VERSION: return "Invalid library version";
+  case SP_ERROR_API_INITIALIZATION_FAILED: return "Initialization failed";
+  case SP_ERROR_TRACK_NOT_PLAYABLE: return "Track not playable";
+  case SP_ERROR_BAD_APPLICATION_KEY: return "Invalid application key";
+  case SP_ERROR_BAD_USERNAME_OR_PASSWORD: return "Incorrect username or password";
+  case SP_ERROR_USER_BANNED: return "Account banned";
+  case SP_ERROR_UNABLE_TO_CONTACT_SERVER: return "Cannot connect to the Spotify backend system";
+  case SP_ERROR_CLIENT_TOO_OLD: return "Client is too old";
+  case SP_ERROR_OTHER_PERMANENT: return "Unknown error";
+  case SP_ERROR_BAD_USER_AGENT: return "Invalid user agent string";
+  case SP_ERROR_MISSING_CALLBACK: return "Missing callback";
+  case SP_ERROR_INVALID_INDATA: return "Invalid input";
+  case SP_ERROR_INDEX_OUT_OF_RANGE: return "Index out of range";
+  case SP_ERROR_USER_NEEDS_PREMIUM: return "A Spotify Premium account is required";
+  case SP_ERROR_OTHER_TRANSIENT: return "A transient error occurred";
+  case SP_ERROR_IS_LOADING: return "Resource not loaded yet";
+  case SP_ERROR_NO_STREAM_AVAILABLE: return "Could not find any suitable stream";
+  case SP_ERROR_PERMISSION_DENIED: return "Permission denied";
+  case SP_ERROR_INBOX_IS_FULL: return "Target inbox is full";
+  case SP_ERROR_NO_CACHE: return "No cache";
+  case SP_ERROR_NO_SUCH_USER: return "No such user";
+  case SP_ERROR_NO_CREDENTIALS: return "No credentials";
+  }
+  return "Unknown error";
+}
+
+/* +-----------------------------------------------------------------+
+   | Sessions                                                        |
+   +-----------------------------------------------------------------+ */
+
+enum event_type {
+  EVENT_LOGIN,
+  EVENT_LOGOUT,
+  EVENT_SEARCH,
+  EVENT_ALBUMBROWSE,
+  EVENT_ARTISTBROWSE,
+  EVENT_IMAGE,
+  EVENT_STREAMING_ERROR,
+  EVENT_CONTAINER,
+  EVENT_PLAYLIST,
+};
+
+/* Something which completes in [sp_session_process_events]. */
+struct event {
+  int64_t deadline;
+  enum event_type type;
+  struct object *target;
+  /* Object completed by the event, on which an internal reference
+     is held. */
+  sp_error error;
+  struct event *next;
+};
+
+/* Callbacks registered on a playlist or a container. They are only
+   used from the main thread. */
+struct callbacks {
+  void *callbacks;
+  void *userdata;
+  struct callbacks *next;
+};
+
+struct sp_playlist {
+  struct object object;
+  int index;
+  char *owner;
+  int loaded;
+  char *name;
+  int num_tracks;
+  int *tracks;
+  /* Indices of the tracks in the catalog. */
+  struct callbacks *callbacks;
+  int offline;
+  /* Whether the playlist is marked for offline use. Offline
+     synchronisation is not simulated, so marked playlists are
+     immediately available offline. */
+};
+
+struct sp_playlistcontainer {
+  struct object object;
+  char *owner;
+  int loaded;
+  int num_playlists;
+  sp_playlist **playlists;
+  /* Playlists of the container, on which it holds internal
+     references. */
+  struct callbacks *callbacks;
+};
+
+struct sp_session {
+  sp_session_callbacks callbacks;
+  void *userdata;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  /* Protect everything below and signal changes to the threads. */
+
+  int stop;
+  /* Whether the threads must exit. */
+  uint64_t rng;
+  /* State of the generator used for jitter and faults. */
+
+  sp_connectionstate state;
+  sp_user *user;
+  char *remembered;
+  int num_friends;
+  sp_playlistcontainer *container;
+  int next_playlist;
+
+  struct event *events;
+  /* Pending events, sorted by deadline. */
+  int notified;
+  /* Whether [notify_main_thread] was called since the last call to
+     [sp_session_process_events]. */
+  pthread_t network_thread;
+
+  sp_track *track;
+  int playing;
+  int stream_failed;
+  int64_t position;
+  int64_t length;
+  /* Position and length of the loaded track, in frames. */
+  unsigned generation;
+  /* Incremented when the position changes from outside the audio
+     thread, so that deliveries in progress are discarded. */
+  int64_t pace_start;
+  int64_t pace_frames;
+  /* Time since which [pace_frames] have been delivered. */
+  int64_t since_stall;
+  pthread_t audio_thread;
+
+  struct mock_spotify_stats stats;
+};
+
+static uint64_t session_random(sp_session *session)
+{
+  session->rng ^= session->rng << 13;
+  session->rng ^= session->rng >> 7;
+  session->rng ^= session->rng << 17;
+  return session->rng;
+}
+
+/* Decide whether an operation fails. Called with the session mutex
+   held. */
+static int session_fault(sp_session *session, enum fault fault)
+{
+  if (config.fault_rate <= 0 || !(config.faults & fault)) return 0;
+  if ((double)(session_random(session) >> 11) / 9007199254740992.0 >= config.fault_rate) return 0;
+  session->stats.faults++;
+  return 1;
+}
+
+/* Schedule an event. Called with the session mutex held. */
+static void session_schedule(sp_session *session, enum event_type type, struct object *target, sp_error error)
+{
+  struct event *event = new(struct event);
+  struct event **ptr;
+  int64_t delay = (int64_t)config.latency * 1000000;
+  if (config.jitter > 0) delay += (int64_t)(session_random(session) % ((uint64_t)config.jitter * 1000000));
+  event->deadline = now() + delay;
+  event->type = type;
+  event->target = target;
+  event->error = error;
+  if (target) object_add_ref(target, 1);
+  for (ptr = &(session->events); *ptr && (*ptr)->deadline <= event->deadline; ptr = &((*ptr)->next));
+  event->next = *ptr;
+  *ptr = event;
+  pthread_cond_broadcast(&(session->cond));
+}
+
+/* Call [notify_main_thread] when events are due. */
+static void *network_worker(void *arg)
+{
+  sp_session *session = (sp_session*)arg;
+  pthread_mutex_lock(&(session->mutex));
+  while (!session->stop) {
+    if (session->events == NULL || session->notified) {
+      pthread_cond_wait(&(session->cond), &(session->mutex));
+    } else if (session->events->deadline > now()) {
+      struct timespec ts;
+      deadline_to_timespec(session->events->deadline, &ts);
+      pthread_cond_timedwait(&(session->cond), &(session->mutex), &ts);
+    } else {
+      session->notified = 1;
+      session->stats.notifications++;
+      pthread_mutex_unlock(&(session->mutex));
+      if (session->callbacks.notify_main_thread) session->callbacks.notify_main_thread(session);
+      pthread_mutex_lock(&(session->mutex));
+    }
+  }
+  pthread_mutex_unlock(&(session->mutex));
+  return NULL;
+}
+
+static void *audio_worker(void *arg);
+
+sp_error sp_session_create(const sp_session_config *config_, sp_session **sess)
+{
+  sp_session *session;
+  init_catalog();
+  if (config_->api_version != SPOTIFY_API_VERSION) return SP_ERROR_BAD_API_VERSION;
+  if (config_->application_key == NULL || config_->application_key_size == 0) return SP_ERROR_BAD_APPLICATION_KEY;
+  if (config_->user_agent == NULL || strlen(config_->user_agent) > 255) return SP_ERROR_BAD_USER_AGENT;
+  if (config_->callbacks == NULL) return SP_ERROR_MISSING_CALLBACK;
+  session = new(sp_session);
+  memset(session, 0, sizeof(sp_session));
+  session->callbacks = *(config_->callbacks);
+  session->userdata = config_->userdata;
+  pthread_mutex_init(&(session->mutex), NULL);
+  pthread_cond_init(&(session->cond), NULL);
+  session->rng = mix64(config.seed) | 1;
+  session->state = SP_CONNECTION_STATE_LOGGED_OUT;
+  session->num_friends = 3;
+  session->generation = 0;
+  if (pthread_create(&(session->network_thread), NULL, network_worker, session)) {
+    pthread_cond_destroy(&(session->cond));
+    pthread_mutex_destroy(&(session->mutex));
+    free(session);
+    return SP_ERROR_API_INITIALIZATION_FAILED;
+  }
+  if (pthread_create(&(session->audio_thread), NULL, audio_worker, session)) {
+    pthread_mutex_lock(&(session->mutex));
+    session->stop = 1;
+    pthread_cond_broadcast(&(session->cond));
+    pthread_mutex_unlock(&(session->mutex));
+    pthread_join(session->network_thread, NULL);
+    pthread_cond_destroy(&(session->cond));
+    pthread_mutex_destroy(&(session->mutex));
+    free(session);
+    return SP_ERROR_API_INITIALIZATION_FAILED;
+  }
+  *sess = session;
+  return SP_ERROR_OK;
+}
+
+void sp_session_release(sp_session *session)
+{
+  struct event *event;
+  pthread_mutex_lock(&(session->mutex));
+  session->stop = 1;
+  pthread_cond_broadcast(&(session->cond));
+  pthread_mutex_unlock(&(session->mutex));
+  pthread_join(session->network_thread, NULL);
+  pthread_join(session->audio_thread, NULL);
+  while ((event = session->events)) {
+    session->events = event->next;
+    if (event->target) object_release(event->target, 1);
+    free(event);
+  }
+  if (session->track) object_release(&(session->track->object), 1);
+  if (session->container) object_release(&(session->container->object), 1);
+  free(session->remembered);
+  pthread_cond_destroy(&(session->cond));
+  pthread_mutex_destroy(&(session->mutex));
+  free(session);
+}
+
+void sp_session_login(sp_session *session, const char *username, const char *password, bool remember_me)
+{
+  sp_error error = SP_ERROR_OK;
+  pthread_mutex_lock(&(session->mutex));
+  if (username == NULL || *username == 0 || password == NULL || *password == 0)
+    error = SP_ERROR_BAD_USERNAME_OR_PASSWORD;
+  else if (session_fault(session, FAULT_LOGIN))
+    error = SP_ERROR_UNABLE_TO_CONTACT_SERVER;
+  if (error == SP_ERROR_OK) {
+    session->user = user_of_name(username);
+    if (remember_me) {
+      free(session->remembered);
+      session->remembered = xstrdup(username);
+    }
+  }
+  session_schedule(session, EVENT_LOGIN, NULL, error);
+  pthread_mutex_unlock(&(session->mutex));
+}
+
+sp_error sp_session_relogin(sp_session *session)
+{
+  sp_error error = SP_ERROR_OK;
+  pthread_mutex_lock(&(session->mutex));
+  if (session->remembered == NULL)
+    error = SP_ERROR_NO_CREDENTIALS;
+  else {
+    session->user = user_of_name(session->remembered);
+    session_schedule(session, EVENT_LOGIN, NULL, session_fault(session, FAULT_LOGIN) ? SP_ERROR_UNABLE_TO_CONTACT_SERVER : SP_ERROR_OK);
+  }
+  pthread_mutex_unlock(&(session->mutex));
+  return error;
+}
+
+size_t sp_session_remembered_user(sp_session *session, char *buffer, size_t buffer_size)
+{
+  size_t len;
+  pthread_mutex_lock(&(session->mutex));
+  if (session->remembered == NULL) {
+    pthread_mutex_unlock(&(session->mutex));
+    return (size_t)-1;
+  }
+  len = strlen(session->remembered);
+  if (buffer && buffer_size > 0) {
+    size_t n = len < buffer_size - 1 ? len : buffer_size - 1;
+    memcpy(buffer, session->remembered, n);
+    buffer[n] = 0;
+  }
+  pthread_mutex_unlock(&(session->mutex));
+  return len;
+}
+
+void sp_session_forget_me(sp_session *session)
+{
+  pthread_mutex_lock(&(session->mutex));
+  free(session->remembered);
+  session->remembered = NULL;
+  pthread_mutex_unlock(&(session->mutex));
+}
+
+sp_user *sp_session_user(sp_session *session)
+{
+  sp_user *user;
+  pthread_mutex_lock(&(session->mutex));
+  user = session->state == SP_CONNECTION_STATE_LOGGED_IN ? session->user : NULL;
+  pthread_mutex_unlock(&(session->mutex));
+  return user;
+}
+
+void sp_session_logout(sp_session *session)
+{
+  pthread_mutex_lock(&(session->mutex));
+  session_schedule(session, EVENT_LOGOUT, NULL, SP_ERROR_OK);
+  pthread_mutex_unlock(&(session->mutex));
+}
+
+sp_connectionstate sp_session_connectionstate(sp_session *session)
+{
+  sp_connectionstate state;
+  pthread_mutex_lock(&(session->mutex));
+  state = session->state;
+  pthread_mutex_unlock(&(session->mutex));
+  return state;
+}
+
+void *sp_session_userdata(sp_session *session)
+{
+  return session->userdata;
+}
+
+void sp_session_set_cache_size(sp_session *session, size_t size)
+{
+}
+
+static void dispatch_event(sp_session *session, struct event *event);
+
+void sp_session_process_events(sp_session *session, int *next_timeout)
+{
+  struct event *due = NULL, **last = &due, *event;
+  int64_t current = now();
+  pthread_mutex_lock(&(session->mutex));
+  while (session->events && session->events->deadline <= current) {
+    event = session->events;
+    session->events = event->next;
+    event->next = NULL;
+    *last = event;
+    last = &(event->next);
+    session->stats.events++;
+  }
+  session->notified = 0;
+  if (next_timeout) {
+    if (session->events)
+      *next_timeout = (int)((session->events->deadline - current + 999999) / 1000000);
+    else
+      *next_timeout = 1000;
+  }
+  pthread_cond_broadcast(&(session->cond));
+  pthread_mutex_unlock(&(session->mutex));
+  while ((event = due)) {
+    due = event->next;
+    dispatch_event(session, event);
+    if (event->target) object_release(event->target, 1);
+    free(event);
+  }
+}
+
+void mock_spotify_session_stats(sp_session *session, struct mock_spotify_stats *stats)
+{
+  pthread_mutex_lock(&(session->mutex));
+  *stats = session->stats;
+  pthread_mutex_unlock(&(session->mutex));
+}
+
+/* +-----------------------------------------------------------------+
+   | Playlists                                                       |
+   +-----------------------------------------------------------------+ */
+
+/* Playlists and containers load after the configured latency. The
+   content of a playlist is derived from its owner and index. */
+
+#define MIN_PLAYLISTS 5
+#define MAX_PLAYLISTS 25
+#define MIN_PLAYLIST_TRACKS 10
+#define MAX_PLAYLIST_TRACKS 60
+
+static uint64_t name_hash(const char *name)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *name; name++) h = (h ^ (unsigned char)*name) * 0x100000001b3ULL;
+  return mix64(h ^ config.catalog_seed);
+}
+
+static void free_callbacks(struct callbacks *node)
+{
+  while (node) {
+    struct callbacks *next = node->next;
+    free(node);
+    node = next;
+  }
+}
+
+static void add_callbacks(struct callbacks **list, void *callbacks, void *userdata)
+{
+  struct callbacks *node = new(struct callbacks);
+  node->callbacks = callbacks;
+  node->userdata = userdata;
+  node->next = *list;
+  *list = node;
+}
+
+static void remove_callbacks(struct callbacks **list, void *callbacks, void *userdata)
+{
+  for (; *list; list = &((*list)->next))
+    if ((*list)->callbacks == callbacks && (*list)->userdata == userdata) {
+      struct callbacks *node = *list;
+      *list = node->next;
+      free(node);
+      return;
+    }
+}
+
+static void free_playlist(struct object *object)
+{
+  sp_playlist *playlist = (sp_playlist*)object;
+  free(playlist->name);
+  free(playlist->tracks);
+  free_callbacks(playlist->callbacks);
+  free(playlist);
+}
+
+static void free_playlistcontainer(struct object *object)
+{
+  sp_playlistcontainer *container = (sp_playlistcontainer*)object;
+  int i;
+  for (i = 0; i < container->num_playlists; i++)
+    object_release(&(container->playlists[i]->object), 1);
+  free(container->playlists);
+  free_callbacks(container->callbacks);
+  free(container);
+}
+
+/* Create a playlist and schedule its loading. Called with the
+   session mutex held. */
+static sp_playlist *playlist_new(sp_session *session, const char *owner, int refcount)
+{
+  sp_playlist *playlist = new(sp_playlist);
+  memset(playlist, 0, sizeof(sp_playlist));
+  object_init(&(playlist->object), KIND_PLAYLIST, refcount, 0, free_playlist);
+  playlist->index = session->next_playlist++;
+  playlist->owner = user_of_name(owner)->name;
+  session_schedule(session, EVENT_PLAYLIST, &(playlist->object), SP_ERROR_OK);
+  return playlist;
+}
+
+/* Create a container and schedule its loading. Called with the
+   session mutex held. */
+static sp_playlistcontainer *playlistcontainer_new(sp_session *session, const char *owner, int refcount)
+{
+  sp_playlistcontainer *container = new(sp_playlistcontainer);
+  memset(container, 0, sizeof(sp_playlistcontainer));
+  object_init(&(container->object), KIND_PLAYLISTCONTAINER, refcount, 0, free_playlistcontainer);
+  container->owner = user_of_name(owner)->name;
+  session_schedule(session, EVENT_CONTAINER, &(container->object), SP_ERROR_OK);
+  return container;
+}
+
+static void playlist_load(sp_session *session, sp_playlist *playlist)
+{
+  struct callbacks *node, *next;
+  char name[64];
+  int i;
+  if (playlist->loaded) return;
+  uint64_t h = mix64(name_hash(playlist->owner) ^ (uint64_t)playlist->index);
+  snprintf(name, sizeof(name), "%s %s", words[h % NUM_WORDS], words[(h >> 8) % NUM_WORDS]);
+  name[0] = toupper(name[0]);
+  playlist->name = xstrdup(name);
+  playlist->num_tracks = MIN_PLAYLIST_TRACKS + (int)((h >> 16) % (MAX_PLAYLIST_TRACKS - MIN_PLAYLIST_TRACKS + 1));
+  playlist->tracks = (int*)xmalloc(playlist->num_tracks * sizeof(int));
+  for (i = 0; i < playlist->num_tracks; i++)
+    playlist->tracks[i] = (int)(mix64(h + i) % (uint64_t)config.num_tracks);
+  playlist->loaded = 1;
+  for (node = playlist->callbacks; node; node = next) {
+    next = node->next;
+    sp_playlist_callbacks *callbacks = (sp_playlist_callbacks*)node->callbacks;
+    if (callbacks->playlist_state_changed) callbacks->playlist_state_changed(playlist, node->userdata);
+  }
+  if (session->callbacks.metadata_updated) session->callbacks.metadata_updated(session);
+}
+
+static void playlistcontainer_load(sp_session *session, sp_playlistcontainer *container)
+{
+  struct callbacks *node, *next;
+  int i;
+  if (container->loaded) return;
+  uint64_t h = name_hash(container->owner);
+  pthread_mutex_lock(&(session->mutex));
+  container->num_playlists = MIN_PLAYLISTS + (int)(h % (MAX_PLAYLISTS - MIN_PLAYLISTS + 1));
+  container->playlists = (sp_playlist**)xmalloc(container->num_playlists * sizeof(sp_playlist*));
+  for (i = 0; i < container->num_playlists; i++) {
+    container->playlists[i] = playlist_new(session, container->owner, 0);
+    container->playlists[i]->object.internal++;
+  }
+  pthread_mutex_unlock(&(session->mutex));
+  container->loaded = 1;
+  for (node = container->callbacks; node; node = next) {
+    next = node->next;
+    sp_playlistcontainer_callbacks *callbacks = (sp_playlistcontainer_callbacks*)node->callbacks;
+    if (callbacks->container_loaded) callbacks->container_loaded(container, node->userdata);
+  }
+}
+
+sp_playlistcontainer *sp_session_playlistcontainer(sp_session *session)
+{
+  sp_playlistcontainer *container;
+  pthread_mutex_lock(&(session->mutex));
+  if (session->state != SP_CONNECTION_STATE_LOGGED_IN)
+    container = NULL;
+  else {
+    if (session->container == NULL) {
+      session->container = playlistcontainer_new(session, session->user->name, 0);
+      session->container->object.internal++;
+    }
+    container = session->container;
+  }
+  pthread_mutex_unlock(&(session->mutex));
+  return container;
+}
+
+static sp_playlist *playlist_create(sp_session *session, const char *owner)
+{
+  sp_playlist *playlist;
+  pthread_mutex_lock(&(session->mutex));
+  playlist = playlist_new(session, owner, 1);
+  pthread_mutex_unlock(&(session->mutex));
+  return playlist;
+}
+
+sp_playlist *sp_session_inbox_create(sp_session *session)
+{
+  sp_user *user = sp_session_user(session);
+  return user ? playlist_create(session, user->name) : NULL;
+}
+
+sp_playlist *sp_session_starred_create(sp_session *session)
+{
+  sp_user *user = sp_session_user(session);
+  return user ? playlist_create(session, user->name) : NULL;
+}
+
+sp_playlist *sp_session_starred_for_user_create(sp_session *session, const char *canonical_username)
+{
+  if (sp_session_user(session) == NULL) return NULL;
+  return playlist_create(session, canonical_username);
+}
+
+sp_playlistcontainer *sp_session_publishedcontainer_for_user_create(sp_session *session, const char *canonical_username)
+{
+  sp_user *user = sp_session_user(session);
+  sp_playlistcontainer *container;
+  if (user == NULL) return NULL;
+  pthread_mutex_lock(&(session->mutex));
+  container = playlistcontainer_new(session, canonical_username ? canonical_username : user->name, 1);
+  pthread_mutex_unlock(&(session->mutex));
+  return container;
+}
+
+bool sp_playlist_is_loaded(sp_playlist *playlist)
+{
+  return playlist->loaded;
+}
+
+void sp_playlist_add_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata)
+{
+  add_callbacks(&(playlist->callbacks), callbacks, userdata);
+}
+
+void sp_playlist_remove_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata)
+{
+  remove_callbacks(&(playlist->callbacks), callbacks, userdata);
+}
+
+int sp_playlist_num_tracks(sp_playlist *playlist)
+{
+  return playlist->loaded ? playlist->num_tracks : 0;
+}
+
+sp_track *sp_playlist_track(sp_playlist *playlist, int index)
+{
+  if (!playlist->loaded || index < 0 || index >= playlist->num_tracks) return NULL;
+  return catalog_track(playlist->tracks[index]);
+}
+
+const char *sp_playlist_name(sp_playlist *playlist)
+{
+  return playlist->loaded ? playlist->name : "";
+}
+
+void sp_playlist_set_offline_mode(sp_session *session, sp_playlist *playlist, bool offline)
+{
+  playlist->offline = offline;
+}
+
+sp_playlist_offline_status sp_playlist_get_offline_status(sp_session *session, sp_playlist *playlist)
+{
+  return playlist->offline ? SP_PLAYLIST_OFFLINE_STATUS_YES : SP_PLAYLIST_OFFLINE_STATUS_NO;
+}
+
+int sp_playlist_get_offline_download_completed(sp_session *session, sp_playlist *playlist)
+{
+  return playlist->offline ? 100 : 0;
+}
+
+bool sp_playlistcontainer_is_loaded(sp_playlistcontainer *pc)
+{
+  return pc->loaded;
+}
+
+void sp_playlistcontainer_add_callbacks(sp_playlistcontainer *pc, sp_playlistcontainer_callbacks *callbacks, void *userdata)
+{
+  add_callbacks(&(pc->callbacks), callbacks, userdata);
+}
+
+void sp_playlistcontainer_remove_callbacks(sp_playlistcontainer *pc, sp_playlistcontainer_callbacks *callbacks, void *userdata)
+{
+  remove_callbacks(&(pc->callbacks), callbacks, userdata);
+}
+
+int sp_playlistcontainer_num_playlists(sp_playlistcontainer *pc)
+{
+  return pc->loaded ? pc->num_playlists : 0;
+}
+
+sp_playlist *sp_playlistcontainer_playlist(sp_playlistcontainer *pc, int index)
+{
+  if (!pc->loaded || index < 0 || index >= pc->num_playlists) return NULL;
+  return pc->playlists[index];
+}
+
+DEFINE_REFCOUNT(playlist)
+DEFINE_REFCOUNT(playlistcontainer)
+DEFINE_REFCOUNT(toplistbrowse)
+DEFINE_REFCOUNT(inbox)
+
+void sp_session_preferred_bitrate(sp_session *session, sp_bitrate bitrate)
+{
+}
+
+void sp_session_preferred_offline_bitrate(sp_session *session, sp_bitrate bitrate, bool allow_resync)
+{
+}
+
+int sp_session_num_friends(sp_session *session)
+{
+  return sp_session_user(session) ? session->num_friends : 0;
+}
+
+sp_user *sp_session_friend(sp_session *session, int index)
+{
+  char name[32];
+  if (index < 0 || index >= sp_session_num_friends(session)) return NULL;
+  snprintf(name, sizeof(name), "friend%d", index);
+  return user_of_name(name);
+}
+
+void sp_session_set_connection_type(sp_session *session, sp_connection_type type)
+{
+}
+
+void sp_session_set_connection_rules(sp_session *session, sp_connection_rules rules)
+{
+}
+
+int sp_offline_tracks_to_sync(sp_session *session)
+{
+  return 0;
+}
+
+int sp_offline_num_playlists(sp_session *session)
+{
+  return 0;
+}
+
+bool sp_offline_sync_get_status(sp_session *session, sp_offline_sync_status *status)
+{
+  memset(status, 0, sizeof(sp_offline_sync_status));
+  return false;
+}
+
+int sp_offline_time_left(sp_session *session)
+{
+  return 0;
+}
+
+int sp_session_user_country(sp_session *session)
+{
+  return ('S' << 8) | 'E';
+}
+
+/* +-----------------------------------------------------------------+
+   | Playback                                                        |
+   +-----------------------------------------------------------------+ */
+
+int16_t mock_spotify_sample(sp_track *track, int64_t frame, int channel)
+{
+  /* A sawtooth whose period depends on the track, so that data from
+     different tracks or positions can be told apart. */
+  uint64_t h = mix64((uint64_t)track->index ^ config.catalog_seed);
+  int period = 64 + (int)(h % 192);
+  int phase = (int)((frame + (int64_t)channel * (period / 4)) % period);
+  return (int16_t)((phase * 65535 / period - 32768) / 4);
+}
+
+/* Reset pacing after a change of position. Called with the session
+   mutex held. */
+static void session_reset_pace(sp_session *session)
+{
+  session->pace_start = now();
+  session->pace_frames = 0;
+  session->generation++;
+  pthread_cond_broadcast(&(session->cond));
+}
+
+sp_error sp_session_player_load(sp_session *session, sp_track *track)
+{
+  pthread_mutex_lock(&(session->mutex));
+  if (session->state != SP_CONNECTION_STATE_LOGGED_IN) {
+    pthread_mutex_unlock(&(session->mutex));
+    return SP_ERROR_OTHER_PERMANENT;
+  }
+  if (!track->available) {
+    pthread_mutex_unlock(&(session->mutex));
+    return SP_ERROR_TRACK_NOT_PLAYABLE;
+  }
+  if (session->callbacks.music_delivery == NULL) {
+    pthread_mutex_unlock(&(session->mutex));
+    return SP_ERROR_MISSING_CALLBACK;
+  }
+  object_add_ref(&(track->object), 1);
+  if (session->track) object_release(&(session->track->object), 1);
+  session->track = track;
+  session->playing = 0;
+  session->position = 0;
+  session->length = (int64_t)track->duration * config.sample_rate / 1000;
+  session->stream_failed = session_fault(session, FAULT_STREAM);
+  if (session->stream_failed) session_schedule(session, EVENT_STREAMING_ERROR, NULL, SP_ERROR_NO_STREAM_AVAILABLE);
+  session_reset_pace(session);
+  pthread_mutex_unlock(&(session->mutex));
+  return SP_ERROR_OK;
+}
+
+void sp_session_player_seek(sp_session *session, int offset)
+{
+  pthread_mutex_lock(&(session->mutex));
+  if (session->track) {
+    int64_t position = (int64_t)offset * config.sample_rate / 1000;
+    session->position = position < 0 ? 0 : position > session->length ? session->length : position;
+    session_reset_pace(session);
+  }
+  pthread_mutex_unlock(&(session->mutex));
+}
+
+void sp_session_player_play(sp_session *session, bool play)
+{
+  pthread_mutex_lock(&(session->mutex));
+  if (session->track && session->playing != play) {
+    session->playing = play;
+    session_reset_pace(session);
+  }
+  pthread_mutex_unlock(&(session->mutex));
+}
+
+void sp_session_player_unload(sp_session *session)
+{
+  pthread_mutex_lock(&(session->mutex));
+  if (session->track) {
+    object_release(&(session->track->object), 1);
+    session->track = NULL;
+    session->playing = 0;
+    session_reset_pace(session);
+  }
+  pthread_mutex_unlock(&(session->mutex));
+}
+
+sp_error sp_session_player_prefetch(sp_session *session, sp_track *track)
+{
+  return SP_ERROR_OK;
+}
+
+/* Wait on the session condition until [deadline]. Called with the
+   session mutex held. */
+static void session_wait_until(sp_session *session, int64_t deadline)
+{
+  struct timespec ts;
+  deadline_to_timespec(deadline, &ts);
+  pthread_cond_timedwait(&(session->cond), &(session->mutex), &ts);
+}
+
+static void *audio_worker(void *arg)
+{
+  sp_session *session = (sp_session*)arg;
+  sp_audioformat format;
+  int16_t *buffer = xmalloc((size_t)config.delivery_frames * config.channels * sizeof(int16_t));
+
+  format.sample_type = SP_SAMPLETYPE_INT16_NATIVE_ENDIAN;
+  format.sample_rate = config.sample_rate;
+  format.channels = config.channels;
+
+  pthread_mutex_lock(&(session->mutex));
+  while (!session->stop) {
+    if (session->track == NULL || !session->playing || session->stream_failed || session->position >= session->length) {
+      pthread_cond_wait(&(session->cond), &(session->mutex));
+      continue;
+    }
+
+    if (config.delivery_rate > 0) {
+      int64_t due = session->pace_start + (int64_t)(session->pace_frames * 1e9 / (config.sample_rate * config.delivery_rate));
+      if (due > now()) {
+        session_wait_until(session, due);
+        continue;
+      }
+    }
+
+    if (config.stall_every > 0 && config.stall > 0 && session->since_stall >= config.stall_every) {
+      /* Simulate a network stall. Pacing is not reset, so delivery
+         catches up afterwards. */
+      unsigned generation = session->generation;
+      int64_t deadline = now() + (int64_t)config.stall * 1000000;
+      session->since_stall = 0;
+      session->stats.stalls++;
+      while (!session->stop && session->generation == generation && now() < deadline)
+        session_wait_until(session, deadline);
+      continue;
+    }
+
+    sp_track *track = session->track;
+    unsigned generation = session->generation;
+    int64_t position = session->position;
+    int count = config.delivery_frames;
+    int i, c;
+    if (session->length - position < count) count = (int)(session->length - position);
+    pthread_mutex_unlock(&(session->mutex));
+
+    for (i = 0; i < count; i++)
+      for (c = 0; c < config.channels; c++)
+        buffer[i * config.channels + c] = mock_spotify_sample(track, position + i, c);
+
+    if (session->callbacks.get_audio_buffer_stats) {
+      sp_audio_buffer_stats stats;
+      memset(&stats, 0, sizeof(stats));
+      session->callbacks.get_audio_buffer_stats(session, &stats);
+    }
+
+    int consumed = session->callbacks.music_delivery(session, &format, buffer, count);
+    if (consumed > count) consumed = count;
+
+    pthread_mutex_lock(&(session->mutex));
+    session->stats.deliveries++;
+    session->stats.frames_offered += count;
+    session->since_stall++;
+    if (generation != session->generation) continue;
+    if (consumed > 0) {
+      session->stats.frames_consumed += consumed;
+      session->position += consumed;
+      session->pace_frames += consumed;
+      if (session->position >= session->length) {
+        pthread_mutex_unlock(&(session->mutex));
+        if (session->callbacks.end_of_track) session->callbacks.end_of_track(session);
+        pthread_mutex_lock(&(session->mutex));
+      }
+    } else {
+      session->stats.retries++;
+      session_wait_until(session, now() + (int64_t)config.retry * 1000000);
+      /* Pacing should not make up for the time the application
+         refused data. */
+      if (generation == session->generation) {
+        session->pace_start = now();
+        session->pace_frames = 0;
+      }
+    }
+  }
+  pthread_mutex_unlock(&(session->mutex));
+  free(buffer);
+  return NULL;
+}
+
+/* +-----------------------------------------------------------------+
+   | Tracks                                                          |
+   +-----------------------------------------------------------------+ */
+
+bool sp_track_is_loaded(sp_track *track)
+{
+  return true;
+}
+
+sp_error sp_track_error(sp_track *track)
+{
+  return SP_ERROR_OK;
+}
+
+bool sp_track_is_available(sp_session *session, sp_track *track)
+{
+  return track->available;
+}
+
+bool sp_track_is_local(sp_session *session, sp_track *track)
+{
+  return track->index < 0;
+}
+
+bool sp_track_is_autolinked(sp_session *session, sp_track *track)
+{
+  return false;
+}
+
+sp_track *sp_track_get_playable(sp_session *session, sp_track *track)
+{
+  return track;
+}
+
+bool sp_track_is_starred(sp_session *session, sp_track *track)
+{
+  bool starred;
+  pthread_mutex_lock(&catalog_mutex);
+  starred = track->starred;
+  pthread_mutex_unlock(&catalog_mutex);
+  return starred;
+}
+
+void sp_track_set_starred(sp_session *session, sp_track *const *tracks, int num_tracks, bool star)
+{
+  int i;
+  pthread_mutex_lock(&catalog_mutex);
+  for (i = 0; i < num_tracks; i++) tracks[i]->starred = star;
+  pthread_mutex_unlock(&catalog_mutex);
+}
+
+int sp_track_num_artists(sp_track *track)
+{
+  return track->num_artists;
+}
+
+sp_artist *sp_track_artist(sp_track *track, int index)
+{
+  return index >= 0 && index < track->num_artists ? track->artists[index] : NULL;
+}
+
+sp_album *sp_track_album(sp_track *track)
+{
+  return track->album;
+}
+
+const char *sp_track_name(sp_track *track)
+{
+  return track->name;
+}
+
+int sp_track_duration(sp_track *track)
+{
+  return track->duration;
+}
+
+int sp_track_popularity(sp_track *track)
+{
+  return track->popularity;
+}
+
+int sp_track_disc(sp_track *track)
+{
+  return track->disc;
+}
+
+int sp_track_index(sp_track *track)
+{
+  return track->track_index;
+}
+
+/* Local tracks own their artist and album. */
+
+static void free_local_track(struct object *object)
+{
+  sp_track *track = (sp_track*)object;
+  pthread_mutex_lock(&objects_mutex);
+  object_unlink(&(track->artists[0]->object));
+  object_unlink(&(track->album->object));
+  pthread_mutex_unlock(&objects_mutex);
+  free(track->artists[0]->name);
+  free(track->artists[0]);
+  free(track->album->name);
+  free(track->album);
+  free(track->name);
+  free(track);
+}
+
+sp_track *sp_localtrack_create(const char *artist, const char *title, const char *album, int length)
+{
+  sp_track *track = new(sp_track);
+  sp_artist *local_artist = new(sp_artist);
+  sp_album *local_album = new(sp_album);
+  init();
+  object_init(&(local_artist->object), KIND_ARTIST, 0, 1, free_object);
+  local_artist->index = -1;
+  local_artist->name = xstrdup(artist);
+  object_init(&(local_album->object), KIND_ALBUM, 0, 1, free_object);
+  local_album->index = -1;
+  local_album->name = xstrdup(album);
+  local_album->artist = local_artist;
+  memset(local_album->cover, 0, sizeof(local_album->cover));
+  local_album->year = 0;
+  local_album->type = SP_ALBUMTYPE_UNKNOWN;
+  object_init(&(track->object), KIND_TRACK, 1, 0, free_local_track);
+  track->index = -1;
+  track->name = xstrdup(title);
+  track->duration = length < 0 ? 0 : length;
+  track->popularity = 0;
+  track->disc = 0;
+  track->track_index = 0;
+  track->available = 0;
+  track->starred = 0;
+  track->album = local_album;
+  track->artists[0] = local_artist;
+  track->artists[1] = NULL;
+  track->num_artists = 1;
+  return track;
+}
+
+DEFINE_REFCOUNT(track)
+
+/* +-----------------------------------------------------------------+
+   | Albums                                                          |
+   +-----------------------------------------------------------------+ */
+
+bool sp_album_is_loaded(sp_album *album)
+{
+  return true;
+}
+
+bool sp_album_is_available(sp_album *album)
+{
+  return album->index >= 0;
+}
+
+sp_artist *sp_album_artist(sp_album *album)
+{
+  return album->artist;
+}
+
+const byte *sp_album_cover(sp_album *album)
+{
+  return album->index >= 0 ? album->cover : NULL;
+}
+
+const char *sp_album_name(sp_album *album)
+{
+  return album->name;
+}
+
+int sp_album_year(sp_album *album)
+{
+  return album->year;
+}
+
+sp_albumtype sp_album_type(sp_album *album)
+{
+  return album->type;
+}
+
+DEFINE_REFCOUNT(album)
+
+/* +-----------------------------------------------------------------+
+   | Artists                                                         |
+   +-----------------------------------------------------------------+ */
+
+const char *sp_artist_name(sp_artist *artist)
+{
+  return artist->name;
+}
+
+bool sp_artist_is_loaded(sp_artist *artist)
+{
+  return true;
+}
+
+DEFINE_REFCOUNT(artist)
+
+static int artist_num_portraits(int index)
+{
+  return 1 + (int)(catalog_hash(KIND_ARTIST, index, 1) % MAX_PORTRAITS);
+}
+
+/* +-----------------------------------------------------------------+
+   | Album browsing                                                  |
+   +-----------------------------------------------------------------+ */
+
+struct sp_albumbrowse {
+  struct object object;
+  sp_album *album;
+  albumbrowse_complete_cb *callback;
+  void *userdata;
+  int loaded;
+  sp_error error;
+  char copyright[64];
+  char review[128];
+  int num_tracks;
+};
+
+sp_albumbrowse *sp_albumbrowse_create(sp_session *session, sp_album *album, albumbrowse_complete_cb *callback, void *userdata)
+{
+  sp_albumbrowse *alb = new(sp_albumbrowse);
+  memset(alb, 0, sizeof(sp_albumbrowse));
+  object_init(&(alb->object), KIND_ALBUMBROWSE, 1, 0, free_object);
+  alb->album = album;
+  alb->callback = callback;
+  alb->userdata = userdata;
+  pthread_mutex_lock(&(session->mutex));
+  session_schedule(session, EVENT_ALBUMBROWSE, &(alb->object), session_fault(session, FAULT_BROWSE) ? SP_ERROR_OTHER_TRANSIENT : SP_ERROR_OK);
+  pthread_mutex_unlock(&(session->mutex));
+  return alb;
+}
+
+static void albumbrowse_complete(sp_albumbrowse *alb, sp_error error)
+{
+  alb->error = error;
+  if (error == SP_ERROR_OK && alb->album->index >= 0) {
+    int first = alb->album->index * TRACKS_PER_ALBUM;
+    alb->num_tracks = config.num_tracks - first < TRACKS_PER_ALBUM ? config.num_tracks - first : TRACKS_PER_ALBUM;
+    snprintf(alb->copyright, sizeof(alb->copyright), "(C) %d Mock Records", alb->album->year);
+    snprintf(alb->review, sizeof(alb->review), "%s is the best album by %s.", alb->album->name, alb->album->artist->name);
+  }
+  alb->loaded = 1;
+}
+
+bool sp_albumbrowse_is_loaded(sp_albumbrowse *alb)
+{
+  return alb->loaded;
+}
+
+sp_error sp_albumbrowse_error(sp_albumbrowse *alb)
+{
+  return alb->loaded ? alb->error : SP_ERROR_IS_LOADING;
+}
+
+sp_album *sp_albumbrowse_album(sp_albumbrowse *alb)
+{
+  return alb->loaded && alb->error == SP_ERROR_OK ? alb->album : NULL;
+}
+
+sp_artist *sp_albumbrowse_artist(sp_albumbrowse *alb)
+{
+  return alb->loaded && alb->error == SP_ERROR_OK ? alb->album->artist : NULL;
+}
+
+int sp_albumbrowse_num_copyrights(sp_albumbrowse *alb)
+{
+  return alb->copyright[0] ? 1 : 0;
+}
+
+const char *sp_albumbrowse_copyright(sp_albumbrowse *alb, int index)
+{
+  return index == 0 && alb->copyright[0] ? alb->copyright : NULL;
+}
+
+int sp_albumbrowse_num_tracks(sp_albumbrowse *alb)
+{
+  return alb->num_tracks;
+}
+
+sp_track *sp_albumbrowse_track(sp_albumbrowse *alb, int index)
+{
+  if (index < 0 || index >= alb->num_tracks) return NULL;
+  return catalog_track(alb->album->index * TRACKS_PER_ALBUM + index);
+}
+
+const char *sp_albumbrowse_review(sp_albumbrowse *alb)
+{
+  return alb->review;
+}
+
+DEFINE_REFCOUNT(albumbrowse)
+
+/* +-----------------------------------------------------------------+
+   | Artist browsing                                                 |
+   +-----------------------------------------------------------------+ */
+
+#define MAX_SIMILAR_ARTISTS 5
+
+struct sp_artistbrowse {
+  struct object object;
+  sp_artist *artist;
+  artistbrowse_complete_cb *callback;
+  void *userdata;
+  int loaded;
+  sp_error error;
+  int num_portraits;
+  byte portraits[MAX_PORTRAITS][20];
+  int *tracks;
+  int num_tracks;
+  int first_album;
+  int num_albums;
+  int num_similar;
+  char biography[256];
+};
+
+static void free_artistbrowse(struct object *object)
+{
+  free(((sp_artistbrowse*)object)->tracks);
+  free(object);
+}
+
+sp_artistbrowse *sp_artistbrowse_create(sp_session *session, sp_artist *artist, artistbrowse_complete_cb *callback, void *userdata)
+{
+  sp_artistbrowse *arb = new(sp_artistbrowse);
+  memset(arb, 0, sizeof(sp_artistbrowse));
+  object_init(&(arb->object), KIND_ARTISTBROWSE, 1, 0, free_artistbrowse);
+  arb->artist = artist;
+  arb->callback = callback;
+  arb->userdata = userdata;
+  pthread_mutex_lock(&(session->mutex));
+  session_schedule(session, EVENT_ARTISTBROWSE, &(arb->object), session_fault(session, FAULT_BROWSE) ? SP_ERROR_OTHER_TRANSIENT : SP_ERROR_OK);
+  pthread_mutex_unlock(&(session->mutex));
+  return arb;
+}
+
+static void artistbrowse_complete(sp_artistbrowse *arb, sp_error error)
+{
+  int index = arb->artist->index;
+  arb->error = error;
+  if (error == SP_ERROR_OK && index >= 0) {
+    int i, album, capacity = ALBUMS_PER_ARTIST * TRACKS_PER_ALBUM;
+    arb->num_portraits = artist_num_portraits(index);
+    for (i = 0; i < arb->num_portraits; i++) image_id(arb->portraits[i], KIND_ARTIST, i, index);
+    arb->first_album = index * ALBUMS_PER_ARTIST;
+    arb->num_albums = num_albums() - arb->first_album < ALBUMS_PER_ARTIST ? num_albums() - arb->first_album : ALBUMS_PER_ARTIST;
+    arb->tracks = xmalloc(capacity * sizeof(int));
+    for (album = arb->first_album; album < arb->first_album + arb->num_albums; album++)
+      for (i = album * TRACKS_PER_ALBUM; i < (album + 1) * TRACKS_PER_ALBUM && i < config.num_tracks; i++)
+        arb->tracks[arb->num_tracks++] = i;
+    arb->num_similar = num_artists() - 1 < MAX_SIMILAR_ARTISTS ? num_artists() - 1 : MAX_SIMILAR_ARTISTS;
+    snprintf(arb->biography, sizeof(arb->biography), "%s released %d albums between %d and %d.",
+             arb->artist->name, arb->num_albums, album_year(arb->first_album), album_year(arb->first_album + arb->num_albums - 1));
+  }
+  arb->loaded = 1;
+}
+
+bool sp_artistbrowse_is_loaded(sp_artistbrowse *arb)
+{
+  return arb->loaded;
+}
+
+sp_error sp_artistbrowse_error(sp_artistbrowse *arb)
+{
+  return arb->loaded ? arb->error : SP_ERROR_IS_LOADING;
+}
+
+sp_artist *sp_artistbrowse_artist(sp_artistbrowse *arb)
+{
+  return arb->loaded && arb->error == SP_ERROR_OK ? arb->artist : NULL;
+}
+
+int sp_artistbrowse_num_portraits(sp_artistbrowse *arb)
+{
+  return arb->num_portraits;
+}
+
+const byte *sp_artistbrowse_portrait(sp_artistbrowse *arb, int index)
+{
+  return index >= 0 && index < arb->num_portraits ? arb->portraits[index] : NULL;
+}
+
+int sp_artistbrowse_num_tracks(sp_artistbrowse *arb)
+{
+  return arb->num_tracks;
+}
+
+sp_track *sp_artistbrowse_track(sp_artistbrowse *arb, int index)
+{
+  return index >= 0 && index < arb->num_tracks ? catalog_track(arb->tracks[index]) : NULL;
+}
+
+int sp_artistbrowse_num_albums(sp_artistbrowse *arb)
+{
+  return arb->num_albums;
+}
+
+sp_album *sp_artistbrowse_album(sp_artistbrowse *arb, int index)
+{
+  return index >= 0 && index < arb->num_albums ? catalog_album(arb->first_album + index) : NULL;
+}
+
+int sp_artistbrowse_num_similar_artists(sp_artistbrowse *arb)
+{
+  return arb->num_similar;
+}
+
+sp_artist *sp_artistbrowse_similar_artist(sp_artistbrowse *arb, int index)
+{
+  if (index < 0 || index >= arb->num_similar) return NULL;
+  /* Similarity is symmetric: neighbours on both sides. */
+  int offset = index / 2 + 1;
+  int other = index % 2 ? arb->artist->index - offset : arb->artist->index + offset;
+  return catalog_artist(((other % num_artists()) + num_artists()) % num_artists());
+}
+
+const char *sp_artistbrowse_biography(sp_artistbrowse *arb)
+{
+  return arb->biography;
+}
+
+DEFINE_REFCOUNT(artistbrowse)
+
+/* +-----------------------------------------------------------------+
+   | Images                                                          |
+   +-----------------------------------------------------------------+ */
+
+struct load_callback {
+  image_loaded_cb *callback;
+  void *userdata;
+  struct load_callback *next;
+};
+
+struct sp_image {
+  struct object object;
+  byte id[20];
+  int loaded;
+  sp_error error;
+  byte *data;
+  size_t size;
+  pthread_mutex_t mutex;
+  struct load_callback *callbacks;
+};
+
+static void free_image(struct object *object)
+{
+  sp_image *image = (sp_image*)object;
+  struct load_callback *cb;
+  while ((cb = image->callbacks)) {
+    image->callbacks = cb->next;
+    free(cb);
+  }
+  pthread_mutex_destroy(&(image->mutex));
+  free(image->data);
+  free(image);
+}
+
+/* Check that an image id was generated by the mock. */
+static int image_id_is_valid(const byte id[20])
+{
+  byte expected[20];
+  uint64_t a = 0;
+  int i;
+  for (i = 0; i < 8; i++) a = (a << 8) | id[i];
+  a = unpermute(a);
+  enum kind kind = (enum kind)(a >> 56);
+  int sub = (a >> 48) & 0xff;
+  int index = (int)(a & 0xffffffff);
+  if (kind != KIND_ALBUM && kind != KIND_ARTIST) return 0;
+  image_id(expected, kind, sub, index);
+  return memcmp(id, expected, 20) == 0;
+}
+
+sp_image *sp_image_create(sp_session *session, const byte image_id[20])
+{
+  sp_image *image = new(sp_image);
+  memset(image, 0, sizeof(sp_image));
+  object_init(&(image->object), KIND_IMAGE, 1, 0, free_image);
+  memcpy(image->id, image_id, 20);
+  pthread_mutex_init(&(image->mutex), NULL);
+  pthread_mutex_lock(&(session->mutex));
+  session_schedule(session, EVENT_IMAGE, &(image->object),
+                   !image_id_is_valid(image_id) ? SP_ERROR_OTHER_PERMANENT :
+                   session_fault(session, FAULT_IMAGE) ? SP_ERROR_OTHER_TRANSIENT : SP_ERROR_OK);
+  pthread_mutex_unlock(&(session->mutex));
+  return image;
+}
+
+static void image_complete(sp_image *image, sp_error error)
+{
+  struct load_callback *callbacks = NULL, *cb, **last = &callbacks;
+  if (error == SP_ERROR_OK) {
+    /* A JPEG-looking blob derived from the id. */
+    uint64_t h = mix64(((uint64_t)image->id[0] << 24) | ((uint64_t)image->id[1] << 16) | ((uint64_t)image->id[2] << 8) | image->id[3]);
+    size_t size = 1024 + h % 3072, i;
+    image->data = xmalloc(size);
+    for (i = 0; i < size; i++) {
+      h = mix64(h);
+      image->data[i] = (byte)h;
+    }
+    image->data[0] = 0xff;
+    image->data[1] = 0xd8;
+    image->data[size - 2] = 0xff;
+    image->data[size - 1] = 0xd9;
+    image->size = size;
+  }
+  pthread_mutex_lock(&(image->mutex));
+  image->error = error;
+  image->loaded = 1;
+  /* Copy callbacks, they may remove themselves. */
+  for (cb = image->callbacks; cb; cb = cb->next) {
+    *last = new(struct load_callback);
+    **last = *cb;
+    (*last)->next = NULL;
+    last = &((*last)->next);
+  }
+  pthread_mutex_unlock(&(image->mutex));
+  while ((cb = callbacks)) {
+    callbacks = cb->next;
+    cb->callback(image, cb->userdata);
+    free(cb);
+  }
+}
+
+void sp_image_add_load_callback(sp_image *image, image_loaded_cb *callback, void *userdata)
+{
+  struct load_callback *cb = new(struct load_callback);
+  cb->callback = callback;
+  cb->userdata = userdata;
+  pthread_mutex_lock(&(image->mutex));
+  cb->next = image->callbacks;
+  image->callbacks = cb;
+  pthread_mutex_unlock(&(image->mutex));
+}
+
+void sp_image_remove_load_callback(sp_image *image, image_loaded_cb *callback, void *userdata)
+{
+  struct load_callback **ptr, *cb;
+  pthread_mutex_lock(&(image->mutex));
+  for (ptr = &(image->callbacks); *ptr; ptr = &((*ptr)->next)) {
+    cb = *ptr;
+    if (cb->callback == callback && cb->userdata == userdata) {
+      *ptr = cb->next;
+      free(cb);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(image->mutex));
+}
+
+bool sp_image_is_loaded(sp_image *image)
+{
+  bool loaded;
+  pthread_mutex_lock(&(image->mutex));
+  loaded = image->loaded;
+  pthread_mutex_unlock(&(image->mutex));
+  return loaded;
+}
+
+sp_error sp_image_error(sp_image *image)
+{
+  return sp_image_is_loaded(image) ? image->error : SP_ERROR_IS_LOADING;
+}
+
+sp_imageformat sp_image_format(sp_image *image)
+{
+  return sp_image_is_loaded(image) && image->error == SP_ERROR_OK ? SP_IMAGE_FORMAT_JPEG : SP_IMAGE_FORMAT_UNKNOWN;
+}
+
+const void *sp_image_data(sp_image *image, size_t *data_size)
+{
+  if (!sp_image_is_loaded(image) || image->data == NULL) {
+    *data_size = 0;
+    return NULL;
+  }
+  *data_size = image->size;
+  return image->data;
+}
+
+const byte *sp_image_image_id(sp_image *image)
+{
+  return image->id;
+}
+
+DEFINE_REFCOUNT(image)
+
+/* +-----------------------------------------------------------------+
+   | Searching                                                       |
+   +-----------------------------------------------------------------+ */
+
+#define RADIO_TRACKS 100
+
+struct sp_search {
+  struct object object;
+  char *query;
+  int radio;
+  unsigned from_year, to_year, genres;
+  int track_offset, track_count;
+  int album_offset, album_count;
+  int artist_offset, artist_count;
+  search_complete_cb *callback;
+  void *userdata;
+  int loaded;
+  sp_error error;
+  int *tracks, num_tracks, total_tracks;
+  int *albums, num_albums, total_albums;
+  int *artists, num_artists, total_artists;
+};
+
+static void free_search(struct object *object)
+{
+  sp_search *search = (sp_search*)object;
+  free(search->query);
+  free(search->tracks);
+  free(search->albums);
+  free(search->artists);
+  free(search);
+}
+
+static sp_search *search_alloc(sp_session *session, search_complete_cb *callback, void *userdata)
+{
+  sp_search *search = new(sp_search);
+  memset(search, 0, sizeof(sp_search));
+  object_init(&(search->object), KIND_SEARCH, 1, 0, free_search);
+  search->callback = callback;
+  search->userdata = userdata;
+  return search;
+}
+
+sp_search *sp_search_create(sp_session *session, const char *query, int track_offset, int track_count, int album_offset, int album_count, int artist_offset, int artist_count, search_complete_cb *callback, void *userdata)
+{
+  sp_search *search = search_alloc(session, callback, userdata);
+  search->query = xstrdup(query);
+  search->track_offset = track_offset;
+  search->track_count = track_count;
+  search->album_offset = album_offset;
+  search->album_count = album_count;
+  search->artist_offset = artist_offset;
+  search->artist_count = artist_count;
+  pthread_mutex_lock(&(session->mutex));
+  session_schedule(session, EVENT_SEARCH, &(search->object), session_fault(session, FAULT_SEARCH) ? SP_ERROR_OTHER_TRANSIENT : SP_ERROR_OK);
+  pthread_mutex_unlock(&(session->mutex));
+  return search;
+}
+
+sp_search *sp_radio_search_create(sp_session *session, unsigned int from_year, unsigned int to_year, sp_radio_genre genres, search_complete_cb *callback, void *userdata)
+{
+  char query[64];
+  sp_search *search = search_alloc(session, callback, userdata);
+  snprintf(query, sizeof(query), "radio:%u-%u:%x", from_year, to_year, (unsigned)genres);
+  search->query = xstrdup(query);
+  search->radio = 1;
+  search->from_year = from_year;
+  search->to_year = to_year;
+  search->genres = genres;
+  search->track_count = RADIO_TRACKS;
+  pthread_mutex_lock(&(session->mutex));
+  session_schedule(session, EVENT_SEARCH, &(search->object), session_fault(session, FAULT_SEARCH) ? SP_ERROR_OTHER_TRANSIENT : SP_ERROR_OK);
+  pthread_mutex_unlock(&(session->mutex));
+  return search;
+}
+
+/* Split a query into lowercase words. */
+static int query_words(const char *query, char words_[][64], int max)
+{
+  int count = 0;
+  while (*query && count < max) {
+    int len = 0;
+    while (*query == ' ') query++;
+    if (*query == 0) break;
+    while (*query && *query != ' ') {
+      if (len < 63) words_[count][len++] = tolower((unsigned char)*query);
+      query++;
+    }
+    words_[count++][len] = 0;
+  }
+  return count;
+}
+
+static int matches(const char *text, char words_[][64], int count)
+{
+  char lower[400];
+  int i;
+  for (i = 0; text[i] && i < (int)sizeof(lower) - 1; i++) lower[i] = tolower((unsigned char)text[i]);
+  lower[i] = 0;
+  for (i = 0; i < count; i++)
+    if (strstr(lower, words_[i]) == NULL) return 0;
+  return 1;
+}
+
+/* Append [index] to a page of results, counting all of them. */
+static void add_result(int **results, int *num, int *total, int offset, int count, int index)
+{
+  if (*total >= offset && *num < count) {
+    if (*results == NULL) *results = xmalloc(count * sizeof(int));
+    (*results)[(*num)++] = index;
+  }
+  (*total)++;
+}
+
+static void search_complete(sp_search *search, sp_error error)
+{
+  int i;
+  search->error = error;
+  if (error == SP_ERROR_OK && search->radio) {
+    for (i = 0; i < num_albums() && search->num_tracks < RADIO_TRACKS; i++) {
+      int year = album_year(i);
+      if ((search->from_year && (unsigned)year < search->from_year) || (search->to_year && (unsigned)year > search->to_year)) continue;
+      if (search->genres && !(album_genres(i) & search->genres)) continue;
+      int track = i * TRACKS_PER_ALBUM + (int)(catalog_hash(KIND_ALBUM, i, 4) % TRACKS_PER_ALBUM);
+      if (track < config.num_tracks) add_result(&(search->tracks), &(search->num_tracks), &(search->total_tracks), 0, RADIO_TRACKS, track);
+    }
+  } else if (error == SP_ERROR_OK) {
+    char words_[16][64], name[128], text[400];
+    int count = query_words(search->query, words_, 16);
+    if (count > 0) {
+      for (i = 0; i < config.num_tracks; i++) {
+        int album = i / TRACKS_PER_ALBUM;
+        char artist[128], album_text[128];
+        track_name(i, name, sizeof(name));
+        artist_name(album_artist_index(album), artist, sizeof(artist));
+        album_name(album, album_text, sizeof(album_text));
+        snprintf(text, sizeof(text), "%s %s %s", name, artist, album_text);
+        if (matches(text, words_, count))
+          add_result(&(search->tracks), &(search->num_tracks), &(search->total_tracks), search->track_offset, search->track_count, i);
+      }
+      for (i = 0; i < num_albums(); i++) {
+        album_name(i, name, sizeof(name));
+        if (matches(name, words_, count))
+          add_result(&(search->albums), &(search->num_albums), &(search->total_albums), search->album_offset, search->album_count, i);
+      }
+      for (i = 0; i < num_artists(); i++) {
+        artist_name(i, name, sizeof(name));
+        if (matches(name, words_, count))
+          add_result(&(search->artists), &(search->num_artists), &(search->total_artists), search->artist_offset, search->artist_count, i);
+      }
+    }
+  }
+  search->loaded = 1;
+}
+
+bool sp_search_is_loaded(sp_search *search)
+{
+  return search->loaded;
+}
+
+sp_error sp_search_error(sp_search *search)
+{
+  return search->loaded ? search->error : SP_ERROR_IS_LOADING;
+}
+
+int sp_search_num_tracks(sp_search *search)
+{
+  return search->num_tracks;
+}
+
+sp_track *sp_search_track(sp_search *search, int index)
+{
+  return index >= 0 && index < search->num_tracks ? catalog_track(search->tracks[index]) : NULL;
+}
+
+int sp_search_num_albums(sp_search *search)
+{
+  return search->num_albums;
+}
+
+sp_album *sp_search_album(sp_search *search, int index)
+{
+  return index >= 0 && index < search->num_albums ? catalog_album(search->albums[index]) : NULL;
+}
+
+int sp_search_num_artists(sp_search *search)
+{
+  return search->num_artists;
+}
+
+sp_artist *sp_search_artist(sp_search *search, int index)
+{
+  return index >= 0 && index < search->num_artists ? catalog_artist(search->artists[index]) : NULL;
+}
+
+const char *sp_search_query(sp_search *search)
+{
+  return search->query;
+}
+
+const char *sp_search_did_you_mean(sp_search *search)
+{
+  return "";
+}
+
+int sp_search_total_tracks(sp_search *search)
+{
+  return search->total_tracks;
+}
+
+int sp_search_total_albums(sp_search *search)
+{
+  return search->total_albums;
+}
+
+int sp_search_total_artists(sp_search *search)
+{
+  return search->total_artists;
+}
+
+DEFINE_REFCOUNT(search)
+
+/* +-----------------------------------------------------------------+
+   | Events                                                          |
+   +-----------------------------------------------------------------+ */
+
+static void dispatch_event(sp_session *session, struct event *event)
+{
+  switch (event->type) {
+  case EVENT_LOGIN:
+    pthread_mutex_lock(&(session->mutex));
+    session->state = event->error == SP_ERROR_OK ? SP_CONNECTION_STATE_LOGGED_IN : SP_CONNECTION_STATE_LOGGED_OUT;
+    pthread_mutex_unlock(&(session->mutex));
+    if (session->callbacks.logged_in) session->callbacks.logged_in(session, event->error);
+    if (event->error == SP_ERROR_OK && session->callbacks.metadata_updated) session->callbacks.metadata_updated(session);
+    break;
+  case EVENT_LOGOUT:
+    pthread_mutex_lock(&(session->mutex));
+    session->state = SP_CONNECTION_STATE_LOGGED_OUT;
+    session->user = NULL;
+    pthread_mutex_unlock(&(session->mutex));
+    if (session->callbacks.logged_out) session->callbacks.logged_out(session);
+    break;
+  case EVENT_SEARCH: {
+    sp_search *search = (sp_search*)event->target;
+    search_complete(search, event->error);
+    if (search->callback && mock_spotify_refcount(search) > 0) search->callback(search, search->userdata);
+    break;
+  }
+  case EVENT_ALBUMBROWSE: {
+    sp_albumbrowse *alb = (sp_albumbrowse*)event->target;
+    albumbrowse_complete(alb, event->error);
+    if (alb->callback && mock_spotify_refcount(alb) > 0) alb->callback(alb, alb->userdata);
+    break;
+  }
+  case EVENT_ARTISTBROWSE: {
+    sp_artistbrowse *arb = (sp_artistbrowse*)event->target;
+    artistbrowse_complete(arb, event->error);
+    if (arb->callback && mock_spotify_refcount(arb) > 0) arb->callback(arb, arb->userdata);
+    break;
+  }
+  case EVENT_IMAGE:
+    image_complete((sp_image*)event->target, event->error);
+    break;
+  case EVENT_STREAMING_ERROR:
+    if (session->callbacks.streaming_error) session->callbacks.streaming_error(session, event->error);
+    break;
+  case EVENT_CONTAINER:
+    playlistcontainer_load(session, (sp_playlistcontainer*)event->target);
+    break;
+  case EVENT_PLAYLIST:
+    playlist_load(session, (sp_playlist*)event->target);
+    break;
+  }
+}
+
+/* +-----------------------------------------------------------------+
+   | Links                                                           |
+   +-----------------------------------------------------------------+ */
+
+#define BASE62 "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+#define BASE62_LENGTH 22
+
+struct sp_link {
+  struct object object;
+  sp_linktype type;
+  enum kind kind;
+  /* Kind of the linked catalog object for image links. */
+  int index;
+  /* Index of the linked catalog object or playlist. */
+  int offset;
+  /* Offset of track links, in milliseconds. */
+  char *text;
+  /* User of profile, starred and playlist links, query of search
+     links. */
+  byte image[20];
+  sp_track *local;
+  /* Local track, owned by the link. */
+};
+
+static void free_link(struct object *object)
+{
+  sp_link *link = (sp_link*)object;
+  if (link->local) object_release(&(link->local->object), 0);
+  free(link->text);
+  free(link);
+}
+
+static sp_link *link_alloc(sp_linktype type)
+{
+  sp_link *link = new(sp_link);
+  memset(link, 0, sizeof(sp_link));
+  object_init(&(link->object), KIND_LINK, 1, 0, free_link);
+  link->type = type;
+  return link;
+}
+
+static void encode_id(enum kind kind, int index, char *buffer)
+{
+  unsigned __int128 x;
+  uint64_t lo = permute(((uint64_t)kind << 56) | (uint32_t)index);
+  int i;
+  x = ((unsigned __int128)(mix64(lo) >> 2) << 64) | lo;
+  for (i = BASE62_LENGTH - 1; i >= 0; i--) {
+    buffer[i] = BASE62[x % 62];
+    x /= 62;
+  }
+  buffer[BASE62_LENGTH] = 0;
+}
+
+/* Decode an id of [kind], return the index or -1 if invalid. */
+static int decode_id(enum kind kind, const char *str, size_t len, int count)
+{
+  unsigned __int128 x = 0;
+  size_t i;
+  if (len != BASE62_LENGTH) return -1;
+  for (i = 0; i < len; i++) {
+    const char *p = memchr(BASE62, str[i], 62);
+    if (p == NULL || str[i] == 0) return -1;
+    x = x * 62 + (p - BASE62);
+  }
+  uint64_t lo = (uint64_t)x;
+  if ((uint64_t)(x >> 64) != mix64(lo) >> 2) return -1;
+  uint64_t v = unpermute(lo);
+  if ((enum kind)(v >> 56) != kind || (v & 0x00ffffff00000000ULL)) return -1;
+  int index = (int)(uint32_t)v;
+  return index < count ? index : -1;
+}
+
+static int parse_hex(const char *str, byte *out, int count)
+{
+  int i;
+  for (i = 0; i < 2 * count; i++) {
+    int c = str[i], d;
+    if (c >= '0' && c <= '9') d = c - '0';
+    else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+    else return 0;
+    if (i % 2) out[i / 2] |= d; else out[i / 2] = d << 4;
+  }
+  return str[2 * count] == 0;
+}
+
+/* Return the end of the next field of a colon-separated link. */
+static const char *field_end(const char *str)
+{
+  return str + strcspn(str, ":");
+}
+
+sp_link *sp_link_create_from_string(const char *str)
+{
+  const char *p;
+  sp_link *link;
+  init_catalog();
+  if (strncmp(str, "spotify:", 8) != 0) return NULL;
+  p = str + 8;
+  if (strncmp(p, "track:", 6) == 0) {
+    const char *id = p + 6, *hash = strchr(id, '#');
+    int index = decode_id(KIND_TRACK, id, hash ? (size_t)(hash - id) : strlen(id), config.num_tracks);
+    int minutes = 0, seconds = 0;
+    if (index < 0) return NULL;
+    if (hash && sscanf(hash + 1, "%d:%d", &minutes, &seconds) != 2) return NULL;
+    link = link_alloc(SP_LINKTYPE_TRACK);
+    link->index = index;
+    link->offset = (minutes * 60 + seconds) * 1000;
+    return link;
+  } else if (strncmp(p, "album:", 6) == 0) {
+    int index = decode_id(KIND_ALBUM, p + 6, strlen(p + 6), num_albums());
+    if (index < 0) return NULL;
+    link = link_alloc(SP_LINKTYPE_ALBUM);
+    link->index = index;
+    return link;
+  } else if (strncmp(p, "artist:", 7) == 0) {
+    int index = decode_id(KIND_ARTIST, p + 7, strlen(p + 7), num_artists());
+    if (index < 0) return NULL;
+    link = link_alloc(SP_LINKTYPE_ARTIST);
+    link->index = index;
+    return link;
+  } else if (strncmp(p, "search:", 7) == 0) {
+    link = link_alloc(SP_LINKTYPE_SEARCH);
+    link->text = xstrdup(p + 7);
+    return link;
+  } else if (strncmp(p, "image:", 6) == 0) {
+    byte id[20];
+    if (!parse_hex(p + 6, id, 20) || !image_id_is_valid(id)) return NULL;
+    link = link_alloc(SP_LINKTYPE_IMAGE);
+    memcpy(link->image, id, 20);
+    return link;
+  } else if (strncmp(p, "local:", 6) == 0) {
+    /* spotify:local:artist:album:title:duration */
+    char artist[256], album[256], title[256];
+    int duration;
+    if (sscanf(p + 6, "%255[^:]:%255[^:]:%255[^:]:%d", artist, album, title, &duration) != 4) return NULL;
+    link = link_alloc(SP_LINKTYPE_LOCALTRACK);
+    link->local = sp_localtrack_create(artist, title, album, duration * 1000);
+    return link;
+  } else if (strncmp(p, "user:", 5) == 0) {
+    const char *user = p + 5, *user_end = field_end(user);
+    if (user_end == user) return NULL;
+    if (*user_end == 0) {
+      link = link_alloc(SP_LINKTYPE_PROFILE);
+    } else if (strcmp(user_end, ":starred") == 0) {
+      link = link_alloc(SP_LINKTYPE_STARRED);
+    } else if (strncmp(user_end, ":playlist:", 10) == 0) {
+      int index = decode_id(KIND_PLAYLIST, user_end + 10, strlen(user_end + 10), INT32_MAX);
+      if (index < 0) return NULL;
+      link = link_alloc(SP_LINKTYPE_PLAYLIST);
+      link->index = index;
+    } else
+      return NULL;
+    link->text = xmalloc(user_end - user + 1);
+    memcpy(link->text, user, user_end - user);
+    link->text[user_end - user] = 0;
+    return link;
+  }
+  return NULL;
+}
+
+sp_link *sp_link_create_from_track(sp_track *track, int offset)
+{
+  sp_link *link;
+  if (track->index < 0) {
+    link = link_alloc(SP_LINKTYPE_LOCALTRACK);
+    object_add_ref(&(track->object), 0);
+    link->local = track;
+  } else {
+    link = link_alloc(SP_LINKTYPE_TRACK);
+    link->index = track->index;
+    link->offset = offset;
+  }
+  return link;
+}
+
+sp_link *sp_link_create_from_album(sp_album *album)
+{
+  sp_link *link;
+  if (album->index < 0) return NULL;
+  link = link_alloc(SP_LINKTYPE_ALBUM);
+  link->index = album->index;
+  return link;
+}
+
+sp_link *sp_link_create_from_album_cover(sp_album *album)
+{
+  sp_link *link;
+  if (album->index < 0) return NULL;
+  link = link_alloc(SP_LINKTYPE_IMAGE);
+  memcpy(link->image, album->cover, 20);
+  return link;
+}
+
+sp_link *sp_link_create_from_artist(sp_artist *artist)
+{
+  sp_link *link;
+  if (artist->index < 0) return NULL;
+  link = link_alloc(SP_LINKTYPE_ARTIST);
+  link->index = artist->index;
+  return link;
+}
+
+sp_link *sp_link_create_from_artist_portrait(sp_artist *artist)
+{
+  sp_link *link;
+  if (artist->index < 0) return NULL;
+  link = link_alloc(SP_LINKTYPE_IMAGE);
+  image_id(link->image, KIND_ARTIST, 0, artist->index);
+  return link;
+}
+
+sp_link *sp_link_create_from_artistbrowse_portrait(sp_artistbrowse *arb, int index)
+{
+  sp_link *link;
+  if (index < 0 || index >= arb->num_portraits) return NULL;
+  link = link_alloc(SP_LINKTYPE_IMAGE);
+  memcpy(link->image, arb->portraits[index], 20);
+  return link;
+}
+
+sp_link *sp_link_create_from_search(sp_search *search)
+{
+  sp_link *link;
+  if (search->radio) return NULL;
+  link = link_alloc(SP_LINKTYPE_SEARCH);
+  link->text = xstrdup(search->query);
+  return link;
+}
+
+sp_link *sp_link_create_from_playlist(sp_playlist *playlist)
+{
+  sp_link *link = link_alloc(SP_LINKTYPE_PLAYLIST);
+  link->index = playlist->index;
+  link->text = xstrdup(playlist->owner);
+  return link;
+}
+
+sp_link *sp_link_create_from_user(sp_user *user)
+{
+  sp_link *link = link_alloc(SP_LINKTYPE_PROFILE);
+  link->text = xstrdup(user->name);
+  return link;
+}
+
+sp_link *sp_link_create_from_image(sp_image *image)
+{
+  sp_link *link = link_alloc(SP_LINKTYPE_IMAGE);
+  memcpy(link->image, image->id, 20);
+  return link;
+}
+
+int sp_link_as_string(sp_link *link, char *buffer, int buffer_size)
+{
+  char str[1024], id[BASE62_LENGTH + 1];
+  int i, len;
+  switch (link->type) {
+  case SP_LINKTYPE_TRACK:
+    encode_id(KIND_TRACK, link->index, id);
+    if (link->offset)
+      len = snprintf(str, sizeof(str), "spotify:track:%s#%d:%02d", id, link->offset / 60000, link->offset / 1000 % 60);
+    else
+      len = snprintf(str, sizeof(str), "spotify:track:%s", id);
+    break;
+  case SP_LINKTYPE_ALBUM:
+    encode_id(KIND_ALBUM, link->index, id);
+    len = snprintf(str, sizeof(str), "spotify:album:%s", id);
+    break;
+  case SP_LINKTYPE_ARTIST:
+    encode_id(KIND_ARTIST, link->index, id);
+    len = snprintf(str, sizeof(str), "spotify:artist:%s", id);
+    break;
+  case SP_LINKTYPE_SEARCH:
+    len = snprintf(str, sizeof(str), "spotify:search:%s", link->text);
+    break;
+  case SP_LINKTYPE_PLAYLIST:
+    encode_id(KIND_PLAYLIST, link->index, id);
+    len = snprintf(str, sizeof(str), "spotify:user:%s:playlist:%s", link->text, id);
+    break;
+  case SP_LINKTYPE_PROFILE:
+    len = snprintf(str, sizeof(str), "spotify:user:%s", link->text);
+    break;
+  case SP_LINKTYPE_STARRED:
+    len = snprintf(str, sizeof(str), "spotify:user:%s:starred", link->text);
+    break;
+  case SP_LINKTYPE_LOCALTRACK:
+    len = snprintf(str, sizeof(str), "spotify:local:%s:%s:%s:%d",
+                   link->local->artists[0]->name, link->local->album->name, link->local->name, link->local->duration / 1000);
+    break;
+  case SP_LINKTYPE_IMAGE:
+    len = snprintf(str, sizeof(str), "spotify:image:");
+    for (i = 0; i < 20; i++) len += snprintf(str + len, sizeof(str) - len, "%02x", link->image[i]);
+    break;
+  default:
+    len = 0;
+    str[0] = 0;
+  }
+  if (len >= (int)sizeof(str)) len = sizeof(str) - 1;
+  if (buffer && buffer_size > 0) {
+    int n = len < buffer_size - 1 ? len : buffer_size - 1;
+    memcpy(buffer, str, n);
+    buffer[n] = 0;
+  }
+  return len;
+}
+
+sp_linktype sp_link_type(sp_link *link)
+{
+  return link->type;
+}
+
+sp_track *sp_link_as_track(sp_link *link)
+{
+  switch (link->type) {
+  case SP_LINKTYPE_TRACK:
+    return catalog_track(link->index);
+  case SP_LINKTYPE_LOCALTRACK:
+    return link->local;
+  default:
+    return NULL;
+  }
+}
+
+sp_track *sp_link_as_track_and_offset(sp_link *link, int *offset)
+{
+  *offset = link->type == SP_LINKTYPE_TRACK ? link->offset : 0;
+  return sp_link_as_track(link);
+}
+
+sp_album *sp_link_as_album(sp_link *link)
+{
+  return link->type == SP_LINKTYPE_ALBUM ? catalog_album(link->index) : NULL;
+}
+
+sp_artist *sp_link_as_artist(sp_link *link)
+{
+  return link->type == SP_LINKTYPE_ARTIST ? catalog_artist(link->index) : NULL;
+}
+
+sp_user *sp_link_as_user(sp_link *link)
+{
+  return link->type == SP_LINKTYPE_PROFILE ? user_of_name(link->text) : NULL;
+}
+
+sp_image *sp_image_create_from_link(sp_session *session, sp_link *link)
+{
+  return link->type == SP_LINKTYPE_IMAGE ? sp_image_create(session, link->image) : NULL;
+}
+
+DEFINE_REFCOUNT(link)
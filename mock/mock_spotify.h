@@ -0,0 +1,80 @@
+/*
+ * mock_spotify.h
+ * --------------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ */
+
+/* Extensions of the mock libspotify, for harnesses which need to
+   inspect it. Programs only using <libspotify/api.h> do not need
+   this header. */
+
+#ifndef MOCK_SPOTIFY_H
+#define MOCK_SPOTIFY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <libspotify/api.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Counters of a mock session. */
+struct mock_spotify_stats {
+  int64_t deliveries;
+  /* Number of calls to the [music_delivery] callback. */
+  int64_t frames_offered;
+  /* Total number of frames passed to [music_delivery]. */
+  int64_t frames_consumed;
+  /* Total number of frames [music_delivery] accepted. */
+  int64_t retries;
+  /* Number of deliveries where no frame was accepted. */
+  int64_t stalls;
+  /* Number of injected delivery stalls. */
+  int64_t events;
+  /* Number of events dispatched by [sp_session_process_events]. */
+  int64_t notifications;
+  /* Number of calls to the [notify_main_thread] callback. */
+  int64_t faults;
+  /* Number of injected faults. */
+};
+
+/* Fill [stats] with the counters of [session]. */
+void mock_spotify_session_stats(sp_session *session, struct mock_spotify_stats *stats);
+
+/* Return the number of references the application holds on
+   [object], which may be of any libspotify type. */
+int mock_spotify_refcount(const void *object);
+
+/* Return the number of objects on which the application still holds
+   references. */
+int mock_spotify_live_objects(void);
+
+/* Return the total number of references the application holds, on
+   all objects. */
+int64_t mock_spotify_references(void);
+
+/* Print objects on which the application still holds references to
+   [out] and return their number. Setting MOCK_SPOTIFY_LEAK_REPORT
+   does this on [stderr] at exit. */
+int mock_spotify_leak_report(FILE *out);
+
+/* Number of tracks in the synthetic catalog. */
+int mock_spotify_num_tracks(void);
+
+/* Return the track at [index] in the synthetic catalog, without
+   adding a reference, or NULL if [index] is out of range. */
+sp_track *mock_spotify_track(int index);
+
+/* Return the sample of [channel] at [frame] that the mock delivers
+   for [track]. */
+int16_t mock_spotify_sample(sp_track *track, int64_t frame, int channel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MOCK_SPOTIFY_H */
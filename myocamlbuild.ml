@@ -18,6 +18,9 @@ let pkg_config flags package =
        Command.execute ~quiet:true & Cmd(S[A "pkg-config"; A("--" ^ flags); A package; Sh ">"; A tmp]);
        List.map (fun arg -> A arg) (string_list_of_file tmp))
 
+let pkg_config_exists package =
+  Sys.command ("pkg-config --exists " ^ Filename.quote package) = 0
+
 let define_c_library ~name ~c_name =
   let tag = Printf.sprintf "use_%s" name in
 
@@ -34,6 +37,21 @@ let define_c_library ~name ~c_name =
   (* OCaml libraries must depends on the C library: *)
   flag ["link"; "ocaml"; tag] & S(List.map (fun arg -> S[A"-cclib"; arg]) lib)
 
+(* Optional codecs used by the encoders, with the symbol enabling them
+   in the stubs and the pkg-config packages they need. *)
+let codecs = [
+  ("HAVE_FLAC", ["flac"]);
+  ("HAVE_VORBIS", ["vorbisenc"; "vorbis"; "ogg"]);
+]
+
+let define_codecs () =
+  let available = List.filter (fun (_, packages) -> List.for_all pkg_config_exists packages) codecs in
+  let opt = List.concat (List.map (fun (symbol, packages) -> A("-D" ^ symbol) :: List.concat (List.map (pkg_config "cflags") packages)) available)
+  and lib = List.concat (List.map (fun (_, packages) -> List.concat (List.map (pkg_config "libs") packages)) available) in
+  flag ["ocamlmklib"; "c"; "use_codecs"] & S lib;
+  flag ["c"; "compile"; "use_codecs"] & S(List.map (fun arg -> S[A"-ccopt"; arg]) opt);
+  flag ["link"; "ocaml"; "use_codecs"] & S(List.map (fun arg -> S[A"-cclib"; arg]) lib)
+
 let () =
   dispatch
     (fun hook ->
@@ -43,7 +61,8 @@ let () =
              Options.make_links := false
 
          | After_rules ->
-             define_c_library ~name:"libspotify" ~c_name:"libspotify"
+             define_c_library ~name:"libspotify" ~c_name:"libspotify";
+             define_codecs ()
 
          | _ ->
              ())
@@ -7,7 +7,9 @@
  * This file is a part of ocaml-spotify.
  *)
 
-(* Force initialization of the thread machinery. *)
+(* Force initialization of the thread machinery. This is only needed
+   with OCaml 4, where threads registered from C cannot run OCaml code
+   before the machinery is initialized. *)
 let _ = Thread.self ()
 
 (* +-----------------------------------------------------------------+
@@ -242,6 +244,17 @@ external session_player_load : session -> track -> unit = "ocaml_spotify_session
 external session_player_seek : session -> float -> unit = "ocaml_spotify_session_player_seek"
 external session_player_play : session -> bool -> unit = "ocaml_spotify_session_player_play"
 external session_player_unload : session -> unit = "ocaml_spotify_session_player_unload"
+
+type replay_stats = {
+  replay_window : float;
+  replay_available : float;
+  replay_hits : int;
+  replay_misses : int;
+  replay_hit_rate : float;
+}
+
+external session_set_replay_window : session -> float -> unit = "ocaml_spotify_session_set_replay_window"
+external session_replay_stats : session -> replay_stats = "ocaml_spotify_session_replay_stats"
 external session_player_prefetch : session -> track -> unit = "ocaml_spotify_session_player_prefetch"
 external session_playlistcontainer : session -> playlistcontainer = "ocaml_spotify_session_playlistcontainer"
 external session_inbox_create : session -> playlist = "ocaml_spotify_session_inbox_create"
@@ -306,7 +319,10 @@ external track_is_available : session -> track -> bool = "ocaml_spotify_track_is
 external track_is_local : session -> track -> bool = "ocaml_spotify_track_is_local"
 external track_is_autolinked : session -> track -> bool = "ocaml_spotify_track_is_autolinked"
 external track_is_starred : session -> track -> bool = "ocaml_spotify_track_is_starred"
-external track_set_starred : session -> track list -> bool -> unit = "ocaml_spotify_track_set_starred"
+external track_get_playable : session -> track -> track = "ocaml_spotify_track_get_playable"
+external tracks_get_playable : session -> track array -> track array = "ocaml_spotify_tracks_get_playable"
+external session_clear_playable_cache : session -> unit = "ocaml_spotify_session_clear_playable_cache"
+external track_set_starred_stub : session -> track array -> bool -> unit = "ocaml_spotify_track_set_starred"
 external track_num_artists : track -> int = "ocaml_spotify_track_num_artists"
 external track_artist : track -> int -> artist = "ocaml_spotify_track_artist"
 external track_album : track -> album = "ocaml_spotify_track_album"
@@ -318,6 +334,69 @@ external track_index : track -> int = "ocaml_spotify_track_index"
 external localtrack_create : artist : string -> title : string -> album : string -> lengh : float -> track = "ocaml_spotify_localtrack_create"
 external track_release : track -> unit = "ocaml_spotify_track_release"
 
+let track_set_starred session tracks star =
+  track_set_starred_stub session (Array.of_list tracks) star
+
+type track_metadata = {
+  metadata_is_loaded : bool;
+  metadata_name : string;
+  metadata_album : string;
+  metadata_artists : string list;
+  metadata_duration : float;
+  metadata_popularity : int;
+  metadata_disc : int;
+  metadata_index : int;
+}
+
+type metadata_chunk
+
+external tracks_metadata_extract : track array -> int -> int -> metadata_chunk = "ocaml_spotify_tracks_metadata_extract"
+external tracks_metadata_build : metadata_chunk -> track_metadata array = "ocaml_spotify_tracks_metadata_build"
+
+(* Number of tracks extracted while holding the libspotify lock. *)
+let metadata_chunk = 256
+
+let tracks_metadata ?(jobs=1) ?(spawn=fun f -> let x = f () in fun () -> x) tracks =
+  let count = Array.length tracks in
+  let jobs = max 1 (min jobs count) in
+  (* libspotify is only called from the current domain; [spawn] only
+     builds the results. *)
+  let extract job =
+    let start = count * job / jobs and stop = count * (job + 1) / jobs in
+    let rec loop offset =
+      if offset >= stop then
+        []
+      else begin
+        let len = min metadata_chunk (stop - offset) in
+        let chunk = tracks_metadata_extract tracks offset len in
+        chunk :: loop (offset + len)
+      end
+    in
+    loop start
+  in
+  let rec start job =
+    if job = jobs then
+      []
+    else begin
+      let chunks = extract job in
+      let join = spawn (fun () -> Array.concat (List.map tracks_metadata_build chunks)) in
+      join :: start (job + 1)
+    end
+  in
+  Array.concat (List.map (fun join -> join ()) (start 0))
+
+type track_flags = {
+  flags_available : bytes;
+  flags_local : bytes;
+  flags_autolinked : bytes;
+  flags_starred : bytes;
+}
+
+external tracks_flags : session -> track array -> track_flags = "ocaml_spotify_tracks_flags"
+
+let track_flag bitset index =
+  Char.code (Bigarray.Array1.get bitset (index lsr 3)) land (1 lsl (index land 7)) <> 0
+
 (* +-----------------------------------------------------------------+
    | Album subsystem                                                 |
    +-----------------------------------------------------------------+ *)
@@ -343,7 +422,7 @@ external album_release : album -> unit = "ocaml_spotify_album_release"
 
 external artist_name : artist -> string = "ocaml_spotify_artist_name"
 external artist_is_loaded : artist -> bool = "ocaml_spotify_artist_is_loaded"
-external artist_release : album -> unit = "ocaml_spotify_artist_release"
+external artist_release : artist -> unit = "ocaml_spotify_artist_release"
 
 (* +-----------------------------------------------------------------+
    | Album browsing                                                  |
@@ -359,7 +438,7 @@ external albumbrowse_copyright : albumbrowse -> int -> string = "ocaml_spotify_a
 external albumbrowse_num_tracks : albumbrowse -> int = "ocaml_spotify_albumbrowse_num_tracks"
 external albumbrowse_track : albumbrowse -> int -> track = "ocaml_spotify_albumbrowse_track"
 external albumbrowse_review : albumbrowse -> string = "ocaml_spotify_albumbrowse_review"
-external albumbrowse_release : album -> unit = "ocaml_spotify_albumbrowse_release"
+external albumbrowse_release : albumbrowse -> unit = "ocaml_spotify_albumbrowse_release"
 
 (* +-----------------------------------------------------------------+
    | Artist browsing                                                 |
@@ -378,7 +457,7 @@ external artistbrowse_album : artistbrowse -> int -> album = "ocaml_spotify_arti
 external artistbrowse_num_similar_artists : artistbrowse -> int = "ocaml_spotify_artistbrowse_num_similar_artists"
 external artistbrowse_similar_artist : artistbrowse -> int -> artist = "ocaml_spotify_artistbrowse_similar_artist"
 external artistbrowse_biography : artistbrowse -> string = "ocaml_spotify_artistbrowse_biography"
-external artistbrowse_release : artist -> unit = "ocaml_spotify_artistbrowse_release"
+external artistbrowse_release : artistbrowse -> unit = "ocaml_spotify_artistbrowse_release"
 
 (* +-----------------------------------------------------------------+
    | Image handling                                                  |
@@ -398,7 +477,7 @@ external image_error : image -> error = "ocaml_spotify_image_error"
 external image_format : image -> image_format = "ocaml_spotify_image_format"
 external image_data : image -> bytes = "ocaml_spotify_image_data"
 external image_image_id : image -> string = "ocaml_spotify_image_image_id"
-external image_release : artist -> unit = "ocaml_spotify_image_release"
+external image_release : image -> unit = "ocaml_spotify_image_release"
 
 (* +-----------------------------------------------------------------+
    | Search subsystem                                                |
@@ -440,3 +519,877 @@ external search_total_tracks : search -> int = "ocaml_spotify_search_total_track
 external search_total_albums : search -> int = "ocaml_spotify_search_total_albums"
 external search_total_artists : search -> int = "ocaml_spotify_search_total_artists"
 external search_release : search -> unit = "ocaml_spotify_search_release"
+
+(* +-----------------------------------------------------------------+
+   | Playlist subsystem                                              |
+   +-----------------------------------------------------------------+ *)
+
+external user_is_loaded : user -> bool = "ocaml_spotify_user_is_loaded"
+external user_canonical_name : user -> string = "ocaml_spotify_user_canonical_name"
+external user_release : user -> unit = "ocaml_spotify_user_release"
+external playlist_is_loaded : playlist -> bool = "ocaml_spotify_playlist_is_loaded"
+external playlist_name : playlist -> string = "ocaml_spotify_playlist_name"
+external playlist_num_tracks : playlist -> int = "ocaml_spotify_playlist_num_tracks"
+external playlist_track : playlist -> int -> track = "ocaml_spotify_playlist_track"
+external playlist_set_offline_mode : session -> playlist -> bool -> unit = "ocaml_spotify_playlist_set_offline_mode"
+external playlist_get_offline_status : session -> playlist -> playlist_offline_status = "ocaml_spotify_playlist_get_offline_status"
+external playlist_get_offline_download_completed : session -> playlist -> int = "ocaml_spotify_playlist_get_offline_download_completed"
+external playlist_release : playlist -> unit = "ocaml_spotify_playlist_release"
+external playlistcontainer_is_loaded : playlistcontainer -> bool = "ocaml_spotify_playlistcontainer_is_loaded"
+external playlistcontainer_num_playlists : playlistcontainer -> int = "ocaml_spotify_playlistcontainer_num_playlists"
+external playlistcontainer_playlist : playlistcontainer -> int -> playlist = "ocaml_spotify_playlistcontainer_playlist"
+external playlistcontainer_release : playlistcontainer -> unit = "ocaml_spotify_playlistcontainer_release"
+
+let playlist_get_playable session playlist =
+  tracks_get_playable session (Array.init (playlist_num_tracks playlist) (playlist_track playlist))
+
+(* +-----------------------------------------------------------------+
+   | Startup                                                         |
+   +-----------------------------------------------------------------+ *)
+
+type startup
+
+type startup_phase =
+  | STARTUP_LOGGED_IN
+  | STARTUP_USER_LOADED
+  | STARTUP_CONTAINER_LOADED
+  | STARTUP_STARRED_LOADED
+  | STARTUP_PLAYLISTS_LOADED
+  | STARTUP_TRACKS_LOADED
+
+external session_startup_stub : session -> (string * string) option -> int -> startup = "ocaml_spotify_session_startup"
+external startup_error : startup -> error = "ocaml_spotify_startup_error"
+external startup_timings : startup -> (startup_phase * float) list = "ocaml_spotify_startup_timings"
+external startup_playlistcontainer : startup -> playlistcontainer = "ocaml_spotify_startup_playlistcontainer"
+external startup_starred : startup -> playlist = "ocaml_spotify_startup_starred"
+external startup_playlists : startup -> playlist array = "ocaml_spotify_startup_playlists"
+external startup_release : startup -> unit = "ocaml_spotify_startup_release"
+
+let session_startup ?credentials ?(prefetch=10) session =
+  session_startup_stub session credentials prefetch
+
+let startup_is_done startup =
+  startup_error startup <> ERROR_OK || List.mem_assoc STARTUP_TRACKS_LOADED (startup_timings startup)
+
+(* +-----------------------------------------------------------------+
+   | Star jobs                                                       |
+   +-----------------------------------------------------------------+ *)
+
+type star_job
+
+external tracks_set_starred_stub : session -> track array -> bool -> int -> star_job = "ocaml_spotify_tracks_set_starred"
+external star_job_progress : star_job -> int * int = "ocaml_spotify_star_job_progress"
+external star_job_is_done : star_job -> bool = "ocaml_spotify_star_job_is_done"
+external star_job_cancel : star_job -> unit = "ocaml_spotify_star_job_cancel"
+external star_job_release : star_job -> unit = "ocaml_spotify_star_job_release"
+
+let tracks_set_starred ?(chunk_size=500) session tracks star =
+  tracks_set_starred_stub session tracks star chunk_size
+
+(* +-----------------------------------------------------------------+
+   | Offline sync                                                    |
+   +-----------------------------------------------------------------+ *)
+
+type offline_plan
+
+type offline_progress = {
+  progress_bytes_per_second : float;
+  progress_time_left : float;
+  progress_done_bytes : int64;
+  progress_done_tracks : int;
+  progress_queued_bytes : int64;
+  progress_queued_tracks : int;
+  progress_syncing : bool;
+  progress_playlists : (playlist * playlist_offline_status * int) list;
+}
+
+external offline_plan_stub : session -> playlist array -> int64 -> bitrate -> (offline_progress -> unit) -> offline_plan = "ocaml_spotify_offline_plan"
+external offline_plan_size : offline_plan -> int64 = "ocaml_spotify_offline_plan_size"
+external offline_plan_playlists : offline_plan -> playlist array = "ocaml_spotify_offline_plan_playlists"
+external offline_plan_release : offline_plan -> unit = "ocaml_spotify_offline_plan_release"
+
+let offline_plan ?(bitrate=BITRATE_160k) session playlists ~budget ~callback =
+  offline_plan_stub session playlists budget bitrate callback
+
+(* +-----------------------------------------------------------------+
+   | Bitrate policy                                                  |
+   +-----------------------------------------------------------------+ *)
+
+type bitrate_policy
+
+type policy_reason =
+  | POLICY_STREAMING_ERROR
+  | POLICY_STUTTER
+  | POLICY_LOW_BUFFER
+  | POLICY_STABLE
+
+type policy_decision = {
+  decision_time : float;
+  decision_bitrate : bitrate;
+  decision_prefetch : int;
+  decision_reason : policy_reason;
+}
+
+external bitrate_policy_create_stub : session -> bitrate -> float -> float -> float -> int -> int -> bitrate_policy = "ocaml_spotify_bitrate_policy_create_byte" "ocaml_spotify_bitrate_policy_create"
+external bitrate_policy_bitrate : bitrate_policy -> bitrate = "ocaml_spotify_bitrate_policy_bitrate"
+external bitrate_policy_prefetch_depth : bitrate_policy -> int = "ocaml_spotify_bitrate_policy_prefetch_depth"
+external bitrate_policy_decisions : bitrate_policy -> policy_decision list = "ocaml_spotify_bitrate_policy_decisions"
+external bitrate_policy_release : bitrate_policy -> unit = "ocaml_spotify_bitrate_policy_release"
+
+let bitrate_policy_create ?(bitrate=BITRATE_160k) ?(window=5.) ?(low_water=0.5) ?(high_water=2.) ?(upgrade_after=6) ?(max_prefetch=4) session =
+  bitrate_policy_create_stub session bitrate window low_water high_water upgrade_after max_prefetch
+
+(* +-----------------------------------------------------------------+
+   | Metadata store                                                  |
+   +-----------------------------------------------------------------+ *)
+
+external track_id : track -> string = "ocaml_spotify_track_id"
+external album_id : album -> string = "ocaml_spotify_album_id"
+external artist_id : artist -> string = "ocaml_spotify_artist_id"
+
+type metadata_store
+
+type metadata_kind =
+  | METADATA_TRACK
+  | METADATA_ALBUM
+  | METADATA_ARTIST
+
+type metadata_entry = {
+  entry_kind : metadata_kind;
+  entry_name : string;
+  entry_parent : string;
+  entry_duration : float;
+  entry_popularity : int;
+  entry_year : int;
+}
+
+external metadata_store_open : string -> metadata_store = "ocaml_spotify_metadata_store_open"
+external metadata_store_close : metadata_store -> unit = "ocaml_spotify_metadata_store_close"
+external metadata_store_find : metadata_store -> string -> metadata_entry option = "ocaml_spotify_metadata_store_find"
+external metadata_store_count : metadata_store -> int = "ocaml_spotify_metadata_store_count"
+external metadata_store_sync : metadata_store -> unit = "ocaml_spotify_metadata_store_sync"
+external metadata_store_attach : metadata_store -> unit = "ocaml_spotify_metadata_store_attach"
+external metadata_store_detach : unit -> unit = "ocaml_spotify_metadata_store_detach"
+external metadata_store_compact : string -> string -> unit = "ocaml_spotify_metadata_store_compact"
+
+let metadata_store_track store track = metadata_store_find store (track_id track)
+let metadata_store_album store album = metadata_store_find store (album_id album)
+let metadata_store_artist store artist = metadata_store_find store (artist_id artist)
+
+(* +-----------------------------------------------------------------+
+   | Shared cache                                                    |
+   +-----------------------------------------------------------------+ *)
+
+type shared_cache
+
+type shared_cache_stats = {
+  shared_slots : int;
+  shared_name_size : int;
+  shared_count : int;
+  shared_evictions : int;
+  shared_hits : int;
+  shared_misses : int;
+}
+
+external shared_cache_open_stub : string -> int -> int -> shared_cache = "ocaml_spotify_shared_cache_open"
+external shared_cache_close : shared_cache -> unit = "ocaml_spotify_shared_cache_close"
+external shared_cache_unlink : string -> unit = "ocaml_spotify_shared_cache_unlink"
+external shared_cache_find : shared_cache -> string -> metadata_entry option = "ocaml_spotify_shared_cache_find"
+external shared_cache_add_track : shared_cache -> track -> bool = "ocaml_spotify_shared_cache_add_track"
+external shared_cache_add_album : shared_cache -> album -> bool = "ocaml_spotify_shared_cache_add_album"
+external shared_cache_add_artist : shared_cache -> artist -> bool = "ocaml_spotify_shared_cache_add_artist"
+external shared_cache_stats : shared_cache -> shared_cache_stats = "ocaml_spotify_shared_cache_stats"
+
+let shared_cache_open ?(slots=65536) ?(name_size=80) name = shared_cache_open_stub name slots name_size
+
+let shared_cache_track cache track = shared_cache_find cache (track_id track)
+let shared_cache_album cache album = shared_cache_find cache (album_id album)
+let shared_cache_artist cache artist = shared_cache_find cache (artist_id artist)
+
+(* +-----------------------------------------------------------------+
+   | Local index                                                     |
+   +-----------------------------------------------------------------+ *)
+
+type local_index
+
+type local_result = {
+  local_tracks : track array;
+  local_albums : album array;
+  local_artists : artist array;
+}
+
+type instant_result =
+  | INSTANT_LOCAL of local_result
+  | INSTANT_REMOTE of search
+
+external local_index_create : unit -> local_index = "ocaml_spotify_local_index_create"
+external local_index_release : local_index -> unit = "ocaml_spotify_local_index_release"
+external local_index_add_track : local_index -> track -> unit = "ocaml_spotify_local_index_add_track"
+external local_index_add_album : local_index -> album -> unit = "ocaml_spotify_local_index_add_album"
+external local_index_add_artist : local_index -> artist -> unit = "ocaml_spotify_local_index_add_artist"
+external local_index_update : local_index -> unit = "ocaml_spotify_local_index_update"
+external local_index_attach_stub : local_index -> int -> unit = "ocaml_spotify_local_index_attach"
+external local_index_detach : unit -> unit = "ocaml_spotify_local_index_detach"
+external local_index_size : local_index -> int = "ocaml_spotify_local_index_size"
+external local_search : local_index -> query : string -> count : int -> local_result = "ocaml_spotify_local_search"
+
+let local_index_attach ?(max_objects=max_int) index = local_index_attach_stub index max_objects
+
+let instant_search index session ~query ~count ~callback =
+  let result = local_search index ~query ~count in
+  if result.local_tracks <> [||] || result.local_albums <> [||] || result.local_artists <> [||] then
+    INSTANT_LOCAL result
+  else
+    INSTANT_REMOTE
+      (search_create session ~query
+         ~track_offset:0 ~track_count:count
+         ~album_offset:0 ~album_count:count
+         ~artist_offset:0 ~artist_count:count
+         ~callback)
+
+(* +-----------------------------------------------------------------+
+   | Fuzzy matching                                                  |
+   +-----------------------------------------------------------------+ *)
+
+module Fuzzy = struct
+  type result = {
+    tracks : (track * int) array;
+    albums : (album * int) array;
+    artists : (artist * int) array;
+  }
+
+  external search_stub : local_index -> string -> int -> int -> int -> result = "ocaml_spotify_fuzzy_search"
+  external distance : string -> string -> int = "ocaml_spotify_fuzzy_distance"
+
+  let search ?(max_errors=2) ?(jobs=1) index ~query ~count =
+    search_stub index query max_errors jobs count
+end
+
+(* +-----------------------------------------------------------------+
+   | Artist graph                                                    |
+   +-----------------------------------------------------------------+ *)
+
+type artist_graph
+
+external artist_of_id : string -> artist = "ocaml_spotify_artist_of_id"
+external artist_graph_create : unit -> artist_graph = "ocaml_spotify_artist_graph_create"
+external artist_graph_release : artist_graph -> unit = "ocaml_spotify_artist_graph_release"
+external artist_graph_add : artist_graph -> artistbrowse -> unit = "ocaml_spotify_artist_graph_add"
+external artist_graph_num_nodes : artist_graph -> int = "ocaml_spotify_artist_graph_num_nodes"
+external artist_graph_num_edges : artist_graph -> int = "ocaml_spotify_artist_graph_num_edges"
+external artist_graph_mem : artist_graph -> string -> bool = "ocaml_spotify_artist_graph_mem"
+external artist_graph_is_expanded : artist_graph -> string -> bool = "ocaml_spotify_artist_graph_is_expanded"
+external artist_graph_name : artist_graph -> string -> string = "ocaml_spotify_artist_graph_name"
+external artist_graph_neighbours : artist_graph -> string -> string array = "ocaml_spotify_artist_graph_neighbours"
+external artist_graph_k_hop : artist_graph -> string -> int -> (string * int) array = "ocaml_spotify_artist_graph_k_hop"
+external artist_graph_save : artist_graph -> string -> unit = "ocaml_spotify_artist_graph_save"
+external artist_graph_load : string -> artist_graph = "ocaml_spotify_artist_graph_load"
+
+type artist_expansion = {
+  expansion_graph : artist_graph;
+  expansion_session : session;
+  expansion_depth : int;
+  expansion_concurrency : int;
+  expansion_interval : float;
+  expansion_queue : (string * int) Queue.t;
+  expansion_visited : (string, unit) Hashtbl.t;
+  mutable expansion_in_flight : int;
+  mutable expansion_next_request : float;
+  mutable expansion_errors : int;
+}
+
+(* Queue the neighbours of [id], found at depth [depth]. *)
+let expansion_visit expansion id depth =
+  if depth < expansion.expansion_depth && artist_graph_mem expansion.expansion_graph id then
+    Array.iter
+      (fun neighbour ->
+         if not (Hashtbl.mem expansion.expansion_visited neighbour) then begin
+           Hashtbl.add expansion.expansion_visited neighbour ();
+           Queue.push (neighbour, depth + 1) expansion.expansion_queue
+         end)
+      (artist_graph_neighbours expansion.expansion_graph id)
+
+let rec artist_expansion_pump expansion =
+  let continue = ref true in
+  while !continue && not (Queue.is_empty expansion.expansion_queue) do
+    let id, depth = Queue.peek expansion.expansion_queue in
+    if artist_graph_is_expanded expansion.expansion_graph id then begin
+      (* Already browsed, possibly before a restart. *)
+      ignore (Queue.pop expansion.expansion_queue);
+      expansion_visit expansion id depth
+    end else if expansion.expansion_in_flight >= expansion.expansion_concurrency then
+      continue := false
+    else begin
+      let now = Unix.gettimeofday () in
+      if now < expansion.expansion_next_request then
+        continue := false
+      else begin
+        ignore (Queue.pop expansion.expansion_queue);
+        let artist = artist_of_id id in
+        if artist_is_null artist then
+          expansion.expansion_errors <- expansion.expansion_errors + 1
+        else begin
+          expansion.expansion_in_flight <- expansion.expansion_in_flight + 1;
+          expansion.expansion_next_request <- now +. expansion.expansion_interval;
+          try
+            ignore
+              (artistbrowse_create expansion.expansion_session artist
+                 (fun browse ->
+                    expansion.expansion_in_flight <- expansion.expansion_in_flight - 1;
+                    if artistbrowse_error browse = ERROR_OK then begin
+                      artist_graph_add expansion.expansion_graph browse;
+                      expansion_visit expansion id depth
+                    end else
+                      expansion.expansion_errors <- expansion.expansion_errors + 1;
+                    artistbrowse_release browse;
+                    artist_release artist;
+                    artist_expansion_pump expansion))
+          with exn ->
+            (* The browse was not started: its callback will never run. *)
+            expansion.expansion_in_flight <- expansion.expansion_in_flight - 1;
+            artist_release artist;
+            raise exn
+        end
+      end
+    end
+  done
+
+let artist_graph_expand ?(depth=2) ?(concurrency=4) ?(rate=10.) graph session artist =
+  let id = artist_id artist in
+  let expansion = {
+    expansion_graph = graph;
+    expansion_session = session;
+    expansion_depth = depth;
+    expansion_concurrency = max 1 concurrency;
+    expansion_interval = if rate > 0. then 1. /. rate else 0.;
+    expansion_queue = Queue.create ();
+    expansion_visited = Hashtbl.create 1024;
+    expansion_in_flight = 0;
+    expansion_next_request = 0.;
+    expansion_errors = 0;
+  } in
+  Hashtbl.add expansion.expansion_visited id ();
+  Queue.push (id, 0) expansion.expansion_queue;
+  artist_expansion_pump expansion;
+  expansion
+
+let artist_expansion_is_done expansion =
+  expansion.expansion_in_flight = 0 && Queue.is_empty expansion.expansion_queue
+
+let artist_expansion_errors expansion = expansion.expansion_errors
+
+(* +-----------------------------------------------------------------+
+   | Radio batches                                                   |
+   +-----------------------------------------------------------------+ *)
+
+type radio_window = {
+  radio_from_year : int;
+  radio_to_year : int;
+  radio_genres : radio_genre list;
+  radio_weight : float;
+}
+
+type radio_candidate = {
+  candidate_track : track;
+  candidate_weight : float;
+  candidate_windows : int;
+}
+
+type radio_batch = {
+  batch_session : session;
+  batch_concurrency : int;
+  batch_queue : radio_window Queue.t;
+  batch_pool : (string, radio_candidate) Hashtbl.t;
+  batch_callback : radio_batch -> unit;
+  mutable batch_in_flight : int;
+  mutable batch_errors : int;
+}
+
+let radio_batch_is_done batch =
+  batch.batch_in_flight = 0 && Queue.is_empty batch.batch_queue
+
+(* Merge the tracks of a completed search in the pool. A track at
+   position [i] of [n] contributes [weight *. (1 - i / n)]. *)
+let radio_batch_merge batch window search =
+  let count = search_num_tracks search in
+  for i = 0 to count - 1 do
+    let track = search_track search i in
+    let id = track_id track in
+    let weight = window.radio_weight *. (1. -. float i /. float count) in
+    match try Some (Hashtbl.find batch.batch_pool id) with Not_found -> None with
+      | Some candidate ->
+          track_release track;
+          Hashtbl.replace batch.batch_pool id {
+            candidate with
+              candidate_weight = candidate.candidate_weight +. weight;
+              candidate_windows = candidate.candidate_windows + 1;
+          }
+      | None ->
+          Hashtbl.add batch.batch_pool id {
+            candidate_track = track;
+            candidate_weight = weight;
+            candidate_windows = 1;
+          }
+  done
+
+let rec radio_batch_pump batch =
+  while batch.batch_in_flight < batch.batch_concurrency && not (Queue.is_empty batch.batch_queue) do
+    let window = Queue.pop batch.batch_queue in
+    batch.batch_in_flight <- batch.batch_in_flight + 1;
+    try
+      ignore
+        (radio_search_create batch.batch_session
+           ~from_year:window.radio_from_year
+           ~to_year:window.radio_to_year
+           ~genres:window.radio_genres
+           ~callback:(fun search ->
+                        batch.batch_in_flight <- batch.batch_in_flight - 1;
+                        if search_error search = ERROR_OK then
+                          radio_batch_merge batch window search
+                        else
+                          batch.batch_errors <- batch.batch_errors + 1;
+                        search_release search;
+                        radio_batch_pump batch;
+                        if radio_batch_is_done batch then batch.batch_callback batch))
+    with exn ->
+      (* The search was not started: its callback will never run. *)
+      batch.batch_in_flight <- batch.batch_in_flight - 1;
+      raise exn
+  done
+
+let radio_batch_create ?(concurrency=4) ?(callback=ignore) session windows =
+  let batch = {
+    batch_session = session;
+    batch_concurrency = max 1 concurrency;
+    batch_queue = Queue.create ();
+    batch_pool = Hashtbl.create 1024;
+    batch_callback = callback;
+    batch_in_flight = 0;
+    batch_errors = 0;
+  } in
+  List.iter (fun window -> Queue.push window batch.batch_queue) windows;
+  radio_batch_pump batch;
+  if radio_batch_is_done batch then callback batch;
+  batch
+
+let radio_batch_errors batch = batch.batch_errors
+
+let radio_batch_candidates batch =
+  let candidates = Array.of_list (Hashtbl.fold (fun _ candidate acc -> candidate :: acc) batch.batch_pool []) in
+  Array.stable_sort (fun a b -> compare b.candidate_weight a.candidate_weight) candidates;
+  candidates
+
+(* +-----------------------------------------------------------------+
+   | Local import                                                    |
+   +-----------------------------------------------------------------+ *)
+
+type imported_track = {
+  imported_path : string;
+  imported_track : track;
+  imported_artist : string;
+  imported_title : string;
+  imported_album : string;
+  imported_duration : float;
+}
+
+type local_import = {
+  import_tracks : imported_track array;
+  import_errors : (string * string) array;
+  import_elapsed : float;
+  import_bytes : int;
+  import_files_per_second : float;
+}
+
+external local_import_stub : string -> int -> local_import = "ocaml_spotify_local_import"
+
+let local_import ?(jobs=4) root = local_import_stub root jobs
+
+let local_import_match ?(concurrency=4) session tracks ~callback =
+  let count = Array.length tracks in
+  let concurrency = max 1 concurrency in
+  let matches = Array.make count None in
+  let next = ref 0 and in_flight = ref 0 in
+  let rec pump () =
+    while !in_flight < concurrency && !next < count do
+      let index = !next in
+      let imported = tracks.(index) in
+      incr next;
+      incr in_flight;
+      try
+        ignore
+          (search_create session
+             ~query:(String.concat " " (List.filter ((<>) "") [imported.imported_artist; imported.imported_title]))
+             ~track_offset:0 ~track_count:1
+             ~album_offset:0 ~album_count:0
+             ~artist_offset:0 ~artist_count:0
+             ~callback:(fun search ->
+                          decr in_flight;
+                          if search_error search = ERROR_OK && search_num_tracks search > 0 then
+                            matches.(index) <- Some (search_track search 0);
+                          search_release search;
+                          pump ();
+                          if !in_flight = 0 && !next = count then callback matches))
+      with exn ->
+        (* The search was not started: its callback will never run. *)
+        decr in_flight;
+        raise exn
+    done
+  in
+  if count = 0 then callback matches else pump ()
+
+(* +-----------------------------------------------------------------+
+   | Export                                                          |
+   +-----------------------------------------------------------------+ *)
+
+type export_format =
+  | EXPORT_ARROW
+  | EXPORT_NDJSON
+
+external export_tracks_stub : export_format -> int -> string -> track array -> unit = "ocaml_spotify_export_tracks"
+external export_albums_stub : export_format -> int -> string -> album array -> unit = "ocaml_spotify_export_albums"
+external export_artists_stub : export_format -> int -> string -> artist array -> unit = "ocaml_spotify_export_artists"
+
+let export_tracks ?(format=EXPORT_ARROW) ?(chunk_size=65536) path tracks =
+  export_tracks_stub format chunk_size path tracks
+
+let export_albums ?(format=EXPORT_ARROW) ?(chunk_size=65536) path albums =
+  export_albums_stub format chunk_size path albums
+
+let export_artists ?(format=EXPORT_ARROW) ?(chunk_size=65536) path artists =
+  export_artists_stub format chunk_size path artists
+
+(* +-----------------------------------------------------------------+
+   | Shard rings                                                     |
+   +-----------------------------------------------------------------+ *)
+
+type shard_ring
+
+external shard_ring_create : int -> shard_ring = "ocaml_spotify_shard_ring_create"
+external shard_ring_send_stub : shard_ring -> string -> float -> bool = "ocaml_spotify_shard_ring_send"
+external shard_ring_send_bytes_stub : shard_ring -> bytes -> int -> int -> float -> bool = "ocaml_spotify_shard_ring_send_bytes"
+external shard_ring_receive_stub : shard_ring -> float -> string option = "ocaml_spotify_shard_ring_receive"
+external shard_ring_length : shard_ring -> int = "ocaml_spotify_shard_ring_length"
+external shard_ring_reset : shard_ring -> unit = "ocaml_spotify_shard_ring_reset"
+external shard_exit : int -> 'a = "ocaml_spotify_shard_exit"
+external shard_can_fork : unit -> bool = "ocaml_spotify_shard_can_fork"
+
+let check_can_fork func =
+  if not (shard_can_fork ()) then
+    failwith ("Spotify." ^ func ^ ": the process owns sessions, encoders or HTTP servers")
+
+let shard_ring_send ?(timeout = -1.) ring message = shard_ring_send_stub ring message timeout
+
+let shard_ring_send_bytes ?(timeout = -1.) ring buffer offset length = shard_ring_send_bytes_stub ring buffer offset length timeout
+
+let shard_ring_receive ?(timeout = -1.) ring = shard_ring_receive_stub ring timeout
+
+type shard = {
+  shard_index : int;
+  shard_inbox : shard_ring;
+  shard_outbox : shard_ring;
+  mutable shard_pid : int;
+  mutable shard_restarts : int;
+}
+
+type shard_fleet = {
+  fleet_shards : shard array;
+  fleet_main : shard -> unit;
+}
+
+let shard_spawn fleet shard =
+  flush stdout;
+  flush stderr;
+  match Unix.fork () with
+    | 0 ->
+        let code = try fleet.fleet_main shard; 0 with _ -> 2 in
+        (* Do not run the at_exit handlers of the parent. *)
+        shard_exit code
+    | pid ->
+        shard.shard_pid <- pid
+
+let shard_fleet_create ?(ring_size = 1 lsl 20) count main =
+  check_can_fork "shard_fleet_create";
+  let fleet = {
+    fleet_shards =
+      Array.init count
+        (fun index -> {
+           shard_index = index;
+           shard_inbox = shard_ring_create ring_size;
+           shard_outbox = shard_ring_create ring_size;
+           shard_pid = 0;
+           shard_restarts = 0;
+         });
+    fleet_main = main;
+  } in
+  Array.iter (shard_spawn fleet) fleet.fleet_shards;
+  fleet
+
+let shard_fleet_shards fleet = fleet.fleet_shards
+
+let shard_fleet_check fleet =
+  Array.fold_right
+    (fun shard restarted ->
+       let exited =
+         shard.shard_pid > 0 &&
+           (try fst (Unix.waitpid [Unix.WNOHANG] shard.shard_pid) <> 0 with Unix.Unix_error (Unix.ECHILD, _, _) -> false)
+       in
+       if exited then begin
+         check_can_fork "shard_fleet_check";
+         shard_ring_reset shard.shard_inbox;
+         shard_ring_reset shard.shard_outbox;
+         shard.shard_restarts <- shard.shard_restarts + 1;
+         shard_spawn fleet shard;
+         shard.shard_index :: restarted
+       end else
+         restarted)
+    fleet.fleet_shards []
+
+let shard_fleet_stop fleet =
+  Array.iter
+    (fun shard ->
+       if shard.shard_pid > 0 then begin
+         (try Unix.kill shard.shard_pid Sys.sigterm with Unix.Unix_error _ -> ());
+         (try ignore (Unix.waitpid [] shard.shard_pid) with Unix.Unix_error _ -> ());
+         shard.shard_pid <- 0
+       end)
+    fleet.fleet_shards
+
+(* +-----------------------------------------------------------------+
+   | Encoding                                                        |
+   +-----------------------------------------------------------------+ *)
+
+type encoder
+
+type encoder_format =
+  | ENCODER_FLAC
+  | ENCODER_VORBIS
+
+type encoder_output =
+  | ENCODER_OUTPUT_MEMORY
+  | ENCODER_OUTPUT_FILE of string
+
+external encoder_available : encoder_format -> bool = "ocaml_spotify_encoder_available" "noalloc"
+external encoder_create_raw : session -> encoder_format -> float -> int -> encoder_output -> encoder = "ocaml_spotify_encoder_create_byte" "ocaml_spotify_encoder_create"
+external encoder_bytes_written : encoder -> int64 = "ocaml_spotify_encoder_bytes_written"
+external encoder_frames_dropped : encoder -> int = "ocaml_spotify_encoder_frames_dropped"
+external encoder_contents : encoder -> string = "ocaml_spotify_encoder_contents"
+external encoder_finish : encoder -> unit = "ocaml_spotify_encoder_finish"
+external encoder_release : encoder -> unit = "ocaml_spotify_encoder_release"
+
+let encoder_create ?(quality = 0.5) ?(buffer_size = 1 lsl 20) session format output =
+  encoder_create_raw session format quality buffer_size output
+
+(* +-----------------------------------------------------------------+
+   | HTTP streaming                                                  |
+   +-----------------------------------------------------------------+ *)
+
+type http_server
+
+type http_server_stats = {
+  listeners : int;
+  accepted : int;
+  evicted : int;
+  bytes_sent : int64;
+  frames_dropped : int;
+}
+
+external http_server_create_raw : session -> string -> int -> int -> int -> int -> (encoder_format * float) option -> http_server = "ocaml_spotify_http_server_create_byte" "ocaml_spotify_http_server_create"
+external http_server_port : http_server -> int = "ocaml_spotify_http_server_port"
+external http_server_stats : http_server -> http_server_stats = "ocaml_spotify_http_server_stats"
+external http_server_release : http_server -> unit = "ocaml_spotify_http_server_release"
+
+let http_server_create ?(address = "127.0.0.1") ?(port = 0) ?(buffer_size = 4 lsl 20) ?(max_lag = 0) ?(max_listeners = 256) ?encoder session =
+  http_server_create_raw session address port buffer_size max_lag max_listeners encoder
+
+(* +-----------------------------------------------------------------+
+   | Recording                                                       |
+   +-----------------------------------------------------------------+ *)
+
+type recorded_callback =
+  | RECORD_LOGGED_IN of error
+  | RECORD_LOGGED_OUT
+  | RECORD_METADATA_UPDATED
+  | RECORD_CONNECTION_ERROR of error
+  | RECORD_MESSAGE_TO_USER of int
+  | RECORD_NOTIFY_MAIN_THREAD
+  | RECORD_MUSIC_DELIVERY of audio_format * int * int
+  | RECORD_PLAY_TOKEN_LOST
+  | RECORD_LOG_MESSAGE of int
+  | RECORD_END_OF_TRACK
+  | RECORD_STREAMING_ERROR of error
+  | RECORD_USERINFO_UPDATED
+  | RECORD_START_PLAYBACK
+  | RECORD_STOP_PLAYBACK
+  | RECORD_GET_AUDIO_BUFFER_STATS of audio_buffer_stats
+  | RECORD_OFFLINE_STATUS_UPDATED
+  | RECORD_SEARCH_COMPLETE of error * int * int * int
+  | RECORD_ALBUMBROWSE_COMPLETE of error * int
+  | RECORD_ARTISTBROWSE_COMPLETE of error * int
+  | RECORD_IMAGE_LOADED of error * int
+
+external record_start : string -> unit = "ocaml_spotify_record_start"
+external record_stop : unit -> unit = "ocaml_spotify_record_stop"
+
+let record_magic = "OSPR"
+let record_version = 1
+
+let errors = [|
+  ERROR_OK;
+  ERROR_BAD_API_VERSION;
+  ERROR_API_INITIALIZATION_FAILED;
+  ERROR_TRACK_NOT_PLAYABLE;
+  ERROR_BAD_APPLICATION_KEY;
+  ERROR_BAD_USERNAME_OR_PASSWORD;
+  ERROR_USER_BANNED;
+  ERROR_UNABLE_TO_CONTACT_SERVER;
+  ERROR_CLIENT_TOO_OLD;
+  ERROR_OTHER_PERMANENT;
+  ERROR_BAD_USER_AGENT;
+  ERROR_MISSING_CALLBACK;
+  ERROR_INVALID_INDATA;
+  ERROR_INDEX_OUT_OF_RANGE;
+  ERROR_USER_NEEDS_PREMIUM;
+  ERROR_OTHER_TRANSIENT;
+  ERROR_IS_LOADING;
+  ERROR_NO_STREAM_AVAILABLE;
+  ERROR_PERMISSION_DENIED;
+  ERROR_INBOX_IS_FULL;
+  ERROR_NO_CACHE;
+  ERROR_NO_SUCH_USER;
+  ERROR_NO_CREDENTIALS;
+|]
+
+let rec read_varint ic shift acc =
+  let byte = input_byte ic in
+  let acc = acc lor ((byte land 0x7f) lsl shift) in
+  if byte land 0x80 = 0 then acc else read_varint ic (shift + 7) acc
+
+let read_record ic tag =
+  let int () = read_varint ic 0 0 in
+  let error () =
+    let n = int () in
+    if n < Array.length errors then errors.(n) else ERROR_OTHER_PERMANENT
+  in
+  match tag with
+    | 0 -> RECORD_LOGGED_IN (error ())
+    | 1 -> RECORD_LOGGED_OUT
+    | 2 -> RECORD_METADATA_UPDATED
+    | 3 -> RECORD_CONNECTION_ERROR (error ())
+    | 4 -> RECORD_MESSAGE_TO_USER (int ())
+    | 5 -> RECORD_NOTIFY_MAIN_THREAD
+    | 6 ->
+        let _sample_type = int () in
+        let sample_rate = int () in
+        let channels = int () in
+        let offered = int () in
+        let consumed = int () in
+        RECORD_MUSIC_DELIVERY ({ sample_type = SAMPLETYPE_INT16_NATIVE_ENDIAN; sample_rate; channels }, offered, consumed)
+    | 7 -> RECORD_PLAY_TOKEN_LOST
+    | 8 -> RECORD_LOG_MESSAGE (int ())
+    | 9 -> RECORD_END_OF_TRACK
+    | 10 -> RECORD_STREAMING_ERROR (error ())
+    | 11 -> RECORD_USERINFO_UPDATED
+    | 12 -> RECORD_START_PLAYBACK
+    | 13 -> RECORD_STOP_PLAYBACK
+    | 14 ->
+        let samples = int () in
+        let stutter = int () in
+        RECORD_GET_AUDIO_BUFFER_STATS { samples; stutter }
+    | 15 -> RECORD_OFFLINE_STATUS_UPDATED
+    | 16 ->
+        let error = error () in
+        let tracks = int () in
+        let albums = int () in
+        let artists = int () in
+        RECORD_SEARCH_COMPLETE (error, tracks, albums, artists)
+    | 17 ->
+        let error = error () in
+        let tracks = int () in
+        RECORD_ALBUMBROWSE_COMPLETE (error, tracks)
+    | 18 ->
+        let error = error () in
+        let tracks = int () in
+        RECORD_ARTISTBROWSE_COMPLETE (error, tracks)
+    | 19 ->
+        let error = error () in
+        let size = int () in
+        RECORD_IMAGE_LOADED (error, size)
+    | _ ->
+        failwith (Printf.sprintf "Spotify.record_fold: unknown record type %d" tag)
+
+let record_fold path f acc =
+  let ic = open_in_bin path in
+  let rec loop acc time =
+    match (try Some (input_byte ic) with End_of_file -> None) with
+      | None ->
+          acc
+      | Some tag ->
+          (* A record truncated by a crash ends the file. *)
+          match
+            (try
+               let time = time +. float (read_varint ic 0 0) /. 1e6 in
+               Some (time, read_record ic tag)
+             with End_of_file ->
+               None)
+          with
+            | None -> acc
+            | Some (time, record) -> loop (f acc time record) time
+  in
+  try
+    String.iter (fun ch -> if input_char ic <> ch then failwith "Spotify.record_fold: not a callback record") record_magic;
+    if read_varint ic 0 0 <> record_version then failwith "Spotify.record_fold: unsupported version";
+    let acc = loop acc 0. in
+    close_in ic;
+    acc
+  with exn ->
+    close_in ic;
+    raise exn
+
+let record_replay ?(realtime = true) ?(on_record = fun _ _ -> ()) session (callbacks : session_callbacks) path =
+  let frames = ref (Bigarray.Array1.create Bigarray.char Bigarray.c_layout 0) in
+  let start = Unix.gettimeofday () in
+  record_fold path
+    (fun () time record ->
+       if realtime then begin
+         let delay = start +. time -. Unix.gettimeofday () in
+         if delay > 0. then Thread.delay delay
+       end;
+       on_record time record;
+       match record with
+         | RECORD_LOGGED_IN error -> callbacks#logged_in session error
+         | RECORD_LOGGED_OUT -> callbacks#logged_out session
+         | RECORD_METADATA_UPDATED -> callbacks#metadata_updated session
+         | RECORD_CONNECTION_ERROR error -> callbacks#connection_error session error
+         | RECORD_MESSAGE_TO_USER length -> callbacks#message_to_user session (String.make length ' ')
+         | RECORD_NOTIFY_MAIN_THREAD -> callbacks#notify_main_thread session
+         | RECORD_MUSIC_DELIVERY (format, count, _) ->
+             let size = count * format.channels * 2 in
+             if Bigarray.Array1.dim !frames < size then begin
+               frames := Bigarray.Array1.create Bigarray.char Bigarray.c_layout size;
+               Bigarray.Array1.fill !frames '\000'
+             end;
+             ignore (callbacks#music_delivery session format (Bigarray.Array1.sub !frames 0 size) count)
+         | RECORD_PLAY_TOKEN_LOST -> callbacks#play_token_lost session
+         | RECORD_LOG_MESSAGE length -> callbacks#log_message session (String.make length ' ')
+         | RECORD_END_OF_TRACK -> callbacks#end_of_track session
+         | RECORD_STREAMING_ERROR error -> callbacks#streaming_error session error
+         | RECORD_USERINFO_UPDATED -> callbacks#userinfo_updated session
+         | RECORD_START_PLAYBACK -> callbacks#start_playback session
+         | RECORD_STOP_PLAYBACK -> callbacks#stop_playback session
+         | RECORD_GET_AUDIO_BUFFER_STATS _ -> ignore (callbacks#get_audio_buffer_stats session)
+         | RECORD_OFFLINE_STATUS_UPDATED -> callbacks#offline_status_updated session
+         | RECORD_SEARCH_COMPLETE _
+         | RECORD_ALBUMBROWSE_COMPLETE _
+         | RECORD_ARTISTBROWSE_COMPLETE _
+         | RECORD_IMAGE_LOADED _ -> ())
+    ()
+
+(* +-----------------------------------------------------------------+
+   | Tracing                                                         |
+   +-----------------------------------------------------------------+ *)
+
+external trace_start_with_capacity : int -> unit = "ocaml_spotify_trace_start"
+external trace_stop : unit -> unit = "ocaml_spotify_trace_stop"
+external trace_dump : string -> unit = "ocaml_spotify_trace_dump"
+
+let trace_start ?(ring_size=65536) () = trace_start_with_capacity ring_size
@@ -9,6 +9,13 @@
 
 (** Spotify client library *)
 
+(** With OCaml 5, callbacks are always run in the first domain, so
+    {!session_create} and {!session_process_events} must be called
+    from it, as must functions on handles: they raise [Failure] when
+    called from another domain. libspotify is only called from the
+    first domain; {!tracks_metadata} may build its result in other
+    domains. *)
+
 (** {6 Spotify types} *)
 
 type session
@@ -555,6 +562,8 @@ val session_create : session_config -> session
       active sessions, and it's recommended to only call this once per
       process.
 
+      With OCaml 5 this must be called from the first domain.
+
       @param config The configuration to use for the session
       @return a new session.
 
@@ -568,6 +577,10 @@ val session_release : session -> unit
   (** Release the session. This will clean up all data and connections
       associated with the session.
 
+      The runtime is released while libspotify stops its threads, so
+      that callbacks they are running can complete. Such callbacks
+      must not call the bindings.
+
       @param session Session object returned from {!session_create}. *)
 
 val session_login : session -> username : string -> password : string -> remember_me : bool -> unit
@@ -645,6 +658,9 @@ val session_set_cache_size : session -> int -> unit
 val session_process_events : session -> float
   (** Make the specified session process any pending events.
 
+      Callbacks are dispatched from this function, so with OCaml 5 it
+      must be called from the first domain.
+
       @param session Your session object
       @return The time (in seconds) until you should call this
       function again. *)
@@ -668,6 +684,12 @@ val session_player_load : session -> track -> unit
 val session_player_seek : session -> float -> unit
   (** Seek to position in the currently loaded track.
 
+      If a replay window is set (see {!session_set_replay_window}) and
+      the position is still in the history, the seek is served
+      locally: the [music_delivery] callback is first called with no
+      frames, then receives the frames of the history until playback
+      catches up with libspotify.
+
       @param session Your session object
       @param offset Track position, in seconds.
   *)
@@ -687,6 +709,37 @@ val session_player_unload : session -> unit
 
       @param session Your session object *)
 
+(** Statistics of the replay buffer. *)
+type replay_stats = {
+  replay_window : float;
+  (** Configured history size, in seconds. *)
+  replay_available : float;
+  (** Duration currently held in the history, in seconds. *)
+  replay_hits : int;
+  (** Number of seeks served from the history. *)
+  replay_misses : int;
+  (** Number of backward seeks which went past the history. *)
+  replay_hit_rate : float;
+  (** [hits / (hits + misses)], 0 if there was no seek. *)
+}
+
+val session_set_replay_window : session -> float -> unit
+  (** Keep the last frames consumed by the [music_delivery] callback
+      so that backward seeks within them do not need to go through
+      libspotify. The history is cleared when a track is loaded or
+      unloaded and when seeking out of it. Replayed frames are not
+      passed to encoders and HTTP servers.
+
+      @param session Your session object
+      @param window Size of the history, in seconds. [0.] disables it
+      (the default). *)
+
+val session_replay_stats : session -> replay_stats
+  (** Return statistics about the replay buffer.
+
+      @param session Your session object
+      @return Stats *)
+
 val session_player_prefetch : session -> track -> unit
   (** Prefetch a track.
 
@@ -1101,6 +1154,31 @@ val track_is_autolinked : session -> track -> bool
       See {!track_is_loaded}
   *)
 
+val track_get_playable : session -> track -> track
+  (** Return the actual track that will be played if the given track
+      is played.
+
+      Results are cached per session, by id of the original track,
+      until the user info is updated or the country of the user
+      changes. Tracks which are not loaded are not cached.
+
+      @param session Session
+      @param track The track
+      @return A track, or a NULL track if it cannot be resolved *)
+
+val tracks_get_playable : session -> track array -> track array
+  (** [tracks_get_playable session tracks] resolves all tracks of
+      [tracks] as {!track_get_playable}, in a single call.
+
+      @raise NULL if one of the tracks has been released *)
+
+val playlist_get_playable : session -> playlist -> track array
+  (** [playlist_get_playable session playlist] resolves all tracks of
+      [playlist]. *)
+
+val session_clear_playable_cache : session -> unit
+  (** Drop the cache of {!track_get_playable}. *)
+
 val track_is_starred : session -> track -> bool
   (** Return true if the track is starred by the currently logged in user.
 
@@ -1122,7 +1200,8 @@ val track_set_starred : session -> track list -> bool -> unit
       @param star Starred status of the tracks
 
       Note: This will fail silently if playlists are disabled.
-      See {!set_playlists_enabled}
+      See {!set_playlists_enabled}. To star many tracks without
+      stalling the session, see {!tracks_set_starred}.
   *)
 
 val track_num_artists : track -> int
@@ -1163,7 +1242,8 @@ val track_name : track -> string
 
       @return The string representation of the specified track's name.
       If no metadata is available for the track yet, this function
-      returns empty string. *)
+      returns empty string. Equal names are returned as the same
+      string when possible, see {!album_name}. *)
 
 val track_duration : track -> float
   (** The duration, in seconds, of the specified track.
@@ -1217,6 +1297,68 @@ val track_release : track -> unit
   (** Destroy the reference to the track. Any subsequent operation on
       the track will raise {!NULL}. *)
 
+(** Metadata of a track, as returned by {!tracks_metadata}. Fields
+    of tracks which are not loaded are empty. Names are interned as
+    with {!track_name}. *)
+type track_metadata = {
+  metadata_is_loaded : bool;
+  metadata_name : string;
+  metadata_album : string;
+  (** Name of the album of the track. *)
+  metadata_artists : string list;
+  (** Names of the artists of the track. *)
+  metadata_duration : float;
+  (** Duration in seconds. *)
+  metadata_popularity : int;
+  metadata_disc : int;
+  metadata_index : int;
+}
+
+val tracks_metadata : ?jobs : int -> ?spawn : ((unit -> track_metadata array) -> unit -> track_metadata array) -> track array -> track_metadata array
+  (** [tracks_metadata ?jobs ?spawn tracks] returns the metadata of
+      all tracks of [tracks].
+
+      Tracks are split into [jobs] slices (defaults to [1]). [spawn f]
+      must start computing [f ()], and return a function waiting for
+      its result. With OCaml 5, [spawn] may run [f] in another domain:
+
+      {[
+        tracks_metadata ~jobs:4
+          ~spawn:(fun f -> let d = Domain.spawn f in fun () -> Domain.join d)
+          tracks
+      ]}
+
+      Metadata is copied out of libspotify in the calling domain,
+      which must be the first one; only the construction of the
+      result runs in [f]. The default [spawn] runs [f] immediately.
+
+      @raise NULL if one of the tracks has been released *)
+
+(** Flags of an array of tracks, as returned by {!tracks_flags}. Each
+    field is a bitset holding one bit per track: bit [i mod 8] of byte
+    [i / 8] is the flag of track [i]. *)
+type track_flags = {
+  flags_available : bytes;
+  (** See {!track_is_available}. *)
+  flags_local : bytes;
+  (** See {!track_is_local}. *)
+  flags_autolinked : bytes;
+  (** See {!track_is_autolinked}. *)
+  flags_starred : bytes;
+  (** See {!track_is_starred}. *)
+}
+
+val tracks_flags : session -> track array -> track_flags
+  (** [tracks_flags session tracks] returns the availability,
+      locality, autolinking and starred status of all tracks of
+      [tracks], computed in a single call.
+
+      @raise NULL if one of the tracks has been released *)
+
+val track_flag : bytes -> int -> bool
+  (** [track_flag bitset index] returns the flag of the track at
+      [index] in a bitset of {!track_flags}. *)
+
 (** {6 Album subsystem} *)
 
 (** Album types. *)
@@ -1274,6 +1416,12 @@ val album_name : album -> string
       @param album Album object
 
       @return Name of album.
+
+      Names of tracks, albums and artists are interned: the bindings
+      keep a weak table of the names they returned, and a name equal
+      to one which is still alive is returned without a copy. This
+      needs OCaml 4.12 or later, and only applies in the first domain
+      with OCaml 5.
   *)
 
 val album_year : album -> int
@@ -1303,7 +1451,8 @@ val artist_name : artist -> string
 
       @param artist Artist object
 
-      @return Name of artist.
+      @return Name of artist. Equal names are returned as the same
+      string when possible, see {!album_name}.
   *)
 
 val artist_is_loaded : artist -> bool
@@ -1314,7 +1463,7 @@ val artist_is_loaded : artist -> bool
       @return [true] if metadata is present, [false] if not.
   *)
 
-val artist_release : album -> unit
+val artist_release : artist -> unit
   (** Destroy the reference to the artist. Any subsequent operation on
       the artist will raise {!NULL}. *)
 
@@ -1421,7 +1570,7 @@ val albumbrowse_review : albumbrowse -> string
       @return Review string in UTF-8 format.
   *)
 
-val albumbrowse_release : album -> unit
+val albumbrowse_release : albumbrowse -> unit
   (** Destroy the reference to the albumbrowse. Any subsequent
       operation on the albumbrowse will raise {!NULL}. *)
 
@@ -1563,7 +1712,7 @@ val artistbrowse_biography : artistbrowse -> string
       @return Biography string in UTF-8 format.
   *)
 
-val artistbrowse_release : artist -> unit
+val artistbrowse_release : artistbrowse -> unit
   (** Destroy the reference to the artistbrowse. Any subsequent
       operation on the artistbrowse will raise {!NULL}. *)
 
@@ -1667,7 +1816,7 @@ val image_image_id : image -> string
       @return Image ID
   *)
 
-val image_release : artist -> unit
+val image_release : image -> unit
   (** Destroy the reference to the image. Any subsequent operation on
       the image will raise {!NULL}. *)
 
@@ -1852,3 +2001,1150 @@ val search_total_artists : search -> int
 val search_release : search -> unit
   (** Destroy the reference to the search. Any subsequent operation on
       the search will raise {!NULL}. *)
+
+(** {6 Playlist subsystem} *)
+
+val user_is_loaded : user -> bool
+  (** Get load status for the specified user. *)
+
+val user_canonical_name : user -> string
+  (** Get the canonical username of the user. *)
+
+val user_release : user -> unit
+  (** Destroy the reference to the user. Any subsequent operation on
+      the user will raise {!NULL}. *)
+
+val playlist_is_loaded : playlist -> bool
+  (** Get load status for the specified playlist. If it's [false],
+      you have to wait until the playlist is loaded. *)
+
+val playlist_name : playlist -> string
+  (** Return the name of the given playlist. *)
+
+val playlist_num_tracks : playlist -> int
+  (** Return the number of tracks in the given playlist. *)
+
+val playlist_track : playlist -> int -> track
+  (** [playlist_track playlist index] returns the track at the given
+      index. *)
+
+val playlist_set_offline_mode : session -> playlist -> bool -> unit
+  (** Mark a playlist to be synchronized for offline playback. The
+      playlist must be loaded.
+
+      @param session Session object
+      @param playlist Playlist object
+      @param offline [true] if the playlist should be offline, [false]
+      otherwise *)
+
+val playlist_get_offline_status : session -> playlist -> playlist_offline_status
+  (** Get offline status for a playlist.
+
+      @param session Session object
+      @param playlist Playlist object
+      @return The offline status of the playlist *)
+
+val playlist_get_offline_download_completed : session -> playlist -> int
+  (** Get download progress for an offline playlist.
+
+      @param session Session object
+      @param playlist Playlist object
+      @return Value from 0 to 100 that indicates amount of playlist
+      that is downloaded, or 0 if the playlist is not in the
+      {!PLAYLIST_OFFLINE_STATUS_DOWNLOADING} mode *)
+
+val playlist_release : playlist -> unit
+  (** Destroy the reference to the playlist. Any subsequent operation
+      on the playlist will raise {!NULL}. *)
+
+val playlistcontainer_is_loaded : playlistcontainer -> bool
+  (** Get load status for the specified container. *)
+
+val playlistcontainer_num_playlists : playlistcontainer -> int
+  (** Get the number of playlists in the given playlist container. *)
+
+val playlistcontainer_playlist : playlistcontainer -> int -> playlist
+  (** [playlistcontainer_playlist container index] returns the
+      playlist at the given index. *)
+
+val playlistcontainer_release : playlistcontainer -> unit
+  (** Destroy the reference to the container. Any subsequent
+      operation on the container will raise {!NULL}. *)
+
+(** {6 Startup} *)
+
+(** A startup brings a session up as fast as possible: it logs in
+    with remembered credentials and, as soon as it is logged in,
+    requests the user, the playlist container and the starred
+    playlist at once. When the container is loaded, its first
+    playlists are requested together. *)
+type startup
+
+(** Phases of a startup, in the order they usually complete. *)
+type startup_phase =
+  | STARTUP_LOGGED_IN
+  | STARTUP_USER_LOADED
+  | STARTUP_CONTAINER_LOADED
+  | STARTUP_STARRED_LOADED
+  | STARTUP_PLAYLISTS_LOADED
+      (** The prefetched playlists of the container are loaded. *)
+  | STARTUP_TRACKS_LOADED
+      (** The tracks of the starred and prefetched playlists are
+          loaded. *)
+
+val session_startup : ?credentials : string * string -> ?prefetch : int -> session -> startup
+  (** [session_startup ?credentials ?prefetch session] starts logging
+      in. Remembered credentials are used if there are some,
+      otherwise [credentials], a username and a password, are used
+      and remembered. The first [prefetch] playlists (defaults to
+      [10]) of the container are loaded.
+
+      The startup progresses while {!session_process_events} runs,
+      before the [logged_in] and [metadata_updated] callbacks are
+      called. A previous startup of the session is released.
+
+      @raise Error if there are no remembered credentials and
+      [credentials] is not given. *)
+
+val startup_is_done : startup -> bool
+  (** Whether all phases completed, or the login failed. *)
+
+val startup_error : startup -> error
+  (** The error of the login, {!ERROR_OK} if it succeeded or is still
+      in progress. *)
+
+val startup_timings : startup -> (startup_phase * float) list
+  (** The phases which completed, with their completion times in
+      seconds since {!session_startup}. When tracing is enabled,
+      phases also appear as events of the trace. *)
+
+val startup_playlistcontainer : startup -> playlistcontainer
+  (** The playlist container of the user, or a NULL container if the
+      startup is not logged in yet. *)
+
+val startup_starred : startup -> playlist
+  (** The starred playlist of the user, or a NULL playlist if the
+      startup is not logged in yet. *)
+
+val startup_playlists : startup -> playlist array
+  (** The prefetched playlists, empty until the container is
+      loaded. *)
+
+val startup_release : startup -> unit
+  (** Release the references the startup holds. Any subsequent
+      operation on it will raise {!NULL}. *)
+
+(** {6 Star jobs} *)
+
+(** A star job stars or unstars a large number of tracks in batches,
+    so that the session keeps processing events meanwhile. *)
+type star_job
+
+val tracks_set_starred : ?chunk_size : int -> session -> track array -> bool -> star_job
+  (** [tracks_set_starred ?chunk_size session tracks star] stars or
+      unstars [tracks], [chunk_size] tracks (defaults to [500]) at a
+      time. One batch is submitted by each call to
+      {!session_process_events}, which returns a timeout of [0] while
+      batches remain.
+
+      The job holds a reference on the tracks it has not submitted
+      yet. A job that is released or collected still runs to
+      completion.
+
+      @raise Invalid_argument if [chunk_size] is not positive. *)
+
+val star_job_progress : star_job -> int * int
+  (** [star_job_progress job] returns the number of tracks submitted
+      and the total number of tracks of the job. *)
+
+val star_job_is_done : star_job -> bool
+  (** Whether all tracks have been submitted, or the job was cancelled
+      or its session released. *)
+
+val star_job_cancel : star_job -> unit
+  (** Stop submitting batches and release the remaining tracks.
+      Batches already submitted are not undone. *)
+
+val star_job_release : star_job -> unit
+  (** Release the job handle. Any subsequent operation on it will
+      raise {!NULL}. *)
+
+(** {6 Offline sync} *)
+
+(** An offline plan chooses which playlists go offline, and reports
+    the progress of the synchronisation. *)
+type offline_plan
+
+(** Progress of the synchronisation since the previous event. *)
+type offline_progress = {
+  progress_bytes_per_second : float;
+  (** Download rate, smoothed over the last events. [0.] until two
+      events have been received. *)
+  progress_time_left : float;
+  (** Estimated time left, in seconds, or [infinity] if the rate is
+      not known yet. *)
+  progress_done_bytes : int64;
+  progress_done_tracks : int;
+  (** Bytes and tracks synchronised since the previous event. *)
+  progress_queued_bytes : int64;
+  progress_queued_tracks : int;
+  (** Bytes and tracks left to synchronise. *)
+  progress_syncing : bool;
+  progress_playlists : (playlist * playlist_offline_status * int) list;
+  (** Planned playlists whose status or download percentage changed,
+      with their new status and percentage. All of them are reported
+      by the first event. *)
+}
+
+val offline_plan : ?bitrate : bitrate -> session -> playlist array -> budget : int64 -> callback : (offline_progress -> unit) -> offline_plan
+  (** [offline_plan ?bitrate session playlists ~budget ~callback]
+      sets the preferred offline bitrate (defaults to
+      {!BITRATE_160k}) and marks [playlists] for offline use in
+      order, as long as their estimated size fits in [budget] bytes.
+      A playlist which does not fit is skipped and the next ones are
+      still considered. Playlists which are not loaded or not
+      selected are unmarked.
+
+      Sizes are estimated from the durations of the tracks and the
+      bitrate.
+
+      [callback] is called on each [offline_status_updated] event,
+      before the method of the session callbacks, for as long as the
+      plan is neither released nor collected. A new plan of the same
+      session replaces the previous one. *)
+
+val offline_plan_size : offline_plan -> int64
+  (** Estimated size of the playlists marked by the plan, in bytes. *)
+
+val offline_plan_playlists : offline_plan -> playlist array
+  (** The playlists marked by the plan, in priority order. *)
+
+val offline_plan_release : offline_plan -> unit
+  (** Stop reporting progress and release the playlists the plan
+      references. Playlists stay marked for offline use. Any
+      subsequent operation on the plan will raise {!NULL}. *)
+
+(** {6 Bitrate policy} *)
+
+(** A bitrate policy adjusts the preferred bitrate of a session and
+    suggests a prefetch depth from the audio buffer stats returned by
+    the [get_audio_buffer_stats] method of the session callbacks and
+    from streaming errors.
+
+    Observations are grouped in windows. A window with stutters,
+    streaming errors or a buffer fill below the low water mark steps
+    down to the next lower bitrate and prefetches one more track. A
+    window whose lowest fill is above the high water mark counts as
+    good, and several consecutive good windows step up. Fills between
+    the two marks keep the current settings.
+
+    The policy can be exercised with the mock libspotify by injecting
+    stalls with [MOCK_SPOTIFY_STALL_EVERY] and [MOCK_SPOTIFY_STALL_MS]
+    and streaming errors with [MOCK_SPOTIFY_FAULTS=stream]. *)
+type bitrate_policy
+
+(** Reason of a decision. *)
+type policy_reason =
+  | POLICY_STREAMING_ERROR
+  | POLICY_STUTTER
+  | POLICY_LOW_BUFFER
+  | POLICY_STABLE
+      (** The buffer stayed above the high water mark. *)
+
+type policy_decision = {
+  decision_time : float;
+  (** Time of the decision, in seconds since the creation of the
+      policy. *)
+  decision_bitrate : bitrate;
+  decision_prefetch : int;
+  decision_reason : policy_reason;
+}
+
+val bitrate_policy_create : ?bitrate : bitrate -> ?window : float -> ?low_water : float -> ?high_water : float -> ?upgrade_after : int -> ?max_prefetch : int -> session -> bitrate_policy
+  (** [bitrate_policy_create ?bitrate ?window ?low_water ?high_water
+      ?upgrade_after ?max_prefetch session] starts adjusting the
+      bitrate of [session], from [bitrate] (defaults to
+      {!BITRATE_160k}) and a prefetch depth of [1].
+
+      @param window Length of a window, in seconds (defaults to [5.])
+      @param low_water Buffer fill, in seconds, below which the policy
+      steps down (defaults to [0.5])
+      @param high_water Buffer fill, in seconds, above which a window
+      is good (defaults to [2.])
+      @param upgrade_after Number of consecutive good windows before
+      stepping up (defaults to [6])
+      @param max_prefetch Maximum prefetch depth (defaults to [4])
+
+      The bitrate is applied by {!session_process_events}. A new
+      policy of the same session replaces the previous one, and the
+      policy stops when it is released or collected.
+
+      @raise Invalid_argument if [window], [upgrade_after] or
+      [max_prefetch] is not positive, or [low_water] is above
+      [high_water]. *)
+
+val bitrate_policy_bitrate : bitrate_policy -> bitrate
+  (** The bitrate chosen by the policy. *)
+
+val bitrate_policy_prefetch_depth : bitrate_policy -> int
+  (** The number of upcoming tracks the application should prefetch
+      with {!session_player_prefetch}. *)
+
+val bitrate_policy_decisions : bitrate_policy -> policy_decision list
+  (** The last 64 decisions, oldest first. *)
+
+val bitrate_policy_release : bitrate_policy -> unit
+  (** Stop the policy. The preferred bitrate is left as is. Any
+      subsequent operation on the policy will raise {!NULL}. *)
+
+(** {6 Metadata store} *)
+
+val track_id : track -> string
+  (** Returns the 128-bit id of a track, as a 16 bytes string. It is
+      decoded from the link of the track; local tracks, which have no
+      such id, get a hash of their link instead.
+
+      @raise NULL if libspotify cannot make a link to the track *)
+
+val album_id : album -> string
+  (** Returns the 128-bit id of an album, see {!track_id}. *)
+
+val artist_id : artist -> string
+  (** Returns the 128-bit id of an artist, see {!track_id}. *)
+
+(** A persistent store of the metadata of tracks, albums and artists,
+    indexed by their ids. It is an append-only file mapped in memory,
+    so it can be queried at startup, before libspotify loaded
+    anything. *)
+type metadata_store
+
+type metadata_kind =
+  | METADATA_TRACK
+  | METADATA_ALBUM
+  | METADATA_ARTIST
+
+(** An entry of the store. *)
+type metadata_entry = {
+  entry_kind : metadata_kind;
+  entry_name : string;
+  entry_parent : string;
+  (** The id of the album of a track, of the artist of an album. It
+      is made of zeros for artists. *)
+  entry_duration : float;
+  (** Duration of tracks in seconds, [0.] for others. *)
+  entry_popularity : int;
+  (** Popularity of tracks, [0] for others. *)
+  entry_year : int;
+  (** Release year of albums, [0] for others. *)
+}
+
+val metadata_store_open : string -> metadata_store
+  (** [metadata_store_open path] opens the store at [path], creating
+      it if it does not exist. A record truncated by a crash at the
+      end of the file is dropped.
+
+      @raise Sys_error if the file cannot be opened
+      @raise Failure if the file is not a metadata store *)
+
+val metadata_store_close : metadata_store -> unit
+  (** Close the store, and detach it if it is attached. Any
+      subsequent operation on the store will raise {!NULL}. *)
+
+val metadata_store_find : metadata_store -> string -> metadata_entry option
+  (** [metadata_store_find store id] returns the latest entry stored
+      for [id], if any.
+
+      @raise Invalid_argument if [id] is not 16 bytes long *)
+
+val metadata_store_track : metadata_store -> track -> metadata_entry option
+  (** [metadata_store_track store track] is
+      [metadata_store_find store (track_id track)]. *)
+
+val metadata_store_album : metadata_store -> album -> metadata_entry option
+  (** [metadata_store_album store album] is
+      [metadata_store_find store (album_id album)]. *)
+
+val metadata_store_artist : metadata_store -> artist -> metadata_entry option
+  (** [metadata_store_artist store artist] is
+      [metadata_store_find store (artist_id artist)]. *)
+
+val metadata_store_count : metadata_store -> int
+  (** Returns the number of distinct ids in the store. *)
+
+val metadata_store_sync : metadata_store -> unit
+  (** Flush the store to disk. *)
+
+val metadata_store_attach : metadata_store -> unit
+  (** Attach the store: from now on, every track, album and artist
+      handle created by the bindings is recorded in it, as soon as it
+      is loaded. New handles are queued and recorded by the next
+      {!session_process_events} or [metadata_updated] callback.
+      Objects which are not loaded yet are referenced until a
+      [metadata_updated] callback finds them loaded. A record is
+      only appended if it differs from the latest one for the same id.
+
+      Only one store can be attached at a time; a previously attached
+      store is detached. *)
+
+val metadata_store_detach : unit -> unit
+  (** Detach the attached store, if any, dropping references on
+      objects which were not loaded yet. *)
+
+val metadata_store_compact : string -> string -> unit
+  (** [metadata_store_compact src dst] writes to [dst] the latest
+      record of every id of the store at [src], in the order of [src].
+      [src] must not be open, and must differ from [dst].
+
+      @raise Sys_error if a file cannot be opened or written
+      @raise Failure if [src] is not a metadata store *)
+
+(** {6 Shared cache} *)
+
+(** A cache of the metadata of tracks, albums and artists in a named
+    shared memory segment, which all the processes of a host can open
+    to share a single copy of the catalog metadata they use.
+
+    The cache is a fixed table of slots, each holding one entry with a
+    name of bounded size. Lookups never block: each slot is protected
+    by a sequence counter, and readers retry when they raced with a
+    writer. When the slots where an id can live are all used, adding
+    it evicts one which was not looked up since the last eviction
+    attempt on these slots (second chance). *)
+type shared_cache
+
+(** Statistics of a shared cache. *)
+type shared_cache_stats = {
+  shared_slots : int;
+  shared_name_size : int;
+  (** Maximum length of names, in bytes. *)
+  shared_count : int;
+  (** Number of used slots. *)
+  shared_evictions : int;
+  (** Entries evicted since the creation of the segment. *)
+  shared_hits : int;
+  shared_misses : int;
+  (** Lookups by this process since it opened the cache. *)
+}
+
+val shared_cache_open : ?slots : int -> ?name_size : int -> string -> shared_cache
+  (** [shared_cache_open ?slots ?name_size name] opens the shared
+      memory segment [name] (see [shm_open(3)]), creating it if it
+      does not exist. A new segment has [slots] slots (defaults to
+      [65536], rounded up to a power of two) holding names of at most
+      [name_size] bytes (defaults to [80], at most [4096]); it uses
+      about [slots * (name_size + 48)] bytes. These arguments are
+      ignored when the segment already exists.
+
+      @raise Invalid_argument if [slots] is above [2^30], or the
+      segment would be larger than 16GB
+      @raise Sys_error if the segment cannot be opened or created
+      @raise Failure if the segment is not a shared cache *)
+
+val shared_cache_close : shared_cache -> unit
+  (** Unmap the cache. Any subsequent operation on it will raise
+      {!NULL}. The segment remains until it is unlinked. *)
+
+val shared_cache_unlink : string -> unit
+  (** [shared_cache_unlink name] removes the segment [name]; processes
+      which opened it keep their mapping. It does nothing if the
+      segment does not exist. *)
+
+val shared_cache_find : shared_cache -> string -> metadata_entry option
+  (** [shared_cache_find cache id] returns the entry of [id], if it is
+      in the cache.
+
+      @raise Invalid_argument if [id] is not 16 bytes long *)
+
+val shared_cache_track : shared_cache -> track -> metadata_entry option
+  (** [shared_cache_track cache track] is
+      [shared_cache_find cache (track_id track)]. *)
+
+val shared_cache_album : shared_cache -> album -> metadata_entry option
+val shared_cache_artist : shared_cache -> artist -> metadata_entry option
+
+val shared_cache_add_track : shared_cache -> track -> bool
+  (** [shared_cache_add_track cache track] stores the metadata of
+      [track], replacing the previous entry for the same id. Returns
+      [false] if the track is not loaded or its name does not fit in
+      a slot. *)
+
+val shared_cache_add_album : shared_cache -> album -> bool
+val shared_cache_add_artist : shared_cache -> artist -> bool
+
+val shared_cache_stats : shared_cache -> shared_cache_stats
+
+(** {6 Local index} *)
+
+(** An in-memory inverted index over the names of tracks, albums and
+    artists, answering queries without a round trip to the
+    server. Words of names are indexed by their trigrams and first
+    characters; a query matches a name when each of its words is a
+    prefix of a word of the name, ignoring ASCII case and
+    punctuation. The index holds a reference on every object it
+    contains. *)
+type local_index
+
+(** Results of a local search, by decreasing popularity. Albums and
+    artists are ranked by the highest popularity of their indexed
+    tracks. *)
+type local_result = {
+  local_tracks : track array;
+  local_albums : album array;
+  local_artists : artist array;
+}
+
+type instant_result =
+  | INSTANT_LOCAL of local_result
+      (** The query matched objects of the index. *)
+  | INSTANT_REMOTE of search
+      (** Nothing matched locally and a search was started. *)
+
+val local_index_create : unit -> local_index
+  (** Create an empty index. *)
+
+val local_index_release : local_index -> unit
+  (** Release the index and the references it holds. Any subsequent
+      operation on it will raise {!NULL}. *)
+
+val local_index_add_track : local_index -> track -> unit
+  (** Add a track to the index. A track which is not loaded yet is
+      indexed by {!local_index_update} once it is. *)
+
+val local_index_add_album : local_index -> album -> unit
+  (** Add an album to the index, see {!local_index_add_track}. *)
+
+val local_index_add_artist : local_index -> artist -> unit
+  (** Add an artist to the index, see {!local_index_add_track}. *)
+
+val local_index_update : local_index -> unit
+  (** Index the objects of the index which have been loaded since
+      they were added. *)
+
+val local_index_attach : ?max_objects : int -> local_index -> unit
+  (** Attach the index: from now on, every track, album and artist
+      handle created by the bindings is added to it by the next
+      {!session_process_events}, and the index is updated before every
+      [metadata_updated] callback. Only one index can be attached at a
+      time.
+
+      The index holds a reference on each of these objects until it is
+      released, so it grows with every object the application sees.
+      Objects are no longer added once the index holds [max_objects]
+      of them (unbounded by default); objects added explicitly are not
+      counted against the limit. *)
+
+val local_index_detach : unit -> unit
+  (** Detach the attached index, if any. *)
+
+val local_index_size : local_index -> int
+  (** Returns the number of indexed objects. *)
+
+val local_search : local_index -> query : string -> count : int -> local_result
+  (** [local_search index ~query ~count] returns the [count] most
+      popular tracks, albums and artists of [index] matching
+      [query]. *)
+
+val instant_search : local_index -> session -> query : string -> count : int -> callback : (search -> unit) -> instant_result
+  (** [instant_search index session ~query ~count ~callback] searches
+      [query] in [index], and falls back to {!search_create}, with
+      [count] results of each kind, if nothing matches. *)
+
+(** {6 Fuzzy matching} *)
+
+(** Typo-tolerant matching of queries against the names of a local
+    index. The distance between a query and a name is the smallest
+    number of insertions, deletions and substitutions turning the
+    query into a substring of the name, ignoring ASCII case and
+    punctuation. Only the first 64 bytes of queries are used. *)
+module Fuzzy : sig
+  (** Matches with their distances, by increasing distance then
+      decreasing popularity. *)
+  type result = {
+    tracks : (track * int) array;
+    albums : (album * int) array;
+    artists : (artist * int) array;
+  }
+
+  val search : ?max_errors : int -> ?jobs : int -> local_index -> query : string -> count : int -> result
+    (** [search ?max_errors ?jobs index ~query ~count] returns the
+        best [count] tracks, albums and artists of [index] whose
+        distance to [query] is at most [max_errors] (defaults to
+        [2]).
+
+        Names are matched by [jobs] threads (defaults to [1]), each
+        taking chunks of the index until none remain; other OCaml
+        threads are blocked meanwhile.
+
+        @raise NULL if the index has been released *)
+
+  val distance : string -> string -> int
+    (** [distance query name] returns the distance between [query]
+        and [name]. *)
+end
+
+(** {6 Artist graph} *)
+
+(** A graph of similar artists, built from artist browsing results
+    and keyed by artist ids (see {!artist_id}). Adjacency lists are
+    stored in compressed sparse row layout. *)
+type artist_graph
+
+val artist_of_id : string -> artist
+  (** [artist_of_id id] returns the artist whose id is [id], or a
+      NULL artist if there is none.
+
+      @raise Invalid_argument if [id] is not 16 bytes long *)
+
+val artist_graph_create : unit -> artist_graph
+  (** Create an empty graph. *)
+
+val artist_graph_release : artist_graph -> unit
+  (** Release the graph. Any subsequent operation on it will raise
+      {!NULL}. *)
+
+val artist_graph_add : artist_graph -> artistbrowse -> unit
+  (** [artist_graph_add graph browse] adds the artist of [browse] to
+      [graph], marks it as expanded and replaces its neighbours by its
+      similar artists.
+
+      @raise NULL if the artist of [browse] cannot be identified *)
+
+val artist_graph_num_nodes : artist_graph -> int
+  (** Returns the number of artists of the graph. *)
+
+val artist_graph_num_edges : artist_graph -> int
+  (** Returns the number of edges of the graph. *)
+
+val artist_graph_mem : artist_graph -> string -> bool
+  (** [artist_graph_mem graph id] returns whether the artist [id] is
+      in the graph. *)
+
+val artist_graph_is_expanded : artist_graph -> string -> bool
+  (** [artist_graph_is_expanded graph id] returns whether the similar
+      artists of [id] have been added to the graph. *)
+
+val artist_graph_name : artist_graph -> string -> string
+  (** [artist_graph_name graph id] returns the name of the artist
+      [id], as it was when it was added.
+
+      @raise Not_found if [id] is not in the graph *)
+
+val artist_graph_neighbours : artist_graph -> string -> string array
+  (** [artist_graph_neighbours graph id] returns the ids of the
+      similar artists of [id].
+
+      @raise Not_found if [id] is not in the graph *)
+
+val artist_graph_k_hop : artist_graph -> string -> int -> (string * int) array
+  (** [artist_graph_k_hop graph id k] returns the artists at most [k]
+      edges away from [id], excluding [id], with their distances, by
+      increasing distance.
+
+      @raise Not_found if [id] is not in the graph *)
+
+val artist_graph_save : artist_graph -> string -> unit
+  (** [artist_graph_save graph path] writes [graph] to [path]. The
+      file is replaced atomically.
+
+      @raise Sys_error if the file cannot be written *)
+
+val artist_graph_load : string -> artist_graph
+  (** [artist_graph_load path] reads a graph written by
+      {!artist_graph_save}.
+
+      @raise Sys_error if the file cannot be read
+      @raise Failure if the file is not a valid graph *)
+
+(** A breadth-first expansion of a graph, browsing artists. *)
+type artist_expansion
+
+val artist_graph_expand : ?depth : int -> ?concurrency : int -> ?rate : float -> artist_graph -> session -> artist -> artist_expansion
+  (** [artist_graph_expand ?depth ?concurrency ?rate graph session
+      artist] adds to [graph] the artists at most [depth] (defaults to
+      [2]) edges away from [artist], browsing those which are not
+      expanded in [graph] yet.
+
+      At most [concurrency] (defaults to [4]) browse requests are in
+      flight at once, and at most [rate] (defaults to [10.]) are
+      started per second. The expansion progresses when requests
+      complete, during {!session_process_events}; when the rate limit
+      delays requests, {!artist_expansion_pump} must also be called
+      periodically. *)
+
+val artist_expansion_pump : artist_expansion -> unit
+  (** Start the requests allowed by the concurrency and rate limits. *)
+
+val artist_expansion_is_done : artist_expansion -> bool
+  (** Whether the expansion is finished. *)
+
+val artist_expansion_errors : artist_expansion -> int
+  (** Returns the number of browse requests which failed. *)
+
+(** {6 Radio batches} *)
+
+(** A radio batch runs radio searches over a grid of year ranges and
+    genres, and merges their tracks in a single pool of candidates. *)
+type radio_batch
+
+(** A cell of the grid. *)
+type radio_window = {
+  radio_from_year : int;
+  radio_to_year : int;
+  radio_genres : radio_genre list;
+  radio_weight : float;
+  (** Weight of the tracks found by this search. *)
+}
+
+(** A track found by one or more searches of a batch. *)
+type radio_candidate = {
+  candidate_track : track;
+  candidate_weight : float;
+  (** Sum over the searches which found the track of the weight of the
+      window, decreasing linearly with the position of the track in
+      the results. *)
+  candidate_windows : int;
+  (** Number of searches which found the track. *)
+}
+
+val radio_batch_create : ?concurrency : int -> ?callback : (radio_batch -> unit) -> session -> radio_window list -> radio_batch
+  (** [radio_batch_create ?concurrency ?callback session windows]
+      starts a radio search for each window, with at most
+      [concurrency] (defaults to [4]) searches in flight at once.
+      Tracks are deduplicated by {!track_id}. The batch progresses
+      during {!session_process_events}, and [callback] is called once
+      all searches completed. *)
+
+val radio_batch_is_done : radio_batch -> bool
+  (** Whether all searches of the batch completed. *)
+
+val radio_batch_errors : radio_batch -> int
+  (** Returns the number of searches which failed. *)
+
+val radio_batch_candidates : radio_batch -> radio_candidate array
+  (** The candidates found so far, by decreasing weight. The tracks
+      are owned by the batch and must not be released. *)
+
+(** {6 Local import} *)
+
+(** A file imported as a local track. *)
+type imported_track = {
+  imported_path : string;
+  imported_track : track;
+  (** The local track, see {!localtrack_create}. *)
+  imported_artist : string;
+  imported_title : string;
+  (** The title from the tags, or the name of the file without its
+      extension. *)
+  imported_album : string;
+  imported_duration : float;
+  (** Duration in seconds, or [-1.] if unknown. *)
+}
+
+(** Result of {!local_import}. *)
+type local_import = {
+  import_tracks : imported_track array;
+  (** Imported files, sorted by path. *)
+  import_errors : (string * string) array;
+  (** Files and directories which could not be read, with the
+      error. *)
+  import_elapsed : float;
+  (** Time spent listing and reading files, in seconds. *)
+  import_bytes : int;
+  (** Total size of the audio files. *)
+  import_files_per_second : float;
+}
+
+val local_import : ?jobs : int -> string -> local_import
+  (** [local_import ?jobs root] creates a local track for each MP3,
+      FLAC, Ogg Vorbis and Opus file under the directory [root].
+      Symbolic links are followed, except those leading back to a
+      directory they are in.
+
+      Tags (ID3v1 and ID3v2 in MP3 files, Vorbis comments otherwise)
+      are read by [jobs] threads (defaults to [4]) without holding
+      the runtime, and durations are taken from the stream headers. *)
+
+val local_import_match : ?concurrency : int -> session -> imported_track array -> callback : (track option array -> unit) -> unit
+  (** [local_import_match ?concurrency session tracks ~callback]
+      searches the catalog for the artist and title of each imported
+      track, with at most [concurrency] (defaults to [4]) searches in
+      flight at once. [callback] receives the best match of each
+      track, in the same order, once all searches completed. *)
+
+(** {6 Export} *)
+
+(** Formats of exported files. *)
+type export_format =
+  | EXPORT_ARROW
+      (** An Arrow IPC file. Strings are dictionary-encoded, numbers
+          are 32-bit integers and ids are 16 bytes binary values. *)
+  | EXPORT_NDJSON
+      (** One JSON object per line, with ids in hexadecimal. *)
+
+val export_tracks : ?format : export_format -> ?chunk_size : int -> string -> track array -> unit
+  (** [export_tracks ?format ?chunk_size path tracks] writes the
+      metadata of [tracks] to [path], in [format] (defaults to
+      {!EXPORT_ARROW}). Columns are [id], [name], [album], [artists]
+      (joined with commas), [duration_ms], [popularity], [disc] and
+      [index]. Arrow files are written in record batches of
+      [chunk_size] rows (defaults to [65536]).
+
+      Metadata is read from libspotify first, then the file is written
+      with the runtime released.
+
+      @raise NULL if one of the tracks has been released
+      @raise Sys_error if the file cannot be written *)
+
+val export_albums : ?format : export_format -> ?chunk_size : int -> string -> album array -> unit
+  (** Same as {!export_tracks}, for albums. Columns are [id], [name],
+      [artist], [year] and [type]. *)
+
+val export_artists : ?format : export_format -> ?chunk_size : int -> string -> artist array -> unit
+  (** Same as {!export_tracks}, for artists. Columns are [id] and
+      [name]. *)
+
+(** {6 Shard rings} *)
+
+(** Hosting sessions in several processes, so that they do not share
+    a runtime lock. The parent creates a fleet of workers with
+    {!shard_fleet_create} before creating any session, and exchanges
+    messages with each of them through a pair of rings in shared
+    memory. Workers create their own sessions; the encoding of the
+    messages is up to the application.
+
+    Workers are forked, and only the forking thread survives in them:
+    the threads of libspotify, encoders and HTTP servers, and the
+    locks they hold, would be lost. The parent must therefore not own
+    any of them when creating the fleet or restarting a worker. *)
+
+type shard_ring
+  (** A single-producer single-consumer queue of messages in shared
+      memory. Rings created before a fork are shared with the child
+      process. *)
+
+val shard_ring_create : int -> shard_ring
+  (** [shard_ring_create size] creates a ring holding at least [size]
+      bytes of messages. The size is rounded up to a power of two. *)
+
+val shard_ring_send : ?timeout : float -> shard_ring -> string -> bool
+  (** [shard_ring_send ?timeout ring message] appends [message] to
+      [ring], waiting for space with the runtime released for at most
+      [timeout] seconds (forever if negative, the default). Returns
+      [false] if the ring is still full.
+
+      Only one process and one thread may send to a given ring.
+
+      @raise Invalid_argument if the message does not fit in the
+      ring *)
+
+val shard_ring_send_bytes : ?timeout : float -> shard_ring -> bytes -> int -> int -> bool
+  (** [shard_ring_send_bytes ?timeout ring buffer offset length] is
+      the same as {!shard_ring_send} for [length] bytes of [buffer]
+      from [offset], for example PCM data. *)
+
+val shard_ring_receive : ?timeout : float -> shard_ring -> string option
+  (** [shard_ring_receive ?timeout ring] removes the oldest message of
+      [ring], waiting for one with the runtime released for at most
+      [timeout] seconds (forever if negative, the default).
+
+      Only one process and one thread may receive from a given
+      ring. *)
+
+val shard_ring_length : shard_ring -> int
+  (** Number of bytes used by pending messages, including headers. *)
+
+val shard_ring_reset : shard_ring -> unit
+  (** Drops all pending messages. Only call it when neither side is
+      using the ring, for example after its worker died. *)
+
+(** A worker process. *)
+type shard = {
+  shard_index : int;
+  shard_inbox : shard_ring;
+  (** Messages from the parent to the worker. *)
+  shard_outbox : shard_ring;
+  (** Messages from the worker to the parent. *)
+  mutable shard_pid : int;
+  mutable shard_restarts : int;
+  (** Number of times the worker has been restarted. *)
+}
+
+type shard_fleet
+
+val shard_fleet_create : ?ring_size : int -> int -> (shard -> unit) -> shard_fleet
+  (** [shard_fleet_create ?ring_size count main] forks [count] worker
+      processes, each running [main] with its shard then exiting. The
+      rings of each shard hold [ring_size] bytes (defaults to 1MB).
+
+      Workers exit without running the [at_exit] functions of the
+      parent. Exceptions escaping [main] make the worker exit with
+      code [2].
+
+      @raise Failure if the process has a session, encoder or HTTP
+      server which is not released yet *)
+
+val shard_fleet_shards : shard_fleet -> shard array
+
+val shard_fleet_check : shard_fleet -> int list
+  (** [shard_fleet_check fleet] restarts the workers which exited,
+      with empty rings, and returns their indices. It does not block
+      and is meant to be called periodically, or on [SIGCHLD].
+
+      @raise Failure if a worker has to be restarted while the process
+      has a session, encoder or HTTP server which is not released
+      yet *)
+
+val shard_fleet_stop : shard_fleet -> unit
+  (** [shard_fleet_stop fleet] terminates all workers and waits for
+      them. *)
+
+(** {6 Encoding} *)
+
+(** An encoder consumes the PCM data delivered to a session and
+    compresses it on a dedicated native thread.
+
+    The frames consumed by the [music_delivery] callback are
+    copied into the encoder ring buffer from the delivery thread,
+    without taking the OCaml runtime lock. Encoding never runs on the
+    delivery thread nor under the runtime lock. If the ring is full,
+    or if the audio format changes, frames are dropped. *)
+
+type encoder
+  (** A handle to an encoder. *)
+
+(** Available encodings. *)
+type encoder_format =
+  | ENCODER_FLAC
+      (** FLAC, using libFLAC. *)
+  | ENCODER_VORBIS
+      (** Ogg/Vorbis, using libvorbis. *)
+
+(** Where the encoded data goes. *)
+type encoder_output =
+  | ENCODER_OUTPUT_MEMORY
+      (** Keep the encoded data in memory, see {!encoder_contents}. *)
+  | ENCODER_OUTPUT_FILE of string
+      (** Write the encoded data to the given file. *)
+
+val encoder_available : encoder_format -> bool
+  (** Return whether the given format was found when ocaml-spotify
+      was built. *)
+
+val encoder_create : ?quality : float -> ?buffer_size : int -> session -> encoder_format -> encoder_output -> encoder
+  (** Create an encoder fed by the music delivered to the given
+      session.
+
+      @param quality Encoding quality, between [0.] and [1.]. For FLAC
+      it is mapped to the compression level. Defaults to [0.5].
+      @param buffer_size Size in bytes of the ring buffer between the
+      delivery thread and the encoder thread. Defaults to 1MB.
+      @param session Session
+      @param format The encoding to use. It must be available.
+      @param output Where to write the encoded data.
+
+      @return A new encoder.
+  *)
+
+val encoder_bytes_written : encoder -> int64
+  (** Return the number of encoded bytes output so far. *)
+
+val encoder_frames_dropped : encoder -> int
+  (** Return the number of delivered frames that were not encoded. *)
+
+val encoder_contents : encoder -> string
+  (** Return the encoded data produced so far by an encoder writing
+      to memory. *)
+
+val encoder_finish : encoder -> unit
+  (** Stop feeding the encoder, encode all pending data and close the
+      output. Raises [Failure] if encoding failed at some point. *)
+
+val encoder_release : encoder -> unit
+  (** Finish and destroy the encoder, waiting for pending data to be
+      encoded and the output to be closed. Any subsequent operation on
+      the encoder will raise {!NULL}.
+
+      This is the way to stop an encoder: one which is garbage
+      collected stops being fed at once, but its output is only
+      completed later, on a background thread, and errors are lost. *)
+
+(** {6 HTTP streaming} *)
+
+(** An embedded HTTP/1.1 server streaming the audio delivered to a
+    session to any number of listeners, using chunked transfer
+    encoding.
+
+    The server runs on its own native thread using epoll. Delivered
+    frames are staged without waiting for the server thread, then
+    written once to a ring buffer shared by all the listeners and sent
+    to each of them directly from there. A listener that lags behind
+    more than a given amount is evicted.
+
+    The following paths are served:
+    - [/] and [/pcm]: raw 16 bits native endian PCM. The format is
+      given in the [X-Audio-Rate] and [X-Audio-Channels] response
+      headers.
+    - [/wav]: the same stream with a WAV header.
+    - [/flac] or [/ogg]: the encoded stream, if the server was
+      created with an encoder.
+
+    Listeners connecting before any audio has been delivered wait for
+    the stream to start. *)
+
+type http_server
+  (** A handle to an HTTP server. *)
+
+(** Server statistics. *)
+type http_server_stats = {
+  listeners : int;
+  (** Number of listeners currently streaming or waiting for the
+      stream to start. *)
+
+  accepted : int;
+  (** Number of connections accepted so far. *)
+
+  evicted : int;
+  (** Number of listeners evicted because they were too slow. *)
+
+  bytes_sent : int64;
+  (** Number of bytes sent so far. *)
+
+  frames_dropped : int;
+  (** Number of delivered frames dropped because the server thread
+      did not keep up. *)
+}
+
+val http_server_create : ?address : string -> ?port : int -> ?buffer_size : int -> ?max_lag : int -> ?max_listeners : int -> ?encoder : encoder_format * float -> session -> http_server
+  (** Start a server streaming the audio of the given session.
+
+      @param address IPv4 address to listen on. Defaults to
+      ["127.0.0.1"].
+      @param port Port to listen on. Defaults to [0], meaning any free
+      port, see {!http_server_port}.
+      @param buffer_size Size in bytes of the shared ring buffer.
+      Defaults to 4MB. Frames are staged in two more buffers of half
+      this size.
+      @param max_lag Number of bytes a listener may lag behind the
+      stream before being evicted. Defaults to half the buffer.
+      @param max_listeners Maximum number of simultaneous listeners,
+      including those waiting for the stream to start. Defaults to
+      [256].
+      @param encoder Format and quality of the encoded stream, see
+      {!encoder_create}. By default only PCM and WAV are served.
+      @param session Session
+
+      @return A running server.
+  *)
+
+val http_server_port : http_server -> int
+  (** Return the port the server listens on. *)
+
+val http_server_stats : http_server -> http_server_stats
+  (** Return statistics about the server. *)
+
+val http_server_release : http_server -> unit
+  (** Stop the server, disconnecting all listeners, and close its
+      socket. Any subsequent operation on the server will raise
+      {!NULL}.
+
+      A server which is garbage collected is stopped on a background
+      thread, so its port may remain bound for a while. *)
+
+(** {6 Recording} *)
+
+(** A callback recorded by {!record_start}. Only sizes of payloads
+    are recorded. *)
+type recorded_callback =
+  | RECORD_LOGGED_IN of error
+  | RECORD_LOGGED_OUT
+  | RECORD_METADATA_UPDATED
+  | RECORD_CONNECTION_ERROR of error
+  | RECORD_MESSAGE_TO_USER of int
+      (** Length of the message. *)
+  | RECORD_NOTIFY_MAIN_THREAD
+  | RECORD_MUSIC_DELIVERY of audio_format * int * int
+      (** Format, number of frames delivered by libspotify, and
+          number of frames consumed. *)
+  | RECORD_PLAY_TOKEN_LOST
+  | RECORD_LOG_MESSAGE of int
+      (** Length of the message. *)
+  | RECORD_END_OF_TRACK
+  | RECORD_STREAMING_ERROR of error
+  | RECORD_USERINFO_UPDATED
+  | RECORD_START_PLAYBACK
+  | RECORD_STOP_PLAYBACK
+  | RECORD_GET_AUDIO_BUFFER_STATS of audio_buffer_stats
+      (** Stats returned by the application. *)
+  | RECORD_OFFLINE_STATUS_UPDATED
+  | RECORD_SEARCH_COMPLETE of error * int * int * int
+      (** Error and number of tracks, albums and artists. *)
+  | RECORD_ALBUMBROWSE_COMPLETE of error * int
+      (** Error and number of tracks. *)
+  | RECORD_ARTISTBROWSE_COMPLETE of error * int
+      (** Error and number of tracks. *)
+  | RECORD_IMAGE_LOADED of error * int
+      (** Error and size of the image data. *)
+
+val record_start : string -> unit
+  (** Start recording every callback made by libspotify, with its
+      time and payload size, to the given file. If a recording is in
+      progress, it is stopped first, ignoring its errors.
+
+      libspotify supports only one session per process, so callbacks
+      of all sessions are recorded.
+
+      @param path File to write to, truncated if it exists.
+
+      @raise Sys_error if the file cannot be opened or written. *)
+
+val record_stop : unit -> unit
+  (** Stop recording and close the file. Does nothing if no recording
+      is in progress.
+
+      @raise Sys_error if a record could not be written, or the file
+      could not be closed. The recording is stopped anyway. *)
+
+val record_fold : string -> ('a -> float -> recorded_callback -> 'a) -> 'a -> 'a
+  (** [record_fold path f acc] folds [f] over the callbacks recorded
+      in [path]. The float is the time of the callback in seconds
+      since the start of the recording.
+
+      @raise Failure if the file is not a recording. *)
+
+val record_replay : ?realtime : bool -> ?on_record : (float -> recorded_callback -> unit) -> session -> session_callbacks -> string -> unit
+  (** [record_replay session callbacks path] calls the methods of
+      [callbacks] as they were called during the recording in [path].
+      [music_delivery] receives silent frames, and its result is
+      ignored. Completions of searches, browses and images are only
+      passed to [on_record].
+
+      @param realtime If [true] (the default), callbacks are spaced
+      as in the recording, otherwise they are called as fast as
+      possible.
+      @param on_record Called with each record before replaying it.
+      @param session Session passed to the callbacks
+      @param callbacks Callbacks to drive
+      @param path Recording to replay *)
+
+(** {6 Tracing} *)
+
+val trace_start : ?ring_size : int -> unit -> unit
+  (** Start tracing session activity: calls to the main API functions
+      (login, event processing, searches, browsing, ...) and all
+      callbacks are timed. Events are kept in memory, in a ring per
+      thread holding the last [ring_size] events (defaults to
+      [65536]). Starting again clears the rings.
+
+      @raise Invalid_argument if [ring_size] is not positive. *)
+
+val trace_stop : unit -> unit
+  (** Stop tracing. Events are kept until the next {!trace_start}. *)
+
+val trace_dump : string -> unit
+  (** [trace_dump path] writes the traced events to [path] in the
+      trace-event JSON format, which can be loaded in Perfetto or
+      chrome://tracing. Each thread, including internal libspotify
+      threads, appears as a separate track. Callbacks are named after
+      the C function receiving them.
+
+      @raise Sys_error if the file cannot be written. *)
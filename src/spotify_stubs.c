@@ -15,13 +15,54 @@
 #include <caml/fail.h>
 #include <caml/callback.h>
 #include <caml/bigarray.h>
+#include <caml/signals.h>
+#include <caml/version.h>
+#include <caml/weak.h>
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #include <libspotify/api.h>
 
+#if OCAML_VERSION_MAJOR >= 5
+#  define OCAML_MULTICORE
+#endif
+
+#if OCAML_VERSION_MAJOR >= 5 || (OCAML_VERSION_MAJOR == 4 && OCAML_VERSION_MINOR >= 12)
+#  define HAVE_EPHEMERON_API
+#endif
+
+#if defined(HAVE_FLAC)
+#  include <FLAC/stream_encoder.h>
+#endif
+
+#if defined(HAVE_VORBIS)
+#  include <vorbis/vorbisenc.h>
+#endif
+
 #define DEBUG_MODE
 
 #if defined(DEBUG_MODE)
@@ -52,6 +93,205 @@ static void* xmalloc(size_t size)
 
 #define new(type) (type*)xmalloc(sizeof(type))
 
+/* +-----------------------------------------------------------------+
+   | libspotify access                                               |
+   +-----------------------------------------------------------------+ */
+
+/* libspotify is not thread-safe. With OCaml 4 the runtime lock
+   serializes the stubs, but with OCaml 5 stubs called from different
+   domains run in parallel.
+
+   Callbacks are run in the first domain, to which threads registered
+   from C are attached, so stubs calling libspotify must be called
+   from it too: they get their handles with [get_*], which raise in
+   other domains, and the runtime lock of the first domain serializes
+   them. Other domains can only build OCaml values from data already
+   copied out of libspotify, see [tracks_metadata].
+
+   [spotify_mutex] additionally serializes event processing and the
+   bulk accessors with the stubs which call libspotify with the
+   runtime released, such as [session_release].
+
+   Finalizers may run in any domain and cannot block, so with OCaml 5
+   they do not release libspotify objects themselves: releases are
+   queued and performed the next time [spotify_mutex] is taken. */
+
+static pthread_mutex_t spotify_mutex;
+static pthread_once_t spotify_mutex_once = PTHREAD_ONCE_INIT;
+
+static void spotify_mutex_init(void)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&spotify_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+struct pending_release {
+  void (*release)(void *object);
+  void *object;
+  struct pending_release *next;
+};
+
+static pthread_mutex_t pending_releases_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pending_release *pending_releases = NULL;
+
+/* Release [object] with [release], now if possible or else the next
+   time libspotify is locked. */
+static void release_later(void (*release)(void *object), void *object)
+{
+#if defined(OCAML_MULTICORE)
+  struct pending_release *node = new(struct pending_release);
+  node->release = release;
+  node->object = object;
+  pthread_mutex_lock(&pending_releases_mutex);
+  node->next = pending_releases;
+  pending_releases = node;
+  pthread_mutex_unlock(&pending_releases_mutex);
+#else
+  release(object);
+#endif
+}
+
+#define RELEASE_LATER(release, object) release_later((void (*)(void*))release, (void*)(object))
+
+/* Number of live sessions, encoders and HTTP servers, which own
+   native threads. A process which has some must not fork. */
+static int native_owners = 0;
+
+#define NATIVE_OWNER_ADD() __sync_fetch_and_add(&native_owners, 1)
+#define NATIVE_OWNER_REMOVE() __sync_fetch_and_sub(&native_owners, 1)
+
+/* Objects whose destruction blocks, joining native threads or
+   flushing files, are handed by their finalizers to a reaper thread,
+   which is started on first use and never runs OCaml code. */
+
+static pthread_mutex_t reaper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+static struct pending_release *reaper_queue = NULL;
+static int reaper_started = 0;
+static pthread_once_t reaper_once = PTHREAD_ONCE_INIT;
+
+static void *reaper_worker(void *arg)
+{
+  pthread_mutex_lock(&reaper_mutex);
+  for (;;) {
+    while (reaper_queue == NULL) pthread_cond_wait(&reaper_cond, &reaper_mutex);
+    struct pending_release *node = reaper_queue;
+    reaper_queue = NULL;
+    pthread_mutex_unlock(&reaper_mutex);
+    while (node) {
+      struct pending_release *next = node->next;
+      node->release(node->object);
+      free(node);
+      node = next;
+    }
+    pthread_mutex_lock(&reaper_mutex);
+  }
+  return NULL;
+}
+
+/* The reaper does not survive a fork. Objects queued in the parent
+   belong to it and are dropped. */
+static void reaper_atfork_child(void)
+{
+  pthread_mutex_init(&reaper_mutex, NULL);
+  pthread_cond_init(&reaper_cond, NULL);
+  reaper_queue = NULL;
+  reaper_started = 0;
+}
+
+static void reaper_init(void)
+{
+  pthread_atfork(NULL, NULL, reaper_atfork_child);
+}
+
+/* Destroy [object] with [release] on the reaper thread, or right now
+   if it cannot be started. */
+static void reap_later(void (*release)(void *object), void *object)
+{
+  struct pending_release *node = new(struct pending_release);
+  node->release = release;
+  node->object = object;
+  pthread_once(&reaper_once, reaper_init);
+  pthread_mutex_lock(&reaper_mutex);
+  if (!reaper_started) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    reaper_started = pthread_create(&thread, &attr, reaper_worker, NULL) == 0;
+    pthread_attr_destroy(&attr);
+  }
+  if (reaper_started) {
+    node->next = reaper_queue;
+    reaper_queue = node;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_mutex);
+  } else {
+    pthread_mutex_unlock(&reaper_mutex);
+    free(node);
+    release(object);
+  }
+}
+
+#define REAP_LATER(release, object) reap_later((void (*)(void*))release, (void*)(object))
+
+/* Lock libspotify. The runtime is released while waiting, so the
+   caller must not hold unrooted values. */
+static void spotify_lock(void)
+{
+  pthread_once(&spotify_mutex_once, spotify_mutex_init);
+  if (pthread_mutex_trylock(&spotify_mutex)) {
+    caml_enter_blocking_section();
+    pthread_mutex_lock(&spotify_mutex);
+    caml_leave_blocking_section();
+  }
+  pthread_mutex_lock(&pending_releases_mutex);
+  struct pending_release *node = pending_releases;
+  pending_releases = NULL;
+  pthread_mutex_unlock(&pending_releases_mutex);
+  while (node) {
+    struct pending_release *next = node->next;
+    node->release(node->object);
+    free(node);
+    node = next;
+  }
+}
+
+static void spotify_unlock(void)
+{
+  pthread_mutex_unlock(&spotify_mutex);
+}
+
+/* Fail if the current domain is not the one running callbacks. */
+#if defined(OCAML_MULTICORE)
+static void check_callback_domain(const char *func)
+{
+  if (Caml_state->id != 0) {
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Spotify.%s: must be called from the first domain", func);
+    caml_failwith(msg);
+  }
+}
+
+/* Fail if a handle of the given kind is used outside of the first
+   domain. libspotify is not thread-safe, and only the first domain
+   is serialized with callbacks. */
+static void check_handle_domain(const char *kind)
+{
+  if (Caml_state->id != 0) {
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Spotify: %s handles must be used from the first domain", kind);
+    caml_failwith(msg);
+  }
+}
+#else
+#  define check_callback_domain(func)
+#  define check_handle_domain(kind)
+#endif
+
 /* +-----------------------------------------------------------------+
    | Custom values                                                   |
    +-----------------------------------------------------------------+ */
@@ -66,11 +306,97 @@ static long spotify_hash(value x)
   return (long)Data_custom_val(x);
 }
 
+/* Handles of tracks, albums and artists are shown to the attached
+   metadata store and local index, if any. Recording and indexing is
+   too heavy for every allocation of a handle, so objects are only
+   queued, with a reference, when handles are created, and the queue
+   is drained by session_process_events and before metadata_updated
+   callbacks. */
+
+enum object_kind {
+  OBJECT_TRACK,
+  OBJECT_ALBUM,
+  OBJECT_ARTIST
+};
+
+struct metadata_store;
+static struct metadata_store *attached_store = NULL;
+static void store_observe(enum object_kind kind, void *object);
+
+struct local_index;
+static struct local_index *attached_index = NULL;
+/* Maximum number of objects of the attached index. */
+static size_t attached_index_max = 0;
+static void index_observe(struct local_index *index, enum object_kind kind, void *object, size_t max_docs);
+
+static void release_object(enum object_kind kind, void *object);
+
+struct observed {
+  enum object_kind kind;
+  void *object;
+};
+
+static pthread_mutex_t observed_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct observed *observed = NULL;
+static size_t num_observed = 0;
+static size_t observed_capacity = 0;
+
+static void observe_object(enum object_kind kind, void *object)
+{
+  switch (kind) {
+  case OBJECT_TRACK: sp_track_add_ref((sp_track*)object); break;
+  case OBJECT_ALBUM: sp_album_add_ref((sp_album*)object); break;
+  default: sp_artist_add_ref((sp_artist*)object); break;
+  }
+  pthread_mutex_lock(&observed_mutex);
+  if (num_observed == observed_capacity) {
+    observed_capacity = observed_capacity ? observed_capacity * 2 : 256;
+    observed = (struct observed*)realloc(observed, observed_capacity * sizeof(struct observed));
+    if (observed == NULL) {
+      perror("cannot allocate memory");
+      abort();
+    }
+  }
+  observed[num_observed].kind = kind;
+  observed[num_observed].object = object;
+  num_observed++;
+  pthread_mutex_unlock(&observed_mutex);
+}
+
+/* Show queued objects to the attached store and index, and drop the
+   references of the queue. */
+static void observe_drain(void)
+{
+  pthread_mutex_lock(&observed_mutex);
+  struct observed *queue = observed;
+  size_t i, count = num_observed;
+  observed = NULL;
+  num_observed = 0;
+  observed_capacity = 0;
+  pthread_mutex_unlock(&observed_mutex);
+  for (i = 0; i < count; i++) {
+    if (attached_store) store_observe(queue[i].kind, queue[i].object);
+    if (attached_index) index_observe(attached_index, queue[i].kind, queue[i].object, attached_index_max);
+    release_object(queue[i].kind, queue[i].object);
+  }
+  free(queue);
+}
+
+#define observe_track(x) if ((attached_store || attached_index) && x) observe_object(OBJECT_TRACK, x)
+#define observe_album(x) if ((attached_store || attached_index) && x) observe_object(OBJECT_ALBUM, x)
+#define observe_artist(x) if ((attached_store || attached_index) && x) observe_object(OBJECT_ARTIST, x)
+#define observe_toplistbrowse(x)
+#define observe_link(x)
+#define observe_user(x)
+#define observe_playlist(x)
+#define observe_playlistcontainer(x)
+#define observe_inbox(x)
+
 #define DEFINE_OPS(name, id)                                            \
   static void name##_finalize(value x)                                  \
   {                                                                     \
     sp_##name *name = *(sp_##name **)Data_custom_val(x);                \
-    if (name) sp_##name##_release(name);                                \
+    if (name) RELEASE_LATER(sp_##name##_release, name);                 \
   }                                                                     \
                                                                         \
   static struct custom_operations name##_ops = {                        \
@@ -86,6 +412,7 @@ static long spotify_hash(value x)
   {                                                                     \
     value x = caml_alloc_custom(&name##_ops, sizeof(sp_##name *), 0, 1); \
     *(sp_##name **)Data_custom_val(x) = name;                           \
+    observe_##name(name);                                               \
     return x;                                                           \
   }                                                                     \
                                                                         \
@@ -93,6 +420,7 @@ static long spotify_hash(value x)
   {                                                                     \
     sp_##name *name = *(sp_##name **)Data_custom_val(x);                \
     if (name == NULL) caml_raise(*caml_named_value("spotify:null"));    \
+    check_handle_domain(#name);                                         \
     return name;                                                        \
   }
 
@@ -121,6 +449,7 @@ static sp_session *get_session(value x)
 {
   sp_session *session = Session_val(x);
   if (session == NULL) caml_raise(*caml_named_value("spotify:null"));
+  check_handle_domain("session");
   return session;
 }
 
@@ -137,7 +466,7 @@ static sp_session *get_session(value x)
     if (name) {                                                         \
       caml_remove_generational_global_root(&(name->callback));          \
       caml_remove_generational_global_root(&(name->name));              \
-      sp_##name##_release(name->sp_##name);                             \
+      RELEASE_LATER(sp_##name##_release, name->sp_##name);              \
       free(name);                                                       \
     }                                                                   \
   }                                                                     \
@@ -162,6 +491,7 @@ static sp_session *get_session(value x)
   {                                                                     \
     struct name *name = *(struct name **)Data_custom_val(x);            \
     if (name == NULL) caml_raise(*caml_named_value("spotify:null"));    \
+    check_handle_domain(#name);                                         \
     return name;                                                        \
   }
 
@@ -200,7 +530,7 @@ static void image_finalize(value x)
       free(node);
       node = next;
     }
-    sp_image_release(image->sp_image);
+    RELEASE_LATER(sp_image_release, image->sp_image);
     free(image);
   }
 }
@@ -225,6 +555,7 @@ static struct image *get_image(value x)
 {
   struct image *image = Image_val(x);
   if (image == NULL) caml_raise(*caml_named_value("spotify:null"));
+  check_handle_domain("image");
   return image;
 }
 
@@ -254,6 +585,333 @@ CAMLprim value ocaml_spotify_is_null(value x)
   return Val_bool(Data_custom_val(x) == NULL);
 }
 
+/* +-----------------------------------------------------------------+
+   | Recording                                                       |
+   +-----------------------------------------------------------------+ */
+
+/* Callbacks are recorded to a file made of the magic string "OSPR",
+   a format version, then one record per callback: its type as a
+   byte, the time elapsed since the previous record in microseconds,
+   and its payload. All integers are unsigned LEB128 varints.
+
+   libspotify supports only one session per process, so there is a
+   single recorder for all callbacks. */
+
+#define RECORD_MAGIC "OSPR"
+#define RECORD_VERSION 1
+
+/* Record types, in the order of the [recorded_callback] type. */
+enum record_type {
+  RECORD_LOGGED_IN,
+  RECORD_LOGGED_OUT,
+  RECORD_METADATA_UPDATED,
+  RECORD_CONNECTION_ERROR,
+  RECORD_MESSAGE_TO_USER,
+  RECORD_NOTIFY_MAIN_THREAD,
+  RECORD_MUSIC_DELIVERY,
+  RECORD_PLAY_TOKEN_LOST,
+  RECORD_LOG_MESSAGE,
+  RECORD_END_OF_TRACK,
+  RECORD_STREAMING_ERROR,
+  RECORD_USERINFO_UPDATED,
+  RECORD_START_PLAYBACK,
+  RECORD_STOP_PLAYBACK,
+  RECORD_GET_AUDIO_BUFFER_STATS,
+  RECORD_OFFLINE_STATUS_UPDATED,
+  RECORD_SEARCH_COMPLETE,
+  RECORD_ALBUMBROWSE_COMPLETE,
+  RECORD_ARTISTBROWSE_COMPLETE,
+  RECORD_IMAGE_LOADED,
+};
+
+static pthread_mutex_t recorder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *recorder_file = NULL;
+static char *recorder_path = NULL;
+static int64_t recorder_time;
+/* Time of the last record, in microseconds. */
+static int recorder_error = 0;
+/* The first error writing a record, reported when the recording is
+   stopped. */
+
+static int64_t monotonic_time_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t encode_varint(unsigned char *buffer, uint64_t x)
+{
+  size_t len = 0;
+  while (x >= 0x80) {
+    buffer[len++] = (unsigned char)(x | 0x80);
+    x >>= 7;
+  }
+  buffer[len++] = (unsigned char)x;
+  return len;
+}
+
+#define RECORD_MAX_VALUES 5
+
+/* Record a callback with [count] int64_t payload values. Negative
+   values are recorded as 0. */
+static void record(enum record_type type, int count, ...)
+{
+  /* Unlocked test: recording is rarely enabled. */
+  if (recorder_file == NULL) return;
+  unsigned char payload[10 * RECORD_MAX_VALUES], buffer[1 + 10 + sizeof(payload)];
+  size_t payload_len = 0, len = 0;
+  va_list args;
+  int i;
+  va_start(args, count);
+  for (i = 0; i < count && i < RECORD_MAX_VALUES; i++) {
+    int64_t x = va_arg(args, int64_t);
+    payload_len += encode_varint(payload + payload_len, x < 0 ? 0 : (uint64_t)x);
+  }
+  va_end(args);
+  pthread_mutex_lock(&recorder_mutex);
+  if (recorder_file) {
+    /* The time is taken under the lock to keep records ordered. */
+    int64_t now = monotonic_time_us();
+    buffer[len++] = type;
+    len += encode_varint(buffer + len, (uint64_t)(now - recorder_time));
+    memcpy(buffer + len, payload, payload_len);
+    if (fwrite(buffer, 1, len + payload_len, recorder_file) != len + payload_len && recorder_error == 0)
+      recorder_error = errno ? errno : EIO;
+    recorder_time = now;
+  }
+  pthread_mutex_unlock(&recorder_mutex);
+}
+
+static void record_fail(const char *path, int error)
+{
+  char message[1024];
+  snprintf(message, sizeof(message), "%s: %s", path, strerror(error));
+  caml_raise_sys_error(caml_copy_string(message));
+}
+
+CAMLprim value ocaml_spotify_record_start(value path)
+{
+  CAMLparam1(path);
+  unsigned char header[16];
+  size_t len = sizeof(RECORD_MAGIC) - 1;
+  FILE *file = fopen(String_val(path), "wb");
+  if (file == NULL) record_fail(String_val(path), errno);
+  memcpy(header, RECORD_MAGIC, len);
+  len += encode_varint(header + len, RECORD_VERSION);
+  if (fwrite(header, 1, len, file) != len) {
+    int error = errno ? errno : EIO;
+    fclose(file);
+    record_fail(String_val(path), error);
+  }
+  pthread_mutex_lock(&recorder_mutex);
+  FILE *previous = recorder_file;
+  char *previous_path = recorder_path;
+  recorder_file = file;
+  recorder_path = strdup(String_val(path));
+  recorder_time = monotonic_time_us();
+  recorder_error = 0;
+  pthread_mutex_unlock(&recorder_mutex);
+  if (previous) fclose(previous);
+  free(previous_path);
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_spotify_record_stop(value unit)
+{
+  char path[1024];
+  pthread_mutex_lock(&recorder_mutex);
+  FILE *file = recorder_file;
+  int error = recorder_error;
+  snprintf(path, sizeof(path), "%s", recorder_path ? recorder_path : "");
+  free(recorder_path);
+  recorder_file = NULL;
+  recorder_path = NULL;
+  recorder_error = 0;
+  pthread_mutex_unlock(&recorder_mutex);
+  if (file == NULL) return Val_unit;
+  if (fclose(file) && error == 0) error = errno;
+  if (error) record_fail(path, error);
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Tracing                                                         |
+   +-----------------------------------------------------------------+ */
+
+/* When tracing is enabled, API calls and callbacks are timed and
+   stored in a ring per thread, overwriting the oldest events when it
+   is full. Rings are dumped in the trace-event JSON format, read by
+   chrome://tracing and Perfetto, with one track per thread.
+
+   Rings are never freed: the thread-local pointer to a ring must
+   stay valid, and libspotify threads live as long as the session
+   anyway. */
+
+enum trace_category {
+  TRACE_API,
+  TRACE_CALLBACK
+};
+
+static const char *trace_categories[] = { "api", "callback" };
+
+struct trace_event {
+  const char *name;
+  enum trace_category category;
+  int64_t start;
+  int64_t duration;
+  /* Times in nanoseconds. */
+  const char *arg_name;
+  /* Name of the argument, or NULL if the event has none. */
+  int64_t arg;
+};
+
+struct trace_ring {
+  pthread_mutex_t mutex;
+  /* Protects the events. It is only contended while dumping. */
+  pid_t tid;
+  int callback_thread;
+  /* Whether the first event of the thread was a callback, in which
+     case it is most likely a libspotify thread. */
+  struct trace_event *events;
+  size_t capacity;
+  uint64_t count;
+  /* Number of events written since tracing was started. */
+  struct trace_ring *next;
+};
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings = NULL;
+static size_t trace_capacity = 0;
+static int64_t trace_origin;
+static volatile int trace_enabled = 0;
+static __thread struct trace_ring *trace_ring = NULL;
+
+static int64_t trace_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_ring *get_trace_ring(enum trace_category category)
+{
+  if (trace_ring) return trace_ring;
+  struct trace_ring *ring = new(struct trace_ring);
+  pthread_mutex_init(&(ring->mutex), NULL);
+  ring->tid = (pid_t)syscall(SYS_gettid);
+  ring->callback_thread = category == TRACE_CALLBACK;
+  ring->count = 0;
+  pthread_mutex_lock(&trace_mutex);
+  ring->capacity = trace_capacity;
+  ring->events = (struct trace_event*)xmalloc(ring->capacity * sizeof(struct trace_event));
+  ring->next = trace_rings;
+  trace_rings = ring;
+  pthread_mutex_unlock(&trace_mutex);
+  trace_ring = ring;
+  return ring;
+}
+
+static void trace_event(enum trace_category category, const char *name, int64_t start, const char *arg_name, int64_t arg)
+{
+  int64_t end = trace_now();
+  struct trace_ring *ring = get_trace_ring(category);
+  pthread_mutex_lock(&(ring->mutex));
+  if (ring->capacity > 0) {
+    struct trace_event *event = &(ring->events[ring->count % ring->capacity]);
+    event->name = name;
+    event->category = category;
+    event->start = start;
+    event->duration = end - start;
+    event->arg_name = arg_name;
+    event->arg = arg;
+    ring->count++;
+  }
+  pthread_mutex_unlock(&(ring->mutex));
+}
+
+/* [TRACE_BEGIN] starts timing the current function, [TRACE_END]
+   stores the event if tracing was enabled all along. */
+#define TRACE_BEGIN                                                     \
+  int64_t __trace_start = trace_enabled ? trace_now() : -1
+
+#define TRACE_END(category, name, arg_name, arg)                        \
+  if (__trace_start >= 0 && trace_enabled)                              \
+    trace_event(category, name, __trace_start, arg_name, (int64_t)(arg))
+
+CAMLprim value ocaml_spotify_trace_start(value val_capacity)
+{
+  long capacity = Long_val(val_capacity);
+  if (capacity <= 0) caml_invalid_argument("Spotify.trace_start");
+  pthread_mutex_lock(&trace_mutex);
+  struct trace_ring *ring;
+  for (ring = trace_rings; ring; ring = ring->next) {
+    pthread_mutex_lock(&(ring->mutex));
+    if (ring->capacity != (size_t)capacity) {
+      free(ring->events);
+      ring->events = (struct trace_event*)xmalloc(capacity * sizeof(struct trace_event));
+      ring->capacity = capacity;
+    }
+    ring->count = 0;
+    pthread_mutex_unlock(&(ring->mutex));
+  }
+  trace_capacity = capacity;
+  trace_origin = trace_now();
+  trace_enabled = 1;
+  pthread_mutex_unlock(&trace_mutex);
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_trace_stop(value unit)
+{
+  trace_enabled = 0;
+  return Val_unit;
+}
+
+static void write_trace(FILE *file)
+{
+  pid_t pid = getpid();
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"ocaml-spotify\"}}", pid, pid);
+  pthread_mutex_lock(&trace_mutex);
+  struct trace_ring *ring;
+  for (ring = trace_rings; ring; ring = ring->next) {
+    pthread_mutex_lock(&(ring->mutex));
+    const char *thread_name = ring->tid == pid ? "main" : ring->callback_thread ? "libspotify" : "ocaml";
+    uint64_t dropped = ring->count > ring->capacity ? ring->count - ring->capacity : 0;
+    fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s %d\",\"dropped\":%llu}}",
+            pid, ring->tid, thread_name, ring->tid, (unsigned long long)dropped);
+    uint64_t i;
+    for (i = dropped; i < ring->count; i++) {
+      struct trace_event *event = &(ring->events[i % ring->capacity]);
+      fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+              event->name, trace_categories[event->category],
+              (double)(event->start - trace_origin) / 1000, (double)event->duration / 1000,
+              pid, ring->tid);
+      if (event->arg_name)
+        fprintf(file, ",\"args\":{\"%s\":%lld}", event->arg_name, (long long)event->arg);
+      fputc('}', file);
+    }
+    pthread_mutex_unlock(&(ring->mutex));
+  }
+  pthread_mutex_unlock(&trace_mutex);
+  fprintf(file, "\n]}\n");
+}
+
+CAMLprim value ocaml_spotify_trace_dump(value path)
+{
+  CAMLparam1(path);
+  FILE *file = fopen(String_val(path), "w");
+  if (file == NULL) caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  caml_enter_blocking_section();
+  write_trace(file);
+  int error = ferror(file);
+  if (fclose(file)) error = 1;
+  caml_leave_blocking_section();
+  if (error) caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  CAMLreturn(Val_unit);
+}
+
 /* +-----------------------------------------------------------------+
    | Session handling                                                |
    +-----------------------------------------------------------------+ */
@@ -263,19 +921,140 @@ CAMLprim value ocaml_spotify_get_api_version()
   return Val_int(SPOTIFY_API_VERSION);
 }
 
+/* A native consumer of the PCM data delivered to a session.
+
+   Sinks are fed from the music delivery thread, after the OCaml
+   callback returned and without holding the runtime system, with the
+   frames the application actually consumed. They must never block. */
+struct pcm_sink {
+  void (*deliver)(struct pcm_sink *sink, const sp_audioformat *format, const void *frames, int num_frames);
+  /* The function feeding frames to the sink. */
+  struct userdata *owner;
+  /* The session the sink is attached to, or NULL. */
+  struct pcm_sink *next;
+};
+
+/* History of the last delivered PCM data, used to serve backward
+   seeks locally. */
+struct replay {
+  pthread_mutex_t mutex;
+  double window;
+  /* Size of the history in seconds, 0 if disabled. */
+  char *data;
+  size_t size;
+  /* Ring holding the history. */
+  int sample_rate;
+  int channels;
+  /* Format of the history. */
+  uint64_t start;
+  uint64_t end;
+  /* Absolute byte offsets of the history. [end] corresponds to the
+     position of libspotify. */
+  int64_t position;
+  /* Position of [end] in the track, in frames. */
+  int replaying;
+  uint64_t cursor;
+  /* Whether frames are currently replayed from the history, and the
+     offset of the next one. */
+  int discontinuity;
+  /* Whether the application must be told to flush its buffers. */
+  unsigned generation;
+  /* Incremented on every seek, load or unload. */
+  char *scratch;
+  size_t scratch_size;
+  /* Linear copy of the frames being replayed. Only used by the
+     delivery thread. */
+  int64_t hits;
+  int64_t misses;
+};
+
 /* User data attached to sessions. */
 struct userdata {
   value session;
   /* The session value. */
   value callbacks;
   /* The callbacks. */
+  pthread_mutex_t sinks_mutex;
+  /* Mutex protecting the list of sinks. */
+  struct pcm_sink *sinks;
+  /* PCM sinks attached to the session. */
+  struct replay replay;
+  /* Replay buffer. */
+  struct startup *startup;
+  /* Startup in progress, if any. */
+  struct star_job *star_jobs;
+  /* Star jobs in progress, in submission order. */
+  struct offline_plan *offline_plan;
+  /* Offline plan receiving progress events, if any. */
+  struct bitrate_policy *policy;
+  /* Bitrate policy of the session, if any. Protected by
+     [policy_mutex]. */
+  int sample_rate;
+  /* Sample rate of the last delivery. */
+  struct playable_cache *playable;
+  /* Playable versions of tracks, or NULL if none has been resolved
+     yet. */
 };
 
+static void startup_logged_in(struct startup *startup, sp_error error);
+static void store_update(void);
+static void index_update(struct local_index *index);
+static void startup_update(struct startup *startup);
+static void startup_detach(struct startup *startup);
+static void star_jobs_pump(struct userdata *data);
+static void star_jobs_detach(struct userdata *data);
+static void offline_plan_detach(struct offline_plan *plan);
+static void offline_plan_notify(struct offline_plan *plan);
+static void policy_stats(struct userdata *data, const sp_audio_buffer_stats *stats);
+static void policy_streaming_error(struct userdata *data, sp_error error);
+static void policy_apply(struct userdata *data, sp_session *session);
+static void policy_detach(struct userdata *data);
+static void playable_cache_free(struct userdata *data);
+static sp_track *playable_resolve(sp_session *session, sp_track *track);
+
+static void attach_pcm_sink(struct userdata *data, struct pcm_sink *sink)
+{
+  pthread_mutex_lock(&(data->sinks_mutex));
+  sink->owner = data;
+  sink->next = data->sinks;
+  data->sinks = sink;
+  pthread_mutex_unlock(&(data->sinks_mutex));
+}
+
+static void detach_pcm_sink(struct pcm_sink *sink)
+{
+  struct userdata *data = sink->owner;
+  if (data == NULL) return;
+  pthread_mutex_lock(&(data->sinks_mutex));
+  struct pcm_sink **cell = &(data->sinks);
+  while (*cell) {
+    if (*cell == sink) {
+      *cell = sink->next;
+      break;
+    }
+    cell = &((*cell)->next);
+  }
+  sink->owner = NULL;
+  sink->next = NULL;
+  pthread_mutex_unlock(&(data->sinks_mutex));
+}
+
+static void feed_pcm_sinks(struct userdata *data, const sp_audioformat *format, const void *frames, int num_frames)
+{
+  pthread_mutex_lock(&(data->sinks_mutex));
+  struct pcm_sink *sink;
+  for (sink = data->sinks; sink; sink = sink->next)
+    sink->deliver(sink, format, frames, num_frames);
+  pthread_mutex_unlock(&(data->sinks_mutex));
+}
+
 /* Try to register the thread as a thread running OCaml code.
 
    If it was not already registered, then we must acquire the runtime
-   system in order to call ocaml code. */
+   system in order to call ocaml code. With OCaml 5, such threads are
+   attached to the first domain. */
 #define ENTER_CALLBACK                                          \
+  TRACE_BEGIN;                                                  \
   int __caml_thread_registered = caml_c_thread_register();      \
   if (__caml_thread_registered) caml_acquire_runtime_system();  \
 
@@ -286,18 +1065,22 @@ struct userdata {
   if (__caml_thread_registered) {                               \
     caml_release_runtime_system();                              \
     caml_c_thread_unregister();                                 \
-  }
+  }                                                             \
+  TRACE_END(TRACE_CALLBACK, __func__, NULL, 0)
 
 static void logged_in(sp_session *session, sp_error error)
 {
-  ENTER_CALLBACK;
+  record(RECORD_LOGGED_IN, 1, (int64_t)error);
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  if (data->startup) startup_logged_in(data->startup, error);
+  ENTER_CALLBACK;
   caml_callback3(caml_get_public_method(data->callbacks, hash_variant("logged_in")), data->callbacks, data->session, Val_int(error));
   LEAVE_CALLBACK;
 }
 
 static void logged_out(sp_session *session)
 {
+  record(RECORD_LOGGED_OUT, 0);
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
   caml_callback2(caml_get_public_method(data->callbacks, hash_variant("logged_out")), data->callbacks, data->session);
@@ -306,14 +1089,20 @@ static void logged_out(sp_session *session)
 
 static void metadata_updated(sp_session *session)
 {
-  ENTER_CALLBACK;
+  record(RECORD_METADATA_UPDATED, 0);
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  if (data->startup) startup_update(data->startup);
+  observe_drain();
+  if (attached_store) store_update();
+  if (attached_index) index_update(attached_index);
+  ENTER_CALLBACK;
   caml_callback2(caml_get_public_method(data->callbacks, hash_variant("metadata_updated")), data->callbacks, data->session);
   LEAVE_CALLBACK;
 }
 
 static void connection_error(sp_session *session, sp_error error)
 {
+  record(RECORD_CONNECTION_ERROR, 1, (int64_t)error);
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
   caml_callback3(caml_get_public_method(data->callbacks, hash_variant("connection_error")), data->callbacks, data->session, Val_int(error));
@@ -322,6 +1111,7 @@ static void connection_error(sp_session *session, sp_error error)
 
 static void message_to_user(sp_session *session, const char *message)
 {
+  record(RECORD_MESSAGE_TO_USER, 1, (int64_t)strlen(message));
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
   caml_callback3(caml_get_public_method(data->callbacks, hash_variant("message_to_user")), data->callbacks, data->session, caml_copy_string(message));
@@ -330,6 +1120,7 @@ static void message_to_user(sp_session *session, const char *message)
 
 static void notify_main_thread(sp_session *session)
 {
+  record(RECORD_NOTIFY_MAIN_THREAD, 0);
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
   caml_callback2(caml_get_public_method(data->callbacks, hash_variant("notify_main_thread")), data->callbacks, data->session);
@@ -347,14 +1138,16 @@ static int frame_size(const sp_audioformat *format)
   }
 }
 
-static int music_delivery(sp_session *session, const sp_audioformat *format, const void *frames, int num_frames)
+/* Pass frames to the application, return the number of frames it
+   consumed. */
+static int deliver_frames(struct userdata *data, const sp_audioformat *format, const void *frames, int num_frames)
 {
+  int consumed;
   ENTER_CALLBACK;
   value audio_format = Val_int(0);
   value bytes = Val_int(0);
   value result;
   Begin_roots2(audio_format, bytes);
-  struct userdata *data = (struct userdata*)sp_session_userdata(session);
   value args[5];
   audio_format = caml_alloc_tuple(3);
   Field(audio_format, 0) = Val_int(format->sample_type);
@@ -369,13 +1162,128 @@ static int music_delivery(sp_session *session, const sp_audioformat *format, con
   args[3] = bytes;
   args[4] = Val_int(num_frames);
   result = caml_callbackN(caml_get_public_method(data->callbacks, hash_variant("music_delivery")), 5, args);
+  consumed = Int_val(result);
   End_roots();
   LEAVE_CALLBACK;
-  return Int_val(result);
+  return consumed;
+}
+
+/* Maximum duration replayed in one delivery, in seconds. libspotify
+   retries delivery about 100ms after we return 0, so it must be well
+   above that. */
+#define REPLAY_CHUNK 0.5
+
+/* Forget the history. Called with the replay mutex held. */
+static void replay_reset(struct replay *replay, int64_t position)
+{
+  replay->start = replay->end = 0;
+  replay->position = position;
+  replay->replaying = 0;
+  replay->generation++;
+}
+
+/* Record frames consumed by the application. Called with the replay
+   mutex held. */
+static void replay_record(struct replay *replay, const sp_audioformat *format, const void *frames, int num_frames)
+{
+  int size = frame_size(format);
+  if (size < 0) return;
+  if (format->sample_rate != replay->sample_rate || format->channels != replay->channels || replay->data == NULL) {
+    free(replay->data);
+    replay->sample_rate = format->sample_rate;
+    replay->channels = format->channels;
+    replay->size = (size_t)(replay->window * format->sample_rate) * size;
+    replay->data = replay->size ? xmalloc(replay->size) : NULL;
+    replay->start = replay->end = 0;
+    if (replay->data == NULL) return;
+  }
+  const char *ptr = (const char*)frames;
+  size_t length = (size_t)num_frames * size;
+  replay->position += num_frames;
+  if (length > replay->size) {
+    ptr += length - replay->size;
+    replay->start += length - replay->size;
+    replay->end += length - replay->size;
+    length = replay->size;
+  }
+  size_t offset = replay->end % replay->size;
+  size_t first = replay->size - offset;
+  if (first > length) first = length;
+  memcpy(replay->data + offset, ptr, first);
+  memcpy(replay->data, ptr + first, length - first);
+  replay->end += length;
+  if (replay->end - replay->start > replay->size) replay->start = replay->end - replay->size;
+}
+
+static int music_delivery(sp_session *session, const sp_audioformat *format, const void *frames, int num_frames)
+{
+  struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  struct replay *replay = &(data->replay);
+  int consumed;
+
+  data->sample_rate = format->sample_rate;
+
+  pthread_mutex_lock(&(replay->mutex));
+  int history = replay->window > 0;
+  if (history && replay->replaying && replay->sample_rate == format->sample_rate && replay->channels == format->channels) {
+    /* Serve frames from the history, keeping the ones of libspotify
+       pending until the history is exhausted. */
+    unsigned generation = replay->generation;
+    int discontinuity = replay->discontinuity;
+    size_t size = frame_size(format);
+    size_t length = replay->end - replay->cursor;
+    size_t max = (size_t)(REPLAY_CHUNK * format->sample_rate) * size;
+    if (length > max) length = max;
+    if (replay->scratch_size < length) {
+      free(replay->scratch);
+      replay->scratch = xmalloc(max);
+      replay->scratch_size = max;
+    }
+    size_t offset = replay->cursor % replay->size;
+    size_t first = replay->size - offset;
+    if (first > length) first = length;
+    memcpy(replay->scratch, replay->data + offset, first);
+    memcpy(replay->scratch + first, replay->data, length - first);
+    replay->discontinuity = 0;
+    pthread_mutex_unlock(&(replay->mutex));
+
+    /* The scratch buffer is only used by this thread. */
+    if (discontinuity) deliver_frames(data, format, NULL, 0);
+    consumed = deliver_frames(data, format, replay->scratch, length / size);
+    if (consumed > 0 && data->sinks) feed_pcm_sinks(data, format, replay->scratch, consumed);
+
+    pthread_mutex_lock(&(replay->mutex));
+    if (consumed > 0 && replay->generation == generation) {
+      replay->cursor += (size_t)consumed * size;
+      if (replay->cursor >= replay->end) replay->replaying = 0;
+    }
+    pthread_mutex_unlock(&(replay->mutex));
+    /* Record the delivery the application saw. */
+    record(RECORD_MUSIC_DELIVERY, 5, (int64_t)format->sample_type, (int64_t)format->sample_rate, (int64_t)format->channels, (int64_t)(length / size), (int64_t)consumed);
+    return 0;
+  }
+  replay->replaying = 0;
+  pthread_mutex_unlock(&(replay->mutex));
+
+  consumed = deliver_frames(data, format, frames, num_frames);
+
+  if (history) {
+    pthread_mutex_lock(&(replay->mutex));
+    if (num_frames == 0)
+      /* Discontinuity, the history is not contiguous anymore. */
+      replay_reset(replay, replay->position);
+    else if (consumed > 0)
+      replay_record(replay, format, frames, consumed);
+    pthread_mutex_unlock(&(replay->mutex));
+  }
+  if (consumed > 0 && data->sinks) feed_pcm_sinks(data, format, frames, consumed);
+  record(RECORD_MUSIC_DELIVERY, 5, (int64_t)format->sample_type, (int64_t)format->sample_rate, (int64_t)format->channels, (int64_t)num_frames, (int64_t)consumed);
+  return consumed;
 }
 
 static void play_token_lost(sp_session *session)
 {
+  record(RECORD_PLAY_TOKEN_LOST, 0);
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
   caml_callback2(caml_get_public_method(data->callbacks, hash_variant("play_token_lost")), data->callbacks, data->session);
@@ -384,6 +1292,7 @@ static void play_token_lost(sp_session *session)
 
 static void log_message(sp_session *session, const char *message)
 {
+  record(RECORD_LOG_MESSAGE, 1, (int64_t)strlen(message));
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
   caml_callback3(caml_get_public_method(data->callbacks, hash_variant("log_message")), data->callbacks, data->session, caml_copy_string(message));
@@ -392,6 +1301,7 @@ static void log_message(sp_session *session, const char *message)
 
 static void end_of_track(sp_session *session)
 {
+  record(RECORD_END_OF_TRACK, 0);
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
   caml_callback2(caml_get_public_method(data->callbacks, hash_variant("end_of_track")), data->callbacks, data->session);
@@ -400,22 +1310,28 @@ static void end_of_track(sp_session *session)
 
 static void streaming_error(sp_session *session, sp_error error)
 {
+  record(RECORD_STREAMING_ERROR, 1, (int64_t)error);
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  policy_streaming_error(data, error);
   caml_callback3(caml_get_public_method(data->callbacks, hash_variant("streaming_error")), data->callbacks, data->session, Val_int(error));
   LEAVE_CALLBACK;
 }
 
 static void userinfo_updated(sp_session *session)
 {
-  ENTER_CALLBACK;
+  record(RECORD_USERINFO_UPDATED, 0);
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  /* Autolinking depends on the country of the user. */
+  playable_cache_free(data);
+  ENTER_CALLBACK;
   caml_callback2(caml_get_public_method(data->callbacks, hash_variant("userinfo_updated")), data->callbacks, data->session);
   LEAVE_CALLBACK;
 }
 
 static void start_playback(sp_session *session)
 {
+  record(RECORD_START_PLAYBACK, 0);
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
   caml_callback2(caml_get_public_method(data->callbacks, hash_variant("start_playback")), data->callbacks, data->session);
@@ -424,6 +1340,7 @@ static void start_playback(sp_session *session)
 
 static void stop_playback(sp_session *session)
 {
+  record(RECORD_STOP_PLAYBACK, 0);
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
   caml_callback2(caml_get_public_method(data->callbacks, hash_variant("stop_playback")), data->callbacks, data->session);
@@ -438,12 +1355,16 @@ static void get_audio_buffer_stats(sp_session *session, sp_audio_buffer_stats *s
   stats->samples = Int_val(Field(result, 0));
   stats->stutter = Int_val(Field(result, 1));
   LEAVE_CALLBACK;
+  policy_stats((struct userdata*)sp_session_userdata(session), stats);
+  record(RECORD_GET_AUDIO_BUFFER_STATS, 2, (int64_t)stats->samples, (int64_t)stats->stutter);
 }
 
 static void offline_status_updated(sp_session *session)
 {
+  record(RECORD_OFFLINE_STATUS_UPDATED, 0);
   ENTER_CALLBACK;
   struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  if (data->offline_plan) offline_plan_notify(data->offline_plan);
   caml_callback2(caml_get_public_method(data->callbacks, hash_variant("offline_status_updated")), data->callbacks, data->session);
   LEAVE_CALLBACK;
 }
@@ -467,16 +1388,11 @@ static sp_session_callbacks callbacks = {
   .offline_status_updated = offline_status_updated
 };
 
+/* A session is never collected while it exists: [data->session] is a
+   global root until the session is released, which also clears the
+   pointer. Sessions whose creation failed have no pointer either. */
 static void session_finalize(value x)
 {
-  sp_session *session = Session_val(x);
-  if (session) {
-    struct userdata *data = (struct userdata*)sp_session_userdata(session);
-    caml_remove_generational_global_root(&(data->session));
-    caml_remove_generational_global_root(&(data->callbacks));
-    free(data);
-    sp_session_release(session);
-  }
 }
 
 static struct custom_operations session_ops = {
@@ -499,6 +1415,7 @@ CAMLprim value ocaml_spotify_session_create(value val_config)
 {
   CAMLparam1(val_config);
   CAMLlocal1(result);
+  check_callback_domain("session_create");
   sp_session_config config;
   memset(&config, 0, sizeof(config));
   config.api_version = Int_val(Field(val_config, 0));
@@ -515,28 +1432,85 @@ CAMLprim value ocaml_spotify_session_create(value val_config)
   result = alloc_session(NULL);
   data->session = result;
   data->callbacks = Field(val_config, 5);
+  pthread_mutex_init(&(data->sinks_mutex), NULL);
+  data->sinks = NULL;
+  memset(&(data->replay), 0, sizeof(struct replay));
+  pthread_mutex_init(&(data->replay.mutex), NULL);
+  data->startup = NULL;
+  data->star_jobs = NULL;
+  data->offline_plan = NULL;
+  data->policy = NULL;
+  data->sample_rate = 0;
+  data->playable = NULL;
   caml_register_generational_global_root(&(data->session));
   caml_register_generational_global_root(&(data->callbacks));
   config.userdata = (void*)data;
+  TRACE_BEGIN;
   sp_error error = sp_session_create(&config, &(Session_val(result)));
+  TRACE_END(TRACE_API, "session_create", "error", error);
   if (error) {
+    caml_remove_generational_global_root(&(data->session));
+    caml_remove_generational_global_root(&(data->callbacks));
+    pthread_mutex_destroy(&(data->sinks_mutex));
+    pthread_mutex_destroy(&(data->replay.mutex));
     free(data);
     fail("sp_session_create", error);
   }
+  NATIVE_OWNER_ADD();
   CAMLreturn(result);
 }
 
-CAMLprim value ocaml_spotify_session_release(value session)
+CAMLprim value ocaml_spotify_session_release(value val_session)
 {
-  session_finalize(session);
-  Session_val(session) = NULL;
-  return Val_unit;
+  CAMLparam1(val_session);
+  sp_session *session = Session_val(val_session);
+  if (session == NULL) CAMLreturn(Val_unit);
+  check_callback_domain("session_release");
+  struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  Session_val(val_session) = NULL;
+  spotify_lock();
+  observe_drain();
+  if (data->startup) startup_detach(data->startup);
+  star_jobs_detach(data);
+  if (data->offline_plan) offline_plan_detach(data->offline_plan);
+  policy_detach(data);
+  playable_cache_free(data);
+  spotify_unlock();
+  /* libspotify joins its threads, which may be waiting for the
+     runtime to run a callback, or in [feed_pcm_sinks]. */
+  caml_enter_blocking_section();
+  pthread_mutex_lock(&spotify_mutex);
+  sp_session_release(session);
+  pthread_mutex_unlock(&spotify_mutex);
+  caml_leave_blocking_section();
+  NATIVE_OWNER_REMOVE();
+  /* No callback can run anymore. */
+  pthread_mutex_lock(&(data->sinks_mutex));
+  struct pcm_sink *sink = data->sinks;
+  while (sink) {
+    struct pcm_sink *next = sink->next;
+    sink->owner = NULL;
+    sink->next = NULL;
+    sink = next;
+  }
+  data->sinks = NULL;
+  pthread_mutex_unlock(&(data->sinks_mutex));
+  pthread_mutex_destroy(&(data->sinks_mutex));
+  caml_remove_generational_global_root(&(data->session));
+  caml_remove_generational_global_root(&(data->callbacks));
+  pthread_mutex_destroy(&(data->replay.mutex));
+  free(data->replay.data);
+  free(data->replay.scratch);
+  free(data);
+  CAMLreturn(Val_unit);
 }
 
 CAMLprim value ocaml_spotify_session_login(value val_session, value username, value password, value remember_me)
 {
   sp_session *session = get_session(val_session);
+  TRACE_BEGIN;
   sp_session_login(session, String_val(username), String_val(password), Bool_val(remember_me));
+  TRACE_END(TRACE_API, "session_login", NULL, 0);
   return Val_unit;
 }
 
@@ -577,7 +1551,9 @@ CAMLprim value ocaml_spotify_session_user(value val_session)
 
 CAMLprim value ocaml_spotify_session_logout(value val_session)
 {
+  TRACE_BEGIN;
   sp_session_logout(get_session(val_session));
+  TRACE_END(TRACE_API, "session_logout", NULL, 0);
   return Val_unit;
 }
 
@@ -592,23 +1568,73 @@ CAMLprim value ocaml_spotify_session_set_cache_size(value session, value size)
   return Val_unit;
 }
 
-CAMLprim value ocaml_spotify_session_process_events(value session)
+CAMLprim value ocaml_spotify_session_process_events(value val_session)
 {
   int timeout;
-  sp_session_process_events(get_session(session), &timeout);
+  sp_session *session = get_session(val_session);
+  struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  check_callback_domain("session_process_events");
+  TRACE_BEGIN;
+  spotify_lock();
+  sp_session_process_events(session, &timeout);
+  observe_drain();
+  if (data->star_jobs) {
+    star_jobs_pump(data);
+    /* Come back right away for the next batches. */
+    if (data->star_jobs) timeout = 0;
+  }
+  policy_apply(data, session);
+  spotify_unlock();
+  TRACE_END(TRACE_API, "session_process_events", "timeout_ms", timeout);
   return caml_copy_double((double)timeout / 1000);
 }
 
-CAMLprim value ocaml_spotify_session_player_load(value session, value track)
+static struct replay *get_replay(sp_session *session)
 {
-  sp_error error = sp_session_player_load(get_session(session), get_track(track));
+  return &(((struct userdata*)sp_session_userdata(session))->replay);
+}
+
+CAMLprim value ocaml_spotify_session_player_load(value val_session, value track)
+{
+  sp_session *session = get_session(val_session);
+  struct replay *replay = get_replay(session);
+  pthread_mutex_lock(&(replay->mutex));
+  replay_reset(replay, 0);
+  pthread_mutex_unlock(&(replay->mutex));
+  TRACE_BEGIN;
+  sp_error error = sp_session_player_load(session, get_track(track));
+  TRACE_END(TRACE_API, "session_player_load", "error", error);
   if (error) fail("sp_session_player_load", error);
   return Val_unit;
 }
 
-CAMLprim value ocaml_spotify_session_player_seek(value session, value offset)
+CAMLprim value ocaml_spotify_session_player_seek(value val_session, value offset)
 {
-  sp_session_player_seek(get_session(session), (int)(Double_val(offset) * 1000));
+  sp_session *session = get_session(val_session);
+  struct replay *replay = get_replay(session);
+  double seconds = Double_val(offset);
+  pthread_mutex_lock(&(replay->mutex));
+  if (replay->window > 0 && replay->sample_rate > 0) {
+    int64_t frame = (int64_t)(seconds * replay->sample_rate);
+    size_t size = replay->channels * 2;
+    int64_t first = replay->position - (int64_t)((replay->end - replay->start) / size);
+    int64_t current = replay->replaying ? replay->position - (int64_t)((replay->end - replay->cursor) / size) : replay->position;
+    if (frame >= first && frame <= replay->position && replay->end > replay->start) {
+      /* Served from the history. libspotify stays where it is and
+         resumes once the history has been replayed. */
+      replay->replaying = frame < replay->position;
+      replay->cursor = replay->end - (uint64_t)(replay->position - frame) * size;
+      replay->discontinuity = 1;
+      replay->generation++;
+      replay->hits++;
+      pthread_mutex_unlock(&(replay->mutex));
+      return Val_unit;
+    }
+    if (frame < current) replay->misses++;
+  }
+  replay_reset(replay, replay->sample_rate > 0 ? (int64_t)(seconds * replay->sample_rate) : 0);
+  pthread_mutex_unlock(&(replay->mutex));
+  sp_session_player_seek(session, (int)(seconds * 1000));
   return Val_unit;
 }
 
@@ -618,12 +1644,52 @@ CAMLprim value ocaml_spotify_session_player_play(value session, value play)
   return Val_unit;
 }
 
-CAMLprim value ocaml_spotify_session_player_unload(value session)
+CAMLprim value ocaml_spotify_session_player_unload(value val_session)
+{
+  sp_session *session = get_session(val_session);
+  struct replay *replay = get_replay(session);
+  pthread_mutex_lock(&(replay->mutex));
+  replay_reset(replay, 0);
+  pthread_mutex_unlock(&(replay->mutex));
+  sp_session_player_unload(session);
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_session_set_replay_window(value val_session, value window)
 {
-  sp_session_player_unload(get_session(session));
+  struct replay *replay = get_replay(get_session(val_session));
+  pthread_mutex_lock(&(replay->mutex));
+  replay->window = Double_val(window) > 0 ? Double_val(window) : 0;
+  /* The history is reallocated on the next delivery. */
+  free(replay->data);
+  replay->data = NULL;
+  replay->size = 0;
+  replay->sample_rate = 0;
+  replay->channels = 0;
+  replay_reset(replay, replay->position);
+  pthread_mutex_unlock(&(replay->mutex));
   return Val_unit;
 }
 
+CAMLprim value ocaml_spotify_session_replay_stats(value val_session)
+{
+  CAMLparam1(val_session);
+  CAMLlocal1(result);
+  struct replay *replay = get_replay(get_session(val_session));
+  pthread_mutex_lock(&(replay->mutex));
+  double window = replay->window;
+  double available = replay->sample_rate > 0 ? (double)(replay->end - replay->start) / (replay->channels * 2) / replay->sample_rate : 0;
+  int64_t hits = replay->hits, misses = replay->misses;
+  pthread_mutex_unlock(&(replay->mutex));
+  result = caml_alloc_tuple(5);
+  Store_field(result, 0, caml_copy_double(window));
+  Store_field(result, 1, caml_copy_double(available));
+  Store_field(result, 2, Val_long(hits));
+  Store_field(result, 3, Val_long(misses));
+  Store_field(result, 4, caml_copy_double(hits + misses > 0 ? (double)hits / (hits + misses) : 0));
+  CAMLreturn(result);
+}
+
 CAMLprim value ocaml_spotify_session_player_prefetch(value session, value track)
 {
   sp_error error = sp_session_player_prefetch(get_session(session), get_track(track));
@@ -633,7 +1699,9 @@ CAMLprim value ocaml_spotify_session_player_prefetch(value session, value track)
 
 CAMLprim value ocaml_spotify_session_playlistcontainer(value session)
 {
+  TRACE_BEGIN;
   sp_playlistcontainer *plc = sp_session_playlistcontainer(get_session(session));
+  TRACE_END(TRACE_API, "session_playlistcontainer", NULL, 0);
   if (plc) sp_playlistcontainer_add_ref(plc);
   return alloc_playlistcontainer(plc);
 }
@@ -867,6 +1935,58 @@ CAMLprim value ocaml_spotify_link_release(value link)
   return Val_unit;
 }
 
+/* +-----------------------------------------------------------------+
+   | Interned names                                                  |
+   +-----------------------------------------------------------------+ */
+
+/* Names of tracks, albums and artists are hash-consed: equal names
+   are returned as the same OCaml string, as long as it is alive. The
+   table is a weak array indexed by a hash of the contents; a name is
+   looked for in a few consecutive slots, and replaces the first free
+   one, or the first one if there is none. Looking up a name does not
+   allocate. */
+
+#define INTERN_SIZE 65536
+#define INTERN_PROBES 8
+
+#if defined(HAVE_EPHEMERON_API)
+static value intern_table = Val_unit;
+#endif
+
+static value intern_string(const char *str)
+{
+#if defined(HAVE_EPHEMERON_API)
+  CAMLparam0();
+  CAMLlocal2(key, result);
+  size_t len = strlen(str), i, slot, free_slot = INTERN_SIZE;
+  uint64_t h = 0xcbf29ce484222325ULL;
+#if defined(OCAML_MULTICORE)
+  /* The table is only used from the first domain. */
+  if (Caml_state->id != 0) CAMLreturn(caml_copy_string(str));
+#endif
+  if (intern_table == Val_unit) {
+    intern_table = caml_ephemeron_create(INTERN_SIZE);
+    caml_register_generational_global_root(&intern_table);
+  }
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char)str[i]) * 0x100000001b3ULL;
+  for (i = 0; i < INTERN_PROBES; i++) {
+    slot = (h + i) & (INTERN_SIZE - 1);
+    if (caml_ephemeron_get_key(intern_table, slot, &key)) {
+      if (caml_string_length(key) == len && memcmp(String_val(key), str, len) == 0)
+        CAMLreturn(key);
+    } else if (free_slot == INTERN_SIZE)
+      free_slot = slot;
+  }
+  if (free_slot == INTERN_SIZE) free_slot = h & (INTERN_SIZE - 1);
+  result = caml_copy_string(str);
+  caml_ephemeron_set_key(intern_table, free_slot, result);
+  CAMLreturn(result);
+#else
+  return caml_copy_string(str);
+#endif
+}
+
 /* +-----------------------------------------------------------------+
    | Track subsystem                                                 |
    +-----------------------------------------------------------------+ */
@@ -901,22 +2021,62 @@ CAMLprim value ocaml_spotify_track_is_starred(value session, value track)
   return Val_bool(sp_track_is_starred(get_session(session), get_track(track)));
 }
 
-CAMLprim value ocaml_spotify_track_set_starred(value session, value tracks, value star)
+CAMLprim value ocaml_spotify_track_set_starred(value val_session, value tracks, value star)
 {
-  int len = 0;
-  value node = tracks;
-  while (Is_block(node)) {
-    len++;
-    node = Field(node, 1);
-  }
-  sp_track *track_array[len];
-  int idx = 0;
-  node = tracks;
-  while (Is_block(node)) {
-    track_array[idx++] = get_track(Field(node, 0));
-    node = Field(node, 1);
+  sp_session *session = get_session(val_session);
+  long i, len = Wosize_val(tracks);
+  for (i = 0; i < len; i++)
+    get_track(Field(tracks, i));
+  sp_track **track_array = (sp_track**)xmalloc(len * sizeof(sp_track*) + 1);
+  for (i = 0; i < len; i++)
+    track_array[i] = Track_val(Field(tracks, i));
+  sp_track_set_starred(session, track_array, len, Bool_val(star));
+  free(track_array);
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_track_get_playable(value val_session, value val_track)
+{
+  sp_session *session = get_session(val_session);
+  sp_track *track = get_track(val_track);
+  spotify_lock();
+  track = playable_resolve(session, track);
+  spotify_unlock();
+  return alloc_track(track);
+}
+
+CAMLprim value ocaml_spotify_tracks_get_playable(value val_session, value tracks)
+{
+  CAMLparam2(val_session, tracks);
+  CAMLlocal2(result, handle);
+  sp_session *session = get_session(val_session);
+  long i, count = Wosize_val(tracks);
+  for (i = 0; i < count; i++)
+    get_track(Field(tracks, i));
+  sp_track **pointers = (sp_track**)xmalloc(count * sizeof(sp_track*) + 1);
+  for (i = 0; i < count; i++)
+    pointers[i] = Track_val(Field(tracks, i));
+  TRACE_BEGIN;
+  spotify_lock();
+  for (i = 0; i < count; i++)
+    pointers[i] = playable_resolve(session, pointers[i]);
+  spotify_unlock();
+  TRACE_END(TRACE_API, "tracks_get_playable", "count", count);
+  result = caml_alloc(count, 0);
+  for (i = 0; i < count; i++) {
+    handle = alloc_track(pointers[i]);
+    Store_field(result, i, handle);
   }
-  sp_track_set_starred(get_session(session), track_array, len, Bool_val(star));
+  free(pointers);
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_session_clear_playable_cache(value val_session)
+{
+  sp_session *session = get_session(val_session);
+  spotify_lock();
+  playable_cache_free((struct userdata*)sp_session_userdata(session));
+  spotify_unlock();
   return Val_unit;
 }
 
@@ -941,7 +2101,7 @@ CAMLprim value ocaml_spotify_track_album(value track)
 
 CAMLprim value ocaml_spotify_track_name(value track)
 {
-  return caml_copy_string(sp_track_name(get_track(track)));
+  return intern_string(sp_track_name(get_track(track)));
 }
 
 CAMLprim value ocaml_spotify_track_duration(value track)
@@ -979,519 +2139,7419 @@ CAMLprim value ocaml_spotify_track_release(value track)
 }
 
 /* +-----------------------------------------------------------------+
-   | Album subsystem                                                 |
+   | Bulk metadata                                                   |
    +-----------------------------------------------------------------+ */
 
-CAMLprim value ocaml_spotify_album_is_loaded(value album)
-{
-  return Val_bool(sp_album_is_loaded(get_album(album)));
-}
+/* Metadata of a track, as offsets in a string arena. */
+struct track_metadata {
+  int is_loaded;
+  size_t name;
+  size_t album;
+  size_t artists;
+  int num_artists;
+  int duration;
+  int popularity;
+  int disc;
+  int index;
+};
 
-CAMLprim value ocaml_spotify_album_is_available(value album)
+struct arena {
+  char *data;
+  size_t size;
+  size_t used;
+};
+
+static size_t arena_add(struct arena *arena, const char *str)
 {
-  return Val_bool(sp_album_is_available(get_album(album)));
+  size_t len = strlen(str) + 1;
+  if (arena->used + len > arena->size) {
+    while (arena->used + len > arena->size) arena->size = arena->size ? arena->size * 2 : 4096;
+    arena->data = realloc(arena->data, arena->size);
+    if (arena->data == NULL) {
+      perror("cannot allocate memory");
+      abort();
+    }
+  }
+  size_t offset = arena->used;
+  memcpy(arena->data + offset, str, len);
+  arena->used += len;
+  return offset;
 }
 
-CAMLprim value ocaml_spotify_album_artist(value album)
-{
-  sp_artist *artist = sp_album_artist(get_album(album));
-  if (artist) sp_artist_add_ref(artist);
-  return alloc_artist(artist);
-}
+/* Metadata is extracted in two steps: it is first copied out of
+   libspotify in the first domain, with the lock held, then OCaml
+   values are built from the copy, possibly in another domain. */
 
-CAMLprim value ocaml_spotify_album_cover(value album)
-{
-  const byte *id = sp_album_cover(get_album(album));
-  value str = caml_alloc_string(20);
-  memcpy(String_val(str), id, 20);
-  return str;
-}
+struct metadata_chunk {
+  long count;
+  struct track_metadata *entries;
+  struct arena arena;
+};
 
-CAMLprim value ocaml_spotify_album_name(value album)
+#define Metadata_chunk_val(v) *(struct metadata_chunk **)Data_custom_val(v)
+
+static void metadata_chunk_finalize(value x)
 {
-  return caml_copy_string(sp_album_name(get_album(album)));
+  struct metadata_chunk *chunk = Metadata_chunk_val(x);
+  if (chunk) {
+    free(chunk->entries);
+    free(chunk->arena.data);
+    free(chunk);
+  }
 }
 
+static struct custom_operations metadata_chunk_ops = {
+  "spotify:metadata_chunk",
+  metadata_chunk_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
 
-CAMLprim value ocaml_spotify_album_year(value album)
+CAMLprim value ocaml_spotify_tracks_metadata_extract(value tracks, value val_offset, value val_count)
 {
-  return Val_int(sp_album_year(get_album(album)));
+  CAMLparam1(tracks);
+  CAMLlocal1(result);
+  long offset = Long_val(val_offset);
+  long count = Long_val(val_count);
+  long i, j;
+  if (offset < 0 || count < 0 || offset > (long)Wosize_val(tracks) - count)
+    caml_invalid_argument("Spotify.tracks_metadata");
+  for (i = 0; i < count; i++)
+    get_track(Field(tracks, offset + i));
+  struct metadata_chunk *chunk = new(struct metadata_chunk);
+  chunk->count = count;
+  chunk->entries = (struct track_metadata*)xmalloc(count * sizeof(struct track_metadata) + 1);
+  chunk->arena.data = NULL;
+  chunk->arena.size = 0;
+  chunk->arena.used = 0;
+  sp_track **pointers = (sp_track**)xmalloc(count * sizeof(sp_track*) + 1);
+  for (i = 0; i < count; i++)
+    pointers[i] = Track_val(Field(tracks, offset + i));
+
+  struct arena *arena = &(chunk->arena);
+  spotify_lock();
+  for (i = 0; i < count; i++) {
+    sp_track *track = pointers[i];
+    struct track_metadata *entry = &(chunk->entries[i]);
+    entry->is_loaded = sp_track_is_loaded(track);
+    entry->name = arena_add(arena, sp_track_name(track));
+    sp_album *album = sp_track_album(track);
+    entry->album = arena_add(arena, album ? sp_album_name(album) : "");
+    entry->num_artists = sp_track_num_artists(track);
+    entry->artists = arena->used;
+    for (j = 0; j < entry->num_artists; j++) {
+      sp_artist *artist = sp_track_artist(track, j);
+      arena_add(arena, artist ? sp_artist_name(artist) : "");
+    }
+    entry->duration = sp_track_duration(track);
+    entry->popularity = sp_track_popularity(track);
+    entry->disc = sp_track_disc(track);
+    entry->index = sp_track_index(track);
+  }
+  spotify_unlock();
+  free(pointers);
+
+  result = caml_alloc_custom(&metadata_chunk_ops, sizeof(struct metadata_chunk *), 0, 1);
+  Metadata_chunk_val(result) = chunk;
+  CAMLreturn(result);
 }
 
-CAMLprim value ocaml_spotify_album_type(value album)
-{
-  return Val_int(sp_album_type(get_album(album)));
+/* Build the metadata of an extracted chunk. It does not call
+   libspotify, so it may run in any domain. The chunk is freed. */
+CAMLprim value ocaml_spotify_tracks_metadata_build(value val_chunk)
+{
+  CAMLparam1(val_chunk);
+  CAMLlocal5(result, metadata, artists, cell, str);
+  struct metadata_chunk *chunk = Metadata_chunk_val(val_chunk);
+  long i, j;
+  if (chunk == NULL) caml_raise(*caml_named_value("spotify:null"));
+  Metadata_chunk_val(val_chunk) = NULL;
+  const char *data = chunk->arena.data;
+  result = caml_alloc(chunk->count, 0);
+  for (i = 0; i < chunk->count; i++) {
+    struct track_metadata *entry = &(chunk->entries[i]);
+    /* Artist names are consecutive in the arena; build the list from
+       the last one. */
+    const char *names[entry->num_artists > 0 ? entry->num_artists : 1];
+    const char *name = data + entry->artists;
+    for (j = 0; j < entry->num_artists; j++) {
+      names[j] = name;
+      name += strlen(name) + 1;
+    }
+    artists = Val_emptylist;
+    for (j = entry->num_artists - 1; j >= 0; j--) {
+      str = intern_string(names[j]);
+      cell = caml_alloc_tuple(2);
+      Store_field(cell, 0, str);
+      Store_field(cell, 1, artists);
+      artists = cell;
+    }
+    metadata = caml_alloc_tuple(8);
+    Store_field(metadata, 0, Val_bool(entry->is_loaded));
+    str = intern_string(data + entry->name);
+    Store_field(metadata, 1, str);
+    str = intern_string(data + entry->album);
+    Store_field(metadata, 2, str);
+    Store_field(metadata, 3, artists);
+    str = caml_copy_double((double)entry->duration / 1000);
+    Store_field(metadata, 4, str);
+    Store_field(metadata, 5, Val_int(entry->popularity));
+    Store_field(metadata, 6, Val_int(entry->disc));
+    Store_field(metadata, 7, Val_int(entry->index));
+    Store_field(result, i, metadata);
+  }
+  free(chunk->entries);
+  free(chunk->arena.data);
+  free(chunk);
+  CAMLreturn(result);
 }
 
-CAMLprim value ocaml_spotify_album_release(value album)
+/* Number of track flags computed by tracks_flags. */
+#define TRACK_FLAGS 4
+
+/* Flags are computed in a single pass with the lock held, into one
+   bitset per flag, bit [i mod 8] of byte [i / 8] being the flag of
+   track [i]. */
+CAMLprim value ocaml_spotify_tracks_flags(value val_session, value tracks)
 {
-  album_finalize(album);
-  Album_val(album) = NULL;
-  return Val_unit;
+  CAMLparam2(val_session, tracks);
+  CAMLlocal2(result, bitset);
+  sp_session *session = get_session(val_session);
+  long i, count = Wosize_val(tracks);
+  int j;
+  intnat dim = (count + 7) / 8;
+  unsigned char *bits[TRACK_FLAGS];
+  for (i = 0; i < count; i++)
+    get_track(Field(tracks, i));
+  result = caml_alloc_tuple(TRACK_FLAGS);
+  for (j = 0; j < TRACK_FLAGS; j++) {
+    bitset = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, &dim);
+    bits[j] = (unsigned char*)Caml_ba_data_val(bitset);
+    memset(bits[j], 0, dim);
+    Store_field(result, j, bitset);
+  }
+  sp_track **pointers = (sp_track**)xmalloc(count * sizeof(sp_track*) + 1);
+  for (i = 0; i < count; i++)
+    pointers[i] = Track_val(Field(tracks, i));
+  TRACE_BEGIN;
+  spotify_lock();
+  for (i = 0; i < count; i++) {
+    unsigned char mask = 1 << (i & 7);
+    sp_track *track = pointers[i];
+    if (sp_track_is_available(session, track)) bits[0][i >> 3] |= mask;
+    if (sp_track_is_local(session, track)) bits[1][i >> 3] |= mask;
+    if (sp_track_is_autolinked(session, track)) bits[2][i >> 3] |= mask;
+    if (sp_track_is_starred(session, track)) bits[3][i >> 3] |= mask;
+  }
+  spotify_unlock();
+  TRACE_END(TRACE_API, "tracks_flags", "count", count);
+  free(pointers);
+  CAMLreturn(result);
 }
 
 /* +-----------------------------------------------------------------+
-   | Aritst subsystem                                                |
+   | Object ids                                                      |
    +-----------------------------------------------------------------+ */
 
-CAMLprim value ocaml_spotify_artist_name(value artist)
-{
-  return caml_copy_string(sp_artist_name(get_artist(artist)));
+/* Ids of tracks, albums and artists are the 128-bit numbers encoded
+   in base 62 in their links. Objects without such an id, like local
+   tracks, get a hash of their link instead. */
+
+#define ID_SIZE 16
+
+static const char base62_digits[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+/* Decode 22 base 62 digits to a big-endian id. Returns 0 on
+   failure. */
+static int decode_base62_id(const char *str, size_t len, unsigned char id[ID_SIZE])
+{
+  uint32_t limbs[4] = { 0, 0, 0, 0 };
+  /* Little-endian 32-bit limbs. */
+  size_t i;
+  int j;
+  if (len != 22) return 0;
+  for (i = 0; i < len; i++) {
+    const char *digit = strchr(base62_digits, str[i]);
+    if (digit == NULL || *digit == 0) return 0;
+    uint64_t carry = digit - base62_digits;
+    for (j = 0; j < 4; j++) {
+      uint64_t x = (uint64_t)limbs[j] * 62 + carry;
+      limbs[j] = (uint32_t)x;
+      carry = x >> 32;
+    }
+    if (carry) return 0;
+  }
+  for (j = 0; j < 4; j++) {
+    uint32_t limb = limbs[3 - j];
+    id[j * 4] = limb >> 24;
+    id[j * 4 + 1] = limb >> 16;
+    id[j * 4 + 2] = limb >> 8;
+    id[j * 4 + 3] = limb;
+  }
+  return 1;
 }
 
-CAMLprim value ocaml_spotify_artist_is_loaded(value artist)
+static void hash_id(const char *str, unsigned char id[ID_SIZE])
 {
-  return Val_bool(sp_artist_is_loaded(get_artist(artist)));
+  uint64_t h1 = 0xcbf29ce484222325ULL, h2 = 0x84222325cbf29ce4ULL;
+  int i;
+  for (; *str; str++) {
+    h1 = (h1 ^ (unsigned char)*str) * 0x100000001b3ULL;
+    h2 = (h2 ^ (unsigned char)*str) * 0x1000193ULL + 0x9e3779b97f4a7c15ULL;
+  }
+  for (i = 0; i < 8; i++) {
+    id[i] = h1 >> (56 - i * 8);
+    id[8 + i] = h2 >> (56 - i * 8);
+  }
 }
 
-CAMLprim value ocaml_spotify_artist_release(value artist)
+/* Compute the id of [object]. Returns 0 if libspotify cannot make a
+   link to it. */
+static int object_id(enum object_kind kind, void *object, unsigned char id[ID_SIZE])
 {
-  artist_finalize(artist);
-  Artist_val(artist) = NULL;
-  return Val_unit;
+  sp_link *link;
+  char buffer[256];
+  switch (kind) {
+  case OBJECT_TRACK: link = sp_link_create_from_track((sp_track*)object, 0); break;
+  case OBJECT_ALBUM: link = sp_link_create_from_album((sp_album*)object); break;
+  default: link = sp_link_create_from_artist((sp_artist*)object); break;
+  }
+  if (link == NULL) return 0;
+  int len = sp_link_as_string(link, buffer, sizeof(buffer));
+  sp_link_release(link);
+  if (len <= 0 || len >= (int)sizeof(buffer)) return 0;
+  const char *last = strrchr(buffer, ':');
+  if (last == NULL || !decode_base62_id(last + 1, strlen(last + 1), id))
+    hash_id(buffer, id);
+  return 1;
+}
+
+static value alloc_id(enum object_kind kind, void *object)
+{
+  unsigned char id[ID_SIZE];
+  if (!object_id(kind, object, id)) caml_raise(*caml_named_value("spotify:null"));
+  value str = caml_alloc_string(ID_SIZE);
+  memcpy(String_val(str), id, ID_SIZE);
+  return str;
 }
 
-/* +-----------------------------------------------------------------+
-   | Album browsing                                                  |
-   +-----------------------------------------------------------------+ */
-
-static void albumbrowse_complete(sp_albumbrowse *result, void *userdata)
+CAMLprim value ocaml_spotify_track_id(value track)
 {
-  ENTER_CALLBACK;
-  struct albumbrowse *albumbrowse = (struct albumbrowse *)userdata;
-  caml_callback(albumbrowse->callback, albumbrowse->albumbrowse);
-  LEAVE_CALLBACK;
+  return alloc_id(OBJECT_TRACK, get_track(track));
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_create(value val_session, value album, value callback)
+CAMLprim value ocaml_spotify_album_id(value album)
 {
-  sp_session *session = get_session(val_session);
-  struct albumbrowse *albumbrowse = new(struct albumbrowse);
-  sp_albumbrowse *sp_albumbrowse = sp_albumbrowse_create(session,
-                                                         Album_val(album),
-                                                         albumbrowse_complete,
-                                                         (void*)albumbrowse);
-  albumbrowse->sp_albumbrowse = sp_albumbrowse;
-  albumbrowse->callback = callback;
-  albumbrowse->albumbrowse = alloc_albumbrowse(albumbrowse);
-  caml_register_generational_global_root(&(albumbrowse->callback));
-  caml_register_generational_global_root(&(albumbrowse->albumbrowse));
-  return albumbrowse->albumbrowse;
+  return alloc_id(OBJECT_ALBUM, get_album(album));
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_is_loaded(value albumbrowse)
+CAMLprim value ocaml_spotify_artist_id(value artist)
 {
-  return Val_bool(sp_albumbrowse_is_loaded(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+  return alloc_id(OBJECT_ARTIST, get_artist(artist));
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_error(value albumbrowse)
+/* Returns the artist whose id is [id], or NULL if [id] is not the id
+   of an artist. */
+static sp_artist *artist_of_id(const unsigned char *id)
 {
-  return Val_int(sp_albumbrowse_error(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+  uint32_t limbs[4];
+  char buffer[64];
+  int i, j;
+  for (j = 0; j < 4; j++)
+    limbs[3 - j] = ((uint32_t)id[j * 4] << 24) | ((uint32_t)id[j * 4 + 1] << 16) | ((uint32_t)id[j * 4 + 2] << 8) | id[j * 4 + 3];
+  strcpy(buffer, "spotify:artist:");
+  char *digits = buffer + strlen(buffer);
+  for (i = 21; i >= 0; i--) {
+    uint64_t remainder = 0;
+    for (j = 3; j >= 0; j--) {
+      uint64_t x = (remainder << 32) | limbs[j];
+      limbs[j] = x / 62;
+      remainder = x % 62;
+    }
+    digits[i] = base62_digits[remainder];
+  }
+  digits[22] = 0;
+  sp_link *link = sp_link_create_from_string(buffer);
+  if (link == NULL) return NULL;
+  sp_artist *artist = sp_link_type(link) == SP_LINKTYPE_ARTIST ? sp_link_as_artist(link) : NULL;
+  if (artist) sp_artist_add_ref(artist);
+  sp_link_release(link);
+  return artist;
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_album(value albumbrowse)
+CAMLprim value ocaml_spotify_artist_of_id(value id)
 {
-  sp_album *album = sp_albumbrowse_album(get_albumbrowse(albumbrowse)->sp_albumbrowse);
-  if (album) sp_album_add_ref(album);
-  return alloc_album(album);
+  if (caml_string_length(id) != ID_SIZE) caml_invalid_argument("Spotify.artist_of_id");
+  return alloc_artist(artist_of_id((const unsigned char*)String_val(id)));
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_artist(value albumbrowse)
-{
-  sp_artist *artist = sp_albumbrowse_artist(get_albumbrowse(albumbrowse)->sp_albumbrowse);
-  if (artist) sp_artist_add_ref(artist);
-  return alloc_artist(artist);
-}
+/* +-----------------------------------------------------------------+
+   | Metadata store                                                  |
+   +-----------------------------------------------------------------+ */
 
-CAMLprim value ocaml_spotify_albumbrowse_num_copyrights(value albumbrowse)
+/* A persistent store of the metadata of tracks, albums and artists,
+   keyed by their ids. The file is append-only: a header, then
+   records aligned on 8 bytes, in host byte order:
+
+   - 0: size of the record (32 bits)
+   - 4: kind (8 bits)
+   - 8: id (16 bytes)
+   - 24: id of the parent: the album of a track, the artist of an
+     album, zeros for artists (16 bytes)
+   - 40, 44: duration in milliseconds and popularity of tracks, year
+     of albums (32 bits each)
+   - 48: length of the name (32 bits)
+   - 52: the name, followed by a null byte
+
+   A record shadows older ones with the same id. The file is mapped
+   read-only; since it only grows, mappings are kept until the store
+   is closed. Names are copied out of the mapping, so that entries
+   remain valid after the store is closed. */
+
+#define STORE_MAGIC "OSPM"
+#define STORE_VERSION 1
+#define STORE_HEADER_SIZE 16
+#define STORE_RECORD_HEADER_SIZE 52
+#define STORE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct store_mapping {
+  unsigned char *addr;
+  size_t length;
+  struct store_mapping *next;
+};
+
+struct store_pending {
+  enum object_kind kind;
+  void *object;
+  /* Object on which a reference is held until it is loaded. */
+};
+
+struct metadata_store {
+  pthread_mutex_t mutex;
+  int fd;
+  size_t size;
+  /* Size of the valid part of the file. */
+  unsigned char *map;
+  size_t mapped;
+  struct store_mapping *mappings;
+  /* All mappings, the first one is [map]. */
+  uint64_t *slots;
+  size_t num_slots;
+  size_t count;
+  /* Open-addressing index from ids to record offsets plus one. */
+  void **seen;
+  size_t num_seen_slots;
+  size_t num_seen;
+  /* Objects already recorded or pending. */
+  struct store_pending *pending;
+  size_t num_pending;
+  size_t pending_capacity;
+};
+
+#define Metadata_store_val(v) *(struct metadata_store **)Data_custom_val(v)
+
+static uint64_t id_hash(const unsigned char *id)
 {
-  return Val_int(sp_albumbrowse_num_copyrights(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+  uint64_t a, b;
+  memcpy(&a, id, 8);
+  memcpy(&b, id + 8, 8);
+  return (a ^ (b * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_copyright(value albumbrowse, value index)
+static const unsigned char *record_id(struct metadata_store *store, uint64_t offset)
 {
-  const char *copyright = sp_albumbrowse_copyright(get_albumbrowse(albumbrowse)->sp_albumbrowse, Int_val(index));
-  if (copyright)
-    return caml_copy_string(copyright);
-  else
-    caml_invalid_argument("Spotify.albumbrowse_copyright");
+  return store->map + offset + 8;
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_num_tracks(value albumbrowse)
+/* Map at least [needed] bytes of the file. */
+static int store_map(struct metadata_store *store, size_t needed)
 {
-  return Val_int(sp_albumbrowse_num_tracks(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+  if (needed <= store->mapped) return 0;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t length = store->mapped * 2;
+  if (length < needed) length = needed;
+  if (length < 1 << 20) length = 1 << 20;
+  length = (length + page - 1) / page * page;
+  void *addr = mmap(NULL, length, PROT_READ, MAP_SHARED, store->fd, 0);
+  if (addr == MAP_FAILED) return -1;
+  struct store_mapping *mapping = new(struct store_mapping);
+  mapping->addr = (unsigned char*)addr;
+  mapping->length = length;
+  mapping->next = store->mappings;
+  store->mappings = mapping;
+  store->map = mapping->addr;
+  store->mapped = length;
+  return 0;
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_track(value albumbrowse, value index)
+/* Return the slot of [id] in the index, empty if it is absent. */
+static uint64_t *store_slot(struct metadata_store *store, const unsigned char *id)
 {
-  sp_track *track = sp_albumbrowse_track(get_albumbrowse(albumbrowse)->sp_albumbrowse, Int_val(index));
-  if (track) sp_track_add_ref(track);
-  return alloc_track(track);
+  size_t mask = store->num_slots - 1;
+  size_t i = id_hash(id) & mask;
+  while (store->slots[i] && memcmp(record_id(store, store->slots[i] - 1), id, ID_SIZE))
+    i = (i + 1) & mask;
+  return &(store->slots[i]);
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_review(value albumbrowse)
+static void store_index(struct metadata_store *store, uint64_t offset)
 {
-  return caml_copy_string(sp_albumbrowse_review(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+  if ((store->count + 1) * 2 > store->num_slots) {
+    uint64_t *old = store->slots;
+    size_t i, num_old = store->num_slots;
+    store->num_slots = num_old ? num_old * 2 : 1024;
+    store->slots = (uint64_t*)calloc(store->num_slots, sizeof(uint64_t));
+    if (store->slots == NULL) {
+      perror("cannot allocate memory");
+      abort();
+    }
+    for (i = 0; i < num_old; i++)
+      if (old[i]) *store_slot(store, record_id(store, old[i] - 1)) = old[i];
+    free(old);
+  }
+  uint64_t *slot = store_slot(store, record_id(store, offset));
+  if (*slot == 0) store->count++;
+  *slot = offset + 1;
 }
 
-CAMLprim value ocaml_spotify_albumbrowse_release(value albumbrowse)
+/* Check the record at [offset] and return its size, or 0 if it is
+   invalid or truncated. */
+static size_t store_check_record(const unsigned char *data, size_t size, size_t offset)
 {
-  albumbrowse_finalize(albumbrowse);
-  Albumbrowse_val(albumbrowse) = NULL;
-  return Val_unit;
+  uint32_t record_size, name_length;
+  if (offset + STORE_RECORD_HEADER_SIZE > size) return 0;
+  memcpy(&record_size, data + offset, 4);
+  memcpy(&name_length, data + offset + 48, 4);
+  if (record_size != STORE_ALIGN(STORE_RECORD_HEADER_SIZE + (size_t)name_length + 1)) return 0;
+  if (offset + record_size > size || data[offset + 4] > OBJECT_ARTIST) return 0;
+  return record_size;
 }
 
-/* +-----------------------------------------------------------------+
-   | Artist browsing                                                 |
-   +-----------------------------------------------------------------+ */
+static void store_close(struct metadata_store *store);
 
-static void artistbrowse_complete(sp_artistbrowse *result, void *userdata)
+static struct metadata_store *store_open(const char *path, int create, const char **error)
 {
-  ENTER_CALLBACK;
-  struct artistbrowse *artistbrowse = (struct artistbrowse *)userdata;
-  caml_callback(artistbrowse->callback, artistbrowse->artistbrowse);
-  LEAVE_CALLBACK;
+  struct stat st;
+  unsigned char header[STORE_HEADER_SIZE];
+  int fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    *error = strerror(errno);
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  if (st.st_size == 0) {
+    uint32_t version = STORE_VERSION;
+    memset(header, 0, sizeof(header));
+    memcpy(header, STORE_MAGIC, 4);
+    memcpy(header + 4, &version, 4);
+    if (pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+      *error = strerror(errno);
+      close(fd);
+      return NULL;
+    }
+    st.st_size = sizeof(header);
+  } else {
+    uint32_t version;
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, STORE_MAGIC, 4)) {
+      *error = NULL;
+      close(fd);
+      return NULL;
+    }
+    memcpy(&version, header + 4, 4);
+    if (version != STORE_VERSION) {
+      *error = NULL;
+      close(fd);
+      return NULL;
+    }
+  }
+  struct metadata_store *store = new(struct metadata_store);
+  memset(store, 0, sizeof(struct metadata_store));
+  pthread_mutex_init(&(store->mutex), NULL);
+  store->fd = fd;
+  if (store_map(store, st.st_size)) {
+    *error = strerror(errno);
+    store_close(store);
+    return NULL;
+  }
+  store->num_slots = 1024;
+  store->slots = (uint64_t*)calloc(store->num_slots, sizeof(uint64_t));
+  if (store->slots == NULL) {
+    perror("cannot allocate memory");
+    abort();
+  }
+  /* Index records. A truncated record at the end, left by a crash,
+     is dropped. */
+  size_t offset = STORE_HEADER_SIZE, record_size;
+  while ((record_size = store_check_record(store->map, st.st_size, offset))) {
+    store_index(store, offset);
+    offset += record_size;
+  }
+  if (offset < (size_t)st.st_size && ftruncate(fd, offset) < 0) {
+    *error = strerror(errno);
+    store_close(store);
+    return NULL;
+  }
+  store->size = offset;
+  return store;
+}
+
+static int store_append(struct metadata_store *store, enum object_kind kind, const unsigned char *id, const unsigned char *parent, int32_t a, int32_t b, const char *name)
+{
+  uint32_t name_length = strlen(name);
+  uint32_t size = STORE_ALIGN(STORE_RECORD_HEADER_SIZE + (size_t)name_length + 1);
+  uint64_t *slot = store_slot(store, id);
+  if (*slot) {
+    /* Skip records which would not change anything. */
+    const unsigned char *record = store->map + *slot - 1;
+    int32_t old_a, old_b;
+    uint32_t old_length;
+    memcpy(&old_a, record + 40, 4);
+    memcpy(&old_b, record + 44, 4);
+    memcpy(&old_length, record + 48, 4);
+    if (record[4] == kind && !memcmp(record + 24, parent, ID_SIZE) && old_a == a && old_b == b
+        && old_length == name_length && !memcmp(record + STORE_RECORD_HEADER_SIZE, name, name_length))
+      return 0;
+  }
+  unsigned char *record = (unsigned char*)xmalloc(size);
+  memset(record, 0, size);
+  memcpy(record, &size, 4);
+  record[4] = kind;
+  memcpy(record + 8, id, ID_SIZE);
+  memcpy(record + 24, parent, ID_SIZE);
+  memcpy(record + 40, &a, 4);
+  memcpy(record + 44, &b, 4);
+  memcpy(record + 48, &name_length, 4);
+  memcpy(record + STORE_RECORD_HEADER_SIZE, name, name_length);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pwrite(store->fd, record + done, size - done, store->size + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      free(record);
+      return -1;
+    }
+    done += n;
+  }
+  free(record);
+  if (store_map(store, store->size + size)) {
+    if (ftruncate(store->fd, store->size) < 0) perror("ocaml-spotify: cannot truncate the metadata store");
+    return -1;
+  }
+  store_index(store, store->size);
+  store->size += size;
+  return 0;
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_create(value val_session, value artist, value callback)
+static int object_is_loaded(enum object_kind kind, void *object)
 {
-  sp_session *session = get_session(val_session);
-  struct artistbrowse *artistbrowse = new(struct artistbrowse);
-  sp_artistbrowse *sp_artistbrowse = sp_artistbrowse_create(session,
-                                                            Artist_val(artist),
-                                                            artistbrowse_complete,
-                                                            (void*)artistbrowse);
-  artistbrowse->sp_artistbrowse = sp_artistbrowse;
-  artistbrowse->callback = callback;
-  artistbrowse->artistbrowse = alloc_artistbrowse(artistbrowse);
-  caml_register_generational_global_root(&(artistbrowse->callback));
-  caml_register_generational_global_root(&(artistbrowse->artistbrowse));
-  return artistbrowse->artistbrowse;
+  switch (kind) {
+  case OBJECT_TRACK: return sp_track_is_loaded((sp_track*)object);
+  case OBJECT_ALBUM: return sp_album_is_loaded((sp_album*)object);
+  default: return sp_artist_is_loaded((sp_artist*)object);
+  }
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_is_loaded(value artistbrowse)
+/* Read the metadata of a loaded object: its id, the id of its parent
+   (zeros if it has none), its name and two numbers, the duration and
+   popularity of tracks or the year of albums. Returns 0 if it has no
+   id. */
+static int object_metadata(enum object_kind kind, void *object, unsigned char id[ID_SIZE], unsigned char parent[ID_SIZE], int32_t *a, int32_t *b, const char **name)
+{
+  memset(parent, 0, ID_SIZE);
+  *a = 0;
+  *b = 0;
+  if (!object_id(kind, object, id)) return 0;
+  switch (kind) {
+  case OBJECT_TRACK: {
+    sp_track *track = (sp_track*)object;
+    sp_album *album = sp_track_album(track);
+    if (album) object_id(OBJECT_ALBUM, album, parent);
+    *name = sp_track_name(track);
+    *a = sp_track_duration(track);
+    *b = sp_track_popularity(track);
+    break;
+  }
+  case OBJECT_ALBUM: {
+    sp_album *album = (sp_album*)object;
+    sp_artist *artist = sp_album_artist(album);
+    if (artist) object_id(OBJECT_ARTIST, artist, parent);
+    *name = sp_album_name(album);
+    *a = sp_album_year(album);
+    break;
+  }
+  default:
+    *name = sp_artist_name((sp_artist*)object);
+    break;
+  }
+  if (*name == NULL) *name = "";
+  return 1;
+}
+
+/* Append the metadata of a loaded object. Called with the store
+   mutex held. */
+static void store_record(struct metadata_store *store, enum object_kind kind, void *object)
 {
-  return Val_bool(sp_artistbrowse_is_loaded(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+  unsigned char id[ID_SIZE], parent[ID_SIZE];
+  const char *name;
+  int32_t a, b;
+  if (!object_metadata(kind, object, id, parent, &a, &b, &name)) return;
+  if (store_append(store, kind, id, parent, a, b, name))
+    perror("ocaml-spotify: cannot append to the metadata store");
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_error(value artistbrowse)
+static void release_object(enum object_kind kind, void *object)
 {
-  return Val_int(sp_artistbrowse_error(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+  switch (kind) {
+  case OBJECT_TRACK: RELEASE_LATER(sp_track_release, object); break;
+  case OBJECT_ALBUM: RELEASE_LATER(sp_album_release, object); break;
+  default: RELEASE_LATER(sp_artist_release, object); break;
+  }
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_artist(value artistbrowse)
+/* Add [object] to the set of seen objects. Returns 0 if it was
+   already there. */
+static int store_see(struct metadata_store *store, void *object)
 {
-  sp_artist *artist = sp_artistbrowse_artist(get_artistbrowse(artistbrowse)->sp_artistbrowse);
-  if (artist) sp_artist_add_ref(artist);
-  return alloc_artist(artist);
+  size_t i, mask;
+  if ((store->num_seen + 1) * 2 > store->num_seen_slots) {
+    void **old = store->seen;
+    size_t num_old = store->num_seen_slots;
+    store->num_seen_slots = num_old ? num_old * 2 : 1024;
+    store->seen = (void**)calloc(store->num_seen_slots, sizeof(void*));
+    if (store->seen == NULL) {
+      perror("cannot allocate memory");
+      abort();
+    }
+    mask = store->num_seen_slots - 1;
+    for (i = 0; i < num_old; i++)
+      if (old[i]) {
+        size_t j = ((uintptr_t)old[i] * 0x9e3779b97f4a7c15ULL >> 16) & mask;
+        while (store->seen[j]) j = (j + 1) & mask;
+        store->seen[j] = old[i];
+      }
+    free(old);
+  }
+  mask = store->num_seen_slots - 1;
+  i = ((uintptr_t)object * 0x9e3779b97f4a7c15ULL >> 16) & mask;
+  while (store->seen[i]) {
+    if (store->seen[i] == object) return 0;
+    i = (i + 1) & mask;
+  }
+  store->seen[i] = object;
+  store->num_seen++;
+  return 1;
+}
+
+static void store_observe(enum object_kind kind, void *object)
+{
+  struct metadata_store *store = attached_store;
+  if (store == NULL) return;
+  pthread_mutex_lock(&(store->mutex));
+  if (store_see(store, object)) {
+    if (object_is_loaded(kind, object))
+      store_record(store, kind, object);
+    else {
+      if (store->num_pending == store->pending_capacity) {
+        store->pending_capacity = store->pending_capacity ? store->pending_capacity * 2 : 64;
+        store->pending = (struct store_pending*)realloc(store->pending, store->pending_capacity * sizeof(struct store_pending));
+        if (store->pending == NULL) {
+          perror("cannot allocate memory");
+          abort();
+        }
+      }
+      switch (kind) {
+      case OBJECT_TRACK: sp_track_add_ref((sp_track*)object); break;
+      case OBJECT_ALBUM: sp_album_add_ref((sp_album*)object); break;
+      default: sp_artist_add_ref((sp_artist*)object); break;
+      }
+      store->pending[store->num_pending].kind = kind;
+      store->pending[store->num_pending].object = object;
+      store->num_pending++;
+    }
+  }
+  pthread_mutex_unlock(&(store->mutex));
+}
+
+/* Record pending objects which are now loaded. */
+static void store_update()
+{
+  struct metadata_store *store = attached_store;
+  size_t i = 0;
+  if (store == NULL) return;
+  pthread_mutex_lock(&(store->mutex));
+  while (i < store->num_pending) {
+    struct store_pending *pending = &(store->pending[i]);
+    if (object_is_loaded(pending->kind, pending->object)) {
+      store_record(store, pending->kind, pending->object);
+      release_object(pending->kind, pending->object);
+      store->pending[i] = store->pending[--store->num_pending];
+    } else
+      i++;
+  }
+  pthread_mutex_unlock(&(store->mutex));
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_num_portraits(value artistbrowse)
+static void store_detach(struct metadata_store *store)
 {
-  return Val_int(sp_artistbrowse_num_portraits(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+  size_t i;
+  if (attached_store == store) attached_store = NULL;
+  pthread_mutex_lock(&(store->mutex));
+  for (i = 0; i < store->num_pending; i++)
+    release_object(store->pending[i].kind, store->pending[i].object);
+  store->num_pending = 0;
+  free(store->seen);
+  store->seen = NULL;
+  store->num_seen_slots = 0;
+  store->num_seen = 0;
+  pthread_mutex_unlock(&(store->mutex));
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_portrait(value artistbrowse, value index)
+static void store_close(struct metadata_store *store)
 {
-  const byte *id = sp_artistbrowse_portrait(get_artistbrowse(artistbrowse)->sp_artistbrowse, Int_val(index));
-  value str = caml_alloc_string(20);
-  memcpy(String_val(str), id, 20);
-  return str;
+  store_detach(store);
+  struct store_mapping *mapping = store->mappings;
+  while (mapping) {
+    struct store_mapping *next = mapping->next;
+    munmap(mapping->addr, mapping->length);
+    free(mapping);
+    mapping = next;
+  }
+  close(store->fd);
+  free(store->slots);
+  free(store->pending);
+  pthread_mutex_destroy(&(store->mutex));
+  free(store);
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_num_tracks(value artistbrowse)
+static void metadata_store_finalize(value x)
 {
-  return Val_int(sp_artistbrowse_num_tracks(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+  struct metadata_store *store = Metadata_store_val(x);
+  if (store) store_close(store);
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_track(value artistbrowse, value index)
+static struct custom_operations metadata_store_ops = {
+  "spotify:metadata_store",
+  metadata_store_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct metadata_store *get_metadata_store(value x)
 {
-  sp_track *track = sp_artistbrowse_track(get_artistbrowse(artistbrowse)->sp_artistbrowse, Int_val(index));
-  if (track) sp_track_add_ref(track);
-  return alloc_track(track);
+  struct metadata_store *store = Metadata_store_val(x);
+  if (store == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return store;
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_num_albums(value artistbrowse)
+CAMLprim value ocaml_spotify_metadata_store_open(value path)
 {
-  return Val_int(sp_artistbrowse_num_albums(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+  const char *error;
+  struct metadata_store *store = store_open(String_val(path), 1, &error);
+  if (store == NULL) {
+    if (error) caml_raise_sys_error(caml_copy_string(error));
+    caml_failwith("Spotify.metadata_store_open: not a metadata store");
+  }
+  value x = caml_alloc_custom(&metadata_store_ops, sizeof(struct metadata_store *), 0, 1);
+  Metadata_store_val(x) = store;
+  return x;
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_album(value artistbrowse, value index)
+CAMLprim value ocaml_spotify_metadata_store_close(value store)
 {
-  sp_album *album = sp_artistbrowse_album(get_artistbrowse(artistbrowse)->sp_artistbrowse, Int_val(index));
-  if (album) sp_album_add_ref(album);
-  return alloc_album(album);
+  metadata_store_finalize(store);
+  Metadata_store_val(store) = NULL;
+  return Val_unit;
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_num_similar_artists(value artistbrowse)
+CAMLprim value ocaml_spotify_metadata_store_attach(value val_store)
 {
-  return Val_int(sp_artistbrowse_num_similar_artists(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+  struct metadata_store *store = get_metadata_store(val_store);
+  if (attached_store && attached_store != store) store_detach(attached_store);
+  attached_store = store;
+  return Val_unit;
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_similar_artist(value artistbrowse, value index)
+CAMLprim value ocaml_spotify_metadata_store_detach(value unit)
 {
-  sp_artist *artist = sp_artistbrowse_similar_artist(get_artistbrowse(artistbrowse)->sp_artistbrowse, Int_val(index));
-  if (artist) sp_artist_add_ref(artist);
-  return alloc_artist(artist);
+  if (attached_store) store_detach(attached_store);
+  return Val_unit;
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_biography(value artistbrowse)
+CAMLprim value ocaml_spotify_metadata_store_sync(value val_store)
 {
-  return caml_copy_string(sp_artistbrowse_biography(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+  struct metadata_store *store = get_metadata_store(val_store);
+  if (fsync(store->fd) < 0) caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  return Val_unit;
 }
 
-CAMLprim value ocaml_spotify_artistbrowse_release(value artistbrowse)
+CAMLprim value ocaml_spotify_metadata_store_count(value val_store)
+{
+  struct metadata_store *store = get_metadata_store(val_store);
+  pthread_mutex_lock(&(store->mutex));
+  size_t count = store->count;
+  pthread_mutex_unlock(&(store->mutex));
+  return Val_long(count);
+}
+
+/* Build a [metadata_entry] from the fields of a record. */
+static value alloc_metadata_entry(enum object_kind kind, value name, value parent, int32_t a, int32_t b)
+{
+  CAMLparam2(name, parent);
+  CAMLlocal2(entry, duration);
+  duration = caml_copy_double(kind == OBJECT_TRACK ? (double)a / 1000 : 0.);
+  entry = caml_alloc_tuple(6);
+  Store_field(entry, 0, Val_int(kind));
+  Store_field(entry, 1, name);
+  Store_field(entry, 2, parent);
+  Store_field(entry, 3, duration);
+  Store_field(entry, 4, Val_int(kind == OBJECT_TRACK ? b : 0));
+  Store_field(entry, 5, Val_int(kind == OBJECT_ALBUM ? a : 0));
+  CAMLreturn(entry);
+}
+
+CAMLprim value ocaml_spotify_metadata_store_find(value val_store, value id)
+{
+  CAMLparam2(val_store, id);
+  CAMLlocal4(result, entry, name, parent);
+  struct metadata_store *store = get_metadata_store(val_store);
+  if (caml_string_length(id) != ID_SIZE) caml_invalid_argument("Spotify.metadata_store_find");
+  pthread_mutex_lock(&(store->mutex));
+  uint64_t offset = *store_slot(store, (const unsigned char*)String_val(id));
+  pthread_mutex_unlock(&(store->mutex));
+  if (offset == 0) CAMLreturn(Val_int(0));
+  /* Records are never modified, so they can be read without the
+     lock. */
+  const unsigned char *record = store->map + offset - 1;
+  int32_t a, b;
+  uint32_t name_length;
+  memcpy(&a, record + 40, 4);
+  memcpy(&b, record + 44, 4);
+  memcpy(&name_length, record + 48, 4);
+  name = caml_alloc_string(name_length);
+  memcpy(String_val(name), record + STORE_RECORD_HEADER_SIZE, name_length);
+  parent = caml_alloc_string(ID_SIZE);
+  memcpy(String_val(parent), record + 24, ID_SIZE);
+  entry = alloc_metadata_entry(record[4], name, parent, a, b);
+  result = caml_alloc_tuple(1);
+  Store_field(result, 0, entry);
+  CAMLreturn(result);
+}
+
+/* Copy the records of [src] which are not shadowed to [dst]. */
+CAMLprim value ocaml_spotify_metadata_store_compact(value src, value dst)
 {
-  artistbrowse_finalize(artistbrowse);
-  Artistbrowse_val(artistbrowse) = NULL;
+  const char *error;
+  struct metadata_store *store = store_open(String_val(src), 0, &error);
+  if (store == NULL) {
+    if (error) caml_raise_sys_error(caml_copy_string(error));
+    caml_failwith("Spotify.metadata_store_compact: not a metadata store");
+  }
+  FILE *file = fopen(String_val(dst), "wb");
+  if (file == NULL) {
+    error = strerror(errno);
+    store_close(store);
+    caml_raise_sys_error(caml_copy_string(error));
+  }
+  fwrite(store->map, 1, STORE_HEADER_SIZE, file);
+  size_t offset = STORE_HEADER_SIZE;
+  while (offset < store->size) {
+    uint32_t size;
+    memcpy(&size, store->map + offset, 4);
+    if (*store_slot(store, record_id(store, offset)) == offset + 1)
+      fwrite(store->map + offset, 1, size, file);
+    offset += size;
+  }
+  int failed = ferror(file);
+  if (fclose(file)) failed = 1;
+  store_close(store);
+  if (failed) caml_raise_sys_error(caml_copy_string(strerror(errno)));
   return Val_unit;
 }
 
 /* +-----------------------------------------------------------------+
-   | Image handling                                                  |
+   | Shared cache                                                    |
    +-----------------------------------------------------------------+ */
 
-CAMLprim value ocaml_spotify_image_create(value val_session, value id)
-{
-  sp_session *session = get_session(val_session);
-  struct image *image = new(struct image);
-  image->sp_image = sp_image_create(session, (byte*)String_val(id));
-  image->callbacks = NULL;
-  image->image = alloc_image(image);
-  return image->image;
-}
+/* A cache of the metadata of tracks, albums and artists in a POSIX
+   shared memory segment, so that all the processes of a host can
+   share it. It is a fixed table of slots of equal size, after a
+   header:
+
+   - 0: magic (4 bytes), version, number of slots, size of slots
+     (32 bits each)
+   - 16: ready flag, set once the creator initialized the header
+   - 24, 32, 40: number of used slots, number of evictions, clock
+     hand (64 bits each)
+
+   Each slot is:
+
+   - 0: sequence number (32 bits)
+   - 4: accessed flag (8 bits)
+   - 5: kind plus one, 0 for empty slots (8 bits)
+   - 6: length of the name (16 bits)
+   - 8: id (16 bytes)
+   - 24: id of the parent, as in the metadata store (16 bytes)
+   - 40, 44: duration and popularity, or year (32 bits each)
+   - 48: the name, without a null byte
+
+   An id lives in one of the SHARED_PROBE slots following its hash.
+   Slots are protected by seqlocks: a writer makes the sequence
+   number odd while it modifies a slot, and readers retry if it
+   changed or was odd while they copied it, so lookups never
+   block. When no slot is free, the writer evicts the first slot
+   whose accessed flag is not set, clearing flags on its way (second
+   chance); lookups set the flag of the slots they hit. Writers also
+   lock the first slot of the window of the id they store. */
+
+#define SHARED_MAGIC "OSPC"
+#define SHARED_VERSION 1
+#define SHARED_HEADER_SIZE 64
+#define SHARED_SLOT_HEADER_SIZE 48
+#define SHARED_PROBE 8
+#define SHARED_MAX_NAME 4096
+#define SHARED_MAX_SLOTS ((size_t)1 << 30)
+#define SHARED_MAX_SIZE ((uint64_t)1 << 34)
+/* Bounds of new segments. */
+/* Attempts at reading or locking a slot held by a writer before
+   giving up. Only a writer dying in the middle of an update holds a
+   slot for long. */
+#define SHARED_SPINS 100000
+
+struct shared_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_slots;
+  uint32_t slot_size;
+  uint32_t ready;
+  uint32_t padding;
+  uint64_t count;
+  uint64_t evictions;
+  uint64_t clock;
+};
 
-CAMLprim value ocaml_spotify_image_create_from_link(value val_session, value val_link)
+struct shared_slot {
+  uint32_t seq;
+  uint8_t accessed;
+  uint8_t kind;
+  uint16_t name_length;
+  unsigned char id[ID_SIZE];
+  unsigned char parent[ID_SIZE];
+  int32_t a;
+  int32_t b;
+  char name[];
+};
+
+struct shared_cache {
+  struct shared_header *header;
+  unsigned char *slots;
+  size_t size;
+  /* Size of the mapping. */
+  uint64_t hits;
+  uint64_t misses;
+  /* Lookups of this process. */
+};
+
+#define Shared_cache_val(v) *(struct shared_cache **)Data_custom_val(v)
+
+static void shared_cache_finalize(value x)
 {
-  sp_session *session = get_session(val_session);
-  sp_link *link = get_link(val_link);
-  struct image *image = new(struct image);
-  image->sp_image = sp_image_create_from_link(session, link);
-  image->callbacks = NULL;
-  image->image = alloc_image(image);
-  return image->image;
+  struct shared_cache *cache = Shared_cache_val(x);
+  if (cache) {
+    munmap(cache->header, cache->size);
+    free(cache);
+  }
 }
 
-static void load_image_complete(sp_image *image, void *userdata)
+static struct custom_operations shared_cache_ops = {
+  "spotify:shared_cache",
+  shared_cache_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct shared_cache *get_shared_cache(value x)
 {
-  ENTER_CALLBACK;
-  struct image_callbacks *node = (struct image_callbacks *)userdata;
-  caml_callback(node->callback, node->image);
-  LEAVE_CALLBACK;
+  struct shared_cache *cache = Shared_cache_val(x);
+  if (cache == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return cache;
 }
 
-CAMLprim value ocaml_spotify_image_add_load_callback(value val_image, value callback)
+static struct shared_slot *shared_slot(struct shared_cache *cache, size_t index)
 {
-  struct image *image = get_image(val_image);
-  struct image_callbacks *node = new(struct image_callbacks);
-  node->image = image->image;
-  node->callback = callback;
-  node->next = image->callbacks;
-  image->callbacks = node;
-  caml_register_generational_global_root(&(node->image));
-  caml_register_generational_global_root(&(node->callback));
-  sp_image_add_load_callback(image->sp_image, load_image_complete, (void*)node);
-  return caml_copy_nativeint((intnat)&node);
+  return (struct shared_slot*)(cache->slots + (index & (cache->header->num_slots - 1)) * cache->header->slot_size);
 }
 
-CAMLprim value ocaml_spotify_image_remove_load_callback(value val_image, value id)
+/* Copy [slot] to [copy], which can hold a slot. Returns 0 if a writer
+   kept it busy. */
+static int shared_read(struct shared_cache *cache, struct shared_slot *slot, struct shared_slot *copy)
 {
-  struct image *image = get_image(val_image);
-  struct image_callbacks *callback = (struct image_callbacks*)Nativeint_val(id);
-  struct image_callbacks *node = image->callbacks;
-  struct image_callbacks **cell = &(image->callbacks);
-  while (node) {
-    if (node == callback) {
-      sp_image_remove_load_callback(image->sp_image, load_image_complete, (void*)node);
-      caml_remove_generational_global_root(&(node->callback));
-      caml_remove_generational_global_root(&(node->image));
-      *cell = node->next;
-      free(node);
-      Nativeint_val(id) = 0;
-      break;
-    }
-    cell = &(node->next);
-    node = node->next;
+  int spins;
+  for (spins = 0; spins < SHARED_SPINS; spins++) {
+    uint32_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+    if (seq & 1) continue;
+    memcpy(copy, slot, SHARED_SLOT_HEADER_SIZE);
+    if (copy->name_length > cache->header->slot_size - SHARED_SLOT_HEADER_SIZE) continue;
+    memcpy(copy->name, slot->name, copy->name_length);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) == seq) return 1;
   }
-  return Val_unit;
+  return 0;
 }
 
-CAMLprim value ocaml_spotify_image_is_loaded(value image)
+/* Look [id] up, copying its slot to [copy]. */
+static int shared_find(struct shared_cache *cache, const unsigned char *id, struct shared_slot *copy)
 {
-  return Val_bool(sp_image_is_loaded(get_image(image)->sp_image));
+  size_t start = id_hash(id), i;
+  for (i = 0; i < SHARED_PROBE; i++) {
+    struct shared_slot *slot = shared_slot(cache, start + i);
+    if (shared_read(cache, slot, copy) && copy->kind && !memcmp(copy->id, id, ID_SIZE)) {
+      if (!__atomic_load_n(&(slot->accessed), __ATOMIC_RELAXED))
+        __atomic_store_n(&(slot->accessed), 1, __ATOMIC_RELAXED);
+      cache->hits++;
+      return 1;
+    }
+  }
+  cache->misses++;
+  return 0;
 }
 
-CAMLprim value ocaml_spotify_image_error(value image)
+/* Lock [slot] by making its sequence number odd. Returns 0 if it
+   stayed locked. */
+static int shared_lock(struct shared_slot *slot)
 {
-  return Val_int(sp_image_error(get_image(image)->sp_image));
+  int spins;
+  for (spins = 0; spins < SHARED_SPINS; spins++) {
+    uint32_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+    if (!(seq & 1) && __atomic_compare_exchange_n(&(slot->seq), &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+  return 0;
 }
 
-CAMLprim value ocaml_spotify_image_format(value image)
+static void shared_unlock(struct shared_slot *slot)
 {
-  return Val_int(sp_image_format(get_image(image)->sp_image) + 1);
+  __atomic_add_fetch(&(slot->seq), 1, __ATOMIC_RELEASE);
 }
 
-CAMLprim value ocaml_spotify_image_data(value image)
+/* Store an entry, replacing the one with the same id, or else taking
+   a free slot, or else evicting one. Returns 0 if the name does not
+   fit in a slot or a slot stayed locked.
+
+   Writers of an id first lock the first slot of its window, so that
+   two processes storing the same id cannot both add it. Slots are
+   chosen from unlocked reads, then checked again once locked, since
+   writers of overlapping windows may have changed them. */
+static int shared_store(struct shared_cache *cache, enum object_kind kind, const unsigned char *id, const unsigned char *parent, int32_t a, int32_t b, const char *name)
 {
-  size_t size;
-  const void *data = sp_image_data(get_image(image)->sp_image, &size);
-  intnat dim[1];
-  dim[0] = size;
-  value x = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_EXTERNAL, 1, (void*)data, dim);
+  struct shared_header *header = cache->header;
+  size_t start = id_hash(id), i, name_length = strlen(name);
+  struct shared_slot *home = shared_slot(cache, start), *target, *slot;
+  unsigned char victim[ID_SIZE];
+  int attempts;
+  if (name_length > header->slot_size - SHARED_SLOT_HEADER_SIZE) return 0;
+  if (!shared_lock(home)) return 0;
+  for (attempts = 0;; attempts++) {
+    int free_slot = 0;
+    if (attempts == SHARED_SPINS) {
+      shared_unlock(home);
+      return 0;
+    }
+    target = NULL;
+    for (i = 0; i < SHARED_PROBE && target == NULL; i++) {
+      slot = shared_slot(cache, start + i);
+      if (__atomic_load_n(&(slot->kind), __ATOMIC_RELAXED) && !memcmp(slot->id, id, ID_SIZE)) target = slot;
+    }
+    for (i = 0; i < SHARED_PROBE && target == NULL; i++) {
+      slot = shared_slot(cache, start + i);
+      if (__atomic_load_n(&(slot->kind), __ATOMIC_RELAXED) == 0) {
+        target = slot;
+        free_slot = 1;
+      }
+    }
+    if (target == NULL) {
+      /* Second chance, starting from a rotating position so that the
+         first slots of a window are not always the victims. */
+      size_t hand = __atomic_fetch_add(&(header->clock), 1, __ATOMIC_RELAXED);
+      for (i = 0; i < 2 * SHARED_PROBE && target == NULL; i++) {
+        slot = shared_slot(cache, start + (hand + i) % SHARED_PROBE);
+        if (__atomic_load_n(&(slot->accessed), __ATOMIC_RELAXED))
+          __atomic_store_n(&(slot->accessed), 0, __ATOMIC_RELAXED);
+        else
+          target = slot;
+      }
+      if (target == NULL) target = shared_slot(cache, start + hand % SHARED_PROBE);
+      memcpy(victim, target->id, ID_SIZE);
+    }
+    if (target != home && !shared_lock(target)) {
+      shared_unlock(home);
+      return 0;
+    }
+    /* Only writers holding [home] add [id], so it cannot have been
+       added elsewhere in the meantime; but the slot may have been
+       taken or evicted by a writer of another window. */
+    if (target->kind && !memcmp(target->id, id, ID_SIZE)) break;
+    if (free_slot ? target->kind == 0 : (target->kind != 0 && !memcmp(target->id, victim, ID_SIZE))) break;
+    if (target != home) shared_unlock(target);
+  }
+  if (target->kind == 0)
+    __atomic_add_fetch(&(header->count), 1, __ATOMIC_RELAXED);
+  else if (memcmp(target->id, id, ID_SIZE))
+    __atomic_add_fetch(&(header->evictions), 1, __ATOMIC_RELAXED);
+  target->accessed = 1;
+  target->kind = kind + 1;
+  target->name_length = name_length;
+  memcpy(target->id, id, ID_SIZE);
+  memcpy(target->parent, parent, ID_SIZE);
+  target->a = a;
+  target->b = b;
+  memcpy(target->name, name, name_length);
+  if (target != home) shared_unlock(target);
+  shared_unlock(home);
+  return 1;
+}
+
+static const char *shared_name(value name, char *buffer)
+{
+  if (caml_string_length(name) + 2 > 256 || strchr(String_val(name) + 1, '/'))
+    caml_invalid_argument("Spotify.shared_cache_open");
+  if (String_val(name)[0] == '/')
+    strcpy(buffer, String_val(name));
+  else {
+    buffer[0] = '/';
+    strcpy(buffer + 1, String_val(name));
+  }
+  return buffer;
+}
+
+CAMLprim value ocaml_spotify_shared_cache_open(value name, value val_slots, value val_name_size)
+{
+  char path[256];
+  struct stat st;
+  int creator = 1, tries;
+  size_t num_slots = 64;
+  if (Long_val(val_name_size) < 0 || Long_val(val_name_size) > SHARED_MAX_NAME
+      || Long_val(val_slots) > (long)SHARED_MAX_SLOTS)
+    caml_invalid_argument("Spotify.shared_cache_open");
+  while ((long)num_slots < Long_val(val_slots)) num_slots *= 2;
+  size_t slot_size = (SHARED_SLOT_HEADER_SIZE + Long_val(val_name_size) + 7) & ~(size_t)7;
+  if (SHARED_HEADER_SIZE + (uint64_t)num_slots * slot_size > SHARED_MAX_SIZE)
+    caml_invalid_argument("Spotify.shared_cache_open");
+  shared_name(name, path);
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    creator = 0;
+    fd = shm_open(path, O_RDWR, 0600);
+  }
+  if (fd < 0) caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  if (creator) {
+    if (ftruncate(fd, SHARED_HEADER_SIZE + num_slots * slot_size) < 0) {
+      int error = errno;
+      close(fd);
+      shm_unlink(path);
+      caml_raise_sys_error(caml_copy_string(strerror(error)));
+    }
+  } else {
+    /* Wait for the creator to size the segment. */
+    for (tries = 0; tries < 1000; tries++) {
+      if (fstat(fd, &st) < 0 || st.st_size >= SHARED_HEADER_SIZE) break;
+      usleep(1000);
+    }
+  }
+  if (fstat(fd, &st) < 0) {
+    int error = errno;
+    close(fd);
+    caml_raise_sys_error(caml_copy_string(strerror(error)));
+  }
+  if (st.st_size < SHARED_HEADER_SIZE) {
+    close(fd);
+    caml_failwith("Spotify.shared_cache_open: not a shared cache");
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  struct shared_header *header = (struct shared_header*)map;
+  if (creator) {
+    memcpy(header->magic, SHARED_MAGIC, 4);
+    header->version = SHARED_VERSION;
+    header->num_slots = num_slots;
+    header->slot_size = slot_size;
+    __atomic_store_n(&(header->ready), 1, __ATOMIC_RELEASE);
+  } else {
+    for (tries = 0; tries < 1000 && !__atomic_load_n(&(header->ready), __ATOMIC_ACQUIRE); tries++)
+      usleep(1000);
+    if (!__atomic_load_n(&(header->ready), __ATOMIC_ACQUIRE)
+        || memcmp(header->magic, SHARED_MAGIC, 4)
+        || header->version != SHARED_VERSION
+        || header->num_slots == 0 || (header->num_slots & (header->num_slots - 1))
+        || header->slot_size < SHARED_SLOT_HEADER_SIZE
+        || SHARED_HEADER_SIZE + (uint64_t)header->num_slots * header->slot_size > (uint64_t)st.st_size) {
+      munmap(map, st.st_size);
+      caml_failwith("Spotify.shared_cache_open: not a shared cache");
+    }
+  }
+  struct shared_cache *cache = new(struct shared_cache);
+  cache->header = header;
+  cache->slots = (unsigned char*)map + SHARED_HEADER_SIZE;
+  cache->size = st.st_size;
+  cache->hits = 0;
+  cache->misses = 0;
+  value x = caml_alloc_custom(&shared_cache_ops, sizeof(struct shared_cache *), 0, 1);
+  Shared_cache_val(x) = cache;
   return x;
 }
 
-CAMLprim value ocaml_spotify_image_image_id(value image)
+CAMLprim value ocaml_spotify_shared_cache_close(value cache)
 {
-  const byte *id = sp_image_image_id(get_image(image)->sp_image);
-  value str = caml_alloc_string(20);
-  memcpy(String_val(str), id, 20);
-  return str;
+  shared_cache_finalize(cache);
+  Shared_cache_val(cache) = NULL;
+  return Val_unit;
 }
 
-CAMLprim value ocaml_spotify_image_release(value image)
+CAMLprim value ocaml_spotify_shared_cache_unlink(value name)
 {
-  image_finalize(image);
-  Image_val(image) = NULL;
+  char path[256];
+  if (shm_unlink(shared_name(name, path)) < 0 && errno != ENOENT)
+    caml_raise_sys_error(caml_copy_string(strerror(errno)));
   return Val_unit;
 }
 
-/* +-----------------------------------------------------------------+
-   | Search subsystem                                                |
-   +-----------------------------------------------------------------+ */
+CAMLprim value ocaml_spotify_shared_cache_find(value val_cache, value id)
+{
+  CAMLparam2(val_cache, id);
+  CAMLlocal4(result, entry, name, parent);
+  struct shared_cache *cache = get_shared_cache(val_cache);
+  if (caml_string_length(id) != ID_SIZE) caml_invalid_argument("Spotify.shared_cache_find");
+  struct shared_slot *copy = (struct shared_slot*)xmalloc(cache->header->slot_size);
+  if (!shared_find(cache, (const unsigned char*)String_val(id), copy)) {
+    free(copy);
+    CAMLreturn(Val_int(0));
+  }
+  intnat dim[1];
+  dim[0] = copy->name_length;
+  name = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, dim);
+  memcpy(Caml_ba_data_val(name), copy->name, copy->name_length);
+  parent = caml_alloc_string(ID_SIZE);
+  memcpy(String_val(parent), copy->parent, ID_SIZE);
+  entry = alloc_metadata_entry(copy->kind - 1, name, parent, copy->a, copy->b);
+  free(copy);
+  result = caml_alloc_tuple(1);
+  Store_field(result, 0, entry);
+  CAMLreturn(result);
+}
 
-static void search_complete(sp_search *result, void *userdata)
+static value shared_cache_add(value val_cache, enum object_kind kind, void *object)
 {
-  ENTER_CALLBACK;
-  struct search *search = (struct search *)userdata;
-  caml_callback(search->callback, search->search);
-  LEAVE_CALLBACK;
+  struct shared_cache *cache = get_shared_cache(val_cache);
+  unsigned char id[ID_SIZE], parent[ID_SIZE];
+  const char *name;
+  int32_t a, b;
+  int stored = 0;
+  spotify_lock();
+  if (object_is_loaded(kind, object) && object_metadata(kind, object, id, parent, &a, &b, &name))
+    stored = shared_store(cache, kind, id, parent, a, b, name);
+  spotify_unlock();
+  return Val_bool(stored);
 }
 
-CAMLprim value ocaml_spotify_search_create(value val_session, value query, value track_offset, value track_count, value album_offset, value album_count, value artist_offset, value artist_count, value callback)
+CAMLprim value ocaml_spotify_shared_cache_add_track(value cache, value track)
 {
-  sp_session *session = get_session(val_session);
-  struct search *search = new(struct search);
-  sp_search *sp_search = sp_search_create(session,
-                                          String_val(query),
-                                          Int_val(track_offset),
-                                          Int_val(track_count),
-                                          Int_val(album_offset),
-                                          Int_val(album_count),
-                                          Int_val(artist_offset),
-                                          Int_val(artist_count),
-                                          search_complete,
-                                          (void*)search);
-  search->sp_search = sp_search;
-  search->callback = callback;
-  search->search = alloc_search(search);
-  caml_register_generational_global_root(&(search->callback));
-  caml_register_generational_global_root(&(search->search));
-  return search->search;
+  return shared_cache_add(cache, OBJECT_TRACK, get_track(track));
 }
 
-CAMLprim value ocaml_spotify_search_create_byte(value *argv, int argn)
+CAMLprim value ocaml_spotify_shared_cache_add_album(value cache, value album)
 {
-  return ocaml_spotify_search_create(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7], argv[8]);
+  return shared_cache_add(cache, OBJECT_ALBUM, get_album(album));
 }
 
-CAMLprim value ocaml_spotify_radio_search_create(value val_session, value from_year, value to_year, value list, value callback)
+CAMLprim value ocaml_spotify_shared_cache_add_artist(value cache, value artist)
 {
-  sp_session *session = get_session(val_session);
-  sp_radio_genre genres = 0;
-  while (Is_block(list)) {
-    genres |= 1 << Int_val(Field(list, 0));
-    list = Field(list, 1);
+  return shared_cache_add(cache, OBJECT_ARTIST, get_artist(artist));
+}
+
+CAMLprim value ocaml_spotify_shared_cache_stats(value val_cache)
+{
+  CAMLparam1(val_cache);
+  CAMLlocal1(result);
+  struct shared_cache *cache = get_shared_cache(val_cache);
+  struct shared_header *header = cache->header;
+  result = caml_alloc_tuple(6);
+  Store_field(result, 0, Val_long(header->num_slots));
+  Store_field(result, 1, Val_long(header->slot_size - SHARED_SLOT_HEADER_SIZE));
+  Store_field(result, 2, Val_long(__atomic_load_n(&(header->count), __ATOMIC_RELAXED)));
+  Store_field(result, 3, Val_long(__atomic_load_n(&(header->evictions), __ATOMIC_RELAXED)));
+  Store_field(result, 4, Val_long(cache->hits));
+  Store_field(result, 5, Val_long(cache->misses));
+  CAMLreturn(result);
+}
+
+/* +-----------------------------------------------------------------+
+   | Local index                                                     |
+   +-----------------------------------------------------------------+ */
+
+/* An inverted index over the names of tracks, albums and artists the
+   application holds. Names are normalized (ASCII letters are
+   lowercased, other ASCII characters separate words), and every word
+   is indexed by its trigrams and by its first one and two
+   characters. Each key maps to the sorted list of the documents
+   containing it, stored as varint-encoded deltas.
+
+   A query matches a document when each of its words is a prefix of a
+   word of the name: candidates are the intersection of the postings
+   of the keys of the query, which are then checked against the
+   name. */
+
+struct index_doc {
+  enum object_kind kind;
+  void *object;
+  /* The object, on which a reference is held. */
+  char *name;
+  /* The normalized name, NULL until the object is loaded. */
+  int popularity;
+  /* Popularity of tracks, highest popularity of the indexed tracks
+     of albums and artists. */
+};
+
+struct popularity {
+  void *object;
+  /* NULL for empty slots. */
+  int popularity;
+};
+
+struct posting {
+  uint32_t key;
+  /* 0 for empty slots. */
+  uint32_t count;
+  uint32_t last;
+  /* Last document added. */
+  size_t length;
+  size_t capacity;
+  unsigned char *data;
+};
+
+struct local_index {
+  pthread_mutex_t mutex;
+  struct index_doc *docs;
+  size_t num_docs;
+  size_t docs_capacity;
+  uint32_t *objects;
+  size_t num_object_slots;
+  /* Open-addressing table from objects to document numbers plus
+     one. */
+  struct posting *postings;
+  size_t num_postings;
+  size_t num_posting_slots;
+  size_t num_indexed;
+  /* Documents before [num_indexed] are indexed, the others are not
+     loaded yet. */
+  struct popularity *popularities;
+  size_t num_popularities;
+  size_t num_popularity_slots;
+  /* Open-addressing table from the albums and artists of indexed
+     tracks to the highest popularity of these tracks, whether or not
+     the albums and artists are in the index yet. Indexed tracks hold
+     references on them, so they stay valid. */
+};
+
+#define Local_index_val(v) *(struct local_index **)Data_custom_val(v)
+
+#define WORD_START 1
+#define INDEX_KEY(a, b, c) (((uint32_t)(unsigned char)(a) << 16) | ((uint32_t)(unsigned char)(b) << 8) | (uint32_t)(unsigned char)(c))
+
+static void *index_realloc(void *ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    perror("cannot allocate memory");
+    abort();
   }
-  struct search *search = new(struct search);
-  sp_search *sp_search = sp_radio_search_create(session,
-                                                Int_val(from_year),
-                                                Int_val(to_year),
-                                                genres,
-                                                search_complete,
-                                                (void*)search);
-  search->sp_search = sp_search;
-  search->callback = callback;
-  search->search = alloc_search(search);
-  caml_register_generational_global_root(&(search->callback));
-  caml_register_generational_global_root(&(search->search));
-  return search->search;
+  return ptr;
 }
 
-CAMLprim value ocaml_spotify_search_is_loaded(value search)
+/* Normalize [src] into words separated by single spaces. [dst] must
+   be at least as large as [src]. */
+static size_t normalize_name(const char *src, char *dst)
 {
-  return Val_bool(sp_search_is_loaded(get_search(search)->sp_search));
+  size_t len = 0;
+  for (; *src; src++) {
+    unsigned char ch = *src;
+    if (ch >= 0x80 || (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z'))
+      dst[len++] = ch;
+    else if (ch >= 'A' && ch <= 'Z')
+      dst[len++] = ch - 'A' + 'a';
+    else if (len > 0 && dst[len - 1] != ' ')
+      dst[len++] = ' ';
+  }
+  if (len > 0 && dst[len - 1] == ' ') len--;
+  dst[len] = 0;
+  return len;
 }
 
-CAMLprim value ocaml_spotify_search_error(value search)
+/* Call [f] on the keys of [word], of length [len]. */
+static void word_keys(const char *word, size_t len, void (*f)(void *data, uint32_t key), void *data)
 {
-  return Val_int(sp_search_error(get_search(search)->sp_search));
+  size_t i;
+  if (len == 0) return;
+  f(data, INDEX_KEY(WORD_START, WORD_START, word[0]));
+  if (len >= 2) f(data, INDEX_KEY(WORD_START, word[0], word[1]));
+  for (i = 0; i + 3 <= len; i++)
+    f(data, INDEX_KEY(word[i], word[i + 1], word[i + 2]));
 }
 
-CAMLprim value ocaml_spotify_search_num_tracks(value search)
+static uint32_t *object_slot(struct local_index *index, void *object)
 {
-  return Val_int(sp_search_num_tracks(get_search(search)->sp_search));
+  size_t mask = index->num_object_slots - 1;
+  size_t i = ((uintptr_t)object * 0x9e3779b97f4a7c15ULL >> 16) & mask;
+  while (index->objects[i] && index->docs[index->objects[i] - 1].object != object)
+    i = (i + 1) & mask;
+  return &(index->objects[i]);
 }
 
-CAMLprim value ocaml_spotify_search_track(value search, value index)
+static struct popularity *popularity_slot(struct local_index *index, void *object)
 {
-  sp_track *track = sp_search_track(get_search(search)->sp_search, Int_val(index));
-  if (track) sp_track_add_ref(track);
-  return alloc_track(track);
+  size_t mask = index->num_popularity_slots - 1;
+  size_t i = ((uintptr_t)object * 0x9e3779b97f4a7c15ULL >> 16) & mask;
+  while (index->popularities[i].object && index->popularities[i].object != object)
+    i = (i + 1) & mask;
+  return &(index->popularities[i]);
 }
 
-CAMLprim value ocaml_spotify_search_num_albums(value search)
+static struct posting *posting_slot(struct local_index *index, uint32_t key)
 {
-  return Val_int(sp_search_num_albums(get_search(search)->sp_search));
+  size_t mask = index->num_posting_slots - 1;
+  size_t i = (key * 0x9e3779b1U) & mask;
+  while (index->postings[i].key && index->postings[i].key != key)
+    i = (i + 1) & mask;
+  return &(index->postings[i]);
 }
 
-CAMLprim value ocaml_spotify_search_album(value search, value index)
+static struct posting *find_posting(struct local_index *index, uint32_t key)
 {
-  sp_album *album = sp_search_album(get_search(search)->sp_search, Int_val(index));
-  if (album) sp_album_add_ref(album);
-  return alloc_album(album);
+  if (index->num_posting_slots == 0) return NULL;
+  struct posting *posting = posting_slot(index, key);
+  return posting->key ? posting : NULL;
 }
 
-CAMLprim value ocaml_spotify_search_num_artists(value search)
+static void posting_add(void *data, uint32_t key)
 {
-  return Val_int(sp_search_num_artists(get_search(search)->sp_search));
+  struct local_index *index = (struct local_index*)data;
+  uint32_t doc = index->num_indexed;
+  if ((index->num_postings + 1) * 2 > index->num_posting_slots) {
+    struct posting *old = index->postings;
+    size_t i, num_old = index->num_posting_slots;
+    index->num_posting_slots = num_old ? num_old * 2 : 4096;
+    index->postings = (struct posting*)calloc(index->num_posting_slots, sizeof(struct posting));
+    if (index->postings == NULL) {
+      perror("cannot allocate memory");
+      abort();
+    }
+    for (i = 0; i < num_old; i++)
+      if (old[i].key) *posting_slot(index, old[i].key) = old[i];
+    free(old);
+  }
+  struct posting *posting = posting_slot(index, key);
+  if (posting->key == 0) {
+    posting->key = key;
+    index->num_postings++;
+  } else if (posting->last == doc)
+    return;
+  if (posting->length + 5 > posting->capacity) {
+    posting->capacity = posting->capacity ? posting->capacity * 2 : 8;
+    posting->data = (unsigned char*)index_realloc(posting->data, posting->capacity);
+  }
+  uint32_t delta = posting->count ? doc - posting->last : doc;
+  while (delta >= 0x80) {
+    posting->data[posting->length++] = (delta & 0x7f) | 0x80;
+    delta >>= 7;
+  }
+  posting->data[posting->length++] = delta;
+  posting->last = doc;
+  posting->count++;
+}
+
+/* Keep in [docs] the [count] documents also in [posting]. Returns the
+   new count. */
+static size_t posting_intersect(const struct posting *posting, uint32_t *docs, size_t count)
+{
+  size_t i = 0, j = 0, kept = 0;
+  uint32_t doc = 0, n;
+  for (n = 0; n < posting->count && j < count; n++) {
+    uint32_t delta = 0;
+    int shift = 0;
+    while (posting->data[i] & 0x80) {
+      delta |= (uint32_t)(posting->data[i++] & 0x7f) << shift;
+      shift += 7;
+    }
+    delta |= (uint32_t)posting->data[i++] << shift;
+    doc = n ? doc + delta : delta;
+    while (j < count && docs[j] < doc) j++;
+    if (j < count && docs[j] == doc) docs[kept++] = docs[j++];
+  }
+  return kept;
 }
 
-CAMLprim value ocaml_spotify_search_artist(value search, value index)
+static size_t posting_decode(const struct posting *posting, uint32_t *docs)
 {
-  sp_artist *artist = sp_search_artist(get_search(search)->sp_search, Int_val(index));
-  if (artist) sp_artist_add_ref(artist);
-  return alloc_artist(artist);
+  size_t i = 0;
+  uint32_t doc = 0, n;
+  for (n = 0; n < posting->count; n++) {
+    uint32_t delta = 0;
+    int shift = 0;
+    while (posting->data[i] & 0x80) {
+      delta |= (uint32_t)(posting->data[i++] & 0x7f) << shift;
+      shift += 7;
+    }
+    delta |= (uint32_t)posting->data[i++] << shift;
+    doc = n ? doc + delta : delta;
+    docs[n] = doc;
+  }
+  return posting->count;
 }
 
-CAMLprim value ocaml_spotify_search_query(value search)
+static const char *object_name(enum object_kind kind, void *object)
 {
-  return caml_copy_string(sp_search_query(get_search(search)->sp_search));
+  switch (kind) {
+  case OBJECT_TRACK: return sp_track_name((sp_track*)object);
+  case OBJECT_ALBUM: return sp_album_name((sp_album*)object);
+  default: return sp_artist_name((sp_artist*)object);
+  }
 }
 
-CAMLprim value ocaml_spotify_search_did_you_mean(value search)
+/* Raise the popularity of the album or artist [object] of an indexed
+   track, which may be added to the index later. */
+static void index_raise_popularity(struct local_index *index, void *object, int popularity)
 {
-  return caml_copy_string(sp_search_did_you_mean(get_search(search)->sp_search));
+  if ((index->num_popularities + 1) * 2 > index->num_popularity_slots) {
+    struct popularity *old = index->popularities;
+    size_t i, num_old = index->num_popularity_slots;
+    index->num_popularity_slots = num_old ? num_old * 2 : 1024;
+    index->popularities = (struct popularity*)calloc(index->num_popularity_slots, sizeof(struct popularity));
+    if (index->popularities == NULL) {
+      perror("cannot allocate memory");
+      abort();
+    }
+    for (i = 0; i < num_old; i++)
+      if (old[i].object) *popularity_slot(index, old[i].object) = old[i];
+    free(old);
+  }
+  struct popularity *entry = popularity_slot(index, object);
+  if (entry->object == NULL) {
+    entry->object = object;
+    entry->popularity = popularity;
+    index->num_popularities++;
+  } else if (entry->popularity < popularity)
+    entry->popularity = popularity;
+  uint32_t *slot = object_slot(index, object);
+  if (*slot && index->docs[*slot - 1].popularity < popularity)
+    index->docs[*slot - 1].popularity = popularity;
+}
+
+/* Index the name of the loaded document [number]. Indexed documents
+   come first and never move, so that postings stay sorted: the
+   document is swapped with the first unloaded one. */
+static void index_doc_loaded(struct local_index *index, uint32_t number)
+{
+  struct index_doc *doc = &(index->docs[number]);
+  const char *name = object_name(doc->kind, doc->object);
+  if (name == NULL) name = "";
+  doc->name = (char*)xmalloc(strlen(name) + 1);
+  normalize_name(name, doc->name);
+  if (doc->kind == OBJECT_TRACK) {
+    sp_track *track = (sp_track*)doc->object;
+    int i, num_artists = sp_track_num_artists(track);
+    doc->popularity = sp_track_popularity(track);
+    sp_album *album = sp_track_album(track);
+    if (album) index_raise_popularity(index, album, doc->popularity);
+    for (i = 0; i < num_artists; i++) {
+      sp_artist *artist = sp_track_artist(track, i);
+      if (artist) index_raise_popularity(index, artist, doc->popularity);
+    }
+  }
+  /* Move the document to the end of the indexed ones. */
+  uint32_t position = index->num_indexed;
+  if (number != position) {
+    struct index_doc tmp = index->docs[position];
+    index->docs[position] = index->docs[number];
+    index->docs[number] = tmp;
+    *object_slot(index, index->docs[number].object) = number + 1;
+    *object_slot(index, index->docs[position].object) = position + 1;
+  }
+  const char *word = index->docs[position].name;
+  while (*word) {
+    const char *end = strchr(word, ' ');
+    size_t len = end ? (size_t)(end - word) : strlen(word);
+    word_keys(word, len, posting_add, index);
+    word += len;
+    if (*word) word++;
+  }
+  index->num_indexed++;
 }
 
-CAMLprim value ocaml_spotify_search_total_tracks(value search)
+/* Add [object] to the index if it is not already there. Documents
+   are stored with indexed ones first, then unloaded ones. */
+static void index_add(struct local_index *index, enum object_kind kind, void *object)
 {
-  return Val_int(sp_search_total_tracks(get_search(search)->sp_search));
+  if ((index->num_docs + 1) * 2 > index->num_object_slots) {
+    size_t i;
+    free(index->objects);
+    index->num_object_slots = index->num_object_slots ? index->num_object_slots * 2 : 1024;
+    index->objects = (uint32_t*)calloc(index->num_object_slots, sizeof(uint32_t));
+    if (index->objects == NULL) {
+      perror("cannot allocate memory");
+      abort();
+    }
+    for (i = 0; i < index->num_docs; i++)
+      *object_slot(index, index->docs[i].object) = i + 1;
+  }
+  uint32_t *slot = object_slot(index, object);
+  if (*slot) return;
+  if (index->num_docs == index->docs_capacity) {
+    index->docs_capacity = index->docs_capacity ? index->docs_capacity * 2 : 256;
+    index->docs = (struct index_doc*)index_realloc(index->docs, index->docs_capacity * sizeof(struct index_doc));
+  }
+  switch (kind) {
+  case OBJECT_TRACK: sp_track_add_ref((sp_track*)object); break;
+  case OBJECT_ALBUM: sp_album_add_ref((sp_album*)object); break;
+  default: sp_artist_add_ref((sp_artist*)object); break;
+  }
+  uint32_t number = index->num_docs++;
+  index->docs[number].kind = kind;
+  index->docs[number].object = object;
+  index->docs[number].name = NULL;
+  index->docs[number].popularity = 0;
+  if (kind != OBJECT_TRACK && index->num_popularities) {
+    /* Tracks of the album or artist may have been indexed before. */
+    struct popularity *entry = popularity_slot(index, object);
+    if (entry->object) index->docs[number].popularity = entry->popularity;
+  }
+  *slot = number + 1;
+  if (object_is_loaded(kind, object))
+    index_doc_loaded(index, number);
 }
 
-CAMLprim value ocaml_spotify_search_total_albums(value search)
+/* Add [object] to [index] unless it already holds [max_docs]
+   objects. */
+static void index_observe(struct local_index *index, enum object_kind kind, void *object, size_t max_docs)
 {
-  return Val_int(sp_search_total_albums(get_search(search)->sp_search));
+  pthread_mutex_lock(&(index->mutex));
+  if (index->num_docs < max_docs) index_add(index, kind, object);
+  pthread_mutex_unlock(&(index->mutex));
 }
 
-CAMLprim value ocaml_spotify_search_total_artists(value search)
+/* Index documents whose objects are now loaded. */
+static void index_update(struct local_index *index)
 {
-  return Val_int(sp_search_total_artists(get_search(search)->sp_search));
+  size_t i;
+  pthread_mutex_lock(&(index->mutex));
+  for (i = index->num_indexed; i < index->num_docs; i++)
+    if (object_is_loaded(index->docs[i].kind, index->docs[i].object))
+      index_doc_loaded(index, i);
+  pthread_mutex_unlock(&(index->mutex));
 }
 
-CAMLprim value ocaml_spotify_search_release(value search)
+static void index_free(struct local_index *index)
 {
-  search_finalize(search);
-  Search_val(search) = NULL;
+  size_t i;
+  if (attached_index == index) attached_index = NULL;
+  for (i = 0; i < index->num_docs; i++) {
+    release_object(index->docs[i].kind, index->docs[i].object);
+    free(index->docs[i].name);
+  }
+  for (i = 0; i < index->num_posting_slots; i++)
+    free(index->postings[i].data);
+  free(index->docs);
+  free(index->objects);
+  free(index->postings);
+  free(index->popularities);
+  pthread_mutex_destroy(&(index->mutex));
+  free(index);
+}
+
+/* Whether [word], of length [len], is a prefix of a word of
+   [name]. */
+static int name_has_prefix(const char *name, const char *word, size_t len)
+{
+  const char *p = name;
+  for (;;) {
+    if (strncmp(p, word, len) == 0) return 1;
+    p = strchr(p, ' ');
+    if (p == NULL) return 0;
+    p++;
+  }
+}
+
+struct query_keys {
+  uint32_t *keys;
+  size_t count;
+};
+
+static void query_key(void *data, uint32_t key)
+{
+  struct query_keys *keys = (struct query_keys*)data;
+  keys->keys[keys->count++] = key;
+}
+
+struct ranked_doc {
+  int popularity;
+  uint32_t doc;
+};
+
+static int compare_ranks(const void *a, const void *b)
+{
+  const struct ranked_doc *ra = (const struct ranked_doc*)a, *rb = (const struct ranked_doc*)b;
+  if (ra->popularity != rb->popularity) return rb->popularity - ra->popularity;
+  return ra->doc < rb->doc ? -1 : 1;
+}
+
+/* Search [query] in [index], and store in [results] the objects of
+   at most [count] matching documents of each kind, on which
+   references are added. Returns the number of results of each
+   kind in [counts]. Called with the index mutex held. */
+static void index_search(struct local_index *index, const char *query, size_t count, void **results, size_t counts[3])
+{
+  char *normalized = (char*)xmalloc(strlen(query) + 1);
+  size_t len = normalize_name(query, normalized);
+  struct query_keys keys;
+  keys.keys = (uint32_t*)xmalloc((len + 2) * 2 * sizeof(uint32_t));
+  keys.count = 0;
+  const char *word = normalized;
+  while (*word) {
+    const char *end = strchr(word, ' ');
+    size_t word_len = end ? (size_t)(end - word) : strlen(word);
+    word_keys(word, word_len, query_key, &keys);
+    word += word_len;
+    if (*word) word++;
+  }
+  counts[0] = counts[1] = counts[2] = 0;
+  size_t i, num_docs = 0;
+  uint32_t *docs = NULL;
+  struct posting *smallest = NULL;
+  /* Start from the shortest posting list. */
+  for (i = 0; i < keys.count; i++) {
+    struct posting *posting = find_posting(index, keys.keys[i]);
+    if (posting == NULL) {
+      smallest = NULL;
+      break;
+    }
+    if (smallest == NULL || posting->count < smallest->count) smallest = posting;
+  }
+  if (smallest) {
+    docs = (uint32_t*)xmalloc(smallest->count * sizeof(uint32_t));
+    num_docs = posting_decode(smallest, docs);
+    for (i = 0; i < keys.count && num_docs > 0; i++) {
+      struct posting *posting = find_posting(index, keys.keys[i]);
+      if (posting != smallest) num_docs = posting_intersect(posting, docs, num_docs);
+    }
+  }
+  /* Check candidates against the words of the query. */
+  struct ranked_doc *ranked = (struct ranked_doc*)xmalloc((num_docs + 1) * sizeof(struct ranked_doc));
+  size_t kept = 0;
+  for (i = 0; i < num_docs; i++) {
+    const char *name = index->docs[docs[i]].name;
+    int matches = 1;
+    word = normalized;
+    while (*word && matches) {
+      const char *end = strchr(word, ' ');
+      size_t word_len = end ? (size_t)(end - word) : strlen(word);
+      matches = name_has_prefix(name, word, word_len);
+      word += word_len;
+      if (*word) word++;
+    }
+    if (matches) {
+      ranked[kept].popularity = index->docs[docs[i]].popularity;
+      ranked[kept].doc = docs[i];
+      kept++;
+    }
+  }
+  if (kept > 0) qsort(ranked, kept, sizeof(struct ranked_doc), compare_ranks);
+  for (i = 0; i < kept; i++) {
+    struct index_doc *doc = &(index->docs[ranked[i].doc]);
+    if (counts[doc->kind] == count) continue;
+    switch (doc->kind) {
+    case OBJECT_TRACK: sp_track_add_ref((sp_track*)doc->object); break;
+    case OBJECT_ALBUM: sp_album_add_ref((sp_album*)doc->object); break;
+    default: sp_artist_add_ref((sp_artist*)doc->object); break;
+    }
+    results[doc->kind * count + counts[doc->kind]++] = doc->object;
+  }
+  free(ranked);
+  free(docs);
+  free(keys.keys);
+  free(normalized);
+}
+
+static void local_index_finalize(value x)
+{
+  struct local_index *index = Local_index_val(x);
+  if (index) index_free(index);
+}
+
+static struct custom_operations local_index_ops = {
+  "spotify:local_index",
+  local_index_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct local_index *get_local_index(value x)
+{
+  struct local_index *index = Local_index_val(x);
+  if (index == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return index;
+}
+
+CAMLprim value ocaml_spotify_local_index_create(value unit)
+{
+  struct local_index *index = new(struct local_index);
+  memset(index, 0, sizeof(struct local_index));
+  pthread_mutex_init(&(index->mutex), NULL);
+  value x = caml_alloc_custom(&local_index_ops, sizeof(struct local_index *), 0, 1);
+  Local_index_val(x) = index;
+  return x;
+}
+
+CAMLprim value ocaml_spotify_local_index_release(value index)
+{
+  local_index_finalize(index);
+  Local_index_val(index) = NULL;
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_local_index_add_track(value index, value track)
+{
+  index_observe(get_local_index(index), OBJECT_TRACK, get_track(track), SIZE_MAX);
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_local_index_add_album(value index, value album)
+{
+  index_observe(get_local_index(index), OBJECT_ALBUM, get_album(album), SIZE_MAX);
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_local_index_add_artist(value index, value artist)
+{
+  index_observe(get_local_index(index), OBJECT_ARTIST, get_artist(artist), SIZE_MAX);
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_local_index_update(value index)
+{
+  index_update(get_local_index(index));
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_local_index_attach(value index, value max_objects)
+{
+  if (Long_val(max_objects) < 0)
+    caml_invalid_argument("Spotify.local_index_attach");
+  attached_index = get_local_index(index);
+  attached_index_max = Long_val(max_objects);
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_local_index_detach(value unit)
+{
+  attached_index = NULL;
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_local_index_size(value val_index)
+{
+  struct local_index *index = get_local_index(val_index);
+  pthread_mutex_lock(&(index->mutex));
+  size_t size = index->num_indexed;
+  pthread_mutex_unlock(&(index->mutex));
+  return Val_long(size);
+}
+
+CAMLprim value ocaml_spotify_local_search(value val_index, value query, value val_count)
+{
+  CAMLparam3(val_index, query, val_count);
+  CAMLlocal3(result, array, handle);
+  struct local_index *index = get_local_index(val_index);
+  size_t count = Int_val(val_count) > 0 ? Int_val(val_count) : 0;
+  size_t counts[3], kind, i;
+  void **results = (void**)xmalloc((count * 3 + 1) * sizeof(void*));
+  TRACE_BEGIN;
+  pthread_mutex_lock(&(index->mutex));
+  index_search(index, String_val(query), count, results, counts);
+  pthread_mutex_unlock(&(index->mutex));
+  TRACE_END(TRACE_API, "local_search", "results", counts[0] + counts[1] + counts[2]);
+  /* Handles are allocated without the lock since allocation notifies
+     the attached index. */
+  result = caml_alloc_tuple(3);
+  for (kind = 0; kind < 3; kind++) {
+    array = caml_alloc(counts[kind], 0);
+    Store_field(result, kind, array);
+    for (i = 0; i < counts[kind]; i++) {
+      void *object = results[kind * count + i];
+      switch (kind) {
+      case OBJECT_TRACK: handle = alloc_track((sp_track*)object); break;
+      case OBJECT_ALBUM: handle = alloc_album((sp_album*)object); break;
+      default: handle = alloc_artist((sp_artist*)object); break;
+      }
+      Store_field(array, i, handle);
+    }
+  }
+  free(results);
+  CAMLreturn(result);
+}
+
+/* +-----------------------------------------------------------------+
+   | Fuzzy matching                                                  |
+   +-----------------------------------------------------------------+ */
+
+/* Typo-tolerant matching of a query against the names of a local
+   index. The distance of a name is the smallest edit distance between
+   the query and a substring of the name, computed with the
+   bit-parallel algorithm of Myers, as formulated by Hyyrö: a column
+   of the dynamic programming matrix is encoded in two bit vectors,
+   so the query is limited to 64 bytes.
+
+   Names are matched four at a time using GCC vector extensions, one
+   name per lane. Large indexes are split into chunks which worker
+   threads take from a shared counter until none remain. */
+
+#define FUZZY_MAX_QUERY 64
+#define FUZZY_LANES 4
+#define FUZZY_CHUNK 1024
+
+typedef uint64_t fuzzy_vector __attribute__ ((vector_size (FUZZY_LANES * 8)));
+
+struct fuzzy_pattern {
+  uint64_t peq[256];
+  /* For each character, the positions where it appears in the
+     query. */
+  int length;
+  int max_errors;
+};
+
+struct fuzzy_match {
+  uint32_t doc;
+  int distance;
+  int popularity;
+};
+
+struct fuzzy_matches {
+  struct fuzzy_match *matches;
+  size_t count;
+  size_t capacity;
+};
+
+static void fuzzy_compile(struct fuzzy_pattern *pattern, const char *query, int max_errors)
+{
+  int i;
+  memset(pattern->peq, 0, sizeof(pattern->peq));
+  pattern->length = strlen(query);
+  if (pattern->length > FUZZY_MAX_QUERY) pattern->length = FUZZY_MAX_QUERY;
+  for (i = 0; i < pattern->length; i++)
+    pattern->peq[(unsigned char)query[i]] |= (uint64_t)1 << i;
+  pattern->max_errors = max_errors;
+}
+
+/* Distance of the query to one name. */
+static int fuzzy_distance(const struct fuzzy_pattern *pattern, const char *name)
+{
+  int m = pattern->length;
+  if (m == 0) return 0;
+  uint64_t high = (uint64_t)1 << (m - 1);
+  uint64_t pv = m == 64 ? ~(uint64_t)0 : ((uint64_t)1 << m) - 1, mv = 0;
+  int score = m, best = m;
+  for (; *name; name++) {
+    uint64_t eq = pattern->peq[(unsigned char)*name];
+    uint64_t xv = eq | mv;
+    uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+    if (ph & high) score++;
+    else if (mh & high) score--;
+    ph <<= 1;
+    mh <<= 1;
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+    if (score < best) best = score;
+  }
+  return best;
+}
+
+/* Distances of the query to [FUZZY_LANES] names at once. Lanes stop
+   at the end of their name. */
+static void fuzzy_distance_lanes(const struct fuzzy_pattern *pattern, const char **names, int *distances)
+{
+  int m = pattern->length, lane;
+  size_t lengths[FUZZY_LANES], length = 0, j;
+  uint64_t mask = m == 64 ? ~(uint64_t)0 : ((uint64_t)1 << m) - 1;
+  fuzzy_vector high, pv, mv, score, best, zero, one;
+  for (lane = 0; lane < FUZZY_LANES; lane++) {
+    lengths[lane] = strlen(names[lane]);
+    if (lengths[lane] > length) length = lengths[lane];
+    high[lane] = (uint64_t)1 << (m - 1);
+    pv[lane] = mask;
+    mv[lane] = 0;
+    score[lane] = m;
+    best[lane] = m;
+    zero[lane] = 0;
+    one[lane] = 1;
+  }
+  for (j = 0; j < length; j++) {
+    fuzzy_vector eq, active;
+    for (lane = 0; lane < FUZZY_LANES; lane++) {
+      active[lane] = j < lengths[lane] ? ~(uint64_t)0 : 0;
+      eq[lane] = j < lengths[lane] ? pattern->peq[(unsigned char)names[lane][j]] : 0;
+    }
+    fuzzy_vector xv = eq | mv;
+    fuzzy_vector xh = (((eq & pv) + pv) ^ pv) | eq;
+    fuzzy_vector ph = mv | ~(xh | pv);
+    fuzzy_vector mh = pv & xh;
+    /* Comparisons give all ones in true lanes. */
+    fuzzy_vector up = (fuzzy_vector)((ph & high) != zero);
+    fuzzy_vector down = (fuzzy_vector)((mh & high) != zero) & ~up;
+    score += (one & up & active) - (one & down & active);
+    ph <<= 1;
+    mh <<= 1;
+    pv = ((mh | ~(xv | ph)) & active) | (pv & ~active);
+    mv = ((ph & xv) & active) | (mv & ~active);
+    fuzzy_vector lower = (fuzzy_vector)(score < best);
+    best = (score & lower) | (best & ~lower);
+  }
+  for (lane = 0; lane < FUZZY_LANES; lane++)
+    distances[lane] = best[lane];
+}
+
+static void fuzzy_add(struct fuzzy_matches *matches, uint32_t doc, int distance, int popularity)
+{
+  if (matches->count == matches->capacity) {
+    matches->capacity = matches->capacity ? matches->capacity * 2 : 64;
+    matches->matches = (struct fuzzy_match*)index_realloc(matches->matches, matches->capacity * sizeof(struct fuzzy_match));
+  }
+  matches->matches[matches->count].doc = doc;
+  matches->matches[matches->count].distance = distance;
+  matches->matches[matches->count].popularity = popularity;
+  matches->count++;
+}
+
+/* Match the indexed documents from [start] to [stop]. */
+static void fuzzy_match_range(struct local_index *index, const struct fuzzy_pattern *pattern, size_t start, size_t stop, struct fuzzy_matches *matches)
+{
+  const char *names[FUZZY_LANES];
+  uint32_t docs[FUZZY_LANES];
+  int distances[FUZZY_LANES];
+  int lanes = 0, lane;
+  size_t i;
+  for (i = start; i < stop; i++) {
+    /* A name shorter than the query by more than the error bound
+       cannot match. */
+    const char *name = index->docs[i].name;
+    if ((int)strlen(name) + pattern->max_errors < pattern->length) continue;
+    names[lanes] = name;
+    docs[lanes] = i;
+    if (++lanes < FUZZY_LANES) continue;
+    fuzzy_distance_lanes(pattern, names, distances);
+    for (lane = 0; lane < FUZZY_LANES; lane++)
+      if (distances[lane] <= pattern->max_errors)
+        fuzzy_add(matches, docs[lane], distances[lane], index->docs[docs[lane]].popularity);
+    lanes = 0;
+  }
+  for (lane = 0; lane < lanes; lane++) {
+    int distance = fuzzy_distance(pattern, names[lane]);
+    if (distance <= pattern->max_errors)
+      fuzzy_add(matches, docs[lane], distance, index->docs[docs[lane]].popularity);
+  }
+}
+
+struct fuzzy_job {
+  struct local_index *index;
+  const struct fuzzy_pattern *pattern;
+  pthread_mutex_t mutex;
+  size_t next_chunk;
+  size_t num_chunks;
+};
+
+struct fuzzy_worker {
+  pthread_t thread;
+  struct fuzzy_job *job;
+  struct fuzzy_matches matches;
+};
+
+static void *fuzzy_worker(void *data)
+{
+  struct fuzzy_worker *worker = (struct fuzzy_worker*)data;
+  struct fuzzy_job *job = worker->job;
+  for (;;) {
+    pthread_mutex_lock(&(job->mutex));
+    size_t chunk = job->next_chunk;
+    if (chunk < job->num_chunks) job->next_chunk++;
+    pthread_mutex_unlock(&(job->mutex));
+    if (chunk >= job->num_chunks) break;
+    size_t start = chunk * FUZZY_CHUNK, stop = start + FUZZY_CHUNK;
+    if (stop > job->index->num_indexed) stop = job->index->num_indexed;
+    fuzzy_match_range(job->index, job->pattern, start, stop, &(worker->matches));
+  }
+  return NULL;
+}
+
+static int compare_fuzzy_matches(const void *a, const void *b)
+{
+  const struct fuzzy_match *ma = (const struct fuzzy_match*)a, *mb = (const struct fuzzy_match*)b;
+  if (ma->distance != mb->distance) return ma->distance - mb->distance;
+  if (ma->popularity != mb->popularity) return mb->popularity - ma->popularity;
+  return ma->doc < mb->doc ? -1 : 1;
+}
+
+/* Match [query] against [index] with [jobs] threads, and store in
+   [results] the objects and distances of the best [count] matches of
+   each kind, on which references are added. Called with the index
+   mutex held. */
+static void fuzzy_search(struct local_index *index, const char *query, int max_errors, int jobs, size_t count, void **results, int *distances, size_t counts[3])
+{
+  struct fuzzy_pattern pattern;
+  struct fuzzy_job job;
+  size_t i;
+  char *normalized = (char*)xmalloc(strlen(query) + 1);
+  normalize_name(query, normalized);
+  fuzzy_compile(&pattern, normalized, max_errors);
+  free(normalized);
+  counts[0] = counts[1] = counts[2] = 0;
+  if (pattern.length == 0) return;
+  job.index = index;
+  job.pattern = &pattern;
+  job.next_chunk = 0;
+  job.num_chunks = (index->num_indexed + FUZZY_CHUNK - 1) / FUZZY_CHUNK;
+  pthread_mutex_init(&(job.mutex), NULL);
+  if (jobs < 1) jobs = 1;
+  if ((size_t)jobs > job.num_chunks) jobs = job.num_chunks ? job.num_chunks : 1;
+  struct fuzzy_worker *workers = (struct fuzzy_worker*)xmalloc(jobs * sizeof(struct fuzzy_worker));
+  memset(workers, 0, jobs * sizeof(struct fuzzy_worker));
+  int started = 1;
+  workers[0].job = &job;
+  for (i = 1; i < (size_t)jobs; i++) {
+    workers[i].job = &job;
+    if (pthread_create(&(workers[i].thread), NULL, fuzzy_worker, &(workers[i])))
+      break;
+    started++;
+  }
+  /* The calling thread works too. */
+  fuzzy_worker(&(workers[0]));
+  for (i = 1; i < (size_t)started; i++)
+    pthread_join(workers[i].thread, NULL);
+  pthread_mutex_destroy(&(job.mutex));
+  for (i = 1; i < (size_t)started; i++) {
+    size_t j;
+    for (j = 0; j < workers[i].matches.count; j++)
+      fuzzy_add(&(workers[0].matches), workers[i].matches.matches[j].doc, workers[i].matches.matches[j].distance, workers[i].matches.matches[j].popularity);
+    free(workers[i].matches.matches);
+  }
+  struct fuzzy_matches *matches = &(workers[0].matches);
+  if (matches->count > 0) qsort(matches->matches, matches->count, sizeof(struct fuzzy_match), compare_fuzzy_matches);
+  for (i = 0; i < matches->count; i++) {
+    struct index_doc *doc = &(index->docs[matches->matches[i].doc]);
+    if (counts[doc->kind] == count) continue;
+    switch (doc->kind) {
+    case OBJECT_TRACK: sp_track_add_ref((sp_track*)doc->object); break;
+    case OBJECT_ALBUM: sp_album_add_ref((sp_album*)doc->object); break;
+    default: sp_artist_add_ref((sp_artist*)doc->object); break;
+    }
+    results[doc->kind * count + counts[doc->kind]] = doc->object;
+    distances[doc->kind * count + counts[doc->kind]] = matches->matches[i].distance;
+    counts[doc->kind]++;
+  }
+  free(matches->matches);
+  free(workers);
+}
+
+CAMLprim value ocaml_spotify_fuzzy_search(value val_index, value query, value max_errors, value jobs, value val_count)
+{
+  CAMLparam5(val_index, query, max_errors, jobs, val_count);
+  CAMLlocal4(result, array, pair, handle);
+  struct local_index *index = get_local_index(val_index);
+  size_t count = Int_val(val_count) > 0 ? Int_val(val_count) : 0;
+  size_t counts[3], kind, i;
+  void **results = (void**)xmalloc((count * 3 + 1) * sizeof(void*));
+  int *distances = (int*)xmalloc((count * 3 + 1) * sizeof(int));
+  TRACE_BEGIN;
+  pthread_mutex_lock(&(index->mutex));
+  fuzzy_search(index, String_val(query), Int_val(max_errors), Int_val(jobs), count, results, distances, counts);
+  pthread_mutex_unlock(&(index->mutex));
+  TRACE_END(TRACE_API, "fuzzy_search", "results", counts[0] + counts[1] + counts[2]);
+  result = caml_alloc_tuple(3);
+  for (kind = 0; kind < 3; kind++) {
+    array = caml_alloc(counts[kind], 0);
+    Store_field(result, kind, array);
+    for (i = 0; i < counts[kind]; i++) {
+      void *object = results[kind * count + i];
+      switch (kind) {
+      case OBJECT_TRACK: handle = alloc_track((sp_track*)object); break;
+      case OBJECT_ALBUM: handle = alloc_album((sp_album*)object); break;
+      default: handle = alloc_artist((sp_artist*)object); break;
+      }
+      pair = caml_alloc_tuple(2);
+      Store_field(pair, 0, handle);
+      Store_field(pair, 1, Val_int(distances[kind * count + i]));
+      Store_field(array, i, pair);
+    }
+  }
+  free(results);
+  free(distances);
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_fuzzy_distance(value query, value name)
+{
+  struct fuzzy_pattern pattern;
+  char *normalized_query = (char*)xmalloc(caml_string_length(query) + 1);
+  char *normalized_name = (char*)xmalloc(caml_string_length(name) + 1);
+  normalize_name(String_val(query), normalized_query);
+  normalize_name(String_val(name), normalized_name);
+  fuzzy_compile(&pattern, normalized_query, 0);
+  int distance = fuzzy_distance(&pattern, normalized_name);
+  free(normalized_query);
+  free(normalized_name);
+  return Val_int(distance);
+}
+
+/* +-----------------------------------------------------------------+
+   | Export                                                          |
+   +-----------------------------------------------------------------+ */
+
+/* Export of the metadata of tracks, albums and artists to files, as
+   Arrow IPC files or as newline-delimited JSON. Metadata is first
+   extracted into columns, strings being dictionary-encoded, then
+   written without libspotify nor the OCaml runtime. */
+
+enum export_type {
+  EXPORT_ID,
+  EXPORT_INT32,
+  EXPORT_STRING
+};
+
+/* A dictionary of strings: [offsets] holds the start of each string
+   in [data], plus the end of the last one. */
+struct export_dict {
+  char *data;
+  uint32_t size;
+  uint32_t capacity;
+  uint32_t *offsets;
+  uint32_t count;
+  uint32_t offsets_capacity;
+  uint32_t *slots;
+  uint32_t num_slots;
+};
+
+struct export_column {
+  const char *name;
+  enum export_type type;
+  int32_t *values;
+  /* Values of integer columns, indices in [dict] of string
+     columns. */
+  unsigned char *ids;
+  struct export_dict dict;
+};
+
+#define EXPORT_MAX_COLUMNS 8
+
+struct export_table {
+  uint32_t rows;
+  int num_columns;
+  struct export_column columns[EXPORT_MAX_COLUMNS];
+};
+
+static uint32_t *dict_slot(struct export_dict *dict, const char *str, uint32_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  uint32_t i;
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char)str[i]) * 0x100000001b3ULL;
+  uint32_t mask = dict->num_slots - 1;
+  i = h & mask;
+  for (;;) {
+    uint32_t slot = dict->slots[i];
+    if (slot == 0) return &(dict->slots[i]);
+    uint32_t start = dict->offsets[slot - 1], end = dict->offsets[slot];
+    if (end - start == len && memcmp(dict->data + start, str, len) == 0) return &(dict->slots[i]);
+    i = (i + 1) & mask;
+  }
+}
+
+static int32_t dict_add(struct export_dict *dict, const char *str)
+{
+  uint32_t len = str ? strlen(str) : 0, i;
+  if (str == NULL) str = "";
+  if (dict->offsets == NULL) {
+    dict->offsets_capacity = 256;
+    dict->offsets = (uint32_t*)xmalloc(dict->offsets_capacity * sizeof(uint32_t));
+    dict->offsets[0] = 0;
+  }
+  if ((dict->count + 1) * 2 > dict->num_slots) {
+    free(dict->slots);
+    dict->num_slots = dict->num_slots ? dict->num_slots * 2 : 1024;
+    dict->slots = (uint32_t*)calloc(dict->num_slots, sizeof(uint32_t));
+    if (dict->slots == NULL) {
+      perror("cannot allocate memory");
+      abort();
+    }
+    for (i = 0; i < dict->count; i++)
+      *dict_slot(dict, dict->data + dict->offsets[i], dict->offsets[i + 1] - dict->offsets[i]) = i + 1;
+  }
+  uint32_t *slot = dict_slot(dict, str, len);
+  if (*slot) return *slot - 1;
+  while (dict->size + len > dict->capacity) {
+    dict->capacity = dict->capacity ? dict->capacity * 2 : 4096;
+    dict->data = (char*)index_realloc(dict->data, dict->capacity);
+  }
+  if (dict->count + 2 > dict->offsets_capacity) {
+    dict->offsets_capacity *= 2;
+    dict->offsets = (uint32_t*)index_realloc(dict->offsets, dict->offsets_capacity * sizeof(uint32_t));
+  }
+  memcpy(dict->data + dict->size, str, len);
+  dict->size += len;
+  dict->offsets[++dict->count] = dict->size;
+  *slot = dict->count;
+  return dict->count - 1;
+}
+
+static struct export_column *export_column(struct export_table *table, const char *name, enum export_type type)
+{
+  struct export_column *column = &(table->columns[table->num_columns++]);
+  memset(column, 0, sizeof(struct export_column));
+  column->name = name;
+  column->type = type;
+  if (type == EXPORT_ID)
+    column->ids = (unsigned char*)xmalloc(table->rows * ID_SIZE + 1);
+  else
+    column->values = (int32_t*)xmalloc(table->rows * sizeof(int32_t) + 1);
+  return column;
+}
+
+static void export_table_free(struct export_table *table)
+{
+  int i;
+  for (i = 0; i < table->num_columns; i++) {
+    struct export_column *column = &(table->columns[i]);
+    free(column->values);
+    free(column->ids);
+    free(column->dict.data);
+    free(column->dict.offsets);
+    free(column->dict.slots);
+  }
+}
+
+static void export_id(struct export_column *column, uint32_t row, enum object_kind kind, void *object)
+{
+  if (object == NULL || !object_id(kind, object, column->ids + row * ID_SIZE))
+    memset(column->ids + row * ID_SIZE, 0, ID_SIZE);
+}
+
+/* Build the table of [tracks]. Called with libspotify locked. */
+static void export_tracks_table(struct export_table *table, sp_track **tracks)
+{
+  struct export_column *ids = export_column(table, "id", EXPORT_ID);
+  struct export_column *names = export_column(table, "name", EXPORT_STRING);
+  struct export_column *albums = export_column(table, "album", EXPORT_STRING);
+  struct export_column *artists = export_column(table, "artists", EXPORT_STRING);
+  struct export_column *durations = export_column(table, "duration_ms", EXPORT_INT32);
+  struct export_column *popularities = export_column(table, "popularity", EXPORT_INT32);
+  struct export_column *discs = export_column(table, "disc", EXPORT_INT32);
+  struct export_column *indices = export_column(table, "index", EXPORT_INT32);
+  struct arena arena = { NULL, 0, 0 };
+  uint32_t row;
+  for (row = 0; row < table->rows; row++) {
+    sp_track *track = tracks[row];
+    int i, num_artists = sp_track_num_artists(track);
+    export_id(ids, row, OBJECT_TRACK, track);
+    names->values[row] = dict_add(&(names->dict), sp_track_name(track));
+    sp_album *album = sp_track_album(track);
+    albums->values[row] = dict_add(&(albums->dict), album ? sp_album_name(album) : "");
+    /* Artists are joined with commas. */
+    arena.used = 0;
+    for (i = 0; i < num_artists; i++) {
+      sp_artist *artist = sp_track_artist(track, i);
+      const char *name = artist ? sp_artist_name(artist) : "";
+      /* Drop the null bytes between names. */
+      arena.used = arena_add(&arena, name) + strlen(name);
+      if (i + 1 < num_artists) arena.used = arena_add(&arena, ", ") + 2;
+    }
+    arena_add(&arena, "");
+    artists->values[row] = dict_add(&(artists->dict), arena.data);
+    durations->values[row] = sp_track_duration(track);
+    popularities->values[row] = sp_track_popularity(track);
+    discs->values[row] = sp_track_disc(track);
+    indices->values[row] = sp_track_index(track);
+  }
+  free(arena.data);
+}
+
+static const char *album_type_names[] = { "album", "single", "compilation", "unknown" };
+
+static void export_albums_table(struct export_table *table, sp_album **albums)
+{
+  struct export_column *ids = export_column(table, "id", EXPORT_ID);
+  struct export_column *names = export_column(table, "name", EXPORT_STRING);
+  struct export_column *artists = export_column(table, "artist", EXPORT_STRING);
+  struct export_column *years = export_column(table, "year", EXPORT_INT32);
+  struct export_column *types = export_column(table, "type", EXPORT_STRING);
+  uint32_t row;
+  for (row = 0; row < table->rows; row++) {
+    sp_album *album = albums[row];
+    export_id(ids, row, OBJECT_ALBUM, album);
+    names->values[row] = dict_add(&(names->dict), sp_album_name(album));
+    sp_artist *artist = sp_album_artist(album);
+    artists->values[row] = dict_add(&(artists->dict), artist ? sp_artist_name(artist) : "");
+    years->values[row] = sp_album_year(album);
+    unsigned int type = sp_album_type(album);
+    types->values[row] = dict_add(&(types->dict), album_type_names[type < 4 ? type : 3]);
+  }
+}
+
+static void export_artists_table(struct export_table *table, sp_artist **artists)
+{
+  struct export_column *ids = export_column(table, "id", EXPORT_ID);
+  struct export_column *names = export_column(table, "name", EXPORT_STRING);
+  uint32_t row;
+  for (row = 0; row < table->rows; row++) {
+    export_id(ids, row, OBJECT_ARTIST, artists[row]);
+    names->values[row] = dict_add(&(names->dict), sp_artist_name(artists[row]));
+  }
+}
+
+/* +-----------------------------------------------------------------+
+   | Flatbuffers                                                     |
+   +-----------------------------------------------------------------+ */
+
+/* A minimal flatbuffers builder, for Arrow metadata. As with the
+   reference implementation, buffers are built from the end, and
+   offsets are positions relative to the end of the buffer. */
+
+#define FB_MAX_FIELDS 8
+
+struct fb {
+  unsigned char *buf;
+  size_t capacity;
+  size_t head;
+  /* Number of bytes used, at the end of [buf]. */
+  size_t min_align;
+  size_t table_start;
+  size_t fields[FB_MAX_FIELDS];
+  int num_fields;
+};
+
+static void fb_init(struct fb *fb)
+{
+  memset(fb, 0, sizeof(struct fb));
+  fb->capacity = 1024;
+  fb->buf = (unsigned char*)xmalloc(fb->capacity);
+  fb->min_align = 1;
+}
+
+static void fb_grow(struct fb *fb, size_t size)
+{
+  while (fb->head + size > fb->capacity) {
+    unsigned char *buf = (unsigned char*)xmalloc(fb->capacity * 2);
+    memcpy(buf + fb->capacity * 2 - fb->head, fb->buf + fb->capacity - fb->head, fb->head);
+    free(fb->buf);
+    fb->buf = buf;
+    fb->capacity *= 2;
+  }
+}
+
+static void fb_push(struct fb *fb, const void *data, size_t size)
+{
+  fb_grow(fb, size);
+  fb->head += size;
+  memcpy(fb->buf + fb->capacity - fb->head, data, size);
+}
+
+/* Pad so that [size] bytes can be pushed aligned on [size] after
+   [additional] more bytes. */
+static void fb_prep(struct fb *fb, size_t size, size_t additional)
+{
+  static const unsigned char zeros[8] = { 0 };
+  if (size > fb->min_align) fb->min_align = size;
+  size_t pad = (~(fb->head + additional) + 1) & (size - 1);
+  fb_push(fb, zeros, pad);
+}
+
+#define FB_SCALAR(name, type)                           \
+  static void fb_##name(struct fb *fb, type x)          \
+  {                                                     \
+    fb_prep(fb, sizeof(type), 0);                       \
+    fb_push(fb, &x, sizeof(type));                      \
+  }
+
+FB_SCALAR(u8, uint8_t)
+FB_SCALAR(i16, int16_t)
+FB_SCALAR(i32, int32_t)
+FB_SCALAR(u32, uint32_t)
+FB_SCALAR(i64, int64_t)
+
+static void fb_offset(struct fb *fb, size_t offset)
+{
+  fb_prep(fb, 4, 0);
+  fb_u32(fb, fb->head + 4 - offset);
+}
+
+static size_t fb_string(struct fb *fb, const char *str)
+{
+  size_t len = strlen(str);
+  fb_prep(fb, 4, len + 1);
+  fb_u8(fb, 0);
+  fb_push(fb, str, len);
+  fb_u32(fb, len);
+  return fb->head;
+}
+
+static size_t fb_offsets(struct fb *fb, const size_t *offsets, size_t count)
+{
+  size_t i;
+  fb_prep(fb, 4, count * 4);
+  for (i = count; i > 0; i--) fb_offset(fb, offsets[i - 1]);
+  fb_u32(fb, count);
+  return fb->head;
+}
+
+/* Start a vector of [count] structs of [size] bytes aligned on
+   [align]; elements must then be pushed in reverse order. */
+static void fb_start_structs(struct fb *fb, size_t size, size_t count, size_t align)
+{
+  fb_prep(fb, 4, size * count);
+  fb_prep(fb, align, size * count);
+}
+
+static size_t fb_end_structs(struct fb *fb, size_t count)
+{
+  fb_u32(fb, count);
+  return fb->head;
+}
+
+static void fb_start_table(struct fb *fb)
+{
+  fb->table_start = fb->head;
+  fb->num_fields = 0;
+  memset(fb->fields, 0, sizeof(fb->fields));
+}
+
+static void fb_slot(struct fb *fb, int slot)
+{
+  fb->fields[slot] = fb->head;
+  if (slot + 1 > fb->num_fields) fb->num_fields = slot + 1;
+}
+
+static void fb_field_u8(struct fb *fb, int slot, uint8_t x) { fb_u8(fb, x); fb_slot(fb, slot); }
+static void fb_field_i16(struct fb *fb, int slot, int16_t x) { fb_i16(fb, x); fb_slot(fb, slot); }
+static void fb_field_i32(struct fb *fb, int slot, int32_t x) { fb_i32(fb, x); fb_slot(fb, slot); }
+static void fb_field_i64(struct fb *fb, int slot, int64_t x) { fb_i64(fb, x); fb_slot(fb, slot); }
+static void fb_field_offset(struct fb *fb, int slot, size_t offset) { fb_offset(fb, offset); fb_slot(fb, slot); }
+
+static size_t fb_end_table(struct fb *fb)
+{
+  int i;
+  fb_i32(fb, 0);
+  size_t object = fb->head;
+  for (i = fb->num_fields - 1; i >= 0; i--)
+    fb_i16(fb, fb->fields[i] ? (int16_t)(object - fb->fields[i]) : 0);
+  fb_i16(fb, (int16_t)(object - fb->table_start));
+  fb_i16(fb, (int16_t)((fb->num_fields + 2) * 2));
+  int32_t vtable = fb->head - object;
+  memcpy(fb->buf + fb->capacity - object, &vtable, 4);
+  return object;
+}
+
+static void fb_finish(struct fb *fb, size_t root)
+{
+  fb_prep(fb, fb->min_align, 4);
+  fb_offset(fb, root);
+}
+
+/* +-----------------------------------------------------------------+
+   | Arrow IPC                                                       |
+   +-----------------------------------------------------------------+ */
+
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_DICTIONARY_BATCH 2
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_FIXED_SIZE_BINARY 15
+#define ARROW_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct arrow_block {
+  int64_t offset;
+  int32_t metadata_length;
+  int64_t body_length;
+};
+
+struct arrow_writer {
+  FILE *file;
+  int64_t position;
+  int error;
+  struct arrow_block *dictionaries;
+  int num_dictionaries;
+  struct arrow_block *batches;
+  size_t num_batches;
+  size_t batches_capacity;
+};
+
+/* Buffers of a message body. */
+struct arrow_body {
+  const void *data[3 * EXPORT_MAX_COLUMNS];
+  int64_t length[3 * EXPORT_MAX_COLUMNS];
+  int count;
+  int64_t nodes[EXPORT_MAX_COLUMNS];
+  int num_nodes;
+};
+
+static void arrow_write(struct arrow_writer *writer, const void *data, size_t size)
+{
+  if (size > 0 && fwrite(data, 1, size, writer->file) != size) writer->error = 1;
+  writer->position += size;
+}
+
+static void arrow_pad(struct arrow_writer *writer)
+{
+  static const char zeros[8] = { 0 };
+  arrow_write(writer, zeros, ARROW_ALIGN(writer->position) - writer->position);
+}
+
+static void arrow_buffer(struct arrow_body *body, const void *data, int64_t length)
+{
+  body->data[body->count] = data;
+  body->length[body->count] = length;
+  body->count++;
+}
+
+static size_t arrow_record_batch(struct fb *fb, int64_t length, struct arrow_body *body)
+{
+  int i;
+  /* Buffers are laid out back to back, each padded to 8 bytes. */
+  fb_start_structs(fb, 16, body->count, 8);
+  for (i = body->count - 1; i >= 0; i--) {
+    int64_t start = 0, j;
+    for (j = 0; j < i; j++) start += ARROW_ALIGN(body->length[j]);
+    fb_i64(fb, body->length[i]);
+    fb_i64(fb, start);
+  }
+  size_t buffers = fb_end_structs(fb, body->count);
+  fb_start_structs(fb, 16, body->num_nodes, 8);
+  for (i = body->num_nodes - 1; i >= 0; i--) {
+    fb_i64(fb, 0);
+    fb_i64(fb, body->nodes[i]);
+  }
+  size_t nodes = fb_end_structs(fb, body->num_nodes);
+  fb_start_table(fb);
+  fb_field_i64(fb, 0, length);
+  fb_field_offset(fb, 1, nodes);
+  fb_field_offset(fb, 2, buffers);
+  return fb_end_table(fb);
+}
+
+static int64_t arrow_body_length(struct arrow_body *body)
+{
+  int64_t length = 0;
+  int i;
+  for (i = 0; i < body->count; i++) length += ARROW_ALIGN(body->length[i]);
+  return length;
+}
+
+/* Write an encapsulated message whose header of type [type] is
+   [header] in [fb], followed by [body]. */
+static struct arrow_block arrow_message(struct arrow_writer *writer, struct fb *fb, uint8_t type, size_t header, struct arrow_body *body)
+{
+  struct arrow_block block;
+  int64_t body_length = body ? arrow_body_length(body) : 0;
+  int i;
+  fb_start_table(fb);
+  fb_field_i64(fb, 3, body_length);
+  fb_field_offset(fb, 2, header);
+  fb_field_i16(fb, 0, ARROW_METADATA_V5);
+  fb_field_u8(fb, 1, type);
+  fb_finish(fb, fb_end_table(fb));
+  block.offset = writer->position;
+  uint32_t continuation = 0xffffffff;
+  int32_t size = ARROW_ALIGN(fb->head + 8) - 8;
+  arrow_write(writer, &continuation, 4);
+  arrow_write(writer, &size, 4);
+  arrow_write(writer, fb->buf + fb->capacity - fb->head, fb->head);
+  arrow_pad(writer);
+  block.metadata_length = writer->position - block.offset;
+  for (i = 0; body && i < body->count; i++) {
+    arrow_write(writer, body->data[i], body->length[i]);
+    arrow_pad(writer);
+  }
+  block.body_length = body_length;
+  free(fb->buf);
+  fb_init(fb);
+  return block;
+}
+
+static size_t arrow_int_type(struct fb *fb, int bits)
+{
+  fb_start_table(fb);
+  fb_field_i32(fb, 0, bits);
+  fb_field_u8(fb, 1, 1);
+  return fb_end_table(fb);
+}
+
+static size_t arrow_schema(struct fb *fb, struct export_table *table)
+{
+  size_t fields[EXPORT_MAX_COLUMNS];
+  int i;
+  for (i = 0; i < table->num_columns; i++) {
+    struct export_column *column = &(table->columns[i]);
+    size_t name = fb_string(fb, column->name);
+    size_t children = fb_offsets(fb, NULL, 0);
+    size_t type, dictionary = 0;
+    uint8_t type_type;
+    switch (column->type) {
+    case EXPORT_ID:
+      fb_start_table(fb);
+      fb_field_i32(fb, 0, ID_SIZE);
+      type = fb_end_table(fb);
+      type_type = ARROW_TYPE_FIXED_SIZE_BINARY;
+      break;
+    case EXPORT_INT32:
+      type = arrow_int_type(fb, 32);
+      type_type = ARROW_TYPE_INT;
+      break;
+    default: {
+      fb_start_table(fb);
+      type = fb_end_table(fb);
+      type_type = ARROW_TYPE_UTF8;
+      size_t index_type = arrow_int_type(fb, 32);
+      fb_start_table(fb);
+      fb_field_i64(fb, 0, i);
+      fb_field_offset(fb, 1, index_type);
+      dictionary = fb_end_table(fb);
+      break;
+    }
+    }
+    fb_start_table(fb);
+    fb_field_offset(fb, 0, name);
+    fb_field_offset(fb, 3, type);
+    if (dictionary) fb_field_offset(fb, 4, dictionary);
+    fb_field_offset(fb, 5, children);
+    fb_field_u8(fb, 1, 0);
+    fb_field_u8(fb, 2, type_type);
+    fields[i] = fb_end_table(fb);
+  }
+  size_t vector = fb_offsets(fb, fields, table->num_columns);
+  fb_start_table(fb);
+  fb_field_offset(fb, 1, vector);
+  return fb_end_table(fb);
+}
+
+static size_t arrow_blocks(struct fb *fb, struct arrow_block *blocks, size_t count)
+{
+  size_t i;
+  fb_start_structs(fb, 24, count, 8);
+  for (i = count; i > 0; i--) {
+    fb_i64(fb, blocks[i - 1].body_length);
+    fb_i32(fb, 0);
+    fb_i32(fb, blocks[i - 1].metadata_length);
+    fb_i64(fb, blocks[i - 1].offset);
+  }
+  return fb_end_structs(fb, count);
+}
+
+/* Write [table] as an Arrow IPC file, in record batches of at most
+   [chunk] rows. Returns 0 on success. */
+static int write_arrow(struct export_table *table, FILE *file, uint32_t chunk)
+{
+  struct arrow_writer writer;
+  struct arrow_body body;
+  struct fb fb;
+  int i;
+  uint32_t start;
+  memset(&writer, 0, sizeof(writer));
+  writer.file = file;
+  writer.dictionaries = (struct arrow_block*)xmalloc(EXPORT_MAX_COLUMNS * sizeof(struct arrow_block));
+  fb_init(&fb);
+  arrow_write(&writer, "ARROW1\0\0", 8);
+  arrow_message(&writer, &fb, ARROW_HEADER_SCHEMA, arrow_schema(&fb, table), NULL);
+  /* Dictionaries, whose ids are the numbers of their columns. */
+  for (i = 0; i < table->num_columns; i++) {
+    struct export_dict *dict = &(table->columns[i].dict);
+    uint32_t empty = 0;
+    if (table->columns[i].type != EXPORT_STRING) continue;
+    memset(&body, 0, sizeof(body));
+    body.nodes[body.num_nodes++] = dict->count;
+    arrow_buffer(&body, NULL, 0);
+    arrow_buffer(&body, dict->offsets ? (void*)dict->offsets : (void*)&empty, (dict->count + 1) * 4);
+    arrow_buffer(&body, dict->data, dict->size);
+    size_t data = arrow_record_batch(&fb, dict->count, &body);
+    fb_start_table(&fb);
+    fb_field_i64(&fb, 0, i);
+    fb_field_offset(&fb, 1, data);
+    writer.dictionaries[writer.num_dictionaries++] = arrow_message(&writer, &fb, ARROW_HEADER_DICTIONARY_BATCH, fb_end_table(&fb), &body);
+  }
+  for (start = 0; start < table->rows || start == 0; start += chunk) {
+    uint32_t rows = table->rows - start < chunk ? table->rows - start : chunk;
+    memset(&body, 0, sizeof(body));
+    for (i = 0; i < table->num_columns; i++) {
+      struct export_column *column = &(table->columns[i]);
+      body.nodes[body.num_nodes++] = rows;
+      arrow_buffer(&body, NULL, 0);
+      if (column->type == EXPORT_ID)
+        arrow_buffer(&body, column->ids + (size_t)start * ID_SIZE, (int64_t)rows * ID_SIZE);
+      else
+        arrow_buffer(&body, column->values + start, (int64_t)rows * 4);
+    }
+    if (writer.num_batches == writer.batches_capacity) {
+      writer.batches_capacity = writer.batches_capacity ? writer.batches_capacity * 2 : 16;
+      writer.batches = (struct arrow_block*)index_realloc(writer.batches, writer.batches_capacity * sizeof(struct arrow_block));
+    }
+    writer.batches[writer.num_batches++] = arrow_message(&writer, &fb, ARROW_HEADER_RECORD_BATCH, arrow_record_batch(&fb, rows, &body), &body);
+    if (table->rows == 0) break;
+  }
+  /* Footer. */
+  size_t schema = arrow_schema(&fb, table);
+  size_t dictionaries = arrow_blocks(&fb, writer.dictionaries, writer.num_dictionaries);
+  size_t batches = arrow_blocks(&fb, writer.batches, writer.num_batches);
+  fb_start_table(&fb);
+  fb_field_offset(&fb, 1, schema);
+  fb_field_offset(&fb, 2, dictionaries);
+  fb_field_offset(&fb, 3, batches);
+  fb_field_i16(&fb, 0, ARROW_METADATA_V5);
+  fb_finish(&fb, fb_end_table(&fb));
+  int32_t footer = fb.head;
+  arrow_write(&writer, fb.buf + fb.capacity - fb.head, fb.head);
+  arrow_write(&writer, &footer, 4);
+  arrow_write(&writer, "ARROW1", 6);
+  free(fb.buf);
+  free(writer.dictionaries);
+  free(writer.batches);
+  return writer.error;
+}
+
+/* +-----------------------------------------------------------------+
+   | NDJSON                                                          |
+   +-----------------------------------------------------------------+ */
+
+static void json_string(FILE *file, const char *str, size_t len)
+{
+  size_t i;
+  putc('"', file);
+  for (i = 0; i < len; i++) {
+    unsigned char ch = str[i];
+    if (ch == '"' || ch == '\\')
+      fprintf(file, "\\%c", ch);
+    else if (ch < 0x20)
+      fprintf(file, "\\u%04x", ch);
+    else
+      putc(ch, file);
+  }
+  putc('"', file);
+}
+
+/* Write [table] as one JSON object per line. Ids are written in
+   hexadecimal. */
+static int write_ndjson(struct export_table *table, FILE *file)
+{
+  uint32_t row;
+  int i, j;
+  for (row = 0; row < table->rows; row++) {
+    putc('{', file);
+    for (i = 0; i < table->num_columns; i++) {
+      struct export_column *column = &(table->columns[i]);
+      if (i > 0) putc(',', file);
+      json_string(file, column->name, strlen(column->name));
+      putc(':', file);
+      switch (column->type) {
+      case EXPORT_ID:
+        putc('"', file);
+        for (j = 0; j < ID_SIZE; j++) fprintf(file, "%02x", column->ids[row * ID_SIZE + j]);
+        putc('"', file);
+        break;
+      case EXPORT_INT32:
+        fprintf(file, "%d", column->values[row]);
+        break;
+      default: {
+        struct export_dict *dict = &(column->dict);
+        uint32_t index = column->values[row];
+        json_string(file, dict->data + dict->offsets[index], dict->offsets[index + 1] - dict->offsets[index]);
+        break;
+      }
+      }
+    }
+    fputs("}\n", file);
+  }
+  return ferror(file);
+}
+
+/* [handles] holds handles of [kind]. [format] is 0 for Arrow and 1
+   for NDJSON. */
+static value export_handles(enum object_kind kind, value format, value chunk, value path, value handles)
+{
+  CAMLparam4(format, chunk, path, handles);
+  uint32_t rows = Wosize_val(handles), i;
+  void **objects = (void**)xmalloc(rows * sizeof(void*) + 1);
+  for (i = 0; i < rows; i++) {
+    switch (kind) {
+    case OBJECT_TRACK: objects[i] = get_track(Field(handles, i)); break;
+    case OBJECT_ALBUM: objects[i] = get_album(Field(handles, i)); break;
+    default: objects[i] = get_artist(Field(handles, i)); break;
+    }
+  }
+  if (Int_val(chunk) <= 0) {
+    free(objects);
+    caml_invalid_argument("Spotify.export: chunk size must be positive");
+  }
+  FILE *file = fopen(String_val(path), "wb");
+  if (file == NULL) {
+    free(objects);
+    caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  }
+  struct export_table table;
+  memset(&table, 0, sizeof(table));
+  table.rows = rows;
+  TRACE_BEGIN;
+  spotify_lock();
+  switch (kind) {
+  case OBJECT_TRACK: export_tracks_table(&table, (sp_track**)objects); break;
+  case OBJECT_ALBUM: export_albums_table(&table, (sp_album**)objects); break;
+  default: export_artists_table(&table, (sp_artist**)objects); break;
+  }
+  spotify_unlock();
+  free(objects);
+  int is_arrow = Int_val(format) == 0;
+  uint32_t chunk_size = Int_val(chunk);
+  caml_enter_blocking_section();
+  int error = is_arrow ? write_arrow(&table, file, chunk_size) : write_ndjson(&table, file);
+  if (fclose(file)) error = 1;
+  caml_leave_blocking_section();
+  TRACE_END(TRACE_API, "export", "rows", rows);
+  export_table_free(&table);
+  if (error) caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_spotify_export_tracks(value format, value chunk, value path, value tracks)
+{
+  return export_handles(OBJECT_TRACK, format, chunk, path, tracks);
+}
+
+CAMLprim value ocaml_spotify_export_albums(value format, value chunk, value path, value albums)
+{
+  return export_handles(OBJECT_ALBUM, format, chunk, path, albums);
+}
+
+CAMLprim value ocaml_spotify_export_artists(value format, value chunk, value path, value artists)
+{
+  return export_handles(OBJECT_ARTIST, format, chunk, path, artists);
+}
+
+/* +-----------------------------------------------------------------+
+   | Album subsystem                                                 |
+   +-----------------------------------------------------------------+ */
+
+CAMLprim value ocaml_spotify_album_is_loaded(value album)
+{
+  return Val_bool(sp_album_is_loaded(get_album(album)));
+}
+
+CAMLprim value ocaml_spotify_album_is_available(value album)
+{
+  return Val_bool(sp_album_is_available(get_album(album)));
+}
+
+CAMLprim value ocaml_spotify_album_artist(value album)
+{
+  sp_artist *artist = sp_album_artist(get_album(album));
+  if (artist) sp_artist_add_ref(artist);
+  return alloc_artist(artist);
+}
+
+CAMLprim value ocaml_spotify_album_cover(value album)
+{
+  const byte *id = sp_album_cover(get_album(album));
+  value str = caml_alloc_string(20);
+  memcpy(String_val(str), id, 20);
+  return str;
+}
+
+CAMLprim value ocaml_spotify_album_name(value album)
+{
+  return intern_string(sp_album_name(get_album(album)));
+}
+
+
+CAMLprim value ocaml_spotify_album_year(value album)
+{
+  return Val_int(sp_album_year(get_album(album)));
+}
+
+CAMLprim value ocaml_spotify_album_type(value album)
+{
+  return Val_int(sp_album_type(get_album(album)));
+}
+
+CAMLprim value ocaml_spotify_album_release(value album)
+{
+  album_finalize(album);
+  Album_val(album) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Aritst subsystem                                                |
+   +-----------------------------------------------------------------+ */
+
+CAMLprim value ocaml_spotify_artist_name(value artist)
+{
+  return intern_string(sp_artist_name(get_artist(artist)));
+}
+
+CAMLprim value ocaml_spotify_artist_is_loaded(value artist)
+{
+  return Val_bool(sp_artist_is_loaded(get_artist(artist)));
+}
+
+CAMLprim value ocaml_spotify_artist_release(value artist)
+{
+  artist_finalize(artist);
+  Artist_val(artist) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Album browsing                                                  |
+   +-----------------------------------------------------------------+ */
+
+static void albumbrowse_complete(sp_albumbrowse *result, void *userdata)
+{
+  record(RECORD_ALBUMBROWSE_COMPLETE, 2, (int64_t)sp_albumbrowse_error(result), (int64_t)sp_albumbrowse_num_tracks(result));
+  ENTER_CALLBACK;
+  struct albumbrowse *albumbrowse = (struct albumbrowse *)userdata;
+  caml_callback(albumbrowse->callback, albumbrowse->albumbrowse);
+  LEAVE_CALLBACK;
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_create(value val_session, value album, value callback)
+{
+  sp_session *session = get_session(val_session);
+  struct albumbrowse *albumbrowse = new(struct albumbrowse);
+  TRACE_BEGIN;
+  sp_albumbrowse *sp_albumbrowse = sp_albumbrowse_create(session,
+                                                         Album_val(album),
+                                                         albumbrowse_complete,
+                                                         (void*)albumbrowse);
+  TRACE_END(TRACE_API, "albumbrowse_create", NULL, 0);
+  albumbrowse->sp_albumbrowse = sp_albumbrowse;
+  albumbrowse->callback = callback;
+  albumbrowse->albumbrowse = alloc_albumbrowse(albumbrowse);
+  caml_register_generational_global_root(&(albumbrowse->callback));
+  caml_register_generational_global_root(&(albumbrowse->albumbrowse));
+  return albumbrowse->albumbrowse;
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_is_loaded(value albumbrowse)
+{
+  return Val_bool(sp_albumbrowse_is_loaded(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_error(value albumbrowse)
+{
+  return Val_int(sp_albumbrowse_error(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_album(value albumbrowse)
+{
+  sp_album *album = sp_albumbrowse_album(get_albumbrowse(albumbrowse)->sp_albumbrowse);
+  if (album) sp_album_add_ref(album);
+  return alloc_album(album);
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_artist(value albumbrowse)
+{
+  sp_artist *artist = sp_albumbrowse_artist(get_albumbrowse(albumbrowse)->sp_albumbrowse);
+  if (artist) sp_artist_add_ref(artist);
+  return alloc_artist(artist);
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_num_copyrights(value albumbrowse)
+{
+  return Val_int(sp_albumbrowse_num_copyrights(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_copyright(value albumbrowse, value index)
+{
+  const char *copyright = sp_albumbrowse_copyright(get_albumbrowse(albumbrowse)->sp_albumbrowse, Int_val(index));
+  if (copyright)
+    return caml_copy_string(copyright);
+  else
+    caml_invalid_argument("Spotify.albumbrowse_copyright");
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_num_tracks(value albumbrowse)
+{
+  return Val_int(sp_albumbrowse_num_tracks(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_track(value albumbrowse, value index)
+{
+  sp_track *track = sp_albumbrowse_track(get_albumbrowse(albumbrowse)->sp_albumbrowse, Int_val(index));
+  if (track) sp_track_add_ref(track);
+  return alloc_track(track);
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_review(value albumbrowse)
+{
+  return caml_copy_string(sp_albumbrowse_review(get_albumbrowse(albumbrowse)->sp_albumbrowse));
+}
+
+CAMLprim value ocaml_spotify_albumbrowse_release(value albumbrowse)
+{
+  albumbrowse_finalize(albumbrowse);
+  Albumbrowse_val(albumbrowse) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Artist browsing                                                 |
+   +-----------------------------------------------------------------+ */
+
+static void artistbrowse_complete(sp_artistbrowse *result, void *userdata)
+{
+  record(RECORD_ARTISTBROWSE_COMPLETE, 2, (int64_t)sp_artistbrowse_error(result), (int64_t)sp_artistbrowse_num_tracks(result));
+  ENTER_CALLBACK;
+  struct artistbrowse *artistbrowse = (struct artistbrowse *)userdata;
+  caml_callback(artistbrowse->callback, artistbrowse->artistbrowse);
+  LEAVE_CALLBACK;
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_create(value val_session, value artist, value callback)
+{
+  sp_session *session = get_session(val_session);
+  struct artistbrowse *artistbrowse = new(struct artistbrowse);
+  TRACE_BEGIN;
+  sp_artistbrowse *sp_artistbrowse = sp_artistbrowse_create(session,
+                                                            Artist_val(artist),
+                                                            artistbrowse_complete,
+                                                            (void*)artistbrowse);
+  TRACE_END(TRACE_API, "artistbrowse_create", NULL, 0);
+  artistbrowse->sp_artistbrowse = sp_artistbrowse;
+  artistbrowse->callback = callback;
+  artistbrowse->artistbrowse = alloc_artistbrowse(artistbrowse);
+  caml_register_generational_global_root(&(artistbrowse->callback));
+  caml_register_generational_global_root(&(artistbrowse->artistbrowse));
+  return artistbrowse->artistbrowse;
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_is_loaded(value artistbrowse)
+{
+  return Val_bool(sp_artistbrowse_is_loaded(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_error(value artistbrowse)
+{
+  return Val_int(sp_artistbrowse_error(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_artist(value artistbrowse)
+{
+  sp_artist *artist = sp_artistbrowse_artist(get_artistbrowse(artistbrowse)->sp_artistbrowse);
+  if (artist) sp_artist_add_ref(artist);
+  return alloc_artist(artist);
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_num_portraits(value artistbrowse)
+{
+  return Val_int(sp_artistbrowse_num_portraits(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_portrait(value artistbrowse, value index)
+{
+  const byte *id = sp_artistbrowse_portrait(get_artistbrowse(artistbrowse)->sp_artistbrowse, Int_val(index));
+  value str = caml_alloc_string(20);
+  memcpy(String_val(str), id, 20);
+  return str;
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_num_tracks(value artistbrowse)
+{
+  return Val_int(sp_artistbrowse_num_tracks(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_track(value artistbrowse, value index)
+{
+  sp_track *track = sp_artistbrowse_track(get_artistbrowse(artistbrowse)->sp_artistbrowse, Int_val(index));
+  if (track) sp_track_add_ref(track);
+  return alloc_track(track);
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_num_albums(value artistbrowse)
+{
+  return Val_int(sp_artistbrowse_num_albums(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_album(value artistbrowse, value index)
+{
+  sp_album *album = sp_artistbrowse_album(get_artistbrowse(artistbrowse)->sp_artistbrowse, Int_val(index));
+  if (album) sp_album_add_ref(album);
+  return alloc_album(album);
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_num_similar_artists(value artistbrowse)
+{
+  return Val_int(sp_artistbrowse_num_similar_artists(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_similar_artist(value artistbrowse, value index)
+{
+  sp_artist *artist = sp_artistbrowse_similar_artist(get_artistbrowse(artistbrowse)->sp_artistbrowse, Int_val(index));
+  if (artist) sp_artist_add_ref(artist);
+  return alloc_artist(artist);
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_biography(value artistbrowse)
+{
+  return caml_copy_string(sp_artistbrowse_biography(get_artistbrowse(artistbrowse)->sp_artistbrowse));
+}
+
+CAMLprim value ocaml_spotify_artistbrowse_release(value artistbrowse)
+{
+  artistbrowse_finalize(artistbrowse);
+  Artistbrowse_val(artistbrowse) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Artist graph                                                    |
+   +-----------------------------------------------------------------+ */
+
+/* A graph of similar artists, keyed by artist ids. Adjacency lists
+   are stored in compressed sparse row layout: the neighbours of node
+   [i] are targets[offsets[i]] to targets[offsets[i + 1] - 1]. Lists
+   added since the last query are kept aside and merged into the
+   arrays before the next one.
+
+   On disk, a graph is, in host byte order: the magic "OSPG", a
+   version, the number of nodes, of edges and the size of the names
+   (32 bits each), then the nodes (id, offset of the name and flags),
+   the offsets, the targets and the names. */
+
+#define GRAPH_MAGIC "OSPG"
+#define GRAPH_VERSION 1
+#define GRAPH_EXPANDED 1
+
+struct graph_node {
+  unsigned char id[ID_SIZE];
+  uint32_t name;
+  /* Offset of the name in [names]. */
+  uint32_t flags;
+};
+
+struct graph_update {
+  uint32_t node;
+  uint32_t *targets;
+  uint32_t count;
+};
+
+struct artist_graph {
+  struct graph_node *nodes;
+  uint32_t num_nodes;
+  uint32_t nodes_capacity;
+  uint32_t *slots;
+  uint32_t num_slots;
+  /* Open-addressing table from ids to node numbers plus one. */
+  char *names;
+  uint32_t names_size;
+  uint32_t names_capacity;
+  uint32_t *offsets;
+  uint32_t *targets;
+  uint32_t num_csr_nodes;
+  /* Number of nodes covered by [offsets]. */
+  struct graph_update *updates;
+  uint32_t num_updates;
+  uint32_t updates_capacity;
+  uint32_t *marks;
+  uint32_t *queue;
+  uint32_t epoch;
+  /* Marks of visited nodes during traversals. A node is visited if
+     its mark is the current epoch. */
+};
+
+#define Artist_graph_val(v) *(struct artist_graph **)Data_custom_val(v)
+
+static uint32_t *graph_slot(struct artist_graph *graph, const unsigned char *id)
+{
+  uint32_t mask = graph->num_slots - 1;
+  uint32_t i = id_hash(id) & mask;
+  while (graph->slots[i] && memcmp(graph->nodes[graph->slots[i] - 1].id, id, ID_SIZE))
+    i = (i + 1) & mask;
+  return &(graph->slots[i]);
+}
+
+/* Returns the node of [id], or -1 if there is none. */
+static int64_t graph_find(struct artist_graph *graph, const unsigned char *id)
+{
+  if (graph->num_slots == 0) return -1;
+  uint32_t slot = *graph_slot(graph, id);
+  return slot ? (int64_t)slot - 1 : -1;
+}
+
+static uint32_t graph_add_name(struct artist_graph *graph, const char *name)
+{
+  uint32_t len = strlen(name) + 1, offset = graph->names_size;
+  while (graph->names_size + len > graph->names_capacity) {
+    graph->names_capacity = graph->names_capacity ? graph->names_capacity * 2 : 4096;
+    graph->names = (char*)index_realloc(graph->names, graph->names_capacity);
+  }
+  memcpy(graph->names + offset, name, len);
+  graph->names_size += len;
+  return offset;
+}
+
+static void graph_rehash(struct artist_graph *graph, uint32_t num_slots)
+{
+  uint32_t i;
+  free(graph->slots);
+  graph->num_slots = num_slots;
+  graph->slots = (uint32_t*)calloc(num_slots, sizeof(uint32_t));
+  if (graph->slots == NULL) {
+    perror("cannot allocate memory");
+    abort();
+  }
+  for (i = 0; i < graph->num_nodes; i++)
+    *graph_slot(graph, graph->nodes[i].id) = i + 1;
+}
+
+/* Returns the node of [id], adding it if needed. An empty name does
+   not replace a known one. */
+static uint32_t graph_node(struct artist_graph *graph, const unsigned char *id, const char *name)
+{
+  if ((graph->num_nodes + 1) * 2 > graph->num_slots)
+    graph_rehash(graph, graph->num_slots ? graph->num_slots * 2 : 1024);
+  uint32_t *slot = graph_slot(graph, id);
+  if (*slot) {
+    struct graph_node *node = &(graph->nodes[*slot - 1]);
+    if (name[0] && strcmp(graph->names + node->name, name))
+      node->name = graph_add_name(graph, name);
+    return *slot - 1;
+  }
+  if (graph->num_nodes == graph->nodes_capacity) {
+    graph->nodes_capacity = graph->nodes_capacity ? graph->nodes_capacity * 2 : 256;
+    graph->nodes = (struct graph_node*)index_realloc(graph->nodes, graph->nodes_capacity * sizeof(struct graph_node));
+  }
+  struct graph_node *node = &(graph->nodes[graph->num_nodes]);
+  memcpy(node->id, id, ID_SIZE);
+  node->name = graph_add_name(graph, name);
+  node->flags = 0;
+  *slot = ++graph->num_nodes;
+  return graph->num_nodes - 1;
+}
+
+static uint32_t graph_degree(struct artist_graph *graph, uint32_t node)
+{
+  return node < graph->num_csr_nodes ? graph->offsets[node + 1] - graph->offsets[node] : 0;
+}
+
+/* Merge pending adjacency lists into the CSR arrays. */
+static void graph_build(struct artist_graph *graph)
+{
+  uint32_t i, *lists, num_edges = 0;
+  if (graph->num_updates == 0 && graph->num_csr_nodes == graph->num_nodes) return;
+  /* For each node, the pending list replacing its current one, plus
+     one. Later updates win. */
+  lists = (uint32_t*)calloc(graph->num_nodes + 1, sizeof(uint32_t));
+  if (lists == NULL) {
+    perror("cannot allocate memory");
+    abort();
+  }
+  for (i = 0; i < graph->num_updates; i++)
+    lists[graph->updates[i].node] = i + 1;
+  uint32_t *offsets = (uint32_t*)xmalloc((graph->num_nodes + 1) * sizeof(uint32_t));
+  for (i = 0; i < graph->num_nodes; i++) {
+    offsets[i] = num_edges;
+    num_edges += lists[i] ? graph->updates[lists[i] - 1].count : graph_degree(graph, i);
+  }
+  offsets[graph->num_nodes] = num_edges;
+  uint32_t *targets = (uint32_t*)xmalloc((num_edges + 1) * sizeof(uint32_t));
+  for (i = 0; i < graph->num_nodes; i++) {
+    if (lists[i])
+      memcpy(targets + offsets[i], graph->updates[lists[i] - 1].targets, graph->updates[lists[i] - 1].count * sizeof(uint32_t));
+    else if (i < graph->num_csr_nodes)
+      memcpy(targets + offsets[i], graph->targets + graph->offsets[i], graph_degree(graph, i) * sizeof(uint32_t));
+  }
+  for (i = 0; i < graph->num_updates; i++)
+    free(graph->updates[i].targets);
+  graph->num_updates = 0;
+  free(lists);
+  free(graph->offsets);
+  free(graph->targets);
+  graph->offsets = offsets;
+  graph->targets = targets;
+  graph->num_csr_nodes = graph->num_nodes;
+  free(graph->marks);
+  free(graph->queue);
+  graph->marks = (uint32_t*)calloc(graph->num_nodes + 1, sizeof(uint32_t));
+  graph->queue = (uint32_t*)xmalloc((graph->num_nodes + 1) * sizeof(uint32_t));
+  if (graph->marks == NULL) {
+    perror("cannot allocate memory");
+    abort();
+  }
+  graph->epoch = 0;
+}
+
+static void graph_set_neighbours(struct artist_graph *graph, uint32_t node, uint32_t *targets, uint32_t count)
+{
+  if (graph->num_updates == graph->updates_capacity) {
+    graph->updates_capacity = graph->updates_capacity ? graph->updates_capacity * 2 : 64;
+    graph->updates = (struct graph_update*)index_realloc(graph->updates, graph->updates_capacity * sizeof(struct graph_update));
+  }
+  graph->updates[graph->num_updates].node = node;
+  graph->updates[graph->num_updates].targets = targets;
+  graph->updates[graph->num_updates].count = count;
+  graph->num_updates++;
+}
+
+static void graph_free(struct artist_graph *graph)
+{
+  uint32_t i;
+  for (i = 0; i < graph->num_updates; i++)
+    free(graph->updates[i].targets);
+  free(graph->updates);
+  free(graph->nodes);
+  free(graph->slots);
+  free(graph->names);
+  free(graph->offsets);
+  free(graph->targets);
+  free(graph->marks);
+  free(graph->queue);
+  free(graph);
+}
+
+static void artist_graph_finalize(value x)
+{
+  struct artist_graph *graph = Artist_graph_val(x);
+  if (graph) graph_free(graph);
+}
+
+static struct custom_operations artist_graph_ops = {
+  "spotify:artist_graph",
+  artist_graph_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct artist_graph *get_artist_graph(value x)
+{
+  struct artist_graph *graph = Artist_graph_val(x);
+  if (graph == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return graph;
+}
+
+static value alloc_artist_graph(struct artist_graph *graph)
+{
+  value x = caml_alloc_custom(&artist_graph_ops, sizeof(struct artist_graph *), 0, 1);
+  Artist_graph_val(x) = graph;
+  return x;
+}
+
+static const unsigned char *get_graph_id(value id)
+{
+  if (caml_string_length(id) != ID_SIZE) caml_invalid_argument("Spotify.artist_graph: invalid artist id");
+  return (const unsigned char*)String_val(id);
+}
+
+CAMLprim value ocaml_spotify_artist_graph_create(value unit)
+{
+  struct artist_graph *graph = new(struct artist_graph);
+  memset(graph, 0, sizeof(struct artist_graph));
+  return alloc_artist_graph(graph);
+}
+
+CAMLprim value ocaml_spotify_artist_graph_release(value graph)
+{
+  artist_graph_finalize(graph);
+  Artist_graph_val(graph) = NULL;
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_artist_graph_add(value val_graph, value artistbrowse)
+{
+  struct artist_graph *graph = get_artist_graph(val_graph);
+  sp_artistbrowse *browse = get_artistbrowse(artistbrowse)->sp_artistbrowse;
+  unsigned char id[ID_SIZE];
+  sp_artist *artist = sp_artistbrowse_artist(browse);
+  if (artist == NULL || !object_id(OBJECT_ARTIST, artist, id)) caml_raise(*caml_named_value("spotify:null"));
+  const char *name = sp_artist_name(artist);
+  uint32_t node = graph_node(graph, id, name ? name : "");
+  graph->nodes[node].flags |= GRAPH_EXPANDED;
+  int i, count = sp_artistbrowse_num_similar_artists(browse);
+  uint32_t num_targets = 0, *targets = (uint32_t*)xmalloc((count + 1) * sizeof(uint32_t));
+  for (i = 0; i < count; i++) {
+    sp_artist *similar = sp_artistbrowse_similar_artist(browse, i);
+    if (similar == NULL || !object_id(OBJECT_ARTIST, similar, id)) continue;
+    name = sp_artist_name(similar);
+    targets[num_targets++] = graph_node(graph, id, name ? name : "");
+  }
+  graph_set_neighbours(graph, node, targets, num_targets);
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_artist_graph_num_nodes(value graph)
+{
+  return Val_long(get_artist_graph(graph)->num_nodes);
+}
+
+CAMLprim value ocaml_spotify_artist_graph_num_edges(value val_graph)
+{
+  struct artist_graph *graph = get_artist_graph(val_graph);
+  graph_build(graph);
+  return Val_long(graph->num_nodes ? graph->offsets[graph->num_nodes] : 0);
+}
+
+CAMLprim value ocaml_spotify_artist_graph_mem(value graph, value id)
+{
+  return Val_bool(graph_find(get_artist_graph(graph), get_graph_id(id)) >= 0);
+}
+
+CAMLprim value ocaml_spotify_artist_graph_is_expanded(value val_graph, value id)
+{
+  struct artist_graph *graph = get_artist_graph(val_graph);
+  int64_t node = graph_find(graph, get_graph_id(id));
+  return Val_bool(node >= 0 && (graph->nodes[node].flags & GRAPH_EXPANDED));
+}
+
+CAMLprim value ocaml_spotify_artist_graph_name(value val_graph, value id)
+{
+  struct artist_graph *graph = get_artist_graph(val_graph);
+  int64_t node = graph_find(graph, get_graph_id(id));
+  if (node < 0) caml_raise_not_found();
+  return caml_copy_string(graph->names + graph->nodes[node].name);
+}
+
+static value alloc_graph_ids(struct artist_graph *graph, const uint32_t *nodes, uint32_t count)
+{
+  CAMLparam0();
+  CAMLlocal2(result, id);
+  uint32_t i;
+  result = caml_alloc(count, 0);
+  for (i = 0; i < count; i++) {
+    id = caml_alloc_string(ID_SIZE);
+    memcpy(String_val(id), graph->nodes[nodes[i]].id, ID_SIZE);
+    Store_field(result, i, id);
+  }
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_artist_graph_neighbours(value val_graph, value id)
+{
+  struct artist_graph *graph = get_artist_graph(val_graph);
+  int64_t node = graph_find(graph, get_graph_id(id));
+  if (node < 0) caml_raise_not_found();
+  graph_build(graph);
+  return alloc_graph_ids(graph, graph->targets + graph->offsets[node], graph_degree(graph, node));
+}
+
+CAMLprim value ocaml_spotify_artist_graph_k_hop(value val_graph, value id, value val_depth)
+{
+  CAMLparam3(val_graph, id, val_depth);
+  CAMLlocal3(result, ids, pair);
+  struct artist_graph *graph = get_artist_graph(val_graph);
+  int64_t start = graph_find(graph, get_graph_id(id));
+  if (start < 0) caml_raise_not_found();
+  graph_build(graph);
+  if (++graph->epoch == 0) {
+    memset(graph->marks, 0, graph->num_nodes * sizeof(uint32_t));
+    graph->epoch = 1;
+  }
+  /* Breadth-first search, one level at a time. */
+  int depth = Int_val(val_depth), level;
+  uint32_t head = 0, tail = 0, level_end;
+  graph->marks[start] = graph->epoch;
+  graph->queue[tail++] = start;
+  int *depths = (int*)xmalloc((graph->num_nodes + 1) * sizeof(int));
+  depths[0] = 0;
+  for (level = 1; level <= depth && head < tail; level++) {
+    level_end = tail;
+    for (; head < level_end; head++) {
+      uint32_t node = graph->queue[head], i;
+      for (i = graph->offsets[node]; i < graph->offsets[node + 1]; i++) {
+        uint32_t target = graph->targets[i];
+        if (graph->marks[target] != graph->epoch) {
+          graph->marks[target] = graph->epoch;
+          depths[tail] = level;
+          graph->queue[tail++] = target;
+        }
+      }
+    }
+  }
+  /* Skip the starting node. */
+  ids = alloc_graph_ids(graph, graph->queue + 1, tail - 1);
+  result = caml_alloc(tail - 1, 0);
+  for (head = 1; head < tail; head++) {
+    pair = caml_alloc_tuple(2);
+    Store_field(pair, 0, Field(ids, head - 1));
+    Store_field(pair, 1, Val_int(depths[head]));
+    Store_field(result, head - 1, pair);
+  }
+  free(depths);
+  CAMLreturn(result);
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+  const char *p = (const char*)data;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *data, size_t size)
+{
+  char *p = (char*)data;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* The graph is written to a temporary file which then replaces
+   [path], so that a crash never leaves a partial graph. */
+CAMLprim value ocaml_spotify_artist_graph_save(value val_graph, value path)
+{
+  struct artist_graph *graph = get_artist_graph(val_graph);
+  graph_build(graph);
+  size_t len = caml_string_length(path);
+  char *tmp = (char*)xmalloc(len + 5);
+  memcpy(tmp, String_val(path), len);
+  memcpy(tmp + len, ".tmp", 5);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    free(tmp);
+    caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  }
+  uint32_t header[4];
+  header[0] = GRAPH_VERSION;
+  header[1] = graph->num_nodes;
+  header[2] = graph->num_nodes ? graph->offsets[graph->num_nodes] : 0;
+  header[3] = graph->names_size;
+  int error = write_all(fd, GRAPH_MAGIC, 4)
+    || write_all(fd, header, sizeof(header))
+    || write_all(fd, graph->nodes, graph->num_nodes * sizeof(struct graph_node))
+    || (graph->num_nodes && write_all(fd, graph->offsets, (graph->num_nodes + 1) * sizeof(uint32_t)))
+    || write_all(fd, graph->targets, header[2] * sizeof(uint32_t))
+    || write_all(fd, graph->names, graph->names_size)
+    || fsync(fd) < 0;
+  int saved_errno = errno;
+  if (close(fd) < 0 && !error) {
+    error = 1;
+    saved_errno = errno;
+  }
+  if (!error && rename(tmp, String_val(path)) < 0) {
+    error = 1;
+    saved_errno = errno;
+  }
+  if (error) unlink(tmp);
+  free(tmp);
+  if (error) caml_raise_sys_error(caml_copy_string(strerror(saved_errno)));
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_artist_graph_load(value path)
+{
+  char magic[4];
+  uint32_t header[4], i;
+  struct stat st;
+  int fd = open(String_val(path), O_RDONLY);
+  if (fd < 0) caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  if (fstat(fd, &st) < 0) {
+    int saved_errno = errno;
+    close(fd);
+    caml_raise_sys_error(caml_copy_string(strerror(saved_errno)));
+  }
+  if (read_all(fd, magic, 4) || memcmp(magic, GRAPH_MAGIC, 4) || read_all(fd, header, sizeof(header)) || header[0] != GRAPH_VERSION) {
+    close(fd);
+    caml_failwith("Spotify.artist_graph_load: not an artist graph");
+  }
+  /* Check the counts against the size of the file before allocating
+     anything. Counts are at most 2^32 - 1, so the sum cannot
+     overflow a 64-bit size. The hash table needs fewer than 2^31
+     nodes. */
+  uint64_t expected = 4 + sizeof(header)
+    + (uint64_t)header[1] * sizeof(struct graph_node)
+    + (header[1] ? ((uint64_t)header[1] + 1) * sizeof(uint32_t) : 0)
+    + (uint64_t)header[2] * sizeof(uint32_t)
+    + header[3];
+  if (st.st_size < 0 || expected != (uint64_t)st.st_size || expected > SIZE_MAX / 2 || header[1] >= (1u << 30)) {
+    close(fd);
+    caml_failwith("Spotify.artist_graph_load: truncated or corrupted artist graph");
+  }
+  struct artist_graph *graph = new(struct artist_graph);
+  memset(graph, 0, sizeof(struct artist_graph));
+  graph->num_nodes = graph->nodes_capacity = header[1];
+  graph->names_size = graph->names_capacity = header[3];
+  graph->nodes = (struct graph_node*)xmalloc(((size_t)header[1] + 1) * sizeof(struct graph_node));
+  graph->offsets = (uint32_t*)xmalloc(((size_t)header[1] + 1) * sizeof(uint32_t));
+  graph->targets = (uint32_t*)xmalloc(((size_t)header[2] + 1) * sizeof(uint32_t));
+  graph->names = (char*)xmalloc((size_t)header[3] + 1);
+  graph->offsets[0] = 0;
+  int error = read_all(fd, graph->nodes, (size_t)header[1] * sizeof(struct graph_node))
+    || (header[1] && read_all(fd, graph->offsets, ((size_t)header[1] + 1) * sizeof(uint32_t)))
+    || read_all(fd, graph->targets, (size_t)header[2] * sizeof(uint32_t))
+    || read_all(fd, graph->names, header[3]);
+  close(fd);
+  /* Check that the file is consistent. */
+  for (i = 0; !error && i < header[1]; i++)
+    error = graph->offsets[i] > graph->offsets[i + 1] || graph->nodes[i].name >= header[3];
+  if (!error && graph->offsets[header[1]] != header[2]) error = 1;
+  for (i = 0; !error && i < header[2]; i++)
+    error = graph->targets[i] >= header[1];
+  if (!error && header[3] > 0 && graph->names[header[3] - 1] != 0) error = 1;
+  if (error) {
+    graph_free(graph);
+    caml_failwith("Spotify.artist_graph_load: truncated or corrupted artist graph");
+  }
+  graph->num_csr_nodes = graph->num_nodes;
+  graph->marks = (uint32_t*)calloc(graph->num_nodes + 1, sizeof(uint32_t));
+  graph->queue = (uint32_t*)xmalloc((graph->num_nodes + 1) * sizeof(uint32_t));
+  if (graph->marks == NULL) {
+    perror("cannot allocate memory");
+    abort();
+  }
+  uint32_t num_slots = 1024;
+  while (num_slots < graph->num_nodes * 2 + 2) num_slots *= 2;
+  graph_rehash(graph, num_slots);
+  return alloc_artist_graph(graph);
+}
+
+/* +-----------------------------------------------------------------+
+   | Image handling                                                  |
+   +-----------------------------------------------------------------+ */
+
+CAMLprim value ocaml_spotify_image_create(value val_session, value id)
+{
+  sp_session *session = get_session(val_session);
+  struct image *image = new(struct image);
+  TRACE_BEGIN;
+  image->sp_image = sp_image_create(session, (byte*)String_val(id));
+  TRACE_END(TRACE_API, "image_create", NULL, 0);
+  image->callbacks = NULL;
+  image->image = alloc_image(image);
+  return image->image;
+}
+
+CAMLprim value ocaml_spotify_image_create_from_link(value val_session, value val_link)
+{
+  sp_session *session = get_session(val_session);
+  sp_link *link = get_link(val_link);
+  struct image *image = new(struct image);
+  image->sp_image = sp_image_create_from_link(session, link);
+  image->callbacks = NULL;
+  image->image = alloc_image(image);
+  return image->image;
+}
+
+static void load_image_complete(sp_image *image, void *userdata)
+{
+  if (recorder_file) {
+    size_t size;
+    sp_image_data(image, &size);
+    record(RECORD_IMAGE_LOADED, 2, (int64_t)sp_image_error(image), (int64_t)size);
+  }
+  ENTER_CALLBACK;
+  struct image_callbacks *node = (struct image_callbacks *)userdata;
+  caml_callback(node->callback, node->image);
+  LEAVE_CALLBACK;
+}
+
+CAMLprim value ocaml_spotify_image_add_load_callback(value val_image, value callback)
+{
+  struct image *image = get_image(val_image);
+  struct image_callbacks *node = new(struct image_callbacks);
+  node->image = image->image;
+  node->callback = callback;
+  node->next = image->callbacks;
+  image->callbacks = node;
+  caml_register_generational_global_root(&(node->image));
+  caml_register_generational_global_root(&(node->callback));
+  sp_image_add_load_callback(image->sp_image, load_image_complete, (void*)node);
+  return caml_copy_nativeint((intnat)&node);
+}
+
+CAMLprim value ocaml_spotify_image_remove_load_callback(value val_image, value id)
+{
+  struct image *image = get_image(val_image);
+  struct image_callbacks *callback = (struct image_callbacks*)Nativeint_val(id);
+  struct image_callbacks *node = image->callbacks;
+  struct image_callbacks **cell = &(image->callbacks);
+  while (node) {
+    if (node == callback) {
+      sp_image_remove_load_callback(image->sp_image, load_image_complete, (void*)node);
+      caml_remove_generational_global_root(&(node->callback));
+      caml_remove_generational_global_root(&(node->image));
+      *cell = node->next;
+      free(node);
+      Nativeint_val(id) = 0;
+      break;
+    }
+    cell = &(node->next);
+    node = node->next;
+  }
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_image_is_loaded(value image)
+{
+  return Val_bool(sp_image_is_loaded(get_image(image)->sp_image));
+}
+
+CAMLprim value ocaml_spotify_image_error(value image)
+{
+  return Val_int(sp_image_error(get_image(image)->sp_image));
+}
+
+CAMLprim value ocaml_spotify_image_format(value image)
+{
+  return Val_int(sp_image_format(get_image(image)->sp_image) + 1);
+}
+
+CAMLprim value ocaml_spotify_image_data(value image)
+{
+  size_t size;
+  const void *data = sp_image_data(get_image(image)->sp_image, &size);
+  intnat dim[1];
+  dim[0] = size;
+  value x = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_EXTERNAL, 1, (void*)data, dim);
+  return x;
+}
+
+CAMLprim value ocaml_spotify_image_image_id(value image)
+{
+  const byte *id = sp_image_image_id(get_image(image)->sp_image);
+  value str = caml_alloc_string(20);
+  memcpy(String_val(str), id, 20);
+  return str;
+}
+
+CAMLprim value ocaml_spotify_image_release(value image)
+{
+  image_finalize(image);
+  Image_val(image) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Search subsystem                                                |
+   +-----------------------------------------------------------------+ */
+
+static void search_complete(sp_search *result, void *userdata)
+{
+  record(RECORD_SEARCH_COMPLETE, 4, (int64_t)sp_search_error(result), (int64_t)sp_search_num_tracks(result), (int64_t)sp_search_num_albums(result), (int64_t)sp_search_num_artists(result));
+  ENTER_CALLBACK;
+  struct search *search = (struct search *)userdata;
+  caml_callback(search->callback, search->search);
+  LEAVE_CALLBACK;
+}
+
+CAMLprim value ocaml_spotify_search_create(value val_session, value query, value track_offset, value track_count, value album_offset, value album_count, value artist_offset, value artist_count, value callback)
+{
+  sp_session *session = get_session(val_session);
+  struct search *search = new(struct search);
+  TRACE_BEGIN;
+  sp_search *sp_search = sp_search_create(session,
+                                          String_val(query),
+                                          Int_val(track_offset),
+                                          Int_val(track_count),
+                                          Int_val(album_offset),
+                                          Int_val(album_count),
+                                          Int_val(artist_offset),
+                                          Int_val(artist_count),
+                                          search_complete,
+                                          (void*)search);
+  TRACE_END(TRACE_API, "search_create", "query_length", caml_string_length(query));
+  search->sp_search = sp_search;
+  search->callback = callback;
+  search->search = alloc_search(search);
+  caml_register_generational_global_root(&(search->callback));
+  caml_register_generational_global_root(&(search->search));
+  return search->search;
+}
+
+CAMLprim value ocaml_spotify_search_create_byte(value *argv, int argn)
+{
+  return ocaml_spotify_search_create(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7], argv[8]);
+}
+
+CAMLprim value ocaml_spotify_radio_search_create(value val_session, value from_year, value to_year, value list, value callback)
+{
+  sp_session *session = get_session(val_session);
+  sp_radio_genre genres = 0;
+  while (Is_block(list)) {
+    genres |= 1 << Int_val(Field(list, 0));
+    list = Field(list, 1);
+  }
+  struct search *search = new(struct search);
+  sp_search *sp_search = sp_radio_search_create(session,
+                                                Int_val(from_year),
+                                                Int_val(to_year),
+                                                genres,
+                                                search_complete,
+                                                (void*)search);
+  search->sp_search = sp_search;
+  search->callback = callback;
+  search->search = alloc_search(search);
+  caml_register_generational_global_root(&(search->callback));
+  caml_register_generational_global_root(&(search->search));
+  return search->search;
+}
+
+CAMLprim value ocaml_spotify_search_is_loaded(value search)
+{
+  return Val_bool(sp_search_is_loaded(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_error(value search)
+{
+  return Val_int(sp_search_error(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_num_tracks(value search)
+{
+  return Val_int(sp_search_num_tracks(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_track(value search, value index)
+{
+  sp_track *track = sp_search_track(get_search(search)->sp_search, Int_val(index));
+  if (track) sp_track_add_ref(track);
+  return alloc_track(track);
+}
+
+CAMLprim value ocaml_spotify_search_num_albums(value search)
+{
+  return Val_int(sp_search_num_albums(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_album(value search, value index)
+{
+  sp_album *album = sp_search_album(get_search(search)->sp_search, Int_val(index));
+  if (album) sp_album_add_ref(album);
+  return alloc_album(album);
+}
+
+CAMLprim value ocaml_spotify_search_num_artists(value search)
+{
+  return Val_int(sp_search_num_artists(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_artist(value search, value index)
+{
+  sp_artist *artist = sp_search_artist(get_search(search)->sp_search, Int_val(index));
+  if (artist) sp_artist_add_ref(artist);
+  return alloc_artist(artist);
+}
+
+CAMLprim value ocaml_spotify_search_query(value search)
+{
+  return caml_copy_string(sp_search_query(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_did_you_mean(value search)
+{
+  return caml_copy_string(sp_search_did_you_mean(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_total_tracks(value search)
+{
+  return Val_int(sp_search_total_tracks(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_total_albums(value search)
+{
+  return Val_int(sp_search_total_albums(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_total_artists(value search)
+{
+  return Val_int(sp_search_total_artists(get_search(search)->sp_search));
+}
+
+CAMLprim value ocaml_spotify_search_release(value search)
+{
+  search_finalize(search);
+  Search_val(search) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Playlist subsystem                                              |
+   +-----------------------------------------------------------------+ */
+
+CAMLprim value ocaml_spotify_user_is_loaded(value user)
+{
+  return Val_bool(sp_user_is_loaded(get_user(user)));
+}
+
+CAMLprim value ocaml_spotify_user_canonical_name(value user)
+{
+  return caml_copy_string(sp_user_canonical_name(get_user(user)));
+}
+
+CAMLprim value ocaml_spotify_user_release(value user)
+{
+  user_finalize(user);
+  User_val(user) = NULL;
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_playlist_is_loaded(value playlist)
+{
+  return Val_bool(sp_playlist_is_loaded(get_playlist(playlist)));
+}
+
+CAMLprim value ocaml_spotify_playlist_name(value playlist)
+{
+  return caml_copy_string(sp_playlist_name(get_playlist(playlist)));
+}
+
+CAMLprim value ocaml_spotify_playlist_num_tracks(value playlist)
+{
+  return Val_int(sp_playlist_num_tracks(get_playlist(playlist)));
+}
+
+CAMLprim value ocaml_spotify_playlist_track(value playlist, value index)
+{
+  sp_track *track = sp_playlist_track(get_playlist(playlist), Int_val(index));
+  if (track) sp_track_add_ref(track);
+  return alloc_track(track);
+}
+
+CAMLprim value ocaml_spotify_playlist_set_offline_mode(value session, value playlist, value offline)
+{
+  sp_playlist_set_offline_mode(get_session(session), get_playlist(playlist), Bool_val(offline));
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_playlist_get_offline_status(value session, value playlist)
+{
+  return Val_int(sp_playlist_get_offline_status(get_session(session), get_playlist(playlist)));
+}
+
+CAMLprim value ocaml_spotify_playlist_get_offline_download_completed(value session, value playlist)
+{
+  return Val_int(sp_playlist_get_offline_download_completed(get_session(session), get_playlist(playlist)));
+}
+
+CAMLprim value ocaml_spotify_playlist_release(value playlist)
+{
+  playlist_finalize(playlist);
+  Playlist_val(playlist) = NULL;
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_playlistcontainer_is_loaded(value playlistcontainer)
+{
+  return Val_bool(sp_playlistcontainer_is_loaded(get_playlistcontainer(playlistcontainer)));
+}
+
+CAMLprim value ocaml_spotify_playlistcontainer_num_playlists(value playlistcontainer)
+{
+  return Val_int(sp_playlistcontainer_num_playlists(get_playlistcontainer(playlistcontainer)));
+}
+
+CAMLprim value ocaml_spotify_playlistcontainer_playlist(value playlistcontainer, value index)
+{
+  sp_playlist *playlist = sp_playlistcontainer_playlist(get_playlistcontainer(playlistcontainer), Int_val(index));
+  if (playlist) sp_playlist_add_ref(playlist);
+  return alloc_playlist(playlist);
+}
+
+CAMLprim value ocaml_spotify_playlistcontainer_release(value playlistcontainer)
+{
+  playlistcontainer_finalize(playlistcontainer);
+  Playlistcontainer_val(playlistcontainer) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Startup                                                         |
+   +-----------------------------------------------------------------+ */
+
+/* A startup logs in and, as soon as it is logged in, requests the
+   user, the playlist container and the starred playlist at once.
+   When the container is loaded, the first playlists are referenced
+   so that libspotify loads them in parallel. Progress is checked
+   from the callbacks, in the main thread, and the time at which each
+   phase completes is stored. */
+
+enum startup_phase {
+  STARTUP_LOGGED_IN,
+  STARTUP_USER_LOADED,
+  STARTUP_CONTAINER_LOADED,
+  STARTUP_STARRED_LOADED,
+  STARTUP_PLAYLISTS_LOADED,
+  STARTUP_TRACKS_LOADED,
+  STARTUP_PHASES
+};
+
+static const char *startup_phase_names[] = {
+  "startup:logged_in",
+  "startup:user_loaded",
+  "startup:container_loaded",
+  "startup:starred_loaded",
+  "startup:playlists_loaded",
+  "startup:tracks_loaded"
+};
+
+struct startup {
+  struct userdata *data;
+  /* The session data, or NULL if the startup has been detached from
+     its session. */
+  sp_session *session;
+  int64_t start;
+  int64_t times[STARTUP_PHASES];
+  /* Time at which each phase completed, in nanoseconds, or -1. */
+  sp_error error;
+  /* Error of the login. */
+  int prefetch;
+  /* Number of playlists of the container to load. */
+  sp_user *user;
+  sp_playlistcontainer *container;
+  sp_playlist *starred;
+  sp_playlist **playlists;
+  int num_playlists;
+};
+
+#define Startup_val(v) *(struct startup **)Data_custom_val(v)
+
+static void startup_playlist_state_changed(sp_playlist *playlist, void *userdata)
+{
+  startup_update((struct startup*)userdata);
+}
+
+static void startup_container_loaded(sp_playlistcontainer *container, void *userdata);
+
+static sp_playlist_callbacks startup_playlist_callbacks = {
+  .playlist_state_changed = startup_playlist_state_changed
+};
+
+static sp_playlistcontainer_callbacks startup_container_callbacks = {
+  .container_loaded = startup_container_loaded
+};
+
+static void startup_reach(struct startup *startup, enum startup_phase phase)
+{
+  if (startup->times[phase] >= 0) return;
+  startup->times[phase] = trace_now();
+  if (trace_enabled) trace_event(TRACE_API, startup_phase_names[phase], startup->times[phase], NULL, 0);
+}
+
+static void startup_logged_in(struct startup *startup, sp_error error)
+{
+  startup->error = error;
+  if (error != SP_ERROR_OK || startup->times[STARTUP_LOGGED_IN] >= 0) return;
+  startup_reach(startup, STARTUP_LOGGED_IN);
+  sp_session *session = startup->session;
+  startup->user = sp_session_user(session);
+  if (startup->user) sp_user_add_ref(startup->user);
+  startup->container = sp_session_playlistcontainer(session);
+  if (startup->container) {
+    sp_playlistcontainer_add_ref(startup->container);
+    sp_playlistcontainer_add_callbacks(startup->container, &startup_container_callbacks, startup);
+  }
+  startup->starred = sp_session_starred_create(session);
+  if (startup->starred) sp_playlist_add_callbacks(startup->starred, &startup_playlist_callbacks, startup);
+  startup_update(startup);
+}
+
+static void startup_container_loaded(sp_playlistcontainer *container, void *userdata)
+{
+  startup_update((struct startup*)userdata);
+}
+
+static int playlist_tracks_loaded(sp_playlist *playlist)
+{
+  int i, count = sp_playlist_num_tracks(playlist);
+  for (i = 0; i < count; i++) {
+    sp_track *track = sp_playlist_track(playlist, i);
+    if (track && !sp_track_is_loaded(track)) return 0;
+  }
+  return 1;
+}
+
+static void startup_update(struct startup *startup)
+{
+  int i;
+  if (startup->data == NULL || startup->times[STARTUP_LOGGED_IN] < 0) return;
+  if (startup->user && sp_user_is_loaded(startup->user))
+    startup_reach(startup, STARTUP_USER_LOADED);
+  if (startup->starred && sp_playlist_is_loaded(startup->starred))
+    startup_reach(startup, STARTUP_STARRED_LOADED);
+  if (startup->container && sp_playlistcontainer_is_loaded(startup->container) && startup->playlists == NULL) {
+    startup_reach(startup, STARTUP_CONTAINER_LOADED);
+    int count = sp_playlistcontainer_num_playlists(startup->container);
+    if (count > startup->prefetch) count = startup->prefetch;
+    startup->playlists = (sp_playlist**)xmalloc(count * sizeof(sp_playlist*) + 1);
+    startup->num_playlists = 0;
+    for (i = 0; i < count; i++) {
+      sp_playlist *playlist = sp_playlistcontainer_playlist(startup->container, i);
+      if (playlist == NULL) continue;
+      sp_playlist_add_ref(playlist);
+      sp_playlist_add_callbacks(playlist, &startup_playlist_callbacks, startup);
+      startup->playlists[startup->num_playlists++] = playlist;
+    }
+  }
+  if (startup->playlists == NULL) return;
+  for (i = 0; i < startup->num_playlists; i++)
+    if (!sp_playlist_is_loaded(startup->playlists[i])) return;
+  startup_reach(startup, STARTUP_PLAYLISTS_LOADED);
+  if (startup->times[STARTUP_STARRED_LOADED] < 0 && startup->starred) return;
+  if (startup->starred && !playlist_tracks_loaded(startup->starred)) return;
+  for (i = 0; i < startup->num_playlists; i++)
+    if (!playlist_tracks_loaded(startup->playlists[i])) return;
+  startup_reach(startup, STARTUP_TRACKS_LOADED);
+}
+
+/* Release everything the startup references and detach it from its
+   session. */
+static void startup_detach(struct startup *startup)
+{
+  int i;
+  if (startup->data == NULL) return;
+  if (startup->data->startup == startup) startup->data->startup = NULL;
+  startup->data = NULL;
+  for (i = 0; i < startup->num_playlists; i++) {
+    sp_playlist_remove_callbacks(startup->playlists[i], &startup_playlist_callbacks, startup);
+    sp_playlist_release(startup->playlists[i]);
+  }
+  free(startup->playlists);
+  startup->playlists = NULL;
+  startup->num_playlists = 0;
+  if (startup->starred) {
+    sp_playlist_remove_callbacks(startup->starred, &startup_playlist_callbacks, startup);
+    sp_playlist_release(startup->starred);
+    startup->starred = NULL;
+  }
+  if (startup->container) {
+    sp_playlistcontainer_remove_callbacks(startup->container, &startup_container_callbacks, startup);
+    sp_playlistcontainer_release(startup->container);
+    startup->container = NULL;
+  }
+  if (startup->user) {
+    sp_user_release(startup->user);
+    startup->user = NULL;
+  }
+}
+
+static void startup_free(struct startup *startup)
+{
+  startup_detach(startup);
+  free(startup);
+}
+
+static void startup_finalize(value x)
+{
+  struct startup *startup = Startup_val(x);
+  if (startup) RELEASE_LATER(startup_free, startup);
+}
+
+static struct custom_operations startup_ops = {
+  "spotify:startup",
+  startup_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct startup *get_startup(value x)
+{
+  struct startup *startup = Startup_val(x);
+  if (startup == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return startup;
+}
+
+CAMLprim value ocaml_spotify_session_startup(value val_session, value credentials, value prefetch)
+{
+  sp_session *session = get_session(val_session);
+  struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  int i;
+  TRACE_BEGIN;
+  sp_error error = sp_session_relogin(session);
+  if (error == SP_ERROR_NO_CREDENTIALS && Is_block(credentials)) {
+    value pair = Field(credentials, 0);
+    sp_session_login(session, String_val(Field(pair, 0)), String_val(Field(pair, 1)), 1);
+    error = SP_ERROR_OK;
+  }
+  TRACE_END(TRACE_API, "session_startup", "error", error);
+  if (error) fail("sp_session_relogin", error);
+  if (data->startup) startup_detach(data->startup);
+  struct startup *startup = new(struct startup);
+  memset(startup, 0, sizeof(struct startup));
+  startup->data = data;
+  startup->session = session;
+  startup->start = trace_now();
+  for (i = 0; i < STARTUP_PHASES; i++) startup->times[i] = -1;
+  startup->error = SP_ERROR_OK;
+  startup->prefetch = Int_val(prefetch) < 0 ? 0 : Int_val(prefetch);
+  data->startup = startup;
+  value x = caml_alloc_custom(&startup_ops, sizeof(struct startup *), 0, 1);
+  Startup_val(x) = startup;
+  return x;
+}
+
+CAMLprim value ocaml_spotify_startup_error(value startup)
+{
+  return Val_int(get_startup(startup)->error);
+}
+
+CAMLprim value ocaml_spotify_startup_timings(value val_startup)
+{
+  CAMLparam1(val_startup);
+  CAMLlocal3(result, cell, pair);
+  struct startup *startup = get_startup(val_startup);
+  int i;
+  result = Val_emptylist;
+  for (i = STARTUP_PHASES - 1; i >= 0; i--) {
+    if (startup->times[i] < 0) continue;
+    pair = caml_copy_double((double)(startup->times[i] - startup->start) / 1e9);
+    cell = caml_alloc_tuple(2);
+    Store_field(cell, 0, Val_int(i));
+    Store_field(cell, 1, pair);
+    pair = cell;
+    cell = caml_alloc_tuple(2);
+    Store_field(cell, 0, pair);
+    Store_field(cell, 1, result);
+    result = cell;
+  }
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_startup_playlistcontainer(value startup)
+{
+  sp_playlistcontainer *container = get_startup(startup)->container;
+  if (container) sp_playlistcontainer_add_ref(container);
+  return alloc_playlistcontainer(container);
+}
+
+CAMLprim value ocaml_spotify_startup_starred(value startup)
+{
+  sp_playlist *playlist = get_startup(startup)->starred;
+  if (playlist) sp_playlist_add_ref(playlist);
+  return alloc_playlist(playlist);
+}
+
+CAMLprim value ocaml_spotify_startup_playlists(value val_startup)
+{
+  CAMLparam1(val_startup);
+  CAMLlocal2(result, playlist);
+  struct startup *startup = get_startup(val_startup);
+  int i, count = startup->num_playlists;
+  result = caml_alloc(count, 0);
+  for (i = 0; i < count; i++) {
+    sp_playlist_add_ref(startup->playlists[i]);
+    playlist = alloc_playlist(startup->playlists[i]);
+    Store_field(result, i, playlist);
+  }
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_startup_release(value startup)
+{
+  startup_finalize(startup);
+  Startup_val(startup) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Star jobs                                                       |
+   +-----------------------------------------------------------------+ */
+
+/* A star job stars or unstars a large array of tracks in batches, one
+   batch per call to sp_session_process_events, so that the session
+   keeps processing events in between. It holds a reference on the
+   tracks it has not submitted yet. Jobs are only modified with the
+   libspotify lock held. */
+struct star_job {
+  struct userdata *data;
+  /* The session data, or NULL if the job is done, cancelled or
+     detached from its session. */
+  struct star_job *next;
+  sp_session *session;
+  sp_track **tracks;
+  int count;
+  int position;
+  /* Number of tracks submitted. */
+  int chunk_size;
+  bool star;
+  int orphan;
+  /* Whether the OCaml value has been collected or released. */
+};
+
+#define Star_job_val(v) *(struct star_job **)Data_custom_val(v)
+
+/* Release the tracks not submitted yet and detach the job from its
+   session. */
+static void star_job_stop(struct star_job *job)
+{
+  struct star_job **link;
+  int i;
+  if (job->data == NULL) return;
+  for (link = &(job->data->star_jobs); *link; link = &((*link)->next)) {
+    if (*link == job) {
+      *link = job->next;
+      break;
+    }
+  }
+  job->data = NULL;
+  job->next = NULL;
+  for (i = job->position; i < job->count; i++) sp_track_release(job->tracks[i]);
+  free(job->tracks);
+  job->tracks = NULL;
+}
+
+/* Submit the next batch of every job. */
+static void star_jobs_pump(struct userdata *data)
+{
+  struct star_job *job = data->star_jobs;
+  while (job) {
+    struct star_job *next = job->next;
+    int i, count = job->count - job->position;
+    if (count > job->chunk_size) count = job->chunk_size;
+    TRACE_BEGIN;
+    sp_track_set_starred(job->session, job->tracks + job->position, count, job->star);
+    TRACE_END(TRACE_API, "track_set_starred", "count", count);
+    for (i = 0; i < count; i++) sp_track_release(job->tracks[job->position + i]);
+    job->position += count;
+    if (job->position == job->count) {
+      star_job_stop(job);
+      if (job->orphan) free(job);
+    }
+    job = next;
+  }
+}
+
+/* Called when the session is released. */
+static void star_jobs_detach(struct userdata *data)
+{
+  while (data->star_jobs) {
+    struct star_job *job = data->star_jobs;
+    star_job_stop(job);
+    if (job->orphan) free(job);
+  }
+}
+
+/* A job dropped by OCaml runs to completion; the session frees it. */
+static void star_job_free(struct star_job *job)
+{
+  if (job->data)
+    job->orphan = 1;
+  else
+    free(job);
+}
+
+static void star_job_finalize(value x)
+{
+  struct star_job *job = Star_job_val(x);
+  if (job) RELEASE_LATER(star_job_free, job);
+}
+
+static struct custom_operations star_job_ops = {
+  "spotify:star_job",
+  star_job_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct star_job *get_star_job(value x)
+{
+  struct star_job *job = Star_job_val(x);
+  if (job == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return job;
+}
+
+CAMLprim value ocaml_spotify_tracks_set_starred(value val_session, value tracks, value star, value val_chunk_size)
+{
+  sp_session *session = get_session(val_session);
+  struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  long i, count = Wosize_val(tracks);
+  if (Long_val(val_chunk_size) <= 0 || count > INT_MAX)
+    caml_invalid_argument("Spotify.tracks_set_starred");
+  for (i = 0; i < count; i++)
+    get_track(Field(tracks, i));
+  struct star_job *job = new(struct star_job);
+  job->data = NULL;
+  job->next = NULL;
+  job->session = session;
+  job->tracks = (sp_track**)xmalloc(count * sizeof(sp_track*) + 1);
+  job->count = count;
+  job->position = 0;
+  job->chunk_size = Long_val(val_chunk_size) > INT_MAX ? INT_MAX : Long_val(val_chunk_size);
+  job->star = Bool_val(star);
+  job->orphan = 0;
+  for (i = 0; i < count; i++) {
+    job->tracks[i] = Track_val(Field(tracks, i));
+    sp_track_add_ref(job->tracks[i]);
+  }
+  if (count > 0) {
+    /* The runtime may be released while waiting for the lock, but the
+       tracks are referenced already. */
+    struct star_job **link;
+    spotify_lock();
+    job->data = data;
+    for (link = &(data->star_jobs); *link; link = &((*link)->next));
+    *link = job;
+    spotify_unlock();
+  } else {
+    free(job->tracks);
+    job->tracks = NULL;
+  }
+  value x = caml_alloc_custom(&star_job_ops, sizeof(struct star_job *), 0, 1);
+  Star_job_val(x) = job;
+  return x;
+}
+
+CAMLprim value ocaml_spotify_star_job_progress(value val_job)
+{
+  CAMLparam1(val_job);
+  CAMLlocal1(result);
+  struct star_job *job = get_star_job(val_job);
+  result = caml_alloc_tuple(2);
+  Store_field(result, 0, Val_int(job->position));
+  Store_field(result, 1, Val_int(job->count));
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_star_job_is_done(value job)
+{
+  return Val_bool(get_star_job(job)->data == NULL);
+}
+
+CAMLprim value ocaml_spotify_star_job_cancel(value val_job)
+{
+  struct star_job *job = get_star_job(val_job);
+  spotify_lock();
+  star_job_stop(job);
+  spotify_unlock();
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_star_job_release(value job)
+{
+  star_job_finalize(job);
+  Star_job_val(job) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Offline sync                                                    |
+   +-----------------------------------------------------------------+ */
+
+/* An offline plan marks playlists for offline use within a storage
+   budget, and turns offline_status_updated into progress events: the
+   download rate and time left are computed here from successive
+   sync statuses, and only playlists whose state changed are
+   reported. */
+struct offline_plan {
+  struct userdata *data;
+  /* The session data, or NULL if the plan has been detached from its
+     session. */
+  sp_session *session;
+  value callback;
+  int count;
+  sp_playlist **playlists;
+  /* Playlists marked for offline use. */
+  int *status;
+  int *completed;
+  /* Last reported state of each playlist, -1 before the first
+     event. */
+  int64_t size;
+  /* Estimated size of the marked playlists, in bytes. */
+  int has_status;
+  sp_offline_sync_status last;
+  int64_t last_time;
+  double rate;
+  /* Smoothed download rate, in bytes per second. */
+};
+
+#define Offline_plan_val(v) *(struct offline_plan **)Data_custom_val(v)
+
+/* Weight of the last sample in the smoothed rate. */
+#define OFFLINE_RATE_WEIGHT 0.3
+
+static const int bitrate_kbps[] = { 160, 320, 96 };
+
+/* Estimate the size of a playlist from the durations of its
+   tracks. */
+static int64_t playlist_offline_size(sp_playlist *playlist, sp_bitrate bitrate)
+{
+  int64_t total = 0;
+  int i, count = sp_playlist_num_tracks(playlist);
+  for (i = 0; i < count; i++) {
+    sp_track *track = sp_playlist_track(playlist, i);
+    if (track) total += sp_track_duration(track);
+  }
+  return total * bitrate_kbps[bitrate] / 8;
+}
+
+static void offline_plan_detach(struct offline_plan *plan)
+{
+  int i;
+  if (plan->data == NULL) return;
+  if (plan->data->offline_plan == plan) plan->data->offline_plan = NULL;
+  plan->data = NULL;
+  caml_remove_generational_global_root(&(plan->callback));
+  for (i = 0; i < plan->count; i++) sp_playlist_release(plan->playlists[i]);
+  free(plan->playlists);
+  free(plan->status);
+  free(plan->completed);
+  plan->playlists = NULL;
+  plan->status = NULL;
+  plan->completed = NULL;
+  plan->count = 0;
+}
+
+/* Compute the progress since the previous status and pass it to the
+   callback of the plan. Called from offline_status_updated with the
+   runtime held. */
+static void offline_plan_notify(struct offline_plan *plan)
+{
+  CAMLparam0();
+  CAMLlocal5(result, playlists, cell, item, handle);
+  sp_offline_sync_status status;
+  int64_t current = trace_now();
+  int i;
+  if (!sp_offline_sync_get_status(plan->session, &status))
+    memset(&status, 0, sizeof(sp_offline_sync_status));
+  /* done_bytes restarts from zero with each sync operation. */
+  int64_t done_bytes = status.done_bytes;
+  int done_tracks = status.done_tracks;
+  if (plan->has_status && status.done_bytes >= plan->last.done_bytes) {
+    done_bytes -= plan->last.done_bytes;
+    done_tracks -= plan->last.done_tracks;
+    double elapsed = (double)(current - plan->last_time) / 1e9;
+    if (elapsed > 0) {
+      double sample = (double)done_bytes / elapsed;
+      plan->rate = plan->rate > 0 ? plan->rate + OFFLINE_RATE_WEIGHT * (sample - plan->rate) : sample;
+    }
+  }
+  double eta = status.queued_bytes == 0 ? 0 : plan->rate > 0 ? (double)status.queued_bytes / plan->rate : INFINITY;
+  plan->has_status = 1;
+  plan->last = status;
+  plan->last_time = current;
+  playlists = Val_emptylist;
+  for (i = plan->count - 1; i >= 0; i--) {
+    int state = sp_playlist_get_offline_status(plan->session, plan->playlists[i]);
+    int completed = sp_playlist_get_offline_download_completed(plan->session, plan->playlists[i]);
+    if (state == plan->status[i] && completed == plan->completed[i]) continue;
+    plan->status[i] = state;
+    plan->completed[i] = completed;
+    sp_playlist_add_ref(plan->playlists[i]);
+    handle = alloc_playlist(plan->playlists[i]);
+    item = caml_alloc_tuple(3);
+    Store_field(item, 0, handle);
+    Store_field(item, 1, Val_int(state));
+    Store_field(item, 2, Val_int(completed));
+    cell = caml_alloc_tuple(2);
+    Store_field(cell, 0, item);
+    Store_field(cell, 1, playlists);
+    playlists = cell;
+  }
+  result = caml_alloc_tuple(8);
+  item = caml_copy_double(plan->rate);
+  Store_field(result, 0, item);
+  item = caml_copy_double(eta);
+  Store_field(result, 1, item);
+  item = caml_copy_int64(done_bytes);
+  Store_field(result, 2, item);
+  Store_field(result, 3, Val_int(done_tracks));
+  item = caml_copy_int64(status.queued_bytes);
+  Store_field(result, 4, item);
+  Store_field(result, 5, Val_int(status.queued_tracks));
+  Store_field(result, 6, Val_bool(status.syncing));
+  Store_field(result, 7, playlists);
+  caml_callback(plan->callback, result);
+  CAMLreturn0;
+}
+
+static void offline_plan_free(struct offline_plan *plan)
+{
+  offline_plan_detach(plan);
+  free(plan);
+}
+
+static void offline_plan_finalize(value x)
+{
+  struct offline_plan *plan = Offline_plan_val(x);
+  if (plan) RELEASE_LATER(offline_plan_free, plan);
+}
+
+static struct custom_operations offline_plan_ops = {
+  "spotify:offline_plan",
+  offline_plan_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct offline_plan *get_offline_plan(value x)
+{
+  struct offline_plan *plan = Offline_plan_val(x);
+  if (plan == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return plan;
+}
+
+/* Playlists are marked in order as long as they fit in the budget;
+   a playlist which does not fit is skipped, so that smaller ones
+   after it may still be marked. */
+CAMLprim value ocaml_spotify_offline_plan(value val_session, value playlists, value val_budget, value val_bitrate, value callback)
+{
+  CAMLparam5(val_session, playlists, val_budget, val_bitrate, callback);
+  sp_session *session = get_session(val_session);
+  struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  sp_bitrate bitrate = Int_val(val_bitrate);
+  int64_t budget = Int64_val(val_budget);
+  long i, count = Wosize_val(playlists);
+  for (i = 0; i < count; i++)
+    get_playlist(Field(playlists, i));
+  TRACE_BEGIN;
+  sp_session_preferred_offline_bitrate(session, bitrate, 0);
+  struct offline_plan *plan = new(struct offline_plan);
+  memset(plan, 0, sizeof(struct offline_plan));
+  plan->session = session;
+  plan->playlists = (sp_playlist**)xmalloc(count * sizeof(sp_playlist*) + 1);
+  for (i = 0; i < count; i++) {
+    sp_playlist *playlist = Playlist_val(Field(playlists, i));
+    int64_t size = sp_playlist_is_loaded(playlist) ? playlist_offline_size(playlist, bitrate) : -1;
+    int selected = size >= 0 && plan->size + size <= budget;
+    sp_playlist_set_offline_mode(session, playlist, selected);
+    if (selected) {
+      sp_playlist_add_ref(playlist);
+      plan->playlists[plan->count++] = playlist;
+      plan->size += size;
+    }
+  }
+  TRACE_END(TRACE_API, "offline_plan", "playlists", plan->count);
+  plan->status = (int*)xmalloc(plan->count * sizeof(int) + 1);
+  plan->completed = (int*)xmalloc(plan->count * sizeof(int) + 1);
+  for (i = 0; i < plan->count; i++) plan->status[i] = plan->completed[i] = -1;
+  plan->callback = callback;
+  caml_register_generational_global_root(&(plan->callback));
+  if (data->offline_plan) offline_plan_detach(data->offline_plan);
+  plan->data = data;
+  data->offline_plan = plan;
+  value x = caml_alloc_custom(&offline_plan_ops, sizeof(struct offline_plan *), 0, 1);
+  Offline_plan_val(x) = plan;
+  CAMLreturn(x);
+}
+
+CAMLprim value ocaml_spotify_offline_plan_size(value plan)
+{
+  return caml_copy_int64(get_offline_plan(plan)->size);
+}
+
+CAMLprim value ocaml_spotify_offline_plan_playlists(value val_plan)
+{
+  CAMLparam1(val_plan);
+  CAMLlocal2(result, playlist);
+  struct offline_plan *plan = get_offline_plan(val_plan);
+  int i, count = plan->count;
+  result = caml_alloc(count, 0);
+  for (i = 0; i < count; i++) {
+    sp_playlist_add_ref(plan->playlists[i]);
+    playlist = alloc_playlist(plan->playlists[i]);
+    Store_field(result, i, playlist);
+  }
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_offline_plan_release(value plan)
+{
+  offline_plan_finalize(plan);
+  Offline_plan_val(plan) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Bitrate policy                                                  |
+   +-----------------------------------------------------------------+ */
+
+/* A bitrate policy watches the audio buffer stats returned by the
+   application and streaming errors, and adjusts the preferred bitrate
+   and a prefetch depth. Observations are grouped in windows: a window
+   with stutters, streaming errors or a buffer fill below the low
+   water mark steps down at once, while stepping up requires several
+   consecutive windows above the high water mark. Fills between the
+   two marks keep the current settings.
+
+   Stats are received on the audio thread; the bitrate is applied by
+   session_process_events. */
+
+enum policy_reason {
+  POLICY_STREAMING_ERROR,
+  POLICY_STUTTER,
+  POLICY_LOW_BUFFER,
+  POLICY_STABLE
+};
+
+struct policy_decision {
+  int64_t time;
+  int level;
+  int prefetch;
+  enum policy_reason reason;
+};
+
+/* Number of decisions kept. */
+#define POLICY_LOG_SIZE 64
+
+/* Bitrates from the lowest to the highest. */
+static const sp_bitrate policy_levels[] = { SP_BITRATE_96k, SP_BITRATE_160k, SP_BITRATE_320k };
+#define POLICY_LEVELS 3
+
+struct bitrate_policy {
+  struct userdata *data;
+  /* The session data, or NULL if the policy has been detached from
+     its session. */
+  int64_t start;
+  int64_t window;
+  double low_water;
+  double high_water;
+  /* Buffer fills, in seconds. */
+  int upgrade_after;
+  /* Number of good windows before stepping up. */
+  int max_prefetch;
+  int level;
+  int prefetch;
+  int pending;
+  /* Whether the bitrate changed since it was last applied. */
+  int64_t window_start;
+  int stutters;
+  int errors;
+  double min_fill;
+  int good;
+  /* Consecutive windows above the high water mark. */
+  struct policy_decision log[POLICY_LOG_SIZE];
+  int64_t decisions;
+};
+
+#define Bitrate_policy_val(v) *(struct bitrate_policy **)Data_custom_val(v)
+
+static pthread_mutex_t policy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void policy_reset_window(struct bitrate_policy *policy, int64_t current)
+{
+  policy->window_start = current;
+  policy->stutters = 0;
+  policy->errors = 0;
+  policy->min_fill = INFINITY;
+}
+
+static void policy_decide(struct bitrate_policy *policy, int64_t current, int level, int prefetch, enum policy_reason reason)
+{
+  if (level == policy->level && prefetch == policy->prefetch) return;
+  if (level != policy->level) policy->pending = 1;
+  policy->level = level;
+  policy->prefetch = prefetch;
+  struct policy_decision *decision = &(policy->log[policy->decisions++ % POLICY_LOG_SIZE]);
+  decision->time = current;
+  decision->level = level;
+  decision->prefetch = prefetch;
+  decision->reason = reason;
+}
+
+/* Close the current window. Called with [policy_mutex] held. */
+static void policy_evaluate(struct bitrate_policy *policy, int64_t current)
+{
+  int reason = -1;
+  if (policy->errors)
+    reason = POLICY_STREAMING_ERROR;
+  else if (policy->stutters)
+    reason = POLICY_STUTTER;
+  else if (policy->min_fill < policy->low_water)
+    reason = POLICY_LOW_BUFFER;
+  if (reason >= 0) {
+    policy->good = 0;
+    policy_decide(policy, current,
+                  policy->level > 0 ? policy->level - 1 : 0,
+                  policy->prefetch < policy->max_prefetch ? policy->prefetch + 1 : policy->max_prefetch,
+                  reason);
+  } else if (policy->min_fill >= policy->high_water) {
+    if (++policy->good >= policy->upgrade_after) {
+      policy->good = 0;
+      policy_decide(policy, current,
+                    policy->level < POLICY_LEVELS - 1 ? policy->level + 1 : POLICY_LEVELS - 1,
+                    policy->prefetch > 1 ? policy->prefetch - 1 : 1,
+                    POLICY_STABLE);
+    }
+  } else
+    policy->good = 0;
+  policy_reset_window(policy, current);
+}
+
+static void policy_stats(struct userdata *data, const sp_audio_buffer_stats *stats)
+{
+  pthread_mutex_lock(&policy_mutex);
+  struct bitrate_policy *policy = data->policy;
+  if (policy) {
+    int64_t current = trace_now();
+    double fill = (double)stats->samples / (data->sample_rate > 0 ? data->sample_rate : 44100);
+    policy->stutters += stats->stutter;
+    if (fill < policy->min_fill) policy->min_fill = fill;
+    if (current - policy->window_start >= policy->window) policy_evaluate(policy, current);
+  }
+  pthread_mutex_unlock(&policy_mutex);
+}
+
+/* Playback may stop on a streaming error, so the window is closed
+   without waiting for more stats. */
+static void policy_streaming_error(struct userdata *data, sp_error error)
+{
+  pthread_mutex_lock(&policy_mutex);
+  struct bitrate_policy *policy = data->policy;
+  if (policy && error != SP_ERROR_OK) {
+    policy->errors++;
+    policy_evaluate(policy, trace_now());
+  }
+  pthread_mutex_unlock(&policy_mutex);
+}
+
+/* Called by session_process_events with the libspotify lock held. */
+static void policy_apply(struct userdata *data, sp_session *session)
+{
+  int level = -1;
+  pthread_mutex_lock(&policy_mutex);
+  if (data->policy && data->policy->pending) {
+    data->policy->pending = 0;
+    level = data->policy->level;
+  }
+  pthread_mutex_unlock(&policy_mutex);
+  if (level >= 0) {
+    TRACE_BEGIN;
+    sp_session_preferred_bitrate(session, policy_levels[level]);
+    TRACE_END(TRACE_API, "session_preferred_bitrate", "bitrate", policy_levels[level]);
+  }
+}
+
+static void policy_detach(struct userdata *data)
+{
+  pthread_mutex_lock(&policy_mutex);
+  if (data->policy) {
+    data->policy->data = NULL;
+    data->policy = NULL;
+  }
+  pthread_mutex_unlock(&policy_mutex);
+}
+
+static void policy_free(struct bitrate_policy *policy)
+{
+  pthread_mutex_lock(&policy_mutex);
+  if (policy->data && policy->data->policy == policy) policy->data->policy = NULL;
+  pthread_mutex_unlock(&policy_mutex);
+  free(policy);
+}
+
+static void policy_finalize(value x)
+{
+  struct bitrate_policy *policy = Bitrate_policy_val(x);
+  if (policy) RELEASE_LATER(policy_free, policy);
+}
+
+static struct custom_operations policy_ops = {
+  "spotify:bitrate_policy",
+  policy_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct bitrate_policy *get_policy(value x)
+{
+  struct bitrate_policy *policy = Bitrate_policy_val(x);
+  if (policy == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return policy;
+}
+
+CAMLprim value ocaml_spotify_bitrate_policy_create(value val_session, value bitrate, value window, value low_water, value high_water, value upgrade_after, value max_prefetch)
+{
+  sp_session *session = get_session(val_session);
+  struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  int level;
+  if (!(Double_val(window) > 0) || !(Double_val(low_water) <= Double_val(high_water))
+      || Int_val(upgrade_after) <= 0 || Int_val(max_prefetch) <= 0)
+    caml_invalid_argument("Spotify.bitrate_policy_create");
+  for (level = 0; policy_levels[level] != (sp_bitrate)Int_val(bitrate); level++);
+  struct bitrate_policy *policy = new(struct bitrate_policy);
+  memset(policy, 0, sizeof(struct bitrate_policy));
+  policy->start = trace_now();
+  policy->window = (int64_t)(Double_val(window) * 1e9);
+  policy->low_water = Double_val(low_water);
+  policy->high_water = Double_val(high_water);
+  policy->upgrade_after = Int_val(upgrade_after);
+  policy->max_prefetch = Int_val(max_prefetch);
+  policy->level = level;
+  policy->prefetch = 1;
+  policy->pending = 1;
+  policy_reset_window(policy, policy->start);
+  pthread_mutex_lock(&policy_mutex);
+  if (data->policy) data->policy->data = NULL;
+  policy->data = data;
+  data->policy = policy;
+  pthread_mutex_unlock(&policy_mutex);
+  value x = caml_alloc_custom(&policy_ops, sizeof(struct bitrate_policy *), 0, 1);
+  Bitrate_policy_val(x) = policy;
+  return x;
+}
+
+CAMLprim value ocaml_spotify_bitrate_policy_create_byte(value *argv, int argn)
+{
+  return ocaml_spotify_bitrate_policy_create(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
+
+CAMLprim value ocaml_spotify_bitrate_policy_bitrate(value val_policy)
+{
+  struct bitrate_policy *policy = get_policy(val_policy);
+  pthread_mutex_lock(&policy_mutex);
+  int level = policy->level;
+  pthread_mutex_unlock(&policy_mutex);
+  return Val_int(policy_levels[level]);
+}
+
+CAMLprim value ocaml_spotify_bitrate_policy_prefetch_depth(value val_policy)
+{
+  struct bitrate_policy *policy = get_policy(val_policy);
+  pthread_mutex_lock(&policy_mutex);
+  int prefetch = policy->prefetch;
+  pthread_mutex_unlock(&policy_mutex);
+  return Val_int(prefetch);
+}
+
+CAMLprim value ocaml_spotify_bitrate_policy_decisions(value val_policy)
+{
+  CAMLparam1(val_policy);
+  CAMLlocal3(result, cell, item);
+  struct bitrate_policy *policy = get_policy(val_policy);
+  struct policy_decision log[POLICY_LOG_SIZE];
+  int64_t i, first;
+  pthread_mutex_lock(&policy_mutex);
+  int64_t last = policy->decisions;
+  memcpy(log, policy->log, sizeof(log));
+  pthread_mutex_unlock(&policy_mutex);
+  first = last > POLICY_LOG_SIZE ? last - POLICY_LOG_SIZE : 0;
+  result = Val_emptylist;
+  for (i = last - 1; i >= first; i--) {
+    struct policy_decision *decision = &(log[i % POLICY_LOG_SIZE]);
+    item = caml_copy_double((double)(decision->time - policy->start) / 1e9);
+    cell = caml_alloc_tuple(4);
+    Store_field(cell, 0, item);
+    Store_field(cell, 1, Val_int(policy_levels[decision->level]));
+    Store_field(cell, 2, Val_int(decision->prefetch));
+    Store_field(cell, 3, Val_int(decision->reason));
+    item = cell;
+    cell = caml_alloc_tuple(2);
+    Store_field(cell, 0, item);
+    Store_field(cell, 1, result);
+    result = cell;
+  }
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_bitrate_policy_release(value policy)
+{
+  policy_finalize(policy);
+  Bitrate_policy_val(policy) = NULL;
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Playable tracks                                                 |
+   +-----------------------------------------------------------------+ */
+
+/* Cache of the playable versions of tracks, keyed by the id of the
+   original track. It holds a reference on playable tracks, and is
+   only accessed with the libspotify lock held. Since autolinking
+   depends on the country of the user, it is dropped when the user
+   info is updated or the country changes. */
+struct playable_entry {
+  unsigned char id[ID_SIZE];
+  sp_track *playable;
+  /* NULL for a free slot. */
+};
+
+struct playable_cache {
+  int country;
+  size_t size;
+  /* Number of slots, a power of two. */
+  size_t count;
+  struct playable_entry *entries;
+};
+
+static void playable_cache_free(struct userdata *data)
+{
+  struct playable_cache *cache = data->playable;
+  size_t i;
+  if (cache == NULL) return;
+  data->playable = NULL;
+  for (i = 0; i < cache->size; i++)
+    if (cache->entries[i].playable) sp_track_release(cache->entries[i].playable);
+  free(cache->entries);
+  free(cache);
+}
+
+static struct playable_entry *playable_find(struct playable_cache *cache, const unsigned char *id)
+{
+  size_t mask = cache->size - 1, i = (size_t)id_hash(id) & mask;
+  while (cache->entries[i].playable && memcmp(cache->entries[i].id, id, ID_SIZE)) i = (i + 1) & mask;
+  return &(cache->entries[i]);
+}
+
+static void playable_grow(struct playable_cache *cache)
+{
+  struct playable_entry *entries = cache->entries;
+  size_t i, size = cache->size;
+  cache->size = size ? size * 2 : 1024;
+  cache->entries = (struct playable_entry*)xmalloc(cache->size * sizeof(struct playable_entry));
+  memset(cache->entries, 0, cache->size * sizeof(struct playable_entry));
+  for (i = 0; i < size; i++)
+    if (entries[i].playable) *playable_find(cache, entries[i].id) = entries[i];
+  free(entries);
+}
+
+/* Return the playable version of [track], with a reference added for
+   the caller. Tracks which are not loaded are resolved but not
+   cached. */
+static sp_track *playable_resolve(sp_session *session, sp_track *track)
+{
+  struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  unsigned char id[ID_SIZE];
+  int country = sp_session_user_country(session);
+  if (data->playable && data->playable->country != country) playable_cache_free(data);
+  if (!sp_track_is_loaded(track) || !object_id(OBJECT_TRACK, track, id)) {
+    track = sp_track_get_playable(session, track);
+    if (track) sp_track_add_ref(track);
+    return track;
+  }
+  if (data->playable == NULL) {
+    data->playable = new(struct playable_cache);
+    memset(data->playable, 0, sizeof(struct playable_cache));
+    data->playable->country = country;
+    playable_grow(data->playable);
+  }
+  struct playable_entry *entry = playable_find(data->playable, id);
+  if (entry->playable == NULL) {
+    sp_track *playable = sp_track_get_playable(session, track);
+    if (playable == NULL) return NULL;
+    sp_track_add_ref(playable);
+    memcpy(entry->id, id, ID_SIZE);
+    entry->playable = playable;
+    if (++data->playable->count * 2 > data->playable->size) {
+      playable_grow(data->playable);
+      entry = playable_find(data->playable, id);
+    }
+  }
+  sp_track_add_ref(entry->playable);
+  return entry->playable;
+}
+
+/* +-----------------------------------------------------------------+
+   | Local import                                                    |
+   +-----------------------------------------------------------------+ */
+
+/* Import of a directory tree of audio files as local tracks. Files
+   are listed by the calling thread, their tags are read by a pool of
+   threads without the runtime nor libspotify, then local tracks are
+   created in one go with the libspotify lock held.
+
+   Supported tags are ID3v2.2 to 2.4 and ID3v1 in MP3 files, Vorbis
+   comments in FLAC files and in Ogg Vorbis and Opus streams. Files
+   without tags get their name as title. */
+
+struct import_file {
+  char *path;
+  int64_t size;
+  char *artist;
+  char *title;
+  char *album;
+  int duration;
+  /* Duration in milliseconds, or -1 if unknown. */
+  char *error;
+  /* Error reading the file, or NULL. */
+};
+
+struct import_files {
+  struct import_file *files;
+  size_t count;
+  size_t capacity;
+};
+
+/* Number of bytes read at once from the start or the end of a file. */
+#define IMPORT_BLOCK 65536
+
+/* Maximum size of a tag field which is read. */
+#define IMPORT_MAX_FIELD 4096
+
+static const char *import_extension(const char *path)
+{
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  return dot && (slash == NULL || dot > slash) ? dot + 1 : "";
+}
+
+static int import_is_audio(const char *path)
+{
+  const char *ext = import_extension(path);
+  return !strcasecmp(ext, "mp3") || !strcasecmp(ext, "flac") || !strcasecmp(ext, "ogg")
+    || !strcasecmp(ext, "oga") || !strcasecmp(ext, "opus");
+}
+
+static struct import_file *import_add(struct import_files *files, char *path, int64_t size)
+{
+  if (files->count == files->capacity) {
+    files->capacity = files->capacity ? files->capacity * 2 : 256;
+    files->files = (struct import_file*)index_realloc(files->files, files->capacity * sizeof(struct import_file));
+  }
+  struct import_file *file = &(files->files[files->count++]);
+  memset(file, 0, sizeof(struct import_file));
+  file->path = path;
+  file->size = size;
+  file->duration = -1;
+  return file;
+}
+
+static char *import_error(const char *what)
+{
+  char buffer[512];
+  snprintf(buffer, sizeof(buffer), "%s: %s", what, strerror(errno));
+  return strdup(buffer);
+}
+
+/* Directories being walked, from [path] up to the root, to detect
+   symbolic links looping back to one of them. */
+struct import_dir {
+  dev_t dev;
+  ino_t ino;
+  struct import_dir *parent;
+};
+
+/* List the audio files under [path], which is the directory
+   [parent]. Directories which cannot be read are reported as files
+   with an error. Symbolic links are followed, except to a directory
+   which is already being walked. */
+static void import_walk(struct import_files *files, const char *path, struct import_dir *parent)
+{
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+  if (dir == NULL) {
+    import_add(files, strdup(path), 0)->error = import_error("cannot open directory");
+    return;
+  }
+  while ((entry = readdir(dir))) {
+    struct stat st;
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+    size_t len = strlen(path) + strlen(entry->d_name) + 2;
+    char *child = (char*)xmalloc(len);
+    snprintf(child, len, "%s/%s", path, entry->d_name);
+    if (stat(child, &st) < 0) {
+      import_add(files, child, 0)->error = import_error("cannot stat file");
+    } else if (S_ISDIR(st.st_mode)) {
+      struct import_dir *ancestor = parent;
+      while (ancestor && (ancestor->dev != st.st_dev || ancestor->ino != st.st_ino))
+        ancestor = ancestor->parent;
+      if (ancestor == NULL) {
+        struct import_dir current = { st.st_dev, st.st_ino, parent };
+        import_walk(files, child, &current);
+      }
+      free(child);
+    } else if (S_ISREG(st.st_mode) && import_is_audio(child)) {
+      import_add(files, child, st.st_size);
+    } else
+      free(child);
+  }
+  closedir(dir);
+}
+
+static uint32_t read_be32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t read_le32(const unsigned char *p)
+{
+  return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static uint32_t read_syncsafe(const unsigned char *p)
+{
+  return ((uint32_t)(p[0] & 0x7f) << 21) | ((uint32_t)(p[1] & 0x7f) << 14) | ((uint32_t)(p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+/* Read up to [len] bytes at [offset]. Returns the number of bytes
+   read, or -1. */
+static ssize_t import_read(int fd, int64_t offset, unsigned char *buffer, size_t len)
+{
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, buffer + done, len - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (n == 0) break;
+    done += n;
+  }
+  return done;
+}
+
+static void utf8_put(char **dst, uint32_t code)
+{
+  unsigned char *p = (unsigned char*)*dst;
+  if (code < 0x80) {
+    *p++ = code;
+  } else if (code < 0x800) {
+    *p++ = 0xc0 | (code >> 6);
+    *p++ = 0x80 | (code & 0x3f);
+  } else if (code < 0x10000) {
+    *p++ = 0xe0 | (code >> 12);
+    *p++ = 0x80 | ((code >> 6) & 0x3f);
+    *p++ = 0x80 | (code & 0x3f);
+  } else {
+    *p++ = 0xf0 | (code >> 18);
+    *p++ = 0x80 | ((code >> 12) & 0x3f);
+    *p++ = 0x80 | ((code >> 6) & 0x3f);
+    *p++ = 0x80 | (code & 0x3f);
+  }
+  *dst = (char*)p;
+}
+
+/* Decode a string of an ID3v2 text frame into UTF-8. Only the first
+   string of a list is kept. */
+static char *id3_text(const unsigned char *data, size_t len)
+{
+  if (len == 0) return strdup("");
+  int encoding = data[0];
+  size_t i;
+  data++;
+  len--;
+  char *result = (char*)xmalloc(len * 2 + 1), *dst = result;
+  if (encoding == 1 || encoding == 2) {
+    int big_endian = encoding == 2;
+    i = 0;
+    if (len >= 2 && data[0] == 0xff && data[1] == 0xfe) { big_endian = 0; i = 2; }
+    else if (len >= 2 && data[0] == 0xfe && data[1] == 0xff) { big_endian = 1; i = 2; }
+    for (; i + 1 < len; i += 2) {
+      uint32_t unit = big_endian ? (data[i] << 8) | data[i + 1] : (data[i + 1] << 8) | data[i];
+      if (unit == 0) break;
+      if (unit >= 0xd800 && unit < 0xdc00 && i + 3 < len) {
+        uint32_t low = big_endian ? (data[i + 2] << 8) | data[i + 3] : (data[i + 3] << 8) | data[i + 2];
+        if (low >= 0xdc00 && low < 0xe000) {
+          unit = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+          i += 2;
+        }
+      }
+      utf8_put(&dst, unit);
+    }
+  } else {
+    for (i = 0; i < len && data[i]; i++) {
+      if (encoding == 3)
+        *dst++ = data[i];
+      else
+        utf8_put(&dst, data[i]);
+    }
+  }
+  *dst = 0;
+  return result;
+}
+
+static void import_set(char **field, char *value)
+{
+  if (*field == NULL && value[0])
+    *field = value;
+  else
+    free(value);
+}
+
+/* Read the ID3v2 tag at the start of a file. Returns the size of the
+   tag, or 0 if there is none. */
+static int64_t import_id3v2(int fd, struct import_file *file)
+{
+  unsigned char header[10], frame[10];
+  if (import_read(fd, 0, header, 10) != 10 || memcmp(header, "ID3", 3)) return 0;
+  int version = header[3];
+  int64_t end = 10 + (int64_t)read_syncsafe(header + 6);
+  int64_t offset = 10;
+  if (version < 2 || version > 4) return end;
+  if (header[5] & 0x40 && version > 2) {
+    unsigned char ext[4];
+    if (import_read(fd, offset, ext, 4) != 4) return end;
+    offset += version == 4 ? read_syncsafe(ext) : read_be32(ext) + 4;
+  }
+  size_t frame_header = version == 2 ? 6 : 10;
+  while (offset + (int64_t)frame_header <= end) {
+    if (import_read(fd, offset, frame, frame_header) != (ssize_t)frame_header || frame[0] == 0) break;
+    uint32_t size;
+    if (version == 2)
+      size = (frame[3] << 16) | (frame[4] << 8) | frame[5];
+    else if (version == 4)
+      size = read_syncsafe(frame + 4);
+    else
+      size = read_be32(frame + 4);
+    int64_t data = offset + frame_header;
+    offset = data + size;
+    if (offset > end) break;
+    char **target = NULL;
+    if (version == 2) {
+      if (!memcmp(frame, "TT2", 3)) target = &(file->title);
+      else if (!memcmp(frame, "TP1", 3)) target = &(file->artist);
+      else if (!memcmp(frame, "TAL", 3)) target = &(file->album);
+    } else {
+      if (!memcmp(frame, "TIT2", 4)) target = &(file->title);
+      else if (!memcmp(frame, "TPE1", 4)) target = &(file->artist);
+      else if (!memcmp(frame, "TALB", 4)) target = &(file->album);
+    }
+    int is_length = version == 2 ? !memcmp(frame, "TLE", 3) : !memcmp(frame, "TLEN", 4);
+    if ((target == NULL && !is_length) || size > IMPORT_MAX_FIELD) continue;
+    unsigned char buffer[IMPORT_MAX_FIELD];
+    if (import_read(fd, data, buffer, size) != (ssize_t)size) break;
+    char *text = id3_text(buffer, size);
+    if (is_length) {
+      if (file->duration < 0 && atoi(text) > 0) file->duration = atoi(text);
+      free(text);
+    } else
+      import_set(target, text);
+  }
+  return end;
+}
+
+/* Copy a fixed-size, space-padded ID3v1 field. */
+static char *id3v1_field(const unsigned char *data, size_t len)
+{
+  char *dst, *result = (char*)xmalloc(len * 2 + 1);
+  size_t i;
+  while (len > 0 && (data[len - 1] == ' ' || data[len - 1] == 0)) len--;
+  dst = result;
+  for (i = 0; i < len && data[i]; i++) utf8_put(&dst, data[i]);
+  *dst = 0;
+  return result;
+}
+
+static void import_id3v1(int fd, struct import_file *file)
+{
+  unsigned char tag[128];
+  if (file->size < 128 || import_read(fd, file->size - 128, tag, 128) != 128 || memcmp(tag, "TAG", 3)) return;
+  import_set(&(file->title), id3v1_field(tag + 3, 30));
+  import_set(&(file->artist), id3v1_field(tag + 33, 30));
+  import_set(&(file->album), id3v1_field(tag + 63, 30));
+}
+
+/* Estimate the duration of an MP3 stream starting at [offset], from
+   its Xing or Info header, or from the bitrate of its first frame. */
+static void import_mp3_duration(int fd, struct import_file *file, int64_t offset)
+{
+  static const int bitrates[2][16] = {
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 }
+  };
+  static const int rates[4] = { 44100, 48000, 32000, 0 };
+  unsigned char buffer[4096];
+  ssize_t len = import_read(fd, offset, buffer, sizeof(buffer));
+  ssize_t i;
+  if (file->duration >= 0 || len < 4) return;
+  for (i = 0; i + 4 <= len; i++)
+    if (buffer[i] == 0xff && (buffer[i + 1] & 0xe6) == 0xe2) break;
+  if (i + 4 > len) return;
+  unsigned char *header = buffer + i;
+  int version = (header[1] >> 3) & 3;
+  /* Layer III only. 3 is MPEG-1, 2 MPEG-2 and 0 MPEG-2.5. */
+  if (version == 1 || ((header[1] >> 1) & 3) != 1) return;
+  int bitrate = bitrates[version != 3][header[2] >> 4];
+  int rate = rates[(header[2] >> 2) & 3];
+  if (bitrate == 0 || rate == 0) return;
+  if (version == 2) rate /= 2;
+  if (version == 0) rate /= 4;
+  int mono = (header[3] >> 6) == 3;
+  int samples = version == 3 ? 1152 : 576;
+  int side = version == 3 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+  ssize_t xing = i + 4 + side;
+  if (xing + 12 <= len && (!memcmp(buffer + xing, "Xing", 4) || !memcmp(buffer + xing, "Info", 4))
+      && (read_be32(buffer + xing + 4) & 1)) {
+    uint32_t frames = read_be32(buffer + xing + 8);
+    file->duration = (int)((int64_t)frames * samples * 1000 / rate);
+  } else
+    file->duration = (int)((file->size - offset - i) * 8 / bitrate);
+}
+
+/* Parse a Vorbis comment block. [vendor] says whether it starts with
+   a vendor string. */
+static void import_vorbis_comment(const unsigned char *data, size_t len, struct import_file *file)
+{
+  size_t offset = 0;
+  uint32_t i, count;
+  if (len < 8) return;
+  offset = 4 + (size_t)read_le32(data);
+  if (offset + 4 > len) return;
+  count = read_le32(data + offset);
+  offset += 4;
+  for (i = 0; i < count && offset + 4 <= len; i++) {
+    size_t size = read_le32(data + offset);
+    offset += 4;
+    if (size > len - offset) return;
+    const char *comment = (const char*)data + offset;
+    const char *equal = memchr(comment, '=', size);
+    offset += size;
+    if (equal == NULL) continue;
+    size_t key = equal - comment;
+    char **target = NULL;
+    if (key == 5 && !strncasecmp(comment, "TITLE", 5)) target = &(file->title);
+    else if (key == 6 && !strncasecmp(comment, "ARTIST", 6)) target = &(file->artist);
+    else if (key == 5 && !strncasecmp(comment, "ALBUM", 5)) target = &(file->album);
+    if (target == NULL) continue;
+    size_t value_len = size - key - 1;
+    char *value = (char*)xmalloc(value_len + 1);
+    memcpy(value, equal + 1, value_len);
+    value[value_len] = 0;
+    import_set(target, value);
+  }
+}
+
+static char *import_flac(int fd, struct import_file *file, int64_t offset)
+{
+  unsigned char header[4];
+  if (import_read(fd, offset, header, 4) != 4 || memcmp(header, "fLaC", 4)) return strdup("not a FLAC file");
+  offset += 4;
+  for (;;) {
+    if (import_read(fd, offset, header, 4) != 4) return strdup("truncated FLAC metadata");
+    int last = header[0] & 0x80, type = header[0] & 0x7f;
+    uint32_t size = (header[1] << 16) | (header[2] << 8) | header[3];
+    offset += 4;
+    if (type == 0 && size >= 18) {
+      unsigned char info[18];
+      if (import_read(fd, offset, info, 18) != 18) return strdup("truncated FLAC metadata");
+      uint32_t rate = (info[10] << 12) | (info[11] << 4) | (info[12] >> 4);
+      uint64_t samples = ((uint64_t)(info[13] & 0x0f) << 32) | read_be32(info + 14);
+      if (rate > 0 && samples > 0) file->duration = (int)(samples * 1000 / rate);
+    } else if (type == 4 && size <= 16 * IMPORT_BLOCK) {
+      unsigned char *block = (unsigned char*)xmalloc(size + 1);
+      if (import_read(fd, offset, block, size) == (ssize_t)size) import_vorbis_comment(block, size, file);
+      free(block);
+    }
+    offset += size;
+    if (last) return NULL;
+  }
+}
+
+/* Reassemble the first packets of the first logical stream of an Ogg
+   file, and parse the identification and comment headers. */
+static char *import_ogg(int fd, struct import_file *file)
+{
+  unsigned char *buffer = (unsigned char*)xmalloc(IMPORT_BLOCK);
+  unsigned char *packet = (unsigned char*)xmalloc(IMPORT_BLOCK);
+  ssize_t len = import_read(fd, 0, buffer, IMPORT_BLOCK);
+  size_t offset = 0, packet_len = 0;
+  int packets = 0;
+  uint32_t serial = 0, rate = 0;
+  char *error = NULL;
+  if (len < 27 || memcmp(buffer, "OggS", 4)) {
+    error = strdup("not an Ogg file");
+    goto done;
+  }
+  serial = read_le32(buffer + 14);
+  while (packets < 2 && offset + 27 <= (size_t)len && !memcmp(buffer + offset, "OggS", 4)) {
+    int segments = buffer[offset + 26], i;
+    size_t data = offset + 27 + segments;
+    if (data > (size_t)len) break;
+    int ours = read_le32(buffer + offset + 14) == serial;
+    for (i = 0; i < segments && packets < 2; i++) {
+      size_t size = buffer[offset + 27 + i];
+      if (data + size > (size_t)len) break;
+      if (ours) {
+        if (packet_len + size > IMPORT_BLOCK) size = IMPORT_BLOCK - packet_len;
+        memcpy(packet + packet_len, buffer + data, size);
+        packet_len += size;
+      }
+      data += buffer[offset + 27 + i];
+      if (ours && buffer[offset + 27 + i] < 255) {
+        /* End of a packet. */
+        if (packets == 0) {
+          if (packet_len >= 16 && !memcmp(packet, "\x01vorbis", 7))
+            rate = read_le32(packet + 12);
+          else if (packet_len >= 8 && !memcmp(packet, "OpusHead", 8))
+            rate = 48000;
+        } else if (packet_len >= 7 && !memcmp(packet, "\x03vorbis", 7))
+          import_vorbis_comment(packet + 7, packet_len - 7, file);
+        else if (packet_len >= 8 && !memcmp(packet, "OpusTags", 8))
+          import_vorbis_comment(packet + 8, packet_len - 8, file);
+        packets++;
+        packet_len = 0;
+      }
+    }
+    offset = data;
+  }
+  /* The granule position of the last page gives the duration. */
+  if (rate > 0 && file->size > 27) {
+    int64_t start = file->size > IMPORT_BLOCK ? file->size - IMPORT_BLOCK : 0;
+    ssize_t i;
+    len = import_read(fd, start, buffer, IMPORT_BLOCK);
+    for (i = len - 27; i >= 0; i--) {
+      if (!memcmp(buffer + i, "OggS", 4) && read_le32(buffer + i + 14) == serial) {
+        uint64_t granule = (uint64_t)read_le32(buffer + i + 6) | ((uint64_t)read_le32(buffer + i + 10) << 32);
+        if (granule != (uint64_t)-1) file->duration = (int)(granule * 1000 / rate);
+        break;
+      }
+    }
+  }
+ done:
+  free(buffer);
+  free(packet);
+  return error;
+}
+
+static void import_scan(struct import_file *file)
+{
+  int fd = open(file->path, O_RDONLY);
+  if (fd < 0) {
+    file->error = import_error("cannot open file");
+    return;
+  }
+  const char *ext = import_extension(file->path);
+  int64_t offset = import_id3v2(fd, file);
+  if (!strcasecmp(ext, "mp3")) {
+    import_id3v1(fd, file);
+    import_mp3_duration(fd, file, offset);
+  } else if (!strcasecmp(ext, "flac"))
+    file->error = import_flac(fd, file, offset);
+  else
+    file->error = import_ogg(fd, file);
+  close(fd);
+  if (file->title == NULL) {
+    /* Use the name of the file, without its extension. */
+    const char *slash = strrchr(file->path, '/');
+    const char *name = slash ? slash + 1 : file->path;
+    size_t len = strlen(name) - (*ext ? strlen(ext) + 1 : 0);
+    file->title = (char*)xmalloc(len + 1);
+    memcpy(file->title, name, len);
+    file->title[len] = 0;
+  }
+}
+
+struct import_job {
+  struct import_files *files;
+  pthread_mutex_t mutex;
+  size_t next;
+};
+
+static void *import_worker(void *data)
+{
+  struct import_job *job = (struct import_job*)data;
+  for (;;) {
+    pthread_mutex_lock(&(job->mutex));
+    size_t i = job->next;
+    if (i < job->files->count) job->next++;
+    pthread_mutex_unlock(&(job->mutex));
+    if (i >= job->files->count) break;
+    if (job->files->files[i].error == NULL) import_scan(&(job->files->files[i]));
+  }
+  return NULL;
+}
+
+static int compare_import_files(const void *a, const void *b)
+{
+  return strcmp(((const struct import_file*)a)->path, ((const struct import_file*)b)->path);
+}
+
+/* List and scan the files under [root] with [jobs] threads. */
+static void import_files(struct import_files *files, const char *root, int jobs)
+{
+  struct import_job job;
+  pthread_t *threads;
+  int i, started = 0;
+  struct stat st;
+  if (stat(root, &st) == 0) {
+    struct import_dir top = { st.st_dev, st.st_ino, NULL };
+    import_walk(files, root, &top);
+  } else
+    import_walk(files, root, NULL);
+  if (files->count > 0) qsort(files->files, files->count, sizeof(struct import_file), compare_import_files);
+  job.files = files;
+  job.next = 0;
+  pthread_mutex_init(&(job.mutex), NULL);
+  if (jobs < 1) jobs = 1;
+  threads = (pthread_t*)xmalloc(jobs * sizeof(pthread_t));
+  for (i = 1; i < jobs; i++) {
+    if (pthread_create(&(threads[i]), NULL, import_worker, &job)) break;
+    started++;
+  }
+  /* The calling thread works too. */
+  import_worker(&job);
+  for (i = 1; i <= started; i++) pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&(job.mutex));
+  free(threads);
+}
+
+static void import_free(struct import_files *files)
+{
+  size_t i;
+  for (i = 0; i < files->count; i++) {
+    struct import_file *file = &(files->files[i]);
+    free(file->path);
+    free(file->artist);
+    free(file->title);
+    free(file->album);
+    free(file->error);
+  }
+  free(files->files);
+}
+
+CAMLprim value ocaml_spotify_local_import(value root, value jobs)
+{
+  CAMLparam2(root, jobs);
+  CAMLlocal5(result, tracks, errors, entry, str);
+  struct import_files files = { NULL, 0, 0 };
+  char *path = strdup(String_val(root));
+  size_t i, num_tracks = 0, num_errors = 0;
+  int64_t bytes = 0;
+  int64_t start = trace_now();
+  caml_enter_blocking_section();
+  import_files(&files, path, Int_val(jobs));
+  caml_leave_blocking_section();
+  double elapsed = (double)(trace_now() - start) / 1e9;
+  free(path);
+  sp_track **created = (sp_track**)xmalloc(files.count * sizeof(sp_track*) + 1);
+  TRACE_BEGIN;
+  spotify_lock();
+  for (i = 0; i < files.count; i++) {
+    struct import_file *file = &(files.files[i]);
+    bytes += file->size;
+    created[i] = NULL;
+    if (file->error) {
+      num_errors++;
+      continue;
+    }
+    created[i] = sp_localtrack_create(file->artist ? file->artist : "", file->title, file->album ? file->album : "", file->duration);
+    if (created[i]) num_tracks++;
+  }
+  spotify_unlock();
+  TRACE_END(TRACE_API, "local_import", "tracks", num_tracks);
+  tracks = caml_alloc(num_tracks, 0);
+  errors = caml_alloc(num_errors, 0);
+  num_tracks = num_errors = 0;
+  for (i = 0; i < files.count; i++) {
+    struct import_file *file = &(files.files[i]);
+    if (file->error) {
+      entry = caml_alloc_tuple(2);
+      str = caml_copy_string(file->path);
+      Store_field(entry, 0, str);
+      str = caml_copy_string(file->error);
+      Store_field(entry, 1, str);
+      Store_field(errors, num_errors++, entry);
+      continue;
+    }
+    if (created[i] == NULL) continue;
+    entry = caml_alloc_tuple(6);
+    str = caml_copy_string(file->path);
+    Store_field(entry, 0, str);
+    str = alloc_track(created[i]);
+    Store_field(entry, 1, str);
+    str = caml_copy_string(file->artist ? file->artist : "");
+    Store_field(entry, 2, str);
+    str = caml_copy_string(file->title);
+    Store_field(entry, 3, str);
+    str = caml_copy_string(file->album ? file->album : "");
+    Store_field(entry, 4, str);
+    str = caml_copy_double(file->duration < 0 ? -1. : (double)file->duration / 1000);
+    Store_field(entry, 5, str);
+    Store_field(tracks, num_tracks++, entry);
+  }
+  free(created);
+  import_free(&files);
+  result = caml_alloc_tuple(5);
+  Store_field(result, 0, tracks);
+  Store_field(result, 1, errors);
+  str = caml_copy_double(elapsed);
+  Store_field(result, 2, str);
+  Store_field(result, 3, Val_long(bytes));
+  str = caml_copy_double(elapsed > 0 ? (double)files.count / elapsed : 0);
+  Store_field(result, 4, str);
+  CAMLreturn(result);
+}
+
+/* +-----------------------------------------------------------------+
+   | Shard rings                                                     |
+   +-----------------------------------------------------------------+ */
+
+/* Single-producer single-consumer message rings in shared memory, to
+   exchange metadata and PCM between processes hosting sessions. A
+   ring is created before forking and inherited by the child. Each
+   message is a 32-bit length followed by its bytes, padded to 8
+   bytes, and is only published once completely written, so that a
+   writer dying in the middle of a message leaves the ring
+   consistent. Blocked readers and writers sleep on futexes, which
+   are only woken when someone waits. */
+
+struct ring_header {
+  uint64_t head;
+  /* Bytes written, only modified by the writer. */
+  uint64_t tail;
+  /* Bytes read, only modified by the reader. */
+  uint32_t data_seq;
+  uint32_t space_seq;
+  /* Futex words, incremented on each write and read. */
+  uint32_t readers_waiting;
+  uint32_t writers_waiting;
+  uint32_t capacity;
+  /* Size of the data area, a power of two. */
+};
+
+/* Offset of the data area in the mapping. */
+#define RING_DATA_OFFSET 64
+
+struct shard_ring {
+  struct ring_header *header;
+  unsigned char *data;
+  size_t size;
+  /* Size of the mapping. */
+};
+
+#define Shard_ring_val(v) *(struct shard_ring **)Data_custom_val(v)
+
+static void shard_ring_finalize(value x)
+{
+  struct shard_ring *ring = Shard_ring_val(x);
+  if (ring) {
+    munmap(ring->header, ring->size);
+    free(ring);
+  }
+}
+
+static struct custom_operations shard_ring_ops = {
+  "spotify:shard_ring",
+  shard_ring_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct shard_ring *get_shard_ring(value x)
+{
+  struct shard_ring *ring = Shard_ring_val(x);
+  if (ring == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return ring;
+}
+
+/* Wait until [*addr] is no longer [expected], at most until
+   [deadline] (in nanoseconds, or -1). */
+static void futex_wait(uint32_t *addr, uint32_t expected, int64_t deadline)
+{
+  struct timespec ts, *timeout = NULL;
+  if (deadline >= 0) {
+    int64_t left = deadline - trace_now();
+    if (left <= 0) return;
+    ts.tv_sec = left / 1000000000;
+    ts.tv_nsec = left % 1000000000;
+    timeout = &ts;
+  }
+  syscall(SYS_futex, addr, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static size_t ring_record_size(size_t len)
+{
+  return (4 + len + 7) & ~(size_t)7;
+}
+
+/* Wait until [ready] holds for [ring], at most until [deadline].
+   [seq] and [waiting] are the futex word and waiter count of the
+   condition. Returns whether it holds. */
+static int ring_wait(struct shard_ring *ring, int (*ready)(struct shard_ring*, size_t), size_t arg, uint32_t *seq, uint32_t *waiting, int64_t deadline)
+{
+  for (;;) {
+    uint32_t current = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+    if (ready(ring, arg)) return 1;
+    if (deadline >= 0 && trace_now() >= deadline) return 0;
+    __atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+    if (!ready(ring, arg)) futex_wait(seq, current, deadline);
+    __atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static int ring_has_space(struct shard_ring *ring, size_t needed)
+{
+  struct ring_header *header = ring->header;
+  uint64_t tail = __atomic_load_n(&(header->tail), __ATOMIC_SEQ_CST);
+  return header->capacity - (header->head - tail) >= needed;
+}
+
+static int ring_has_data(struct shard_ring *ring, size_t unused)
+{
+  struct ring_header *header = ring->header;
+  return __atomic_load_n(&(header->head), __ATOMIC_SEQ_CST) != header->tail;
+}
+
+static void ring_copy_in(struct shard_ring *ring, uint64_t position, const void *src, size_t len)
+{
+  size_t offset = position & (ring->header->capacity - 1);
+  size_t first = ring->header->capacity - offset;
+  if (first > len) first = len;
+  memcpy(ring->data + offset, src, first);
+  memcpy(ring->data, (const unsigned char*)src + first, len - first);
+}
+
+static void ring_copy_out(struct shard_ring *ring, uint64_t position, void *dst, size_t len)
+{
+  size_t offset = position & (ring->header->capacity - 1);
+  size_t first = ring->header->capacity - offset;
+  if (first > len) first = len;
+  memcpy(dst, ring->data + offset, first);
+  memcpy((unsigned char*)dst + first, ring->data, len - first);
+}
+
+static int64_t ring_deadline(value timeout)
+{
+  double seconds = Double_val(timeout);
+  return seconds < 0 ? -1 : trace_now() + (int64_t)(seconds * 1e9);
+}
+
+CAMLprim value ocaml_spotify_shard_ring_create(value val_size)
+{
+  size_t capacity = 4096;
+  int fd = -1;
+  while ((long)capacity < Long_val(val_size) && capacity < ((size_t)1 << 30)) capacity *= 2;
+  size_t size = RING_DATA_OFFSET + capacity;
+#if defined(SYS_memfd_create)
+  fd = syscall(SYS_memfd_create, "spotify-shard-ring", 0);
+  if (fd >= 0 && ftruncate(fd, size) < 0) {
+    close(fd);
+    caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  }
+#endif
+  void *map = fd >= 0
+    ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+    : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  /* The mapping keeps the memory alive. */
+  if (fd >= 0) close(fd);
+  if (map == MAP_FAILED) caml_raise_sys_error(caml_copy_string(strerror(errno)));
+  struct shard_ring *ring = new(struct shard_ring);
+  ring->header = (struct ring_header*)map;
+  ring->data = (unsigned char*)map + RING_DATA_OFFSET;
+  ring->size = size;
+  memset(ring->header, 0, sizeof(struct ring_header));
+  ring->header->capacity = capacity;
+  value x = caml_alloc_custom(&shard_ring_ops, sizeof(struct shard_ring *), 0, 1);
+  Shard_ring_val(x) = ring;
+  return x;
+}
+
+/* Write [len] bytes of [*buffer], after waiting for space with the
+   runtime released. [buffer] points to a registered root and is only
+   dereferenced after the wait since its value may have moved. */
+static value ring_send(struct shard_ring *ring, value *buffer, const void *(*data)(value, size_t), size_t offset, size_t len, value timeout)
+{
+  struct ring_header *header = ring->header;
+  size_t needed = ring_record_size(len);
+  uint32_t length = len;
+  int64_t deadline = ring_deadline(timeout);
+  if (needed > header->capacity) caml_invalid_argument("Spotify.shard_ring_send");
+  if (!ring_has_space(ring, needed)) {
+    int ok;
+    caml_enter_blocking_section();
+    ok = ring_wait(ring, ring_has_space, needed, &(header->space_seq), &(header->writers_waiting), deadline);
+    caml_leave_blocking_section();
+    if (!ok) return Val_false;
+  }
+  ring_copy_in(ring, header->head, &length, 4);
+  ring_copy_in(ring, header->head + 4, data(*buffer, offset), len);
+  __atomic_store_n(&(header->head), header->head + needed, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&(header->data_seq), 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(header->readers_waiting), __ATOMIC_SEQ_CST)) futex_wake(&(header->data_seq));
+  return Val_true;
+}
+
+static const void *string_data(value str, size_t offset)
+{
+  return String_val(str) + offset;
+}
+
+static const void *bigarray_data(value ba, size_t offset)
+{
+  return (const unsigned char*)Caml_ba_data_val(ba) + offset;
+}
+
+CAMLprim value ocaml_spotify_shard_ring_send(value val_ring, value str, value timeout)
+{
+  CAMLparam3(val_ring, str, timeout);
+  CAMLreturn(ring_send(get_shard_ring(val_ring), &str, string_data, 0, caml_string_length(str), timeout));
+}
+
+CAMLprim value ocaml_spotify_shard_ring_send_bytes(value val_ring, value ba, value offset, value len, value timeout)
+{
+  CAMLparam5(val_ring, ba, offset, len, timeout);
+  if (Long_val(offset) < 0 || Long_val(len) < 0 || Long_val(offset) > (long)Caml_ba_array_val(ba)->dim[0] - Long_val(len))
+    caml_invalid_argument("Spotify.shard_ring_send_bytes");
+  CAMLreturn(ring_send(get_shard_ring(val_ring), &ba, bigarray_data, Long_val(offset), Long_val(len), timeout));
+}
+
+CAMLprim value ocaml_spotify_shard_ring_receive(value val_ring, value timeout)
+{
+  CAMLparam2(val_ring, timeout);
+  CAMLlocal2(result, str);
+  struct shard_ring *ring = get_shard_ring(val_ring);
+  struct ring_header *header = ring->header;
+  uint32_t length;
+  int64_t deadline = ring_deadline(timeout);
+  if (!ring_has_data(ring, 0)) {
+    int ok;
+    caml_enter_blocking_section();
+    ok = ring_wait(ring, ring_has_data, 0, &(header->data_seq), &(header->readers_waiting), deadline);
+    caml_leave_blocking_section();
+    if (!ok) CAMLreturn(Val_int(0));
+  }
+  ring_copy_out(ring, header->tail, &length, 4);
+  if (ring_record_size(length) > header->capacity) caml_failwith("Spotify.shard_ring_receive: corrupted ring");
+  str = caml_alloc_string(length);
+  ring_copy_out(ring, header->tail + 4, (void*)String_val(str), length);
+  __atomic_store_n(&(header->tail), header->tail + ring_record_size(length), __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&(header->space_seq), 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(header->writers_waiting), __ATOMIC_SEQ_CST)) futex_wake(&(header->space_seq));
+  result = caml_alloc_tuple(1);
+  Store_field(result, 0, str);
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_shard_ring_length(value ring)
+{
+  struct ring_header *header = get_shard_ring(ring)->header;
+  return Val_long(__atomic_load_n(&(header->head), __ATOMIC_SEQ_CST) - __atomic_load_n(&(header->tail), __ATOMIC_SEQ_CST));
+}
+
+CAMLprim value ocaml_spotify_shard_ring_reset(value ring)
+{
+  struct ring_header *header = get_shard_ring(ring)->header;
+  __atomic_store_n(&(header->head), 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&(header->tail), 0, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&(header->space_seq), 1, __ATOMIC_SEQ_CST);
+  futex_wake(&(header->space_seq));
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_shard_can_fork(value unit)
+{
+  return Val_bool(__sync_fetch_and_add(&native_owners, 0) == 0);
+}
+
+CAMLprim value ocaml_spotify_shard_exit(value code)
+{
+  fflush(NULL);
+  _exit(Int_val(code));
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | Encoding                                                        |
+   +-----------------------------------------------------------------+ */
+
+enum encoder_format {
+  ENCODER_FLAC,
+  ENCODER_VORBIS
+};
+
+#define Encoder_val(v) *(struct encoder **)Data_custom_val(v)
+
+/* Kind of the data passed to the output of an encoder. */
+enum encoder_output_kind {
+  ENCODER_OUTPUT_HEADER,
+  /* Stream headers, produced before any audio data. */
+  ENCODER_OUTPUT_SYNC,
+  /* Start of a unit (ogg page or FLAC frame) a decoder can start
+     from once it has the headers. */
+  ENCODER_OUTPUT_DATA
+  /* Continuation of the current unit. */
+};
+
+/* Maximum number of bytes encoded at once by the worker thread. */
+#define ENCODER_CHUNK_SIZE 65536
+
+struct encoder {
+  struct pcm_sink sink;
+  /* Must be the first field, the delivery function casts it back to
+     the encoder. */
+  enum encoder_format format;
+  float quality;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  /* Mutex and condition protecting everything below and used to wake
+     up the worker thread. */
+  char *ring;
+  size_t ring_size;
+  uint64_t ring_head;
+  uint64_t ring_tail;
+  /* Ring of PCM data waiting to be encoded. [ring_head] and
+     [ring_tail] are absolute byte offsets. */
+  int sample_rate;
+  int channels;
+  /* Format of the stream, fixed by the first delivery. */
+  int stop;
+  /* Whether the worker must flush the stream and exit. */
+  int finished;
+  /* Whether the worker has been joined. */
+  int error;
+  /* Whether the codec reported an error. */
+  int64_t frames_dropped;
+  int64_t bytes_written;
+  int in_memory;
+  FILE *file;
+  char *buffer;
+  size_t buffer_length;
+  size_t buffer_capacity;
+  void (*output)(void *data, const void *buffer, size_t length, enum encoder_output_kind kind);
+  void *output_data;
+  /* Output, either a file, a memory buffer or a native consumer
+     called from the worker thread. */
+#if defined(HAVE_FLAC)
+  FLAC__StreamEncoder *flac;
+#endif
+#if defined(HAVE_VORBIS)
+  vorbis_info vorbis_info;
+  vorbis_comment vorbis_comment;
+  vorbis_dsp_state vorbis_dsp;
+  vorbis_block vorbis_block;
+  ogg_stream_state ogg_stream;
+#endif
+  int codec_ready;
+};
+
+/* Feed frames to the encoder. Called from the music delivery thread:
+   the data is only copied into the ring, and dropped if it is full. */
+static void encoder_deliver(struct pcm_sink *sink, const sp_audioformat *format, const void *frames, int num_frames)
+{
+  struct encoder *encoder = (struct encoder *)sink;
+  int size = frame_size(format);
+  if (size < 0) return;
+  size_t length = (size_t)num_frames * size;
+  pthread_mutex_lock(&(encoder->mutex));
+  if (encoder->channels == 0) {
+    encoder->sample_rate = format->sample_rate;
+    encoder->channels = format->channels;
+  }
+  if (encoder->stop
+      || format->sample_rate != encoder->sample_rate
+      || format->channels != encoder->channels
+      || encoder->ring_size - (size_t)(encoder->ring_head - encoder->ring_tail) < length) {
+    encoder->frames_dropped += num_frames;
+  } else {
+    size_t offset = encoder->ring_head % encoder->ring_size;
+    size_t first = encoder->ring_size - offset;
+    if (first > length) first = length;
+    memcpy(encoder->ring + offset, frames, first);
+    memcpy(encoder->ring, (const char*)frames + first, length - first);
+    encoder->ring_head += length;
+    pthread_cond_signal(&(encoder->cond));
+  }
+  pthread_mutex_unlock(&(encoder->mutex));
+}
+
+#if defined(HAVE_FLAC) || defined(HAVE_VORBIS)
+static int encoder_output(struct encoder *encoder, const void *data, size_t length, enum encoder_output_kind kind)
+{
+  if (encoder->output) {
+    encoder->output(encoder->output_data, data, length, kind);
+    pthread_mutex_lock(&(encoder->mutex));
+  } else if (encoder->file) {
+    if (fwrite(data, 1, length, encoder->file) != length) return -1;
+    pthread_mutex_lock(&(encoder->mutex));
+  } else {
+    pthread_mutex_lock(&(encoder->mutex));
+    if (encoder->buffer_length + length > encoder->buffer_capacity) {
+      size_t capacity = encoder->buffer_capacity ? encoder->buffer_capacity : 65536;
+      while (encoder->buffer_length + length > capacity) capacity *= 2;
+      char *buffer = realloc(encoder->buffer, capacity);
+      if (buffer == NULL) {
+        pthread_mutex_unlock(&(encoder->mutex));
+        return -1;
+      }
+      encoder->buffer = buffer;
+      encoder->buffer_capacity = capacity;
+    }
+    memcpy(encoder->buffer + encoder->buffer_length, data, length);
+    encoder->buffer_length += length;
+  }
+  encoder->bytes_written += length;
+  pthread_mutex_unlock(&(encoder->mutex));
+  return 0;
+}
+#endif
+
+#if defined(HAVE_FLAC)
+
+static FLAC__StreamEncoderWriteStatus flac_write(const FLAC__StreamEncoder *flac, const FLAC__byte buffer[], size_t bytes, unsigned samples, unsigned current_frame, void *userdata)
+{
+  struct encoder *encoder = (struct encoder *)userdata;
+  enum encoder_output_kind kind = !encoder->codec_ready ? ENCODER_OUTPUT_HEADER : samples ? ENCODER_OUTPUT_SYNC : ENCODER_OUTPUT_DATA;
+  if (encoder_output(encoder, buffer, bytes, kind))
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+  else
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+#endif
+
+#if defined(HAVE_VORBIS)
+
+/* Write all the pages ready in the ogg stream. If [flush] is set,
+   force the last page out. */
+static int vorbis_write_pages(struct encoder *encoder, int flush)
+{
+  ogg_page page;
+  while (flush ? ogg_stream_flush(&(encoder->ogg_stream), &page) : ogg_stream_pageout(&(encoder->ogg_stream), &page)) {
+    if (encoder_output(encoder, page.header, page.header_len, encoder->codec_ready ? ENCODER_OUTPUT_SYNC : ENCODER_OUTPUT_HEADER)) return -1;
+    if (encoder_output(encoder, page.body, page.body_len, encoder->codec_ready ? ENCODER_OUTPUT_DATA : ENCODER_OUTPUT_HEADER)) return -1;
+  }
+  return 0;
+}
+
+/* Pull all the packets out of the vorbis encoder. */
+static int vorbis_drain(struct encoder *encoder)
+{
+  ogg_packet packet;
+  while (vorbis_analysis_blockout(&(encoder->vorbis_dsp), &(encoder->vorbis_block)) == 1) {
+    vorbis_analysis(&(encoder->vorbis_block), NULL);
+    vorbis_bitrate_addblock(&(encoder->vorbis_block));
+    while (vorbis_bitrate_flushpacket(&(encoder->vorbis_dsp), &packet)) {
+      ogg_stream_packetin(&(encoder->ogg_stream), &packet);
+      if (vorbis_write_pages(encoder, 0)) return -1;
+    }
+  }
+  return 0;
+}
+
+#endif
+
+/* Initialise the codec, once the format of the stream is known. */
+static int encoder_start(struct encoder *encoder)
+{
+  switch (encoder->format) {
+#if defined(HAVE_FLAC)
+  case ENCODER_FLAC:
+    encoder->flac = FLAC__stream_encoder_new();
+    if (encoder->flac == NULL) return -1;
+    FLAC__stream_encoder_set_channels(encoder->flac, encoder->channels);
+    FLAC__stream_encoder_set_bits_per_sample(encoder->flac, 16);
+    FLAC__stream_encoder_set_sample_rate(encoder->flac, encoder->sample_rate);
+    FLAC__stream_encoder_set_compression_level(encoder->flac, (unsigned)(encoder->quality * 8 + 0.5));
+    if (FLAC__stream_encoder_init_stream(encoder->flac, flac_write, NULL, NULL, NULL, (void*)encoder) != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+      FLAC__stream_encoder_delete(encoder->flac);
+      encoder->flac = NULL;
+      return -1;
+    }
+    return 0;
+#endif
+#if defined(HAVE_VORBIS)
+  case ENCODER_VORBIS: {
+    ogg_packet header, header_comment, header_code;
+    vorbis_info_init(&(encoder->vorbis_info));
+    if (vorbis_encode_init_vbr(&(encoder->vorbis_info), encoder->channels, encoder->sample_rate, encoder->quality)) {
+      vorbis_info_clear(&(encoder->vorbis_info));
+      return -1;
+    }
+    vorbis_comment_init(&(encoder->vorbis_comment));
+    vorbis_comment_add_tag(&(encoder->vorbis_comment), "ENCODER", "ocaml-spotify");
+    vorbis_analysis_init(&(encoder->vorbis_dsp), &(encoder->vorbis_info));
+    vorbis_block_init(&(encoder->vorbis_dsp), &(encoder->vorbis_block));
+    ogg_stream_init(&(encoder->ogg_stream), rand());
+    vorbis_analysis_headerout(&(encoder->vorbis_dsp), &(encoder->vorbis_comment), &header, &header_comment, &header_code);
+    ogg_stream_packetin(&(encoder->ogg_stream), &header);
+    ogg_stream_packetin(&(encoder->ogg_stream), &header_comment);
+    ogg_stream_packetin(&(encoder->ogg_stream), &header_code);
+    return vorbis_write_pages(encoder, 1);
+  }
+#endif
+  default:
+    return -1;
+  }
+}
+
+/* Encode [num_frames] frames of interleaved 16 bits samples. */
+static int encoder_encode(struct encoder *encoder, const int16_t *samples, int num_frames)
+{
+  switch (encoder->format) {
+#if defined(HAVE_FLAC)
+  case ENCODER_FLAC: {
+    int i, count = num_frames * encoder->channels;
+    FLAC__int32 buffer[count];
+    for (i = 0; i < count; i++) buffer[i] = samples[i];
+    return FLAC__stream_encoder_process_interleaved(encoder->flac, buffer, num_frames) ? 0 : -1;
+  }
+#endif
+#if defined(HAVE_VORBIS)
+  case ENCODER_VORBIS: {
+    int i, j, channels = encoder->channels;
+    float **buffer = vorbis_analysis_buffer(&(encoder->vorbis_dsp), num_frames);
+    for (i = 0; i < num_frames; i++)
+      for (j = 0; j < channels; j++)
+        buffer[j][i] = samples[i * channels + j] / 32768.f;
+    vorbis_analysis_wrote(&(encoder->vorbis_dsp), num_frames);
+    return vorbis_drain(encoder);
+  }
+#endif
+  default:
+    return -1;
+  }
+}
+
+/* Flush the end of the stream and release the codec. */
+static void encoder_stop(struct encoder *encoder)
+{
+  switch (encoder->format) {
+#if defined(HAVE_FLAC)
+  case ENCODER_FLAC:
+    if (!FLAC__stream_encoder_finish(encoder->flac)) encoder->error = 1;
+    FLAC__stream_encoder_delete(encoder->flac);
+    encoder->flac = NULL;
+    break;
+#endif
+#if defined(HAVE_VORBIS)
+  case ENCODER_VORBIS:
+    vorbis_analysis_wrote(&(encoder->vorbis_dsp), 0);
+    if (vorbis_drain(encoder) || vorbis_write_pages(encoder, 1)) encoder->error = 1;
+    ogg_stream_clear(&(encoder->ogg_stream));
+    vorbis_block_clear(&(encoder->vorbis_block));
+    vorbis_dsp_clear(&(encoder->vorbis_dsp));
+    vorbis_comment_clear(&(encoder->vorbis_comment));
+    vorbis_info_clear(&(encoder->vorbis_info));
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+/* The worker thread. It never runs OCaml code. */
+static void *encoder_worker(void *arg)
+{
+  struct encoder *encoder = (struct encoder *)arg;
+  char *chunk = xmalloc(ENCODER_CHUNK_SIZE);
+  for (;;) {
+    pthread_mutex_lock(&(encoder->mutex));
+    while (!encoder->stop && encoder->ring_head == encoder->ring_tail)
+      pthread_cond_wait(&(encoder->cond), &(encoder->mutex));
+    if (encoder->ring_head == encoder->ring_tail) {
+      /* Stop requested and nothing left to encode. */
+      pthread_mutex_unlock(&(encoder->mutex));
+      break;
+    }
+    size_t size = encoder->channels * 2;
+    size_t length = (size_t)(encoder->ring_head - encoder->ring_tail);
+    if (length > ENCODER_CHUNK_SIZE) length = ENCODER_CHUNK_SIZE;
+    length -= length % size;
+    size_t offset = encoder->ring_tail % encoder->ring_size;
+    size_t first = encoder->ring_size - offset;
+    if (first > length) first = length;
+    memcpy(chunk, encoder->ring + offset, first);
+    memcpy(chunk + first, encoder->ring, length - first);
+    encoder->ring_tail += length;
+    pthread_mutex_unlock(&(encoder->mutex));
+
+    if (encoder->error) continue;
+    if (!encoder->codec_ready) {
+      if (encoder_start(encoder)) {
+        encoder->error = 1;
+        continue;
+      }
+      encoder->codec_ready = 1;
+    }
+    if (encoder_encode(encoder, (int16_t*)chunk, length / size)) encoder->error = 1;
+  }
+  if (encoder->codec_ready) encoder_stop(encoder);
+  free(chunk);
+  return NULL;
+}
+
+/* Stop the worker after it encoded all the pending data and close
+   the output. */
+static void encoder_finish(struct encoder *encoder)
+{
+  if (encoder->finished) return;
+  detach_pcm_sink(&(encoder->sink));
+  pthread_mutex_lock(&(encoder->mutex));
+  encoder->stop = 1;
+  pthread_cond_signal(&(encoder->cond));
+  pthread_mutex_unlock(&(encoder->mutex));
+  pthread_join(encoder->thread, NULL);
+  if (encoder->file) {
+    if (fclose(encoder->file)) encoder->error = 1;
+    encoder->file = NULL;
+  }
+  encoder->finished = 1;
+}
+
+static void encoder_free(struct encoder *encoder)
+{
+  encoder_finish(encoder);
+  pthread_mutex_destroy(&(encoder->mutex));
+  pthread_cond_destroy(&(encoder->cond));
+  free(encoder->ring);
+  free(encoder->buffer);
+  free(encoder);
+  NATIVE_OWNER_REMOVE();
+}
+
+static void encoder_finalize(value x)
+{
+  struct encoder *encoder = Encoder_val(x);
+  if (encoder) {
+    /* Stop feeding it now, and let the reaper wait for the worker
+       and close the output. */
+    detach_pcm_sink(&(encoder->sink));
+    REAP_LATER(encoder_free, encoder);
+  }
+}
+
+static struct custom_operations encoder_ops = {
+  "spotify:encoder",
+  encoder_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct encoder *get_encoder(value x)
+{
+  struct encoder *encoder = Encoder_val(x);
+  if (encoder == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return encoder;
+}
+
+static int encoder_is_available(enum encoder_format format)
+{
+  switch (format) {
+#if defined(HAVE_FLAC)
+  case ENCODER_FLAC:
+    return 1;
+#endif
+#if defined(HAVE_VORBIS)
+  case ENCODER_VORBIS:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+CAMLprim value ocaml_spotify_encoder_available(value format)
+{
+  return Val_bool(encoder_is_available(Int_val(format)));
+}
+
+/* Create an encoder and start its worker thread. Return NULL if the
+   thread cannot be created. */
+static struct encoder *encoder_new(enum encoder_format format, double quality, size_t ring_size, FILE *file)
+{
+  struct encoder *encoder = new(struct encoder);
+  memset(encoder, 0, sizeof(struct encoder));
+  encoder->sink.deliver = encoder_deliver;
+  encoder->format = format;
+  encoder->quality = quality < 0 ? 0 : quality > 1 ? 1 : quality;
+  encoder->ring_size = ring_size;
+  encoder->ring = xmalloc(ring_size);
+  encoder->in_memory = file == NULL;
+  encoder->file = file;
+  pthread_mutex_init(&(encoder->mutex), NULL);
+  pthread_cond_init(&(encoder->cond), NULL);
+  NATIVE_OWNER_ADD();
+  if (pthread_create(&(encoder->thread), NULL, encoder_worker, (void*)encoder)) {
+    /* Do not try to join a thread that does not exist. */
+    encoder->finished = 1;
+    encoder->file = NULL;
+    encoder_free(encoder);
+    return NULL;
+  }
+  return encoder;
+}
+
+CAMLprim value ocaml_spotify_encoder_create(value val_session, value format, value quality, value buffer_size, value output)
+{
+  CAMLparam5(val_session, format, quality, buffer_size, output);
+  CAMLlocal1(result);
+  sp_session *session = get_session(val_session);
+  if (!encoder_is_available(Int_val(format)))
+    caml_invalid_argument("Spotify.encoder_create: format not available");
+  if (Long_val(buffer_size) <= 0)
+    caml_invalid_argument("Spotify.encoder_create: buffer_size");
+  FILE *file = NULL;
+  if (Is_block(output)) {
+    file = fopen(String_val(Field(output, 0)), "wb");
+    if (file == NULL) {
+      char message[1024];
+      snprintf(message, sizeof(message), "%s: %s", String_val(Field(output, 0)), strerror(errno));
+      caml_raise_sys_error(caml_copy_string(message));
+    }
+  }
+  struct encoder *encoder = encoder_new(Int_val(format), Double_val(quality), Long_val(buffer_size), file);
+  if (encoder == NULL) {
+    if (file) fclose(file);
+    caml_failwith("Spotify.encoder_create: cannot create the encoder thread");
+  }
+  result = caml_alloc_custom(&encoder_ops, sizeof(struct encoder *), 0, 1);
+  Encoder_val(result) = encoder;
+  attach_pcm_sink((struct userdata*)sp_session_userdata(session), &(encoder->sink));
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_encoder_create_byte(value *argv, int argn)
+{
+  return ocaml_spotify_encoder_create(argv[0], argv[1], argv[2], argv[3], argv[4]);
+}
+
+CAMLprim value ocaml_spotify_encoder_bytes_written(value val_encoder)
+{
+  struct encoder *encoder = get_encoder(val_encoder);
+  pthread_mutex_lock(&(encoder->mutex));
+  int64_t bytes = encoder->bytes_written;
+  pthread_mutex_unlock(&(encoder->mutex));
+  return caml_copy_int64(bytes);
+}
+
+CAMLprim value ocaml_spotify_encoder_frames_dropped(value val_encoder)
+{
+  struct encoder *encoder = get_encoder(val_encoder);
+  pthread_mutex_lock(&(encoder->mutex));
+  int64_t frames = encoder->frames_dropped;
+  pthread_mutex_unlock(&(encoder->mutex));
+  return Val_long(frames);
+}
+
+CAMLprim value ocaml_spotify_encoder_contents(value val_encoder)
+{
+  struct encoder *encoder = get_encoder(val_encoder);
+  if (!encoder->in_memory)
+    caml_invalid_argument("Spotify.encoder_contents");
+  pthread_mutex_lock(&(encoder->mutex));
+  size_t length = encoder->buffer_length;
+  pthread_mutex_unlock(&(encoder->mutex));
+  /* The buffer may only grow, and its first [length] bytes are not
+     modified anymore. Copy them without holding the mutex since the
+     allocation may trigger a collection. */
+  value str = caml_alloc_string(length);
+  pthread_mutex_lock(&(encoder->mutex));
+  memcpy(String_val(str), encoder->buffer, length);
+  pthread_mutex_unlock(&(encoder->mutex));
+  return str;
+}
+
+CAMLprim value ocaml_spotify_encoder_finish(value val_encoder)
+{
+  struct encoder *encoder = get_encoder(val_encoder);
+  detach_pcm_sink(&(encoder->sink));
+  caml_enter_blocking_section();
+  encoder_finish(encoder);
+  caml_leave_blocking_section();
+  if (encoder->error) caml_failwith("Spotify.encoder_finish: encoding failed");
+  return Val_unit;
+}
+
+CAMLprim value ocaml_spotify_encoder_release(value val_encoder)
+{
+  struct encoder *encoder = Encoder_val(val_encoder);
+  if (encoder) {
+    Encoder_val(val_encoder) = NULL;
+    detach_pcm_sink(&(encoder->sink));
+    caml_enter_blocking_section();
+    encoder_free(encoder);
+    caml_leave_blocking_section();
+  }
+  return Val_unit;
+}
+
+/* +-----------------------------------------------------------------+
+   | HTTP streaming                                                  |
+   +-----------------------------------------------------------------+ */
+
+#define Http_server_val(v) *(struct http_server **)Data_custom_val(v)
+
+/* Maximum size of a chunk sent to a listener. */
+#define HTTP_CHUNK_SIZE 65536
+
+/* Maximum size of a request. */
+#define HTTP_REQUEST_SIZE 4096
+
+/* A ring shared by all the listeners of a stream. Data is written
+   once and sent to each listener directly from the ring. */
+struct http_ring {
+  char *data;
+  size_t size;
+  uint64_t head;
+  /* Absolute offset of the end of the data. */
+  uint64_t sync;
+  /* Absolute offset where new listeners start. */
+  char *header;
+  size_t header_length;
+  size_t header_capacity;
+  /* Stream headers, sent to every listener first. */
+  int ready;
+  /* Whether listeners can start receiving the stream. */
+};
+
+/* Frames delivered since the server thread last took them. */
+struct http_staging {
+  char *data;
+  size_t length;
+  int sample_rate;
+  int channels;
+};
+
+enum http_stream {
+  HTTP_STREAM_PCM,
+  HTTP_STREAM_WAV,
+  HTTP_STREAM_ENCODED
+};
+
+struct http_client {
+  int fd;
+  int parsed;
+  /* Whether the request has been parsed. */
+  int started;
+  /* Whether the request has been parsed and the response started. */
+  int close_after_prefix;
+  /* Whether the connection must be closed once the prefix is sent. */
+  enum http_stream stream;
+  char *request;
+  size_t request_length;
+  char *prefix;
+  size_t prefix_length;
+  size_t prefix_sent;
+  /* Response headers and stream headers, sent before the data. */
+  uint64_t offset;
+  /* Absolute offset in the ring of the next byte to send. */
+  uint64_t chunk_end;
+  /* End of the chunk being sent. */
+  char chunk_header[16];
+  size_t chunk_header_length;
+  size_t chunk_header_sent;
+  size_t chunk_trailer_sent;
+  int writing;
+  /* Whether the client waits for EPOLLOUT. */
+  int dead;
+  /* Whether the client has been removed. Its events left in the
+     current batch are ignored. */
+  struct http_client *next;
+};
+
+struct http_server {
+  struct pcm_sink sink;
+  /* Must be the first field. */
+  int listen_fd;
+  int event_fd;
+  int epoll_fd;
+  int port;
+  pthread_t thread;
+  int running;
+  /* Whether the server thread has been started. */
+  pthread_mutex_t mutex;
+  /* Mutex protecting the rings, the listeners and the statistics. It
+     is held by the server thread while it processes events. */
+  pthread_mutex_t staging_mutex;
+  struct http_staging staging[2];
+  int staging_current;
+  size_t staging_size;
+  /* The delivery thread never takes [mutex]. It appends frames to the
+     current staging buffer, and the server thread swaps the buffers
+     under [staging_mutex] before copying the frames to the ring. */
+  int64_t frames_dropped;
+  /* Frames which did not fit in the staging buffer. */
+  int stop;
+  struct http_ring pcm;
+  struct http_ring encoded;
+  int sample_rate;
+  int channels;
+  /* Format of the PCM stream. */
+  size_t max_lag;
+  /* Number of bytes a listener may lag behind before being
+     evicted. */
+  int max_listeners;
+  struct encoder *encoder;
+  enum encoder_format encoder_format;
+  /* Encoder producing the encoded stream, if any. */
+  struct http_client *clients;
+  struct http_client *dead;
+  /* Clients removed while processing a batch of events. They are
+     only freed after the batch, since later events of the batch may
+     still point to them. */
+  int listeners;
+  /* Clients admitted to a stream, started or waiting for the stream
+     to start. */
+  int64_t accepted;
+  int64_t evicted;
+  int64_t bytes_sent;
+};
+
+static void http_wakeup(struct http_server *server)
+{
+  uint64_t one = 1;
+  ssize_t __attribute__((unused)) n = write(server->event_fd, &one, sizeof(one));
+}
+
+static void http_ring_append(struct http_ring *ring, const void *data, size_t length)
+{
+  const char *ptr = (const char*)data;
+  /* Only the last [ring->size] bytes are kept. */
+  if (length > ring->size) {
+    ptr += length - ring->size;
+    ring->head += length - ring->size;
+    length = ring->size;
+  }
+  size_t offset = ring->head % ring->size;
+  size_t first = ring->size - offset;
+  if (first > length) first = length;
+  memcpy(ring->data + offset, ptr, first);
+  memcpy(ring->data, ptr + first, length - first);
+  ring->head += length;
+}
+
+/* Called from the music delivery thread. It only waits for the
+   server thread to swap the staging buffers. */
+static void http_deliver(struct pcm_sink *sink, const sp_audioformat *format, const void *frames, int num_frames)
+{
+  struct http_server *server = (struct http_server *)sink;
+  int size = frame_size(format);
+  if (size < 0) return;
+  size_t length = (size_t)num_frames * size;
+  pthread_mutex_lock(&(server->staging_mutex));
+  struct http_staging *staging = &(server->staging[server->staging_current]);
+  if (staging->length == 0) {
+    staging->sample_rate = format->sample_rate;
+    staging->channels = format->channels;
+  }
+  if (staging->length + length > server->staging_size || format->sample_rate != staging->sample_rate || format->channels != staging->channels) {
+    /* The server thread is late, or the format changed since the
+       buffer was started. */
+    server->frames_dropped += num_frames;
+    pthread_mutex_unlock(&(server->staging_mutex));
+    return;
+  }
+  memcpy(staging->data + staging->length, frames, length);
+  staging->length += length;
+  pthread_mutex_unlock(&(server->staging_mutex));
+  http_wakeup(server);
+}
+
+/* Copy the staged frames to the PCM ring. Called from the server
+   thread with the server mutex held. */
+static void http_unstage(struct http_server *server)
+{
+  pthread_mutex_lock(&(server->staging_mutex));
+  struct http_staging *staging = &(server->staging[server->staging_current]);
+  server->staging_current ^= 1;
+  pthread_mutex_unlock(&(server->staging_mutex));
+  if (staging->length == 0) return;
+  if (!server->pcm.ready || staging->sample_rate != server->sample_rate || staging->channels != server->channels) {
+    /* New listeners start on a frame boundary with the new format. */
+    server->sample_rate = staging->sample_rate;
+    server->channels = staging->channels;
+    server->pcm.ready = 1;
+    server->pcm.sync = server->pcm.head;
+  }
+  http_ring_append(&(server->pcm), staging->data, staging->length);
+  server->pcm.sync = server->pcm.head;
+  staging->length = 0;
+}
+
+/* Called from the encoder worker thread. */
+static void http_encoded_output(void *data, const void *buffer, size_t length, enum encoder_output_kind kind)
+{
+  struct http_server *server = (struct http_server *)data;
+  struct http_ring *ring = &(server->encoded);
+  pthread_mutex_lock(&(server->mutex));
+  switch (kind) {
+  case ENCODER_OUTPUT_HEADER:
+    if (ring->header_length + length > ring->header_capacity) {
+      size_t capacity = ring->header_capacity ? ring->header_capacity : 4096;
+      while (ring->header_length + length > capacity) capacity *= 2;
+      char *header = realloc(ring->header, capacity);
+      if (header == NULL) break;
+      ring->header = header;
+      ring->header_capacity = capacity;
+    }
+    memcpy(ring->header + ring->header_length, buffer, length);
+    ring->header_length += length;
+    break;
+  case ENCODER_OUTPUT_SYNC:
+    ring->sync = ring->head;
+    ring->ready = 1;
+    /* fallthrough */
+  case ENCODER_OUTPUT_DATA:
+    http_ring_append(ring, buffer, length);
+    break;
+  }
+  pthread_mutex_unlock(&(server->mutex));
+  if (kind != ENCODER_OUTPUT_HEADER) http_wakeup(server);
+}
+
+/* Free the clients removed during the last batch of events. */
+static void http_client_reap(struct http_server *server)
+{
+  while (server->dead) {
+    struct http_client *client = server->dead;
+    server->dead = client->next;
+    free(client->request);
+    free(client->prefix);
+    free(client);
+  }
+}
+
+static void http_client_remove(struct http_server *server, struct http_client *client)
+{
+  struct http_client **cell = &(server->clients);
+  while (*cell) {
+    if (*cell == client) {
+      *cell = client->next;
+      break;
+    }
+    cell = &((*cell)->next);
+  }
+  if (client->parsed && !client->close_after_prefix) server->listeners--;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+  client->dead = 1;
+  client->next = server->dead;
+  server->dead = client;
+}
+
+static void http_client_want_write(struct http_server *server, struct http_client *client, int writing)
+{
+  if (client->writing == writing) return;
+  struct epoll_event event;
+  event.events = writing ? EPOLLOUT : EPOLLIN;
+  event.data.ptr = client;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+  client->writing = writing;
+}
+
+static void http_client_set_prefix(struct http_client *client, const char *head, const char *body, size_t body_length)
+{
+  size_t head_length = strlen(head);
+  char chunk[16];
+  size_t chunk_length = body_length ? (size_t)snprintf(chunk, sizeof(chunk), "%zx\r\n", body_length) : 0;
+  client->prefix_length = head_length + (body_length ? chunk_length + body_length + 2 : 0);
+  client->prefix = xmalloc(client->prefix_length);
+  char *ptr = client->prefix;
+  memcpy(ptr, head, head_length);
+  ptr += head_length;
+  if (body_length) {
+    memcpy(ptr, chunk, chunk_length);
+    ptr += chunk_length;
+    memcpy(ptr, body, body_length);
+    ptr += body_length;
+    memcpy(ptr, "\r\n", 2);
+  }
+  client->prefix_sent = 0;
+}
+
+static void http_client_error(struct http_client *client, const char *status)
+{
+  char head[256];
+  snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+  http_client_set_prefix(client, head, NULL, 0);
+  client->close_after_prefix = 1;
+  client->started = 1;
+}
+
+/* Try to start the response once the stream is ready. Called with
+   the server mutex held. Return whether the response started. */
+static int http_client_start(struct http_server *server, struct http_client *client)
+{
+  char head[512];
+  struct http_ring *ring = client->stream == HTTP_STREAM_ENCODED ? &(server->encoded) : &(server->pcm);
+  if (!ring->ready) return 0;
+  switch (client->stream) {
+  case HTTP_STREAM_PCM:
+    snprintf(head, sizeof(head),
+             "HTTP/1.1 200 OK\r\n"
+             "Content-Type: application/octet-stream\r\n"
+             "X-Audio-Format: s16ne\r\n"
+             "X-Audio-Rate: %d\r\n"
+             "X-Audio-Channels: %d\r\n"
+             "Cache-Control: no-cache\r\n"
+             "Transfer-Encoding: chunked\r\n"
+             "Connection: close\r\n\r\n",
+             server->sample_rate, server->channels);
+    http_client_set_prefix(client, head, NULL, 0);
+    break;
+  case HTTP_STREAM_WAV: {
+    /* A WAV header for a stream of unknown length. */
+    unsigned char wav[44];
+    uint32_t rate = server->sample_rate, channels = server->channels;
+    uint32_t byte_rate = rate * channels * 2, unknown = 0xffffffff;
+    uint16_t block_align = channels * 2, bits = 16, pcm = 1, nchannels = channels;
+    uint32_t fmt_size = 16;
+    memcpy(wav, "RIFF", 4);
+    memcpy(wav + 4, &unknown, 4);
+    memcpy(wav + 8, "WAVEfmt ", 8);
+    memcpy(wav + 16, &fmt_size, 4);
+    memcpy(wav + 20, &pcm, 2);
+    memcpy(wav + 22, &nchannels, 2);
+    memcpy(wav + 24, &rate, 4);
+    memcpy(wav + 28, &byte_rate, 4);
+    memcpy(wav + 32, &block_align, 2);
+    memcpy(wav + 34, &bits, 2);
+    memcpy(wav + 36, "data", 4);
+    memcpy(wav + 40, &unknown, 4);
+    http_client_set_prefix(client,
+                           "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: audio/wav\r\n"
+                           "Cache-Control: no-cache\r\n"
+                           "Transfer-Encoding: chunked\r\n"
+                           "Connection: close\r\n\r\n",
+                           (const char*)wav, sizeof(wav));
+    break;
+  }
+  case HTTP_STREAM_ENCODED:
+    snprintf(head, sizeof(head),
+             "HTTP/1.1 200 OK\r\n"
+             "Content-Type: %s\r\n"
+             "Cache-Control: no-cache\r\n"
+             "Transfer-Encoding: chunked\r\n"
+             "Connection: close\r\n\r\n",
+             server->encoder_format == ENCODER_FLAC ? "audio/flac" : "audio/ogg");
+    http_client_set_prefix(client, head, ring->header, ring->header_length);
+    break;
+  }
+  client->offset = ring->sync;
+  client->chunk_end = 0;
+  client->started = 1;
+  return 1;
+}
+
+static void http_client_read(struct http_server *server, struct http_client *client)
+{
+  char discard[256];
+  char *buffer = discard;
+  size_t length = sizeof(discard);
+  if (!client->parsed) {
+    if (client->request == NULL) client->request = xmalloc(HTTP_REQUEST_SIZE + 1);
+    buffer = client->request + client->request_length;
+    length = HTTP_REQUEST_SIZE - client->request_length;
+  }
+  ssize_t n = read(client->fd, buffer, length);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    http_client_remove(server, client);
+    return;
+  }
+  if (n < 0 || client->parsed) return;
+  client->request_length += n;
+  client->request[client->request_length] = 0;
+  if (strstr(client->request, "\r\n\r\n") == NULL) {
+    if (client->request_length == HTTP_REQUEST_SIZE) {
+      client->parsed = 1;
+      http_client_error(client, "413 Request Entity Too Large");
+      http_client_want_write(server, client, 1);
+    }
+    return;
+  }
+  char method[16], path[256];
+  client->parsed = 1;
+  if (sscanf(client->request, "%15s %255s", method, path) != 2) {
+    http_client_error(client, "400 Bad Request");
+  } else if (strcmp(method, "GET") != 0) {
+    http_client_error(client, "405 Method Not Allowed");
+  } else if (server->listeners >= server->max_listeners) {
+    http_client_error(client, "503 Service Unavailable");
+  } else if (strcmp(path, "/") == 0 || strcmp(path, "/pcm") == 0) {
+    client->stream = HTTP_STREAM_PCM;
+  } else if (strcmp(path, "/wav") == 0) {
+    client->stream = HTTP_STREAM_WAV;
+  } else if (server->encoder && strcmp(path, server->encoder_format == ENCODER_FLAC ? "/flac" : "/ogg") == 0) {
+    client->stream = HTTP_STREAM_ENCODED;
+  } else {
+    http_client_error(client, "404 Not Found");
+  }
+  if (!client->close_after_prefix) server->listeners++;
+  free(client->request);
+  client->request = NULL;
+  /* If the stream is not ready yet, the response starts on the next
+     wakeup. */
+  if (client->started || http_client_start(server, client)) http_client_want_write(server, client, 1);
+}
+
+/* Evict the client if it is too slow, before its data is
+   overwritten. Return whether it was evicted. */
+static int http_client_evict(struct http_server *server, struct http_client *client)
+{
+  struct http_ring *ring = client->stream == HTTP_STREAM_ENCODED ? &(server->encoded) : &(server->pcm);
+  if (!client->started || client->close_after_prefix) return 0;
+  if (ring->head - client->offset <= server->max_lag && ring->head - client->offset <= ring->size) return 0;
+  server->evicted++;
+  http_client_remove(server, client);
+  return 1;
+}
+
+/* Send as much as possible to a client. Called with the server mutex
+   held, the socket being non-blocking. */
+static void http_client_write(struct http_server *server, struct http_client *client)
+{
+  for (;;) {
+    struct iovec iov[4];
+    int count = 0;
+    if (client->prefix_sent < client->prefix_length) {
+      iov[0].iov_base = client->prefix + client->prefix_sent;
+      iov[0].iov_len = client->prefix_length - client->prefix_sent;
+      count = 1;
+    } else if (client->close_after_prefix) {
+      http_client_remove(server, client);
+      return;
+    } else {
+      struct http_ring *ring = client->stream == HTTP_STREAM_ENCODED ? &(server->encoded) : &(server->pcm);
+      if (http_client_evict(server, client)) return;
+      if (client->chunk_end == 0) {
+        /* Start a new chunk with all the available data. */
+        if (client->offset == ring->head) {
+          /* Caught up, wait for more data. */
+          http_client_want_write(server, client, 0);
+          return;
+        }
+        client->chunk_end = ring->head;
+        if (client->chunk_end - client->offset > HTTP_CHUNK_SIZE) client->chunk_end = client->offset + HTTP_CHUNK_SIZE;
+        client->chunk_header_length = snprintf(client->chunk_header, sizeof(client->chunk_header), "%zx\r\n", (size_t)(client->chunk_end - client->offset));
+        client->chunk_header_sent = 0;
+        client->chunk_trailer_sent = 0;
+      }
+      if (client->chunk_header_sent < client->chunk_header_length) {
+        iov[count].iov_base = client->chunk_header + client->chunk_header_sent;
+        iov[count].iov_len = client->chunk_header_length - client->chunk_header_sent;
+        count++;
+      }
+      if (client->offset < client->chunk_end) {
+        size_t offset = client->offset % ring->size;
+        size_t length = client->chunk_end - client->offset;
+        size_t first = ring->size - offset;
+        if (first > length) first = length;
+        iov[count].iov_base = ring->data + offset;
+        iov[count].iov_len = first;
+        count++;
+        if (length > first) {
+          iov[count].iov_base = ring->data;
+          iov[count].iov_len = length - first;
+          count++;
+        }
+      }
+      iov[count].iov_base = (char*)"\r\n" + client->chunk_trailer_sent;
+      iov[count].iov_len = 2 - client->chunk_trailer_sent;
+      count++;
+    }
+    /* Not writev: a listener which went away must not raise
+       SIGPIPE. */
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    ssize_t n = sendmsg(client->fd, &message, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        http_client_want_write(server, client, 1);
+        return;
+      }
+      http_client_remove(server, client);
+      return;
+    }
+    server->bytes_sent += n;
+    size_t sent = n;
+    if (client->prefix_sent < client->prefix_length) {
+      client->prefix_sent += sent;
+      continue;
+    }
+    size_t part = client->chunk_header_length - client->chunk_header_sent;
+    if (part > sent) part = sent;
+    client->chunk_header_sent += part;
+    sent -= part;
+    part = client->chunk_end - client->offset;
+    if (part > sent) part = sent;
+    client->offset += part;
+    sent -= part;
+    client->chunk_trailer_sent += sent;
+    if (client->chunk_trailer_sent == 2) client->chunk_end = 0;
+  }
+}
+
+static void http_accept(struct http_server *server)
+{
+  for (;;) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct http_client *client = new(struct http_client);
+    memset(client, 0, sizeof(struct http_client));
+    client->fd = fd;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+      close(fd);
+      free(client);
+      continue;
+    }
+    client->next = server->clients;
+    server->clients = client;
+    server->accepted++;
+  }
+}
+
+/* The server thread. It never runs OCaml code. */
+static void *http_worker(void *arg)
+{
+  struct http_server *server = (struct http_server *)arg;
+  struct epoll_event events[64];
+  for (;;) {
+    int count = epoll_wait(server->epoll_fd, events, 64, -1);
+    int i;
+    pthread_mutex_lock(&(server->mutex));
+    if (server->stop) break;
+    for (i = 0; i < count; i++) {
+      if (events[i].data.ptr == &(server->listen_fd)) {
+        http_accept(server);
+      } else if (events[i].data.ptr == &(server->event_fd)) {
+        uint64_t value;
+        ssize_t __attribute__((unused)) n = read(server->event_fd, &value, sizeof(value));
+        http_unstage(server);
+        /* New data: resume all the listeners that caught up, and start
+           the ones waiting for the stream. */
+        struct http_client *client = server->clients, *next;
+        for (; client; client = next) {
+          next = client->next;
+          if (client->parsed && !client->started) http_client_start(server, client);
+          if (client->writing)
+            /* Blocked on a full socket. */
+            http_client_evict(server, client);
+          else if (client->started)
+            http_client_write(server, client);
+        }
+      } else {
+        struct http_client *client = (struct http_client *)events[i].data.ptr;
+        if (client->dead)
+          continue;
+        else if (events[i].events & EPOLLOUT)
+          http_client_write(server, client);
+        else
+          http_client_read(server, client);
+      }
+    }
+    http_client_reap(server);
+    pthread_mutex_unlock(&(server->mutex));
+  }
+  while (server->clients) http_client_remove(server, server->clients);
+  http_client_reap(server);
+  pthread_mutex_unlock(&(server->mutex));
+  return NULL;
+}
+
+static void http_server_free(struct http_server *server)
+{
+  detach_pcm_sink(&(server->sink));
+  if (server->encoder) {
+    /* Stop the encoder first, it writes to the encoded ring. */
+    encoder_free(server->encoder);
+    server->encoder = NULL;
+  }
+  if (server->running) {
+    pthread_mutex_lock(&(server->mutex));
+    server->stop = 1;
+    pthread_mutex_unlock(&(server->mutex));
+    http_wakeup(server);
+    pthread_join(server->thread, NULL);
+  }
+  if (server->epoll_fd >= 0) close(server->epoll_fd);
+  if (server->event_fd >= 0) close(server->event_fd);
+  if (server->listen_fd >= 0) close(server->listen_fd);
+  pthread_mutex_destroy(&(server->mutex));
+  pthread_mutex_destroy(&(server->staging_mutex));
+  free(server->staging[0].data);
+  free(server->staging[1].data);
+  free(server->pcm.data);
+  free(server->encoded.data);
+  free(server->encoded.header);
+  free(server);
+  NATIVE_OWNER_REMOVE();
+}
+
+static void http_server_finalize(value x)
+{
+  struct http_server *server = Http_server_val(x);
+  if (server) {
+    /* Stop feeding it now, and let the reaper stop its threads. */
+    detach_pcm_sink(&(server->sink));
+    if (server->encoder) detach_pcm_sink(&(server->encoder->sink));
+    REAP_LATER(http_server_free, server);
+  }
+}
+
+static struct custom_operations http_server_ops = {
+  "spotify:http_server",
+  http_server_finalize,
+  spotify_compare,
+  spotify_hash,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static struct http_server *get_http_server(value x)
+{
+  struct http_server *server = Http_server_val(x);
+  if (server == NULL) caml_raise(*caml_named_value("spotify:null"));
+  return server;
+}
+
+CAMLprim value ocaml_spotify_http_server_create(value val_session, value address, value port, value buffer_size, value max_lag, value max_listeners, value encoder)
+{
+  CAMLparam5(val_session, address, port, buffer_size, max_lag);
+  CAMLxparam2(max_listeners, encoder);
+  CAMLlocal1(result);
+  sp_session *session = get_session(val_session);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(Int_val(port));
+  if (inet_pton(AF_INET, String_val(address), &(addr.sin_addr)) != 1)
+    caml_invalid_argument("Spotify.http_server_create: address");
+  if (Long_val(buffer_size) <= 0)
+    caml_invalid_argument("Spotify.http_server_create: buffer_size");
+  if (Is_block(encoder) && !encoder_is_available(Int_val(Field(Field(encoder, 0), 0))))
+    caml_invalid_argument("Spotify.http_server_create: format not available");
+
+  struct http_server *server = new(struct http_server);
+  memset(server, 0, sizeof(struct http_server));
+  NATIVE_OWNER_ADD();
+  server->sink.deliver = http_deliver;
+  server->listen_fd = server->event_fd = server->epoll_fd = -1;
+  pthread_mutex_init(&(server->mutex), NULL);
+  pthread_mutex_init(&(server->staging_mutex), NULL);
+  server->pcm.size = server->encoded.size = Long_val(buffer_size);
+  server->pcm.data = xmalloc(server->pcm.size);
+  server->staging_size = server->pcm.size / 2;
+  server->staging[0].data = xmalloc(server->staging_size);
+  server->staging[1].data = xmalloc(server->staging_size);
+  server->max_lag = Long_val(max_lag) > 0 ? (size_t)Long_val(max_lag) : server->pcm.size / 2;
+  server->max_listeners = Int_val(max_listeners);
+
+  const char *error = NULL;
+  int one = 1;
+  socklen_t length = sizeof(addr);
+  struct epoll_event event;
+  if ((server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    error = "socket";
+  else if (setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+    error = "setsockopt";
+  else if (bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    error = "bind";
+  else if (listen(server->listen_fd, 64) < 0)
+    error = "listen";
+  else if (getsockname(server->listen_fd, (struct sockaddr*)&addr, &length) < 0)
+    error = "getsockname";
+  else if ((server->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    error = "eventfd";
+  else if ((server->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    error = "epoll_create1";
+  if (error == NULL) {
+    event.events = EPOLLIN;
+    event.data.ptr = &(server->listen_fd);
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) < 0) error = "epoll_ctl";
+    event.data.ptr = &(server->event_fd);
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->event_fd, &event) < 0) error = "epoll_ctl";
+  }
+  if (error) {
+    char message[256];
+    snprintf(message, sizeof(message), "Spotify.http_server_create: %s: %s", error, strerror(errno));
+    http_server_free(server);
+    caml_raise_sys_error(caml_copy_string(message));
+  }
+  server->port = ntohs(addr.sin_port);
+
+  if (Is_block(encoder)) {
+    server->encoded.data = xmalloc(server->encoded.size);
+    server->encoder_format = Int_val(Field(Field(encoder, 0), 0));
+    server->encoder = encoder_new(server->encoder_format, Double_val(Field(Field(encoder, 0), 1)), server->pcm.size, NULL);
+    if (server->encoder == NULL) {
+      http_server_free(server);
+      caml_failwith("Spotify.http_server_create: cannot create the encoder thread");
+    }
+    server->encoder->output = http_encoded_output;
+    server->encoder->output_data = server;
+  }
+  if (pthread_create(&(server->thread), NULL, http_worker, (void*)server)) {
+    http_server_free(server);
+    caml_failwith("Spotify.http_server_create: cannot create the server thread");
+  }
+  server->running = 1;
+  result = caml_alloc_custom(&http_server_ops, sizeof(struct http_server *), 0, 1);
+  Http_server_val(result) = server;
+  struct userdata *data = (struct userdata*)sp_session_userdata(session);
+  attach_pcm_sink(data, &(server->sink));
+  if (server->encoder) attach_pcm_sink(data, &(server->encoder->sink));
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_http_server_create_byte(value *argv, int argn)
+{
+  return ocaml_spotify_http_server_create(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
+
+CAMLprim value ocaml_spotify_http_server_port(value server)
+{
+  return Val_int(get_http_server(server)->port);
+}
+
+CAMLprim value ocaml_spotify_http_server_stats(value val_server)
+{
+  CAMLparam1(val_server);
+  CAMLlocal2(result, bytes);
+  struct http_server *server = get_http_server(val_server);
+  pthread_mutex_lock(&(server->mutex));
+  int listeners = server->listeners;
+  int64_t accepted = server->accepted, evicted = server->evicted, bytes_sent = server->bytes_sent;
+  pthread_mutex_unlock(&(server->mutex));
+  pthread_mutex_lock(&(server->staging_mutex));
+  int64_t frames_dropped = server->frames_dropped;
+  pthread_mutex_unlock(&(server->staging_mutex));
+  bytes = caml_copy_int64(bytes_sent);
+  result = caml_alloc_tuple(5);
+  Store_field(result, 0, Val_int(listeners));
+  Store_field(result, 1, Val_long(accepted));
+  Store_field(result, 2, Val_long(evicted));
+  Store_field(result, 3, bytes);
+  Store_field(result, 4, Val_long(frames_dropped));
+  CAMLreturn(result);
+}
+
+CAMLprim value ocaml_spotify_http_server_release(value val_server)
+{
+  struct http_server *server = Http_server_val(val_server);
+  if (server) {
+    Http_server_val(val_server) = NULL;
+    detach_pcm_sink(&(server->sink));
+    if (server->encoder) detach_pcm_sink(&(server->encoder->sink));
+    caml_enter_blocking_section();
+    http_server_free(server);
+    caml_leave_blocking_section();
+  }
   return Val_unit;
 }
@@ -0,0 +1,277 @@
+(*
+ * stress.ml
+ * ---------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ *)
+
+(* Stress test of the lifecycle of handles: several threads allocate
+   and drop millions of handles while full major collections run in
+   between, then the references still held on the backend are
+   checked. It is meant to be run against the mock libspotify (see
+   mock/), which can count references; against the real library only
+   timings and peak RSS are reported. *)
+
+open Spotify
+
+external backend_references : unit -> int = "ocaml_spotify_stress_backend_references"
+external backend_live_objects : unit -> int = "ocaml_spotify_stress_backend_live_objects"
+external backend_leak_report : unit -> int = "ocaml_spotify_stress_backend_leak_report"
+external peak_rss : unit -> int = "ocaml_spotify_stress_peak_rss"
+
+(* +-----------------------------------------------------------------+
+   | Options                                                         |
+   +-----------------------------------------------------------------+ *)
+
+let iterations = ref 1_000_000
+let threads = ref 4
+let full_major_every = ref 100_000
+let release_ratio = ref 0.5
+let mix = ref "track=4,album=2,artist=2,link=1,image=1,search=1"
+let seed = ref 42
+
+let args = Arg.align [
+  "-iterations", Arg.Set_int iterations, "<n> number of handles allocated by each thread (default: 1000000)";
+  "-threads", Arg.Set_int threads, "<n> number of allocating threads (default: 4)";
+  "-full-major-every", Arg.Set_int full_major_every, "<n> run a full major collection every <n> handles of a thread (default: 100000)";
+  "-release-ratio", Arg.Set_float release_ratio, "<r> fraction of handles released explicitly before being dropped (default: 0.5)";
+  "-mix", Arg.Set_string mix, "<kind=weight,...> weights of handle kinds, among track, album, artist, link, image and search";
+  "-seed", Arg.Set_int seed, "<n> random seed (default: 42)";
+]
+
+let usage = "Usage: stress [options]\noptions are:"
+
+type kind = Track | Album | Artist | Link | Image | Search
+
+let kinds = ["track", Track; "album", Album; "artist", Artist; "link", Link; "image", Image; "search", Search]
+
+let rec split ch str =
+  match try Some (String.index str ch) with Not_found -> None with
+    | Some idx -> String.sub str 0 idx :: split ch (String.sub str (idx + 1) (String.length str - idx - 1))
+    | None -> [str]
+
+(* Parse a mix into an array of [(kind, cumulative weight)]. *)
+let parse_mix str =
+  let total = ref 0 in
+  let table =
+    List.map
+      (fun item ->
+         try
+           let idx = String.index item '=' in
+           let name = String.sub item 0 idx and weight = int_of_string (String.sub item (idx + 1) (String.length item - idx - 1)) in
+           if weight < 0 then raise Exit;
+           total := !total + weight;
+           (List.assoc name kinds, !total)
+         with Not_found | Exit | Failure _ ->
+           raise (Arg.Bad (Printf.sprintf "invalid handle mix item %S" item)))
+      (List.filter (fun item -> item <> "") (split ',' str))
+  in
+  if !total = 0 then raise (Arg.Bad "the handle mix is empty");
+  (Array.of_list table, !total)
+
+let pick (table, total) state =
+  let r = Random.State.int state total in
+  let rec loop i =
+    let kind, limit = table.(i) in
+    if r < limit then kind else loop (i + 1)
+  in
+  loop 0
+
+(* +-----------------------------------------------------------------+
+   | Session                                                         |
+   +-----------------------------------------------------------------+ *)
+
+let mutex = Mutex.create ()
+let cond = Condition.create ()
+let notified = ref false
+
+class callbacks = object
+  inherit session_callbacks
+
+  method notify_main_thread session =
+    Mutex.lock mutex;
+    notified := true;
+    Condition.broadcast cond;
+    Mutex.unlock mutex
+end
+
+let wait_notification () =
+  Mutex.lock mutex;
+  while not !notified do
+    Condition.wait cond mutex
+  done;
+  notified := false;
+  Mutex.unlock mutex
+
+let rec process_until session f =
+  if not (f ()) then begin
+    wait_notification ();
+    ignore (session_process_events session);
+    process_until session f
+  end
+
+let config = {
+  api_version = api_version;
+  cache_location = "";
+  settings_location = "";
+  application_key = "ocaml-spotify stress";
+  user_agent = "ocaml-spotify stress";
+  callbacks = new callbacks;
+  compress_playlists = false;
+  dont_save_metadata_for_playlists = true;
+  initially_unload_playlists = true;
+}
+
+let create_search session query count callback =
+  search_create session
+    ~query
+    ~track_offset:0
+    ~track_count:count
+    ~album_offset:0
+    ~album_count:count
+    ~artist_offset:0
+    ~artist_count:count
+    ~callback
+
+(* +-----------------------------------------------------------------+
+   | Workers                                                         |
+   +-----------------------------------------------------------------+ *)
+
+(* Statistics of full major collections, shared by all threads. *)
+let stats_mutex = Mutex.create ()
+let collections = ref 0
+let collection_time = ref 0.
+let finalized = ref 0
+
+let full_major () =
+  let before = backend_references () in
+  let start = Unix.gettimeofday () in
+  Gc.full_major ();
+  let elapsed = Unix.gettimeofday () -. start in
+  let after = backend_references () in
+  Mutex.lock stats_mutex;
+  incr collections;
+  collection_time := !collection_time +. elapsed;
+  if before >= 0 then finalized := !finalized + max 0 (before - after);
+  Mutex.unlock stats_mutex
+
+(* Allocate one handle of kind [kind], and release it if [release]
+   holds. *)
+let churn session search tracks state kind release =
+  let track = tracks.(Random.State.int state (Array.length tracks)) in
+  match kind with
+    | Track ->
+        let track = search_track search (Random.State.int state (Array.length tracks)) in
+        if release then track_release track
+    | Album ->
+        let album = track_album track in
+        if release then album_release album
+    | Artist ->
+        let artist = track_artist track 0 in
+        if release then artist_release artist
+    | Link ->
+        let link = link_create_from_track track 0. in
+        if release then link_release link
+    | Image ->
+        let image = image_create session (album_cover (track_album track)) in
+        if release then image_release image
+    | Search ->
+        let search = create_search session "" 0 ignore in
+        if release then search_release search
+
+let worker (session, search, tracks, mix, allocated, id) =
+  let state = Random.State.make [| !seed; id |] in
+  for i = 1 to !iterations do
+    churn session search tracks state (pick mix state) (Random.State.float state 1.0 < !release_ratio);
+    if i mod !full_major_every = 0 then full_major ();
+    allocated.(id) <- i
+  done
+
+(* +-----------------------------------------------------------------+
+   | Entry point                                                     |
+   +-----------------------------------------------------------------+ *)
+
+let json_fields fields =
+  "{" ^ String.concat "," (List.map (fun (key, value) -> Printf.sprintf "\"%s\":%s" key value) fields) ^ "}"
+
+let () =
+  Arg.parse args ignore usage;
+  let mix =
+    try
+      parse_mix !mix
+    with Arg.Bad msg ->
+      prerr_endline msg;
+      exit 2
+  in
+  if !full_major_every <= 0 then full_major_every := max_int;
+  try
+    let session = session_create config in
+    session_login session ~username:"stress" ~password:"stress" ~remember_me:false;
+    process_until session (fun () -> session_connection_state session = CONNECTION_STATE_LOGGED_IN);
+    let search = create_search session "e" 100 ignore in
+    process_until session (fun () -> search_is_loaded search);
+    let tracks = Array.init (search_num_tracks search) (search_track search) in
+    if Array.length tracks = 0 then failwith "the search returned no track";
+    let baseline_references = backend_references () in
+    let allocated = Array.make !threads 0 in
+    let start = Unix.gettimeofday () in
+    let workers =
+      Array.init !threads
+        (fun id -> Thread.create worker (session, search, tracks, mix, allocated, id))
+    in
+    (* Workers run concurrently with event processing, so that image
+       and search handles are also released by libspotify. *)
+    let finished = ref false in
+    let pump =
+      Thread.create
+        (fun () ->
+           while not !finished do
+             ignore (session_process_events session);
+             Thread.delay 0.001
+           done)
+        ()
+    in
+    Array.iter Thread.join workers;
+    let elapsed = Unix.gettimeofday () -. start in
+    full_major ();
+    finished := true;
+    Thread.join pump;
+    (* Let pending loads complete so that the backend drops its own
+       references on images and searches. *)
+    for i = 1 to 100 do
+      ignore (session_process_events session);
+      Thread.delay 0.001
+    done;
+    (* Drop the handles used by workers. *)
+    Array.iter track_release tracks;
+    search_release search;
+    full_major ();
+    let total = Array.fold_left (+) 0 allocated in
+    let references = backend_references () in
+    let leaked = if references < 0 then -1 else references - baseline_references + Array.length tracks + 1 in
+    Printf.printf "%s\n%!"
+      (json_fields [
+         "threads", string_of_int !threads;
+         "handles", string_of_int total;
+         "handles_per_second", Printf.sprintf "%.0f" (float total /. elapsed);
+         "full_major_collections", string_of_int !collections;
+         "full_major_seconds", Printf.sprintf "%.3f" !collection_time;
+         "finalized", string_of_int !finalized;
+         "finalized_per_second",
+         Printf.sprintf "%.0f" (if !collection_time > 0. then float !finalized /. !collection_time else 0.);
+         "peak_rss_kb", string_of_int (peak_rss ());
+         "backend_references", string_of_int references;
+         "backend_live_objects", string_of_int (backend_live_objects ());
+         "leaked_references", string_of_int leaked;
+       ]);
+    session_logout session;
+    session_release session;
+    if leaked > 0 then begin
+      ignore (backend_leak_report ());
+      exit 1
+    end
+  with Error (func, err) ->
+    Printf.eprintf "%s: %s\n" func (error_message err);
+    exit 1
@@ -0,0 +1,47 @@
+/*
+ * stress_stubs.c
+ * --------------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ */
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/resource.h>
+
+/* Introspection functions of the mock libspotify. They are weak so
+   that the stress test also links against the real library, where
+   they are NULL. */
+extern int64_t mock_spotify_references(void) __attribute__((weak));
+extern int mock_spotify_live_objects(void) __attribute__((weak));
+extern int mock_spotify_leak_report(FILE *out) __attribute__((weak));
+
+CAMLprim value ocaml_spotify_stress_backend_references(value unit)
+{
+  return Val_long(mock_spotify_references ? mock_spotify_references() : -1);
+}
+
+CAMLprim value ocaml_spotify_stress_backend_live_objects(value unit)
+{
+  return Val_int(mock_spotify_live_objects ? mock_spotify_live_objects() : -1);
+}
+
+CAMLprim value ocaml_spotify_stress_backend_leak_report(value unit)
+{
+  if (mock_spotify_leak_report == NULL) return Val_int(-1);
+  fflush(stdout);
+  return Val_int(mock_spotify_leak_report(stderr));
+}
+
+/* Peak resident set size, in kilobytes. */
+CAMLprim value ocaml_spotify_stress_peak_rss(value unit)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) return Val_int(-1);
+  return Val_long(usage.ru_maxrss);
+}
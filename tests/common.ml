@@ -0,0 +1,98 @@
+(*
+ * common.ml
+ * ---------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ *)
+
+(* Helpers shared by the tests, which run against the mock libspotify
+   (see mock/). *)
+
+open Spotify
+
+let failures = ref 0
+
+let check name ok =
+  if not ok then begin
+    incr failures;
+    Printf.eprintf "FAIL: %s\n%!" name
+  end
+
+(* Exit with an error if a check failed. *)
+let finish () =
+  if !failures > 0 then begin
+    Printf.eprintf "%d check(s) failed\n%!" !failures;
+    exit 1
+  end
+
+(* Process events until [f ()] holds, at most [timeout] seconds.
+   Returns whether it holds. *)
+let process_until ?(timeout=10.) session f =
+  let deadline = Unix.gettimeofday () +. timeout in
+  let rec loop () =
+    ignore (session_process_events session);
+    if f () then
+      true
+    else if Unix.gettimeofday () > deadline then
+      false
+    else begin
+      Thread.delay 0.005;
+      loop ()
+    end
+  in
+  loop ()
+
+let config callbacks = {
+  api_version = api_version;
+  cache_location = "";
+  settings_location = "";
+  application_key = "ocaml-spotify tests";
+  user_agent = "ocaml-spotify tests";
+  callbacks = callbacks;
+  compress_playlists = false;
+  dont_save_metadata_for_playlists = true;
+  initially_unload_playlists = true;
+}
+
+(* Run [f] with a logged in session. *)
+let with_session ?(callbacks = new session_callbacks) f =
+  let session = session_create (config callbacks) in
+  let close () =
+    session_logout session;
+    session_release session
+  in
+  session_login session ~username:"test" ~password:"test" ~remember_me:false;
+  if not (process_until session (fun () -> session_connection_state session = CONNECTION_STATE_LOGGED_IN)) then
+    failwith "login timed out";
+  let result = try f session with exn -> close (); raise exn in
+  close ();
+  result
+
+(* Search for [count] tracks matching [query]. *)
+let search_tracks session query count =
+  let search =
+    search_create session
+      ~query
+      ~track_offset:0 ~track_count:count
+      ~album_offset:0 ~album_count:0
+      ~artist_offset:0 ~artist_count:0
+      ~callback:ignore
+  in
+  if not (process_until session (fun () -> search_is_loaded search)) then failwith "search timed out";
+  let tracks = Array.init (search_num_tracks search) (search_track search) in
+  search_release search;
+  tracks
+
+(* Load and start playing the first available track matching
+   [query]. *)
+let play_track session query =
+  let tracks = search_tracks session query 20 in
+  let track =
+    try List.find (track_is_available session) (Array.to_list tracks)
+    with Not_found -> failwith "no playable track"
+  in
+  session_player_load session track;
+  session_player_play session true;
+  track
@@ -0,0 +1,111 @@
+(*
+ * test_http.ml
+ * ------------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ *)
+
+(* Tests of the HTTP streaming server. *)
+
+open Spotify
+open Common
+
+(* Connect to the server and send a request for [path]. Reads time out
+   after 10 seconds. *)
+let connect port path =
+  let fd = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
+  Unix.setsockopt_float fd Unix.SO_RCVTIMEO 10.;
+  Unix.connect fd (Unix.ADDR_INET (Unix.inet_addr_loopback, port));
+  let request = Printf.sprintf "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n" path in
+  ignore (Unix.write_substring fd request 0 (String.length request));
+  fd
+
+(* Read the response headers. Returns them, and the number of bytes of
+   body read with them. *)
+let read_headers fd =
+  let buffer = Buffer.create 512 and chunk = Bytes.create 4096 in
+  let rec loop () =
+    let contents = Buffer.contents buffer in
+    let rec find i =
+      if i + 4 > String.length contents then
+        None
+      else if String.sub contents i 4 = "\r\n\r\n" then
+        Some i
+      else
+        find (i + 1)
+    in
+    match find 0 with
+      | Some i ->
+          (String.sub contents 0 (i + 4), String.length contents - i - 4)
+      | None ->
+          let n = Unix.read fd chunk 0 (Bytes.length chunk) in
+          if n = 0 then failwith "connection closed in the headers";
+          Buffer.add_subbytes buffer chunk 0 n;
+          loop ()
+  in
+  loop ()
+
+(* Read at least [count] bytes of body. Returns whether they were
+   received. *)
+let read_body fd count =
+  let chunk = Bytes.create 65536 in
+  let rec loop received =
+    received >= count ||
+      (match try Unix.read fd chunk 0 (Bytes.length chunk) with Unix.Unix_error _ -> 0 with
+         | 0 -> false
+         | n -> loop (received + n))
+  in
+  loop 0
+
+let contains string sub =
+  let n = String.length sub in
+  let rec loop i = i + n <= String.length string && (String.sub string i n = sub || loop (i + 1)) in
+  loop 0
+
+let () =
+  with_session
+    (fun session ->
+       let server = http_server_create ~max_listeners:2 session in
+       let port = http_server_port server in
+       ignore (play_track session "e");
+
+       (* A listener receives the PCM stream. *)
+       let listener = connect port "/pcm" in
+       let headers, _ = read_headers listener in
+       check "status" (contains headers "200 OK");
+       check "rate header" (contains headers "X-Audio-Rate: 44100");
+       check "channels header" (contains headers "X-Audio-Channels: 2");
+       check "stream data" (read_body listener 65536);
+
+       (* A second listener drops in the middle of the stream. *)
+       let dropped = connect port "/wav" in
+       let headers, _ = read_headers dropped in
+       check "second status" (contains headers "200 OK");
+       check "second stream data" (read_body dropped 4096);
+       Unix.close dropped;
+       check "dropped listener removed"
+         (process_until session (fun () -> (http_server_stats server).listeners = 1));
+
+       (* The first one is still served. *)
+       check "stream data after drop" (read_body listener 65536);
+
+       (* Listeners are capped. *)
+       let second = connect port "/pcm" in
+       let headers, _ = read_headers second in
+       check "listener under the cap" (contains headers "200 OK");
+       let third = connect port "/pcm" in
+       let headers, _ = read_headers third in
+       check "listener over the cap" (contains headers "503");
+       Unix.close third;
+       Unix.close second;
+
+       let stats = http_server_stats server in
+       check "accepted" (stats.accepted = 4);
+       check "nothing evicted" (stats.evicted = 0);
+       check "bytes sent" (stats.bytes_sent > 131072L);
+       Unix.close listener;
+       http_server_release server;
+       session_player_unload session);
+  finish ()
@@ -0,0 +1,86 @@
+(*
+ * test_policy.ml
+ * --------------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ *)
+
+(* Tests of the bitrate policy, fed with synthetic buffer stats. *)
+
+open Spotify
+open Common
+
+(* Stats reported by the get_audio_buffer_stats callback. *)
+let samples = ref 0
+let stutter = ref 0
+
+let callbacks = object
+  inherit session_callbacks
+  method! get_audio_buffer_stats session = { samples = !samples; stutter = !stutter }
+end
+
+let has_decision policy f = List.exists f (bitrate_policy_decisions policy)
+
+let () =
+  with_session ~callbacks
+    (fun session ->
+       let policy = bitrate_policy_create ~window:0.05 ~upgrade_after:2 ~max_prefetch:3 session in
+       check "initial bitrate" (bitrate_policy_bitrate policy = BITRATE_160k);
+       check "initial prefetch" (bitrate_policy_prefetch_depth policy = 1);
+       ignore (play_track session "e");
+
+       (* An empty buffer steps down. *)
+       samples := 0;
+       check "step down on a low buffer"
+         (process_until session
+            (fun () ->
+               has_decision policy
+                 (fun decision ->
+                    decision.decision_reason = POLICY_LOW_BUFFER
+                    && decision.decision_bitrate = BITRATE_96k
+                    && decision.decision_prefetch = 2)));
+       check "bitrate after stepping down" (bitrate_policy_bitrate policy = BITRATE_96k);
+       (* The prefetch depth keeps growing up to its maximum. *)
+       check "prefetch capped"
+         (process_until session (fun () -> bitrate_policy_prefetch_depth policy = 3));
+
+       (* Ten seconds of buffer step up after two good windows. *)
+       samples := 441000;
+       check "step up on a full buffer"
+         (process_until session
+            (fun () ->
+               has_decision policy
+                 (fun decision ->
+                    decision.decision_reason = POLICY_STABLE
+                    && decision.decision_bitrate = BITRATE_160k)));
+       check "step up after stepping down"
+         (match List.rev (bitrate_policy_decisions policy) with
+            | last :: _ -> last.decision_reason = POLICY_STABLE
+            | [] -> false);
+       check "bitrate after stepping up"
+         (process_until session (fun () -> bitrate_policy_bitrate policy = BITRATE_320k));
+       check "prefetch after stepping up" (bitrate_policy_prefetch_depth policy = 1);
+
+       (* A stutter steps down at the end of its window, even with a
+          full buffer. *)
+       stutter := 1;
+       check "step down on a stutter"
+         (process_until ~timeout:0.5 session
+            (fun () ->
+               has_decision policy
+                 (fun decision ->
+                    decision.decision_reason = POLICY_STUTTER
+                    && decision.decision_bitrate = BITRATE_160k
+                    && decision.decision_prefetch = 2)));
+       stutter := 0;
+       check "bitrate after a stutter" (bitrate_policy_bitrate policy = BITRATE_160k);
+
+       (* Decisions are ordered. *)
+       let times = List.map (fun decision -> decision.decision_time) (bitrate_policy_decisions policy) in
+       check "decisions ordered" (List.sort compare times = times);
+
+       bitrate_policy_release policy;
+       session_player_unload session);
+  finish ()
@@ -0,0 +1,45 @@
+(*
+ * test_policy_errors.ml
+ * ---------------------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ *)
+
+(* Tests of the bitrate policy with streaming errors injected by the
+   mock. The mock reads its configuration when the first session is
+   created, so this runs apart from the other policy tests. *)
+
+open Spotify
+open Common
+
+let callbacks = object
+  inherit session_callbacks
+  (* Ten seconds of buffer, so that only errors step down. *)
+  method! get_audio_buffer_stats session = { samples = 441000; stutter = 0 }
+end
+
+let () =
+  Unix.putenv "MOCK_SPOTIFY_FAULTS" "stream";
+  Unix.putenv "MOCK_SPOTIFY_FAULT_RATE" "1";
+  with_session ~callbacks
+    (fun session ->
+       (* Windows never close on their own: a decision can only come
+          from the error itself. *)
+       let policy = bitrate_policy_create ~window:3600. session in
+       ignore (play_track session "e");
+       check "step down on a streaming error"
+         (process_until session
+            (fun () ->
+               List.exists
+                 (fun decision ->
+                    decision.decision_reason = POLICY_STREAMING_ERROR
+                    && decision.decision_bitrate = BITRATE_96k
+                    && decision.decision_prefetch = 2)
+                 (bitrate_policy_decisions policy)));
+       check "bitrate after a streaming error" (bitrate_policy_bitrate policy = BITRATE_96k);
+       check "single decision" (List.length (bitrate_policy_decisions policy) = 1);
+       bitrate_policy_release policy;
+       session_player_unload session);
+  finish ()
@@ -0,0 +1,66 @@
+(*
+ * test_store.ml
+ * -------------
+ * Copyright : (c) 2011, Jeremie Dimino <jeremie@dimino.org>
+ * Licence   : BSD3
+ *
+ * This file is a part of ocaml-spotify.
+ *)
+
+(* Tests of the metadata store. *)
+
+open Spotify
+open Common
+
+let () =
+  let path = Filename.temp_file "ocaml-spotify" ".store" in
+  Sys.remove path;
+
+  (* A new store is empty, and can be queried before anything was
+     appended. *)
+  let store = metadata_store_open path in
+  check "new store is empty" (metadata_store_count store = 0);
+  check "find in a new store" (metadata_store_find store (String.make 16 '\000') = None);
+
+  (* Handles created while the store is attached are recorded. *)
+  let names =
+    with_session
+      (fun session ->
+         metadata_store_attach store;
+         let tracks = search_tracks session "e" 20 in
+         ignore (session_process_events session);
+         metadata_store_detach ();
+         check "search returned tracks" (Array.length tracks > 0);
+         Array.map (fun track -> (track_id track, track_name track)) tracks)
+  in
+  let check_names store =
+    Array.iter
+      (fun (id, name) ->
+         match metadata_store_find store id with
+           | Some entry ->
+               check ("name of " ^ name) (entry.entry_kind = METADATA_TRACK && entry.entry_name = name)
+           | None ->
+               check ("track " ^ name ^ " recorded") false)
+      names
+  in
+  check_names store;
+  let count = metadata_store_count store in
+  check "tracks counted" (count >= Array.length names);
+  let id, name = names.(0) in
+  let entry = metadata_store_find store id in
+  metadata_store_close store;
+
+  (* Entries outlive the store. *)
+  Gc.full_major ();
+  (match entry with
+     | Some entry -> check "entry after closing" (entry.entry_name = name)
+     | None -> ());
+
+  (* Records survive reopening. *)
+  let store = metadata_store_open path in
+  check "count after reopening" (metadata_store_count store = count);
+  check_names store;
+  metadata_store_close store;
+
+  Sys.remove path;
+  finish ()